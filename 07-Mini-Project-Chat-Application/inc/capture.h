@@ -0,0 +1,90 @@
+/**
+ * capture.h - Traffic capture for the chat application
+ *
+ * Records every received frame to a compact binary file so real traffic
+ * can be replayed later with chat_replay.
+ *
+ * File layout (host byte order):
+ *   capture_header_t, then for each frame a capture_record_t followed
+ *   by `length` bytes of payload.
+ */
+
+ #ifndef CAPTURE_H
+ #define CAPTURE_H
+
+ #include <stdbool.h>
+ #include <stdint.h>
+ #include <stddef.h>
+ #include <stdio.h>
+
+ // Magic bytes at the start of every capture file
+ #define CAPTURE_MAGIC "CHATCAP1"
+ #define CAPTURE_MAGIC_LENGTH 8
+
+ // Current capture format version
+ #define CAPTURE_VERSION 1
+
+ /**
+  * Capture file header
+  */
+ typedef struct __attribute__((packed)) {
+     char magic[CAPTURE_MAGIC_LENGTH];  // CAPTURE_MAGIC, not null-terminated
+     uint32_t version;                  // CAPTURE_VERSION
+     uint32_t reserved;                 // Always 0
+     uint64_t start_realtime_ns;        // Wall-clock time the capture started
+ } capture_header_t;
+
+ /**
+  * Header of one captured frame
+  */
+ typedef struct __attribute__((packed)) {
+     uint64_t timestamp_ns;             // CLOCK_MONOTONIC time the frame was received
+     uint32_t conn_id;                  // Connection the frame was received on
+     uint32_t length;                   // Payload length in bytes
+ } capture_record_t;
+
+ /**
+  * Start recording received frames to a file
+  *
+  * @param path Path of the capture file (created or truncated)
+  * @return 0 on success, -1 on failure
+  */
+ int capture_start(const char *path);
+
+ /**
+  * Record a received frame if capture is enabled
+  *
+  * @param conn_id Connection ID
+  * @param data Frame payload
+  * @param length Payload length
+  */
+ void capture_frame(int conn_id, const char *data, size_t length);
+
+ /**
+  * Flush and close the capture file
+  *
+  * @return Number of frames recorded
+  */
+ unsigned long capture_stop(void);
+
+ /**
+  * Open a capture file for reading and validate its header
+  *
+  * @param path Path of the capture file
+  * @param header Filled with the file header
+  * @return Open file positioned at the first record, NULL on failure
+  */
+ FILE* capture_open(const char *path, capture_header_t *header);
+
+ /**
+  * Read the next frame of a capture file
+  *
+  * @param file File returned by capture_open
+  * @param record Filled with the frame header
+  * @param buffer Buffer receiving the payload
+  * @param buffer_size Size of the buffer
+  * @return 1 if a frame was read, 0 at end of file, -1 on error
+  */
+ int capture_read(FILE *file, capture_record_t *record, char *buffer, size_t buffer_size);
+
+ #endif /* CAPTURE_H */
@@ -8,6 +8,8 @@
  #ifndef COMMAND_H
  #define COMMAND_H
  
+ #include <stdbool.h>
+ 
  /**
   * Command types
   */
@@ -19,6 +21,14 @@
      CMD_LIST,       // List connections
      CMD_TERMINATE,  // Terminate a connection
      CMD_SEND,       // Send a message
+     CMD_LIMIT,      // Configure rate limits
+     CMD_JOIN,       // Join a room
+     CMD_LEAVE,      // Leave a room
+     CMD_SAY,        // Send a message to a room
+     CMD_ROOMS,      // List rooms
+     CMD_COMPRESS,   // Configure compression
+     CMD_STATS,      // Display traffic, latency and compression statistics
+     CMD_TRACE,      // Control the event tracer
      CMD_EXIT,       // Exit the application
      CMD_UNKNOWN     // Unknown command
  } command_t;
@@ -27,8 +37,9 @@
   * Process a command string from the user
   * 
   * @param command_line Command string
+  * @return false if the application should exit, true otherwise
   */
- void process_command(char *command_line);
+ bool process_command(char *command_line);
  
  /**
   * Parse a command string to determine its type
@@ -0,0 +1,45 @@
+/**
+ * compress.h - Payload compression for the chat application
+ *
+ * A small LZ77 codec in the style of the LZ4 block format: a stream of
+ * sequences, each made of a token byte, literal bytes and a back
+ * reference (16-bit offset, length >= 4). No external library is needed.
+ */
+
+ #ifndef COMPRESS_H
+ #define COMPRESS_H
+
+ #include <stddef.h>
+
+ // Messages shorter than this are sent uncompressed by default
+ #define DEFAULT_COMPRESS_MIN_SIZE 64
+
+ // Worst-case compressed size of n bytes of incompressible input
+ #define LZ_COMPRESS_BOUND(n) ((n) + (n) / 255 + 16)
+
+ /**
+  * Compress a buffer
+  *
+  * @param src Input data
+  * @param src_len Input length
+  * @param dst Output buffer
+  * @param dst_cap Size of the output buffer
+  * @return Compressed length, or -1 if the output buffer is too small
+  */
+ int lz_compress(const unsigned char *src, size_t src_len, unsigned char *dst, size_t dst_cap);
+
+ /**
+  * Decompress a buffer produced by lz_compress
+  *
+  * Every offset and length is checked, so corrupt input cannot write
+  * outside the output buffer.
+  *
+  * @param src Compressed data
+  * @param src_len Compressed length
+  * @param dst Output buffer
+  * @param dst_cap Size of the output buffer
+  * @return Decompressed length, or -1 if the input is corrupt or too large
+  */
+ int lz_decompress(const unsigned char *src, size_t src_len, unsigned char *dst, size_t dst_cap);
+
+ #endif /* COMPRESS_H */
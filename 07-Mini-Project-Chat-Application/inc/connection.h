@@ -9,8 +9,11 @@
  #define CONNECTION_H
  
  #include <stdbool.h>
+ #include <stdint.h>
  #include <netinet/in.h>
  #include <pthread.h>
+ #include "metrics.h"
+ #include "ratelimit.h"
  
  // Maximum number of connections the application can handle
  #define MAX_CONNECTIONS 100
@@ -18,6 +21,21 @@
  // Maximum length of IP address string
  #define IP_LENGTH 16
  
+ /**
+  * Compression statistics of a connection, per direction
+  * 
+  * Updated without the connection mutex, by atomic additions, and kept on
+  * their own cache line. Received data is counted by the receive thread,
+  * sent data by every thread sending to the peer.
+  */
+ typedef struct {
+     _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t raw_bytes;  // Bytes before compression
+     _Atomic uint64_t wire_bytes;        // Bytes on the wire
+     _Atomic uint64_t compressed;        // Frames sent/received compressed
+     _Atomic uint64_t uncompressed;      // Frames sent/received as is
+     _Atomic uint64_t cpu_ns;            // Thread CPU time spent in the codec
+ } compress_stats_t;
+ 
  /**
   * Structure to represent a connection to another peer
   */
@@ -30,8 +48,41 @@
      pthread_t thread;           // Thread for receiving messages
      bool is_active;             // Whether connection is active
      bool is_incoming;           // Whether connection was initiated by peer
+     token_bucket_t inbound;     // Rate limit for received messages
+     token_bucket_t outbound;    // Rate limit for sent messages
+     unsigned long shed_in;      // Received messages dropped by rate limiting
+     unsigned long shed_out;     // Sent messages refused by rate limiting
+     bool compress_enabled;      // Whether we may compress data sent to the peer
+     bool peer_compress;         // Whether the peer announced it can decompress
+     bool peer_newline;          // Whether the peer ends plain messages with a newline
+     compress_stats_t comp_out;  // Compression of sent data
+     compress_stats_t comp_in;   // Decompression of received data
  } connection_t;
  
+ /**
+  * Snapshot of an active connection, used for statistics
+  */
+ typedef struct {
+     int slot;                   // Slot index in the connection array
+     int id;                     // Connection ID
+     char ip[IP_LENGTH];         // Peer IP address
+     int port;                   // Peer port number
+     bool is_incoming;           // Whether connection was initiated by peer
+     int recv_queue;             // Bytes waiting in the kernel receive queue
+     int send_queue;             // Bytes not yet acknowledged by the peer
+     unsigned long shed_in;      // Received messages dropped by rate limiting
+     unsigned long shed_out;     // Sent messages refused by rate limiting
+ } connection_info_t;
+ 
+ /**
+  * Rate limit scopes that can be configured by the user
+  */
+ typedef enum {
+     LIMIT_INBOUND,      // Per-connection limit on received messages
+     LIMIT_OUTBOUND,     // Per-connection limit on sent messages
+     LIMIT_GLOBAL        // Limit on received messages across all connections
+ } limit_scope_t;
+ 
  /**
   * Initialize the server socket for the local device
   * 
@@ -84,6 +135,167 @@
   */
  connection_t* find_connection_by_id(int conn_id);
  
+ /**
+  * Get the slot index of a connection in the connection array
+  * 
+  * @param conn_id Connection ID
+  * @return Slot index, -1 if not found
+  */
+ int get_connection_slot(int conn_id);
+ 
+ /**
+  * Take a snapshot of all active connections
+  * 
+  * @param info Array receiving the snapshots
+  * @param max_info Size of the array
+  * @return Number of active connections copied
+  */
+ int get_connection_info(connection_info_t *info, int max_info);
+ 
+ /**
+  * Mark a connection closed by the peer as inactive
+  * 
+  * Also removes the connection from every room it joined.
+  * 
+  * @param conn_id Connection ID
+  */
+ void mark_connection_closed(int conn_id);
+ 
+ /**
+  * Send raw data on the connection stored in a slot
+  * 
+  * The data is charged against the connection's outbound limit.
+  * 
+  * @param slot Slot index
+  * @param data Data to send
+  * @param len Length of the data
+  * @return 0 on success, -1 on failure, -2 if the outbound limit was exceeded
+  */
+ int send_to_slot(int slot, const char *data, size_t len);
+ 
+ /**
+  * Send control frames on the connection stored in a slot
+  * 
+  * Like send_to_slot(), but not charged against the outbound limit, so
+  * announcements are never refused however many rooms they cover.
+  * 
+  * @param slot Slot index
+  * @param data Data to send
+  * @param len Length of the data
+  * @return 0 on success, -1 on failure
+  */
+ int send_control_to_slot(int slot, const char *data, size_t len);
+ 
+ /**
+  * Send control frames to every active connection
+  * 
+  * Not charged against the outbound limit and never compressed. The
+  * connection lock is not held while sending, so a peer that does not
+  * read only delays the caller.
+  * 
+  * @param data Data to send
+  * @param len Length of the data
+  * @return Number of connections the data was sent to
+  */
+ int broadcast_data(const char *data, size_t len);
+ 
+ /**
+  * Check whether a received frame may be handled
+  * 
+  * Called once per frame, messages and control frames alike, before it is
+  * decompressed or parsed. Charges the connection's inbound bucket and the
+  * global bucket. Rejected frames are counted so they show up in the
+  * connection list.
+  * 
+  * @param slot Slot index
+  * @return true if the frame may be handled, false if it must be dropped
+  */
+ bool admit_inbound_message(int slot);
+ 
+ /**
+  * Change a rate limit
+  * 
+  * Per-connection limits apply to existing and future connections.
+  * 
+  * @param scope Which limit to change
+  * @param rate Messages per second (0 = unlimited)
+  * @param burst Maximum burst of messages
+  * @return 0 on success, -1 on failure
+  */
+ int set_rate_limit(limit_scope_t scope, double rate, double burst);
+ 
+ /**
+  * Check whether data sent on a slot should be compressed
+  * 
+  * @param slot Slot index
+  * @return true if compression is enabled locally and supported by the peer
+  */
+ bool use_compression(int slot);
+ 
+ /**
+  * Record whether the peer on a slot can decompress frames
+  * 
+  * @param slot Slot index
+  * @param supported Whether the peer announced compression support
+  */
+ void set_peer_compression(int slot, bool supported);
+ 
+ /**
+  * Record that the peer on a slot ends plain messages with a newline
+  * 
+  * @param slot Slot index
+  */
+ void set_peer_newline(int slot);
+ 
+ /**
+  * Check whether the peer on a slot ends plain messages with a newline
+  * 
+  * Peers that did not announce it send one plain message per send.
+  * 
+  * @param slot Slot index
+  * @return true if the peer announced newline-terminated messages
+  */
+ bool peer_uses_newline(int slot);
+ 
+ /**
+  * Enable or disable compression of data sent on a connection
+  * 
+  * @param conn_id Connection ID
+  * @param enabled Whether to compress
+  * @return 0 on success, -1 if the connection was not found
+  */
+ int set_compression(int conn_id, bool enabled);
+ 
+ /**
+  * Add a frame to the compression statistics of a slot (any thread)
+  * 
+  * @param slot Slot index
+  * @param outbound true for sent data, false for received data
+  * @param raw_len Length before compression (after decompression)
+  * @param wire_len Length on the wire
+  * @param cpu_ns CPU time spent compressing or decompressing
+  * @param compressed Whether the frame was compressed
+  */
+ void record_compression(int slot, bool outbound, size_t raw_len, size_t wire_len,
+                         uint64_t cpu_ns, bool compressed);
+ 
+ /**
+  * Display compression statistics of all active connections
+  */
+ void show_compression_stats(void);
+ 
+ /**
+  * Flush outgoing data before shutdown
+  * 
+  * Stops accepting connections, half-closes every connection so queued
+  * data is followed by FIN, then waits until peers acknowledged all sent
+  * bytes or the timeout expires.
+  * 
+  * @param timeout_ms Maximum time to wait in milliseconds
+  * @return Number of bytes still unacknowledged (0 when fully drained)
+  */
+ int drain_connections(int timeout_ms);
+ 
  /**
   * Close all connections and free resources
   */
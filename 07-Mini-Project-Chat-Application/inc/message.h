@@ -8,10 +8,37 @@
  #ifndef MESSAGE_H
  #define MESSAGE_H
  
+ #include <stdbool.h>
+ #include "compress.h"
  #include "connection.h"
+ #include "room.h"
  
  // Maximum message length (including null terminator)
  #define MAX_MESSAGE_LENGTH 101
+
+ // Maximum length of a room control frame (marker, type, room, space, message, newline)
+ #define MAX_FRAME_LENGTH (2 + ROOM_NAME_LENGTH + MAX_MESSAGE_LENGTH + 1)
+
+ /**
+  * Capability frames, sent with ROOM_FRAME_MARKER when a connection is set up:
+  * "\x01C<codec>\n" announces that we can decompress frames from that codec,
+  * "\x01Cnl\n" that our plain messages end with a newline. Peers that only
+  * know codecs take "nl" for a codec they lack, so it is sent first.
+  */
+ #define CAPS_FRAME          'C'
+ #define CAPS_CODEC_LZ       "lz"
+ #define CAPS_PLAIN_NEWLINE  "nl"
+
+ /**
+  * Compressed frame: marker, 16-bit compressed length and 16-bit original
+  * length (both big-endian), then the compressed bytes of a plain message
+  * or a room frame
+  */
+ #define COMPRESSED_FRAME_MARKER     '\x02'
+ #define COMPRESSED_HEADER_LENGTH    5
+
+ // Largest frame that can arrive on the wire
+ #define MAX_WIRE_FRAME_LENGTH (COMPRESSED_HEADER_LENGTH + LZ_COMPRESS_BOUND(MAX_FRAME_LENGTH))
  
  /**
   * Message structure
@@ -31,6 +58,52 @@
   */
  int send_message(int conn_id, const char *message);
  
+ /**
+  * Send a message to every peer subscribed to a room
+  * 
+  * @param room Room name
+  * @param message Message to send
+  * @return Number of peers the message was sent to, -1 on failure
+  */
+ int send_room_message(const char *room, const char *message);
+ 
+ /**
+  * Tell all peers that the local user joined or left a room
+  * 
+  * @param room Room name
+  * @param joined true for join, false for leave
+  * @return Number of peers notified
+  */
+ int announce_room(const char *room, bool joined);
+ 
+ /**
+  * Tell a newly connected peer which codecs we can decompress
+  * 
+  * @param conn_id Connection ID
+  */
+ void announce_capabilities(int conn_id);
+ 
+ /**
+  * Set the smallest message size that is compressed
+  * 
+  * @param min_size Size in bytes
+  */
+ void set_compress_min_size(int min_size);
+ 
+ /**
+  * Get the smallest message size that is compressed
+  * 
+  * @return Size in bytes
+  */
+ int get_compress_min_size(void);
+ 
+ /**
+  * Tell a newly connected peer about every room the local user joined
+  * 
+  * @param conn_id Connection ID
+  */
+ void announce_joined_rooms(int conn_id);
+ 
  /**
   * Thread handler function for receiving messages
   * 
@@ -0,0 +1,113 @@
+/**
+ * metrics.h - Runtime metrics for the chat application
+ *
+ * Counters and latency histograms are kept per connection slot, with the
+ * fields written by the receive thread and by sending threads on separate
+ * cache lines, so the receive thread never contends with senders. Every
+ * thread sending to a peer adds to the same send counters, with atomic
+ * additions and no lock. Totals are only merged when they are read, by the
+ * `stats` command or by a scrape of the metrics socket (Prometheus text
+ * format).
+ */
+
+ #ifndef METRICS_H
+ #define METRICS_H
+
+ #include <stddef.h>
+ #include <stdint.h>
+
+ // Size of a cache line, used to pad per-writer counter groups
+ #define CACHE_LINE_SIZE 64
+
+ // Number of power-of-two latency buckets (1 ns .. ~550 s)
+ #define LATENCY_BUCKETS 40
+
+ /**
+  * Start the uptime clock
+  */
+ void metrics_init(void);
+
+ /**
+  * Reset the counters of a slot for a new connection
+  *
+  * The previous values are kept in the process totals.
+  *
+  * @param slot Connection slot
+  */
+ void metrics_reset_peer(int slot);
+
+ /**
+  * Count a message or frame received on a slot (receive thread)
+  *
+  * @param slot Connection slot
+  * @param bytes Bytes on the wire
+  */
+ void metrics_message_in(int slot, size_t bytes);
+
+ /**
+  * Count a message or frame sent on a slot
+  *
+  * @param slot Connection slot
+  * @param bytes Bytes on the wire
+  */
+ void metrics_message_out(int slot, size_t bytes);
+
+ /**
+  * Count a receive error (socket error or corrupt frame) on a slot
+  *
+  * @param slot Connection slot
+  */
+ void metrics_recv_error(int slot);
+
+ /**
+  * Count a send error on a slot
+  *
+  * @param slot Connection slot
+  */
+ void metrics_send_error(int slot);
+
+ /**
+  * Record the time from recv() returning to the data being displayed
+  *
+  * Only called for receives that displayed at least one message.
+  *
+  * @param slot Connection slot
+  * @param ns Latency in nanoseconds
+  */
+ void metrics_latency(int slot, uint64_t ns);
+
+ /**
+  * Count an accepted incoming connection (listener thread)
+  */
+ void metrics_accept(void);
+
+ /**
+  * Get the current CLOCK_MONOTONIC time
+  *
+  * @return Time in nanoseconds
+  */
+ uint64_t metrics_now_ns(void);
+
+ /**
+  * Display totals, latency percentiles and per-peer counters
+  */
+ void show_metrics(void);
+
+ /**
+  * Serve metrics in Prometheus text format on a Unix socket
+  *
+  * Each client connecting to the socket receives one snapshot. Clients
+  * sending an HTTP GET first get an HTTP response, so the socket can be
+  * scraped with `curl --unix-socket`.
+  *
+  * @param path Path of the Unix socket
+  * @return 0 on success, -1 on failure
+  */
+ int start_metrics_server(const char *path);
+
+ /**
+  * Stop the metrics server and remove its socket
+  */
+ void stop_metrics_server(void);
+
+ #endif /* METRICS_H */
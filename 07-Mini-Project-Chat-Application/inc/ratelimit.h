@@ -0,0 +1,65 @@
+/**
+ * ratelimit.h - Token bucket rate limiting for the chat application
+ *
+ * Provides a simple token bucket used to shed excess traffic per
+ * connection (inbound and outbound) and across all connections.
+ */
+
+ #ifndef RATELIMIT_H
+ #define RATELIMIT_H
+
+ #include <stdbool.h>
+ #include <time.h>
+
+ // Default per-connection inbound limit (messages per second / burst size)
+ #define DEFAULT_INBOUND_RATE    20.0
+ #define DEFAULT_INBOUND_BURST   40.0
+
+ // Default per-connection outbound limit (messages per second / burst size)
+ #define DEFAULT_OUTBOUND_RATE   20.0
+ #define DEFAULT_OUTBOUND_BURST  40.0
+
+ // Default global inbound limit shared by all connections
+ #define DEFAULT_GLOBAL_RATE     200.0
+ #define DEFAULT_GLOBAL_BURST    400.0
+
+ /**
+  * Token bucket structure
+  *
+  * A rate of 0 disables the limit: every consume call succeeds.
+  */
+ typedef struct {
+     double rate;                // Tokens added per second
+     double burst;               // Maximum number of tokens (bucket size)
+     double tokens;              // Tokens currently available
+     struct timespec last;       // Time of the last refill
+ } token_bucket_t;
+
+ /**
+  * Initialize a token bucket, starting full
+  *
+  * @param bucket Pointer to the bucket
+  * @param rate Tokens added per second (0 = unlimited)
+  * @param burst Bucket capacity
+  */
+ void token_bucket_init(token_bucket_t *bucket, double rate, double burst);
+
+ /**
+  * Change the limits of a bucket without resetting its refill time
+  *
+  * @param bucket Pointer to the bucket
+  * @param rate Tokens added per second (0 = unlimited)
+  * @param burst Bucket capacity
+  */
+ void token_bucket_configure(token_bucket_t *bucket, double rate, double burst);
+
+ /**
+  * Refill the bucket and try to take tokens from it
+  *
+  * @param bucket Pointer to the bucket
+  * @param cost Number of tokens needed
+  * @return true if the tokens were taken, false if traffic must be shed
+  */
+ bool token_bucket_consume(token_bucket_t *bucket, double cost);
+
+ #endif /* RATELIMIT_H */
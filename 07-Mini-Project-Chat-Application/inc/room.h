@@ -0,0 +1,121 @@
+/**
+ * room.h - Chat rooms for the chat application
+ *
+ * Maintains an inverted index from room name to the connections
+ * subscribed to it, and the set of rooms joined by the local user.
+ */
+
+ #ifndef ROOM_H
+ #define ROOM_H
+
+ #include <stdbool.h>
+
+ // Maximum length of a room name (including null terminator)
+ #define ROOM_NAME_LENGTH 32
+
+ // Maximum number of rooms the local user may join and a peer may belong to.
+ // A new peer's capability frame and join announcements then fit in the
+ // default inbound burst, which every received frame is charged against.
+ #define MAX_JOINED_ROOMS 32
+
+ /**
+  * Room control frames exchanged between peers
+  *
+  * A frame starts with ROOM_FRAME_MARKER, followed by the frame type,
+  * the room name and, for messages, a space and the message text.
+  * Frames are terminated by a newline.
+  */
+ #define ROOM_FRAME_MARKER   '\x01'
+ #define ROOM_FRAME_JOIN     'J'
+ #define ROOM_FRAME_LEAVE    'L'
+ #define ROOM_FRAME_MESSAGE  'M'
+
+ /**
+  * Check if a room name is valid (1-31 printable characters, no spaces)
+  *
+  * @param room Room name
+  * @return true if valid, false otherwise
+  */
+ bool is_valid_room_name(const char *room);
+
+ /**
+  * Subscribe a connection to a room
+  *
+  * @param room Room name
+  * @param slot Connection slot
+  * @return 0 on success, -1 on failure or if the connection already
+  *         belongs to MAX_JOINED_ROOMS rooms
+  */
+ int room_add_member(const char *room, int slot);
+
+ /**
+  * Unsubscribe a connection from a room
+  *
+  * @param room Room name
+  * @param slot Connection slot
+  * @return 0 on success, -1 if the connection was not a member
+  */
+ int room_remove_member(const char *room, int slot);
+
+ /**
+  * Unsubscribe a connection from every room it belongs to
+  *
+  * @param slot Connection slot
+  */
+ void room_drop_member(int slot);
+
+ /**
+  * Copy the connection slots subscribed to a room
+  *
+  * @param room Room name
+  * @param slots Array receiving the slots
+  * @param max_slots Size of the array
+  * @return Number of slots copied
+  */
+ int room_get_members(const char *room, int *slots, int max_slots);
+
+ /**
+  * Mark a room as joined by the local user
+  *
+  * @param room Room name
+  * @return 0 on success, -1 on failure or if MAX_JOINED_ROOMS rooms are
+  *         already joined
+  */
+ int room_join(const char *room);
+
+ /**
+  * Mark a room as left by the local user
+  *
+  * @param room Room name
+  * @return 0 on success, -1 if the room was not joined
+  */
+ int room_leave(const char *room);
+
+ /**
+  * Check whether the local user joined a room
+  *
+  * @param room Room name
+  * @return true if joined, false otherwise
+  */
+ bool room_is_joined(const char *room);
+
+ /**
+  * Copy the names of the rooms joined by the local user
+  *
+  * @param names Array receiving the names
+  * @param max_names Size of the array
+  * @return Number of names copied
+  */
+ int room_get_joined(char names[][ROOM_NAME_LENGTH], int max_names);
+
+ /**
+  * Display all known rooms with their member count
+  */
+ void list_rooms(void);
+
+ /**
+  * Free all room resources
+  */
+ void room_cleanup(void);
+
+ #endif /* ROOM_H */
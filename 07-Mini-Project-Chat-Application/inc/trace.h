@@ -0,0 +1,137 @@
+/**
+ * trace.h - In-process event tracer for the chat application
+ *
+ * Every thread records compact binary events into its own ring buffer,
+ * timestamped with the CPU time stamp counter. The owning thread is the
+ * only writer of its ring, so recording takes no lock. When tracing is
+ * disabled, the cost is a single relaxed load and branch. The `trace dump`
+ * command converts the buffers to Chrome trace JSON (chrome://tracing,
+ * Perfetto).
+ */
+
+ #ifndef TRACE_H
+ #define TRACE_H
+
+ #include <stdatomic.h>
+ #include <stdbool.h>
+ #include <stdint.h>
+ #include <time.h>
+
+ #if defined(__x86_64__) || defined(__i386__)
+ #include <x86intrin.h>
+ #endif
+
+ // Number of events kept per thread (power of two)
+ #define TRACE_RING_SIZE 4096
+
+ // Maximum number of threads with a ring buffer
+ #define TRACE_MAX_THREADS 64
+
+ // Connection ID meaning "the connection handled by this thread"
+ #define TRACE_THREAD_CONN (-1)
+
+ /**
+  * Traced events
+  */
+ typedef enum {
+     TRACE_ACCEPT,   // Incoming connection set up by the listener
+     TRACE_RECV,     // Data returned by recv() (instant)
+     TRACE_PARSE,    // Received data split into frames and handled
+     TRACE_DISPLAY,  // Received message printed
+     TRACE_SEND,     // Data passed to send()
+     TRACE_EVENT_TYPES
+ } trace_type_t;
+
+ // Set while tracing is enabled, checked before taking a timestamp
+ extern atomic_bool trace_active;
+
+ /**
+  * Read the trace clock (TSC ticks, or nanoseconds where there is no TSC)
+  *
+  * @return Current time, never 0
+  */
+ static inline uint64_t trace_clock(void) {
+ #if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+ #else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+ #endif
+ }
+
+ /**
+  * Record an event of the calling thread
+  *
+  * @param type Event type
+  * @param conn_id Connection ID, or TRACE_THREAD_CONN
+  * @param arg Event argument (bytes)
+  * @param start Clock value when the event started
+  * @param end Clock value when the event ended (equal to start for instants)
+  */
+ void trace_record(trace_type_t type, int conn_id, uint32_t arg, uint64_t start, uint64_t end);
+
+ /**
+  * Start timing an event
+  *
+  * @return Clock value to pass to trace_end(), 0 if tracing is disabled
+  */
+ static inline uint64_t trace_begin(void) {
+    if (!atomic_load_explicit(&trace_active, memory_order_relaxed)) {
+        return 0;
+    }
+    return trace_clock();
+ }
+
+ /**
+  * Record an event started with trace_begin()
+  *
+  * @param type Event type
+  * @param conn_id Connection ID, or TRACE_THREAD_CONN
+  * @param arg Event argument (bytes)
+  * @param start Value returned by trace_begin()
+  */
+ static inline void trace_end(trace_type_t type, int conn_id, uint32_t arg, uint64_t start) {
+    if (start) {
+        trace_record(type, conn_id, arg, start, trace_clock());
+    }
+ }
+
+ /**
+  * Record an event without duration
+  *
+  * @param type Event type
+  * @param conn_id Connection ID, or TRACE_THREAD_CONN
+  * @param arg Event argument (bytes)
+  */
+ static inline void trace_instant(trace_type_t type, int conn_id, uint32_t arg) {
+    if (atomic_load_explicit(&trace_active, memory_order_relaxed)) {
+        uint64_t now = trace_clock();
+        trace_record(type, conn_id, arg, now, now);
+    }
+ }
+
+ /**
+  * Name the calling thread in dumps
+  *
+  * @param name Thread name
+  * @param conn_id Connection handled by the thread, or -1
+  */
+ void trace_thread_name(const char *name, int conn_id);
+
+ /**
+  * Enable or disable tracing
+  *
+  * @param enable true to start recording
+  */
+ void trace_set_enabled(bool enable);
+
+ /**
+  * Write the recorded events as Chrome trace JSON
+  *
+  * @param path Output file
+  * @return Number of events written, -1 on failure
+  */
+ int trace_dump(const char *path);
+
+ #endif /* TRACE_H */
@@ -17,21 +17,52 @@
  void print_error(const char *message);
  
  /**
-  * Signal handler for SIGINT (Ctrl+C)
+  * Route SIGINT and SIGTERM to a signalfd
   * 
-  * @param sig Signal number
+  * The signals are blocked in the calling thread (and in threads created
+  * later) so shutdown is handled in the main event loop instead of in a
+  * signal handler. Must be called before any thread is created.
+  * 
+  * @return signalfd descriptor, or -1 on failure
   */
- void handle_signal(int sig);
+ int setup_signal_fd(void);
  
  /**
   * Get the local IP address (not loopback)
   * 
+  * The address is served from a cache kept fresh by the address monitor.
+  * 
   * @param buffer Buffer to store the IP address
   * @param buffer_size Size of the buffer
   * @return true if successful, false otherwise
   */
  bool get_local_ip(char *buffer, int buffer_size);
  
+ /**
+  * Check if an IP address belongs to this host
+  * 
+  * Loopback addresses and every address of every interface are local.
+  * 
+  * @param ip IP address string
+  * @return true if local, false otherwise
+  */
+ bool is_local_address(const char *ip);
+ 
+ /**
+  * Start watching local address changes
+  * 
+  * Fills the address cache and starts a thread listening for netlink
+  * RTM_NEWADDR/RTM_DELADDR events to keep it up to date.
+  * 
+  * @return 0 on success, -1 on failure
+  */
+ int start_address_monitor(void);
+ 
+ /**
+  * Stop the address monitor thread
+  */
+ void stop_address_monitor(void);
+ 
  /**
   * Check if an IP address is valid
   * 
@@ -48,6 +79,8 @@
  /**
   * Check if two IP addresses and ports are the same
   * 
+  * Two different addresses of this host are considered the same.
+  * 
   * @param ip1 First IP address
   * @param port1 First port
   * @param ip2 Second IP address
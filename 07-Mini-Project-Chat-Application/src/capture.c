@@ -0,0 +1,147 @@
+/**
+ * capture.c - Traffic capture implementation
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <time.h>
+ #include <pthread.h>
+ #include "capture.h"
+
+ // Size of the stdio buffer of the capture file
+ #define CAPTURE_BUFFER_SIZE (1 << 20)
+
+ // Capture file, NULL when recording is disabled
+ static FILE *capture_file = NULL;
+ static char *capture_buffer = NULL;
+ static unsigned long captured_frames = 0;
+
+ // Mutex serializing writes from the receive threads
+ static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+ // Set once before receive threads start, lets disabled capture skip the lock
+ static volatile bool capture_enabled = false;
+
+ // Local function prototypes
+ static uint64_t clock_ns(clockid_t clock);
+
+ int capture_start(const char *path) {
+    if (!path) {
+        return -1;
+    }
+
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return -1;
+    }
+
+    // Large buffer so frames are written in big chunks
+    capture_buffer = malloc(CAPTURE_BUFFER_SIZE);
+    if (capture_buffer) {
+        setvbuf(file, capture_buffer, _IOFBF, CAPTURE_BUFFER_SIZE);
+    }
+
+    capture_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LENGTH);
+    header.version = CAPTURE_VERSION;
+    header.start_realtime_ns = clock_ns(CLOCK_REALTIME);
+
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        fclose(file);
+        free(capture_buffer);
+        capture_buffer = NULL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&capture_mutex);
+    capture_file = file;
+    captured_frames = 0;
+    capture_enabled = true;
+    pthread_mutex_unlock(&capture_mutex);
+
+    return 0;
+ }
+
+ void capture_frame(int conn_id, const char *data, size_t length) {
+    if (!capture_enabled || !data) {
+        return;
+    }
+
+    capture_record_t record;
+    record.timestamp_ns = clock_ns(CLOCK_MONOTONIC);
+    record.conn_id = (uint32_t)conn_id;
+    record.length = (uint32_t)length;
+
+    pthread_mutex_lock(&capture_mutex);
+
+    if (capture_file) {
+        fwrite(&record, sizeof(record), 1, capture_file);
+        fwrite(data, 1, length, capture_file);
+        captured_frames++;
+    }
+
+    pthread_mutex_unlock(&capture_mutex);
+ }
+
+ unsigned long capture_stop(void) {
+    pthread_mutex_lock(&capture_mutex);
+
+    unsigned long frames = captured_frames;
+    capture_enabled = false;
+
+    if (capture_file) {
+        fclose(capture_file);
+        capture_file = NULL;
+    }
+    free(capture_buffer);
+    capture_buffer = NULL;
+
+    pthread_mutex_unlock(&capture_mutex);
+    return frames;
+ }
+
+ FILE* capture_open(const char *path, capture_header_t *header) {
+    if (!path || !header) {
+        return NULL;
+    }
+
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+
+    if (fread(header, sizeof(*header), 1, file) != 1 ||
+        memcmp(header->magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LENGTH) != 0 ||
+        header->version != CAPTURE_VERSION) {
+        fclose(file);
+        return NULL;
+    }
+
+    return file;
+ }
+
+ int capture_read(FILE *file, capture_record_t *record, char *buffer, size_t buffer_size) {
+    if (!file || !record || !buffer) {
+        return -1;
+    }
+
+    if (fread(record, sizeof(*record), 1, file) != 1) {
+        return feof(file) ? 0 : -1;
+    }
+
+    // Truncated file or frame larger than the caller's buffer
+    if (record->length > buffer_size ||
+        fread(buffer, 1, record->length, file) != record->length) {
+        return -1;
+    }
+
+    return 1;
+ }
+
+ static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+ }
@@ -8,6 +8,9 @@
  #include "command.h"
  #include "connection.h"
  #include "message.h"
+ #include "metrics.h"
+ #include "room.h"
+ #include "trace.h"
  #include "utils.h"
 
  // Command strings matching the command_t enum
@@ -19,6 +22,14 @@
     "list",
     "terminate",
     "send",
+    "limit",
+    "join",
+    "leave",
+    "say",
+    "rooms",
+    "compress",
+    "stats",
+    "trace",
     "exit"
  };
 
@@ -46,13 +57,23 @@
     printf("list                         : List all active connections\n");
     printf("terminate <id>               : Terminate a connection\n");
     printf("send <id> <message>          : Send a message to a peer\n");
+    printf("limit <in|out|global> <r> <b>: Set rate limit (msg/s, burst)\n");
+    printf("join <room>                  : Join a room\n");
+    printf("leave <room>                 : Leave a room\n");
+    printf("say <room> <message>         : Send a message to a room\n");
+    printf("rooms                        : List all known rooms\n");
+    printf("compress <id> <on|off>       : Enable/disable compression to a peer\n");
+    printf("compress min <bytes>         : Set the smallest message compressed\n");
+    printf("stats                        : Display traffic and latency statistics\n");
+    printf("trace <on|off>               : Start/stop recording events\n");
+    printf("trace dump <file>            : Write events as Chrome trace JSON\n");
     printf("exit                         : Exit the application\n");
     printf("-----------------------------\n");
  }
 
- void process_command(char *command_line) {
+ bool process_command(char *command_line) {
     if (!command_line || strlen(command_line) == 0) {
-        return;
+        return true;
     }
 
     // Remove tralling newline if present
@@ -64,7 +85,7 @@
     // Extract command
     char command[20];
     if (sscanf(command_line, "%19s", command) != 1) {
-        return;
+        return true;
     }
 
     // Parse command and execute
@@ -137,15 +158,160 @@
             break;
         }
 
+        case CMD_LIMIT: {
+            char scope_str[10];
+            double rate, burst;
+            limit_scope_t scope;
+
+            // Parse scope, rate and burst
+            if (sscanf(command_line, "%*s %9s %lf %lf", scope_str, &rate, &burst) != 3) {
+                print_error("Invalid format. Usage: limit <in|out|global> <rate> <burst>");
+                break;
+            }
+
+            if (strcmp(scope_str, "in") == 0) {
+                scope = LIMIT_INBOUND;
+            }
+            else if (strcmp(scope_str, "out") == 0) {
+                scope = LIMIT_OUTBOUND;
+            }
+            else if (strcmp(scope_str, "global") == 0) {
+                scope = LIMIT_GLOBAL;
+            }
+            else {
+                print_error("Invalid scope. Use in, out or global");
+                break;
+            }
+
+            if (set_rate_limit(scope, rate, burst) == 0) {
+                printf("Rate limit updated: %s %.1f msg/s, burst %.0f%s\n",
+                       scope_str, rate, burst, rate == 0 ? " (unlimited)" : "");
+            }
+            break;
+        }
+
+        case CMD_JOIN:
+        case CMD_LEAVE: {
+            char room[ROOM_NAME_LENGTH];
+            bool join = parse_command(command) == CMD_JOIN;
+
+            // Parse room name
+            if (sscanf(command_line, "%*s %31s", room) != 1 || !is_valid_room_name(room)) {
+                print_error(join ? "Invalid format. Usage: join <room>"
+                                 : "Invalid format. Usage: leave <room>");
+                break;
+            }
+
+            if (join ? room_join(room) != 0 : room_leave(room) != 0) {
+                print_error(join ? "Could not join room" : "Not a member of this room");
+                break;
+            }
+
+            int notified = announce_room(room, join);
+            printf("%s room %s (%d peer(s) notified).\n", join ? "Joined" : "Left", room, notified);
+            break;
+        }
+
+        case CMD_SAY: {
+            char room[ROOM_NAME_LENGTH];
+            char message[MAX_MESSAGE_LENGTH];
+
+            // Parse room and extract message portion
+            if (sscanf(command_line, "%*s %31s %100[^\n]", room, message) != 2) {
+                print_error("Invalid format. Usage: say <room> <message>");
+                break;
+            }
+
+            int sent = send_room_message(room, message);
+            if (sent >= 0) {
+                printf("Message sent to %d member(s) of room %s.\n", sent, room);
+            }
+            break;
+        }
+
+        case CMD_ROOMS:
+            list_rooms();
+            break;
+
+        case CMD_COMPRESS: {
+            char target[12];
+            char value[8];
+
+            // Parse target (connection ID or "min") and value
+            if (sscanf(command_line, "%*s %11s %7s", target, value) != 2) {
+                print_error("Invalid format. Usage: compress <id> <on|off> | compress min <bytes>");
+                break;
+            }
+
+            if (strcmp(target, "min") == 0) {
+                int min_size = atoi(value);
+                if (min_size < 0) {
+                    print_error("Minimum size must not be negative");
+                    break;
+                }
+                set_compress_min_size(min_size);
+                printf("Messages of %d byte(s) or more will be compressed.\n", min_size);
+                break;
+            }
+
+            bool enable = strcmp(value, "on") == 0;
+            if (!enable && strcmp(value, "off") != 0) {
+                print_error("Invalid value. Use on or off");
+                break;
+            }
+
+            int id = atoi(target);
+            if (set_compression(id, enable) != 0) {
+                print_error("Connection not found!");
+                break;
+            }
+            printf("Compression %s for connection %d.\n", enable ? "enabled" : "disabled", id);
+            break;
+        }
+
+        case CMD_STATS:
+            show_metrics();
+            show_compression_stats();
+            printf("Compression threshold: %d byte(s)\n", get_compress_min_size());
+            break;
+
+        case CMD_TRACE: {
+            char action[8];
+            char path[128];
+
+            // Parse action and, for dump, the output file
+            int fields = sscanf(command_line, "%*s %7s %127s", action, path);
+
+            if (fields == 1 && (strcmp(action, "on") == 0 || strcmp(action, "off") == 0)) {
+                bool enable = strcmp(action, "on") == 0;
+                trace_set_enabled(enable);
+                printf("Tracing %s.\n", enable ? "enabled" : "disabled");
+                break;
+            }
+
+            if (fields != 2 || strcmp(action, "dump") != 0) {
+                print_error("Invalid format. Usage: trace <on|off> | trace dump <file>");
+                break;
+            }
+
+            int count = trace_dump(path);
+            if (count < 0) {
+                print_error("Cannot write trace file");
+                break;
+            }
+            printf("Wrote %d event(s) to %s.\n", count, path);
+            break;
+        }
+
         case CMD_EXIT:
+            // The caller drains connections and cleans up
             printf("Exiting application...\n");
-            cleanup_resources();
-            exit(EXIT_SUCCESS);
-            break;
+            return false;
         case CMD_UNKNOWN:
         default:
             printf("Unknown command. Type 'help' for available commands.\n");
             break;
     }
 
+    return true;
  }
\ No newline at end of file
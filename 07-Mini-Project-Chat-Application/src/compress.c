@@ -0,0 +1,229 @@
+/**
+ * compress.c - LZ77 codec implementation
+ *
+ * Sequence layout:
+ *   token    high nibble: literal length, low nibble: match length - 4
+ *            (a nibble of 15 is followed by extra bytes, each added to
+ *            the length, until a byte below 255)
+ *   literals literal length bytes copied as is
+ *   offset   2 bytes little-endian distance back into the output
+ *   extra match length bytes if the low nibble is 15
+ * The last sequence only has a token and literals.
+ */
+
+ #include <string.h>
+ #include <stdint.h>
+ #include "compress.h"
+
+ // Shortest back reference worth encoding
+ #define MIN_MATCH 4
+
+ // Largest distance a back reference can reach
+ #define MAX_OFFSET 65535
+
+ // Size of the match finder hash table (log2)
+ #define HASH_BITS 12
+
+ // Bytes at the end of the input that are always emitted as literals
+ #define LAST_LITERALS 5
+
+ // Local function prototypes
+ static uint32_t read32(const unsigned char *p);
+ static uint32_t hash32(uint32_t value);
+ static int write_length(unsigned char **op, unsigned char *end, size_t length);
+ static int emit_sequence(unsigned char **op, unsigned char *end, const unsigned char *literals,
+                          size_t literal_len, size_t offset, size_t match_len);
+
+ int lz_compress(const unsigned char *src, size_t src_len, unsigned char *dst, size_t dst_cap) {
+    if (!src || !dst) {
+        return -1;
+    }
+
+    // Positions are stored + 1 so that 0 means empty
+    uint32_t table[1 << HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    unsigned char *op = dst;
+    unsigned char *end = dst + dst_cap;
+    size_t ip = 0;
+    size_t anchor = 0;
+
+    if (src_len > LAST_LITERALS + MIN_MATCH) {
+        size_t limit = src_len - LAST_LITERALS;
+
+        while (ip + MIN_MATCH <= limit) {
+            uint32_t seq = read32(src + ip);
+            uint32_t h = hash32(seq);
+            size_t ref = table[h];
+            table[h] = (uint32_t)ip + 1;
+
+            if (ref == 0 || ip - (ref - 1) > MAX_OFFSET || read32(src + ref - 1) != seq) {
+                ip++;
+                continue;
+            }
+            ref--;
+
+            // Extend the match as far as the last literals allow
+            size_t match_len = MIN_MATCH;
+            while (ip + match_len < limit && src[ref + match_len] == src[ip + match_len]) {
+                match_len++;
+            }
+
+            if (emit_sequence(&op, end, src + anchor, ip - anchor, ip - ref, match_len) < 0) {
+                return -1;
+            }
+
+            ip += match_len;
+            anchor = ip;
+        }
+    }
+
+    // Final sequence: remaining literals, no match
+    if (emit_sequence(&op, end, src + anchor, src_len - anchor, 0, 0) < 0) {
+        return -1;
+    }
+
+    return (int)(op - dst);
+ }
+
+ int lz_decompress(const unsigned char *src, size_t src_len, unsigned char *dst, size_t dst_cap) {
+    if (!src || !dst) {
+        return -1;
+    }
+
+    const unsigned char *ip = src;
+    const unsigned char *ip_end = src + src_len;
+    size_t out = 0;
+
+    while (ip < ip_end) {
+        unsigned token = *ip++;
+
+        // Literal length
+        size_t literal_len = token >> 4;
+        if (literal_len == 15) {
+            unsigned char b;
+            do {
+                if (ip >= ip_end) {
+                    return -1;
+                }
+                b = *ip++;
+                literal_len += b;
+            } while (b == 255);
+        }
+
+        if (literal_len > (size_t)(ip_end - ip) || literal_len > dst_cap - out) {
+            return -1;
+        }
+        memcpy(dst + out, ip, literal_len);
+        ip += literal_len;
+        out += literal_len;
+
+        // The last sequence ends after its literals
+        if (ip == ip_end) {
+            break;
+        }
+
+        // Back reference
+        if (ip_end - ip < 2) {
+            return -1;
+        }
+        size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > out) {
+            return -1;
+        }
+
+        size_t match_len = (token & 15);
+        if (match_len == 15) {
+            unsigned char b;
+            do {
+                if (ip >= ip_end) {
+                    return -1;
+                }
+                b = *ip++;
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += MIN_MATCH;
+
+        if (match_len > dst_cap - out) {
+            return -1;
+        }
+
+        // Byte by byte: the match may overlap the bytes it produces
+        for (size_t i = 0; i < match_len; i++) {
+            dst[out + i] = dst[out - offset + i];
+        }
+        out += match_len;
+    }
+
+    return (int)out;
+ }
+
+ static uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+ }
+
+ // Multiplicative hash of 4 bytes
+ static uint32_t hash32(uint32_t value) {
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+ }
+
+ // Write the extra bytes of a length that did not fit in its nibble
+ static int write_length(unsigned char **op, unsigned char *end, size_t length) {
+    while (length >= 255) {
+        if (*op >= end) {
+            return -1;
+        }
+        *(*op)++ = 255;
+        length -= 255;
+    }
+
+    if (*op >= end) {
+        return -1;
+    }
+    *(*op)++ = (unsigned char)length;
+    return 0;
+ }
+
+ static int emit_sequence(unsigned char **op, unsigned char *end, const unsigned char *literals,
+                          size_t literal_len, size_t offset, size_t match_len) {
+    size_t match_code = match_len >= MIN_MATCH ? match_len - MIN_MATCH : 0;
+
+    if (*op >= end) {
+        return -1;
+    }
+
+    unsigned char *token = (*op)++;
+    *token = (unsigned char)(((literal_len < 15 ? literal_len : 15) << 4) |
+                             (match_code < 15 ? match_code : 15));
+
+    if (literal_len >= 15 && write_length(op, end, literal_len - 15) < 0) {
+        return -1;
+    }
+
+    if (literal_len > (size_t)(end - *op)) {
+        return -1;
+    }
+    memcpy(*op, literals, literal_len);
+    *op += literal_len;
+
+    // Final sequence has no back reference
+    if (match_len == 0) {
+        return 0;
+    }
+
+    if (end - *op < 2) {
+        return -1;
+    }
+    *(*op)++ = (unsigned char)(offset & 0xFF);
+    *(*op)++ = (unsigned char)(offset >> 8);
+
+    if (match_code >= 15 && write_length(op, end, match_code - 15) < 0) {
+        return -1;
+    }
+
+    return 0;
+ }
@@ -10,9 +10,16 @@
  #include <arpa/inet.h>
  #include <netinet/in.h>
  #include <pthread.h>
+ #include <stdatomic.h>
  #include <errno.h>
+ #include <time.h>
+ #include <sys/ioctl.h>
+ #include <linux/sockios.h>
  #include "connection.h"
  #include "message.h"
+ #include "metrics.h"
+ #include "trace.h"
+ #include "room.h"
  #include "utils.h"
 
  // Array of connections - both outgoing and incoming
@@ -35,10 +42,23 @@
  // Connection counters
  static int active_connections = 0;
 
+ // Configured per-connection limits (messages per second / burst)
+ static double inbound_rate = DEFAULT_INBOUND_RATE;
+ static double inbound_burst = DEFAULT_INBOUND_BURST;
+ static double outbound_rate = DEFAULT_OUTBOUND_RATE;
+ static double outbound_burst = DEFAULT_OUTBOUND_BURST;
+
+ // Global inbound limit shared by all connections
+ static token_bucket_t global_inbound;
+ static unsigned long global_shed = 0;
+
  // Local function prototypes
  static void* connection_listener(void* arg);
  static int find_free_slot(void);
  static int check_duplicate_connection(const char* ip, int port);
+ static void init_peer_state(connection_t *conn);
+ static void reset_compress_stats(compress_stats_t *stats);
+ static int send_on_slot(int slot, const char *data, size_t len, bool limited);
 
  int initialize_server(int port) {
     // Create socket
@@ -93,6 +113,8 @@
         connections[i].is_active = false;
     }
 
+    token_bucket_init(&global_inbound, DEFAULT_GLOBAL_RATE, DEFAULT_GLOBAL_BURST);
+
     return 0;
  }
 
@@ -121,6 +143,8 @@
     socklen_t client_len = sizeof(client_addr);
     int client_socket;
 
+    trace_thread_name("listener", -1);
+
     while (1) {
         // Accept new conncection
         client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &client_len);
@@ -138,6 +162,9 @@
             continue;
         }
 
+        metrics_accept();
+        uint64_t trace_start = trace_begin();
+
         // Find a free slot for the new connection
         pthread_mutex_lock(&conn_mutex);
         int slot = find_free_slot();
@@ -156,6 +183,7 @@
         connections[slot].addr = client_addr;
         connections[slot].is_active = true;
         connections[slot].is_incoming = true;
+        init_peer_state(&connections[slot]);
 
         // Covert IP address to string
         inet_ntop(AF_INET, &client_addr.sin_addr, connections[slot].ip, IP_LENGTH);
@@ -198,6 +226,12 @@
 
         // Detach thread
         pthread_detach(connections[slot].thread);
+
+        // Tell the new peer what we support and which rooms we are in
+        announce_capabilities(connections[slot].id);
+        announce_joined_rooms(connections[slot].id);
+
+        trace_end(TRACE_ACCEPT, connections[slot].id, 0, trace_start);
     }
     
     return NULL;
@@ -272,6 +306,7 @@
     connections[slot].addr = peer_addr;
     connections[slot].is_active = true;
     connections[slot].is_incoming = false;
+    init_peer_state(&connections[slot]);
     strncpy(connections[slot].ip, ip, IP_LENGTH -1);
     connections[slot].ip[IP_LENGTH - 1] = '\0';
 
@@ -281,7 +316,7 @@
     printf("Connected to %s:%d\n", ip, port);
 
     // Create a new thread to handle message from this connection
-    connection_t *conn_copy = malloc(sizeof(sizeof(connection_t)));
+    connection_t *conn_copy = malloc(sizeof(connection_t));
     if (!conn_copy) {
         print_error("Memory allocation failed");
         pthread_mutex_lock(&conn_mutex);
@@ -293,7 +328,12 @@
         return -1;
     }
 
-    // Copy thread for receiving message
+    // Copy connection data to avoid race conditions
+    pthread_mutex_lock(&conn_mutex);
+    memcpy(conn_copy, &connections[slot], sizeof(connection_t));
+    pthread_mutex_unlock(&conn_mutex);
+
+    // Create thread for receiving message
     if (pthread_create(&connections[slot].thread, NULL, receive_message_handler, conn_copy) != 0) {
         print_error("Failed to create receive thread");
         free(conn_copy);
@@ -309,6 +349,10 @@
     // Detach thread
     pthread_detach(connections[slot].thread);
 
+    // Tell the new peer what we support and which rooms we are in
+    announce_capabilities(connections[slot].id);
+    announce_joined_rooms(connections[slot].id);
+
     return 0;
  }
 
@@ -322,7 +366,7 @@
 
     // Send termination notification
     char msg[MAX_MESSAGE_LENGTH];
-    snprintf(msg, MAX_MESSAGE_LENGTH, "Connection terminated by peer");
+    snprintf(msg, MAX_MESSAGE_LENGTH, "Connection terminated by peer\n");
 
     // Try to send
     if (conn->socket >= 0) {
@@ -343,6 +387,9 @@
     }
     pthread_mutex_unlock(&conn_mutex);
 
+    // Remove the peer from all rooms
+    room_drop_member((int)(conn - connections));
+
     return 0;
  }
  
@@ -350,17 +397,19 @@
     pthread_mutex_lock(&conn_mutex);
     
     printf("\n-------- Connection List --------\n");
-    printf("ID  |  IP Address        |  Port  |  Type\n");
-    printf("----------------------------------------\n");
+    printf("ID  |  IP Address        |  Port  |  Type      |  Shed In  |  Shed Out\n");
+    printf("----------------------------------------------------------------------\n");
     
     int count = 0;
     for (int i = 0; i < MAX_CONNECTIONS; i++) {
         if (connections[i].is_active) {
-            printf("%-4d|  %-18s|  %-6d|  %s\n", 
+            printf("%-4d|  %-18s|  %-6d|  %-10s|  %-9lu|  %lu\n", 
                    connections[i].id, 
                    connections[i].ip, 
                    connections[i].port,
-                   connections[i].is_incoming ? "Incoming" : "Outgoing");
+                   connections[i].is_incoming ? "Incoming" : "Outgoing",
+                   connections[i].shed_in,
+                   connections[i].shed_out);
             count++;
         }
     }
@@ -369,8 +418,9 @@
         printf("No active connections\n");
     }
     
-    printf("----------------------------------------\n");
+    printf("----------------------------------------------------------------------\n");
     printf("Total: %d connection(s)\n", count);
+    printf("Shed by global limit: %lu message(s)\n", global_shed);
     
     pthread_mutex_unlock(&conn_mutex);
  }
@@ -389,6 +439,410 @@
     return NULL;
  }
 
+ int get_connection_slot(int conn_id) {
+    pthread_mutex_lock(&conn_mutex);
+
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (connections[i].is_active && connections[i].id == conn_id) {
+            pthread_mutex_unlock(&conn_mutex);
+            return i;
+        }
+    }
+
+    pthread_mutex_unlock(&conn_mutex);
+    return -1;
+ }
+
+ int get_connection_info(connection_info_t *info, int max_info) {
+    if (!info) {
+        return 0;
+    }
+
+    int count = 0;
+
+    pthread_mutex_lock(&conn_mutex);
+
+    for (int i = 0; i < MAX_CONNECTIONS && count < max_info; i++) {
+        if (!connections[i].is_active) {
+            continue;
+        }
+
+        connection_info_t *out = &info[count++];
+        out->slot = i;
+        out->id = connections[i].id;
+        memcpy(out->ip, connections[i].ip, IP_LENGTH);
+        out->port = connections[i].port;
+        out->is_incoming = connections[i].is_incoming;
+        out->shed_in = connections[i].shed_in;
+        out->shed_out = connections[i].shed_out;
+
+        // Queue depths are read under the lock so the socket cannot be reused
+        out->recv_queue = 0;
+        out->send_queue = 0;
+        if (connections[i].socket >= 0) {
+            ioctl(connections[i].socket, SIOCINQ, &out->recv_queue);
+            ioctl(connections[i].socket, SIOCOUTQ, &out->send_queue);
+        }
+    }
+
+    pthread_mutex_unlock(&conn_mutex);
+    return count;
+ }
+
+ void mark_connection_closed(int conn_id) {
+    int slot = -1;
+
+    pthread_mutex_lock(&conn_mutex);
+
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (connections[i].is_active && connections[i].id == conn_id) {
+            connections[i].is_active = false;
+            connections[i].socket = -1;
+            active_connections--;
+            slot = i;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&conn_mutex);
+
+    if (slot >= 0) {
+        room_drop_member(slot);
+    }
+ }
+
+ int send_to_slot(int slot, const char *data, size_t len) {
+    return send_on_slot(slot, data, len, true);
+ }
+
+ int send_control_to_slot(int slot, const char *data, size_t len) {
+    return send_on_slot(slot, data, len, false);
+ }
+
+ static int send_on_slot(int slot, const char *data, size_t len, bool limited) {
+    if (slot < 0 || slot >= MAX_CONNECTIONS || !data) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&conn_mutex);
+
+    if (!connections[slot].is_active || connections[slot].socket < 0) {
+        pthread_mutex_unlock(&conn_mutex);
+        return -1;
+    }
+
+    if (limited && !token_bucket_consume(&connections[slot].outbound, 1)) {
+        connections[slot].shed_out++;
+        pthread_mutex_unlock(&conn_mutex);
+        return -2;
+    }
+
+    int sock = connections[slot].socket;
+    int id = connections[slot].id;
+    pthread_mutex_unlock(&conn_mutex);
+
+    uint64_t trace_start = trace_begin();
+    ssize_t sent = send(sock, data, len, 0);
+    trace_end(TRACE_SEND, id, (uint32_t)len, trace_start);
+
+    if (sent < 0) {
+        metrics_send_error(slot);
+        return -1;
+    }
+
+    metrics_message_out(slot, len);
+    return 0;
+ }
+
+ int broadcast_data(const char *data, size_t len) {
+    if (!data) {
+        return 0;
+    }
+
+    int slots[MAX_CONNECTIONS];
+    int socks[MAX_CONNECTIONS];
+    int ids[MAX_CONNECTIONS];
+    int count = 0;
+
+    // Copy the targets, so a peer that is slow to read blocks only this sender
+    pthread_mutex_lock(&conn_mutex);
+
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (connections[i].is_active && connections[i].socket >= 0) {
+            slots[count] = i;
+            socks[count] = connections[i].socket;
+            ids[count] = connections[i].id;
+            count++;
+        }
+    }
+
+    pthread_mutex_unlock(&conn_mutex);
+
+    int sent = 0;
+
+    for (int i = 0; i < count; i++) {
+        uint64_t trace_start = trace_begin();
+        ssize_t result = send(socks[i], data, len, 0);
+        trace_end(TRACE_SEND, ids[i], (uint32_t)len, trace_start);
+
+        if (result < 0) {
+            metrics_send_error(slots[i]);
+            continue;
+        }
+
+        metrics_message_out(slots[i], len);
+        sent++;
+    }
+
+    return sent;
+ }
+
+ bool admit_inbound_message(int slot) {
+    if (slot < 0 || slot >= MAX_CONNECTIONS) {
+        return false;
+    }
+
+    bool admitted = false;
+
+    pthread_mutex_lock(&conn_mutex);
+
+    if (connections[slot].is_active) {
+        // A noisy peer is stopped by its own bucket before it can drain the global one
+        if (!token_bucket_consume(&connections[slot].inbound, 1)) {
+            connections[slot].shed_in++;
+        }
+        else if (!token_bucket_consume(&global_inbound, 1)) {
+            connections[slot].shed_in++;
+            global_shed++;
+        }
+        else {
+            admitted = true;
+        }
+    }
+
+    pthread_mutex_unlock(&conn_mutex);
+    return admitted;
+ }
+
+ int set_rate_limit(limit_scope_t scope, double rate, double burst) {
+    if (rate < 0 || burst < 1) {
+        print_error("Invalid limit. Rate must be >= 0 and burst >= 1");
+        return -1;
+    }
+
+    pthread_mutex_lock(&conn_mutex);
+
+    switch (scope) {
+        case LIMIT_INBOUND:
+            inbound_rate = rate;
+            inbound_burst = burst;
+            break;
+        case LIMIT_OUTBOUND:
+            outbound_rate = rate;
+            outbound_burst = burst;
+            break;
+        case LIMIT_GLOBAL:
+            token_bucket_configure(&global_inbound, rate, burst);
+            break;
+        default:
+            pthread_mutex_unlock(&conn_mutex);
+            return -1;
+    }
+
+    // Apply per-connection limits to existing connections
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (!connections[i].is_active) {
+            continue;
+        }
+        if (scope == LIMIT_INBOUND) {
+            token_bucket_configure(&connections[i].inbound, rate, burst);
+        }
+        else if (scope == LIMIT_OUTBOUND) {
+            token_bucket_configure(&connections[i].outbound, rate, burst);
+        }
+    }
+
+    pthread_mutex_unlock(&conn_mutex);
+    return 0;
+ }
+
+ bool use_compression(int slot) {
+    if (slot < 0 || slot >= MAX_CONNECTIONS) {
+        return false;
+    }
+
+    pthread_mutex_lock(&conn_mutex);
+    bool use = connections[slot].is_active && connections[slot].compress_enabled
+               && connections[slot].peer_compress;
+    pthread_mutex_unlock(&conn_mutex);
+
+    return use;
+ }
+
+ void set_peer_compression(int slot, bool supported) {
+    if (slot < 0 || slot >= MAX_CONNECTIONS) {
+        return;
+    }
+
+    pthread_mutex_lock(&conn_mutex);
+    connections[slot].peer_compress = supported;
+    pthread_mutex_unlock(&conn_mutex);
+ }
+
+ void set_peer_newline(int slot) {
+    if (slot < 0 || slot >= MAX_CONNECTIONS) {
+        return;
+    }
+
+    pthread_mutex_lock(&conn_mutex);
+    connections[slot].peer_newline = true;
+    pthread_mutex_unlock(&conn_mutex);
+ }
+
+ bool peer_uses_newline(int slot) {
+    if (slot < 0 || slot >= MAX_CONNECTIONS) {
+        return false;
+    }
+
+    pthread_mutex_lock(&conn_mutex);
+    bool newline = connections[slot].is_active && connections[slot].peer_newline;
+    pthread_mutex_unlock(&conn_mutex);
+
+    return newline;
+ }
+
+ int set_compression(int conn_id, bool enabled) {
+    int result = -1;
+
+    pthread_mutex_lock(&conn_mutex);
+
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (connections[i].is_active && connections[i].id == conn_id) {
+            connections[i].compress_enabled = enabled;
+            result = 0;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&conn_mutex);
+    return result;
+ }
+
+ void record_compression(int slot, bool outbound, size_t raw_len, size_t wire_len,
+                         uint64_t cpu_ns, bool compressed) {
+    if (slot < 0 || slot >= MAX_CONNECTIONS) {
+        return;
+    }
+
+    // Called for every frame, so no lock: the counters are only summed
+    compress_stats_t *stats = outbound ? &connections[slot].comp_out : &connections[slot].comp_in;
+    atomic_fetch_add_explicit(&stats->raw_bytes, raw_len, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->wire_bytes, wire_len, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->cpu_ns, cpu_ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(compressed ? &stats->compressed : &stats->uncompressed, 1,
+                              memory_order_relaxed);
+ }
+
+ void show_compression_stats(void) {
+    pthread_mutex_lock(&conn_mutex);
+
+    printf("\n-------- Compression Statistics --------\n");
+    printf("ID  |  Mode  |  Dir  |  Raw bytes   |  Wire bytes  |  Ratio  |  Frames (z/plain)  |  CPU us\n");
+    printf("-----------------------------------------------------------------------------------------\n");
+
+    int count = 0;
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (!connections[i].is_active) {
+            continue;
+        }
+
+        const char *mode = !connections[i].peer_compress ? "n/a"
+                         : connections[i].compress_enabled ? "on" : "off";
+
+        for (int dir = 0; dir < 2; dir++) {
+            compress_stats_t *s = dir == 0 ? &connections[i].comp_out : &connections[i].comp_in;
+            uint64_t raw_bytes = atomic_load_explicit(&s->raw_bytes, memory_order_relaxed);
+            uint64_t wire_bytes = atomic_load_explicit(&s->wire_bytes, memory_order_relaxed);
+            uint64_t cpu_ns = atomic_load_explicit(&s->cpu_ns, memory_order_relaxed);
+            double ratio = wire_bytes > 0 ? (double)raw_bytes / (double)wire_bytes : 1.0;
+            char frames[48];
+            snprintf(frames, sizeof(frames), "%llu/%llu",
+                     (unsigned long long)atomic_load_explicit(&s->compressed, memory_order_relaxed),
+                     (unsigned long long)atomic_load_explicit(&s->uncompressed, memory_order_relaxed));
+
+            printf("%-4d|  %-6s|  %-5s|  %-12llu|  %-12llu|  %-5.2fx |  %-18s|  %.1f\n",
+                   connections[i].id, mode, dir == 0 ? "out" : "in",
+                   (unsigned long long)raw_bytes, (unsigned long long)wire_bytes, ratio, frames,
+                   (double)cpu_ns / 1000.0);
+        }
+        count++;
+    }
+
+    if (count == 0) {
+        printf("No active connections\n");
+    }
+
+    printf("-----------------------------------------------------------------------------------------\n");
+
+    pthread_mutex_unlock(&conn_mutex);
+ }
+
+ int drain_connections(int timeout_ms) {
+    // Stop accepting, shutdown() also wakes the listener blocked in accept()
+    int listen_sock = server_socket;
+    server_socket = -1;
+    if (listen_sock >= 0) {
+        shutdown(listen_sock, SHUT_RDWR);
+        close(listen_sock);
+    }
+
+    // Half-close so peers receive everything queued followed by FIN
+    pthread_mutex_lock(&conn_mutex);
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (connections[i].is_active && connections[i].socket >= 0) {
+            shutdown(connections[i].socket, SHUT_WR);
+        }
+    }
+    pthread_mutex_unlock(&conn_mutex);
+
+    struct timespec now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    // Wait until the kernel send queues hold no unacknowledged bytes
+    while (1) {
+        int pending = 0;
+
+        pthread_mutex_lock(&conn_mutex);
+        for (int i = 0; i < MAX_CONNECTIONS; i++) {
+            int queued = 0;
+            if (connections[i].is_active && connections[i].socket >= 0 &&
+                ioctl(connections[i].socket, SIOCOUTQ, &queued) == 0) {
+                pending += queued;
+            }
+        }
+        pthread_mutex_unlock(&conn_mutex);
+
+        if (pending == 0) {
+            return 0;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > deadline.tv_sec ||
+            (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec)) {
+            return pending;
+        }
+
+        struct timespec pause = { 0, 5 * 1000000L };
+        nanosleep(&pause, NULL);
+    }
+ }
+
  void close_all_connections(void) {
     // Stop accepting new connections
     if (server_socket >= 0) {
@@ -409,6 +863,9 @@
 
     active_connections = 0;
     pthread_mutex_unlock(&conn_mutex);
+
+    // Free the room index
+    room_cleanup();
     
     // Destroy mutex
     pthread_mutex_destroy(&conn_mutex);
@@ -431,4 +888,31 @@
         }
     }
     return -1;
+ }
+
+ // Reset per-peer limits and statistics, caller must hold conn_mutex
+ static void init_peer_state(connection_t *conn) {
+    token_bucket_init(&conn->inbound, inbound_rate, inbound_burst);
+    token_bucket_init(&conn->outbound, outbound_rate, outbound_burst);
+    conn->shed_in = 0;
+    conn->shed_out = 0;
+
+    metrics_reset_peer((int)(conn - connections));
+
+    // Compression starts once the peer announces support
+    conn->compress_enabled = true;
+    conn->peer_compress = false;
+    reset_compress_stats(&conn->comp_out);
+    reset_compress_stats(&conn->comp_in);
+
+    // Until the peer announces otherwise, it sends one plain message per send
+    conn->peer_newline = false;
+ }
+
+ static void reset_compress_stats(compress_stats_t *stats) {
+    atomic_store_explicit(&stats->raw_bytes, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats->wire_bytes, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats->compressed, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats->uncompressed, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats->cpu_ns, 0, memory_order_relaxed);
  }
\ No newline at end of file
@@ -7,40 +7,117 @@
  #include <string.h>
  #include <signal.h>
  #include <unistd.h>
+ #include <getopt.h>
+ #include <poll.h>
+ #include <errno.h>
+ #include <sys/signalfd.h>
+ #include "capture.h"
  #include "command.h"
  #include "connection.h"
  #include "message.h"
+ #include "metrics.h"
+ #include "trace.h"
  #include "utils.h"
 
  #define MAX_COMAND_LENGTH 256
 
- int main(int argc, char const *argv[])
+ // Default time allowed for flushing connections on shutdown
+ #define DEFAULT_DRAIN_TIMEOUT_MS 2000
+
+ static void print_usage(const char *prog) {
+    printf("Usage: %s [--drain-timeout <ms>] [--record <file>] [--metrics-socket <path>] [--trace] <port>\n", prog);
+ }
+
+ int main(int argc, char *argv[])
  {
+    int drain_timeout_ms = DEFAULT_DRAIN_TIMEOUT_MS;
+    const char *record_path = NULL;
+    const char *metrics_path = NULL;
+    char default_metrics_path[64];
+
+    static const struct option long_options[] = {
+        { "drain-timeout", required_argument, NULL, 'd' },
+        { "record", required_argument, NULL, 'r' },
+        { "metrics-socket", required_argument, NULL, 'm' },
+        { "trace", no_argument, NULL, 't' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    // Parse options
+    int opt;
+    while ((opt = getopt_long(argc, argv, "d:r:m:t", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'd':
+                drain_timeout_ms = atoi(optarg);
+                if (drain_timeout_ms < 0) {
+                    print_error("Drain timeout must not be negative");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'r':
+                record_path = optarg;
+                break;
+            case 'm':
+                metrics_path = optarg;
+                break;
+            case 't':
+                trace_set_enabled(true);
+                break;
+            default:
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
     // Validate command line arguments
-    if (argc != 2) {
-        printf("Usage: %s <port>\n", argv[0]);
+    if (argc - optind != 1) {
+        print_usage(argv[0]);
         return EXIT_FAILURE;
     }
 
     // Parase and validate port number
-    int port = atoi(argv[1]);
+    int port = atoi(argv[optind]);
     if (port <= 0 || port >= 65535) {
         print_error("Invalid port number. Port must be between 1 and 65535");
         return EXIT_FAILURE;
     }
 
-    // Register signal handler for clean termination
-    if (signal(SIGINT, handle_signal) == SIG_ERR) {
+    metrics_init();
+    trace_thread_name("main", -1);
+
+    // Record received traffic before any connection can be accepted
+    if (record_path && capture_start(record_path) != 0) {
+        print_error("Cannot open capture file");
+        return EXIT_FAILURE;
+    }
+
+    // Route shutdown signals to a descriptor, before any thread is started
+    int signal_fd = setup_signal_fd();
+    if (signal_fd < 0) {
         print_error("Cannot handle SINGINT");
         return EXIT_FAILURE;
     }
 
+    // Cache local addresses and watch for changes (not fatal if unavailable)
+    if (start_address_monitor() != 0) {
+        print_error("Address changes will not be tracked");
+    }
+
     // Initialize sever socket
     if (initialize_server(port) != 0) {
         print_error("Failed to initialize sever socket");
         return EXIT_FAILURE;
     }
 
+    // Serve metrics on a Unix socket (not fatal if unavailable)
+    if (!metrics_path) {
+        snprintf(default_metrics_path, sizeof(default_metrics_path), "/tmp/chat_app.%d.metrics", port);
+        metrics_path = default_metrics_path;
+    }
+    if (start_metrics_server(metrics_path) != 0) {
+        print_error("Metrics will not be exported");
+    }
+
     // Start connection listener thread
     if (start_connection_listener() != 0) {
         print_error("Failed to start connection listener");
@@ -52,25 +129,83 @@
     printf("Chat Application started on port: %d\n", port);
     display_help();
 
-    // Main command processing loop
+    // Main event loop: user commands and shutdown signals
+    struct pollfd fds[2] = {
+        { .fd = STDIN_FILENO, .events = POLLIN },
+        { .fd = signal_fd, .events = POLLIN }
+    };
     char command_line[MAX_COMAND_LENGTH];
-    while (1) {
-        // Display prompt and get user input
-        printf("Enter command: ");
-        if (fgets(command_line, sizeof(command_line), stdin) == NULL) {
+    size_t line_len = 0;
+    bool running = true;
+
+    printf("Enter command: ");
+    fflush(stdout);
+
+    while (running) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            print_error("poll failed");
+            break;
+        }
+
+        // Shutdown requested by signal
+        if (fds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            if (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                printf("\nReceived %s. Shutting down...\n", strsignal(info.ssi_signo));
+            }
+            break;
+        }
+
+        if (!(fds[0].revents & (POLLIN | POLLHUP))) {
+            continue;
+        }
+
+        // Read whatever is available; stdio buffering would hide lines from poll
+        ssize_t n = read(STDIN_FILENO, command_line + line_len, sizeof(command_line) - 1 - line_len);
+        if (n <= 0) {
             // Handle EOF or read error
             break;
         }
+        line_len += (size_t)n;
 
-        // Process the command
-        process_command(command_line);
-    }   
+        // Process every complete line
+        char *start = command_line;
+        char *newline;
+        while (running && (newline = memchr(start, '\n', line_len - (size_t)(start - command_line)))) {
+            *newline = '\0';
+            running = process_command(start);
+            start = newline + 1;
+
+            if (running) {
+                printf("Enter command: ");
+                fflush(stdout);
+            }
+        }
+
+        // Keep the incomplete line, drop it if it cannot fit
+        line_len -= (size_t)(start - command_line);
+        memmove(command_line, start, line_len);
+        if (line_len == sizeof(command_line) - 1) {
+            print_error("Command too long");
+            line_len = 0;
+        }
+    }
+
+    // Flush in-flight data to peers before closing everything
+    int pending = drain_connections(drain_timeout_ms);
+    if (pending > 0) {
+        printf("Drain timeout: %d byte(s) not acknowledged by peers\n", pending);
+    }
 
     // Clean up resources before exiting
     cleanup_resources();
+    close(signal_fd);
+
+    if (record_path) {
+        printf("Recorded %lu frame(s) to %s\n", capture_stop(), record_path);
+    }
     return EXIT_SUCCESS;
  }
-
-
- 
- 
\ No newline at end of file
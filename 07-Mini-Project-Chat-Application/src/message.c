@@ -7,10 +7,33 @@
  #include <string.h>
  #include <unistd.h>
  #include <errno.h>
+ #include <time.h>
+ #include "capture.h"
+ #include "compress.h"
  #include "message.h"
+ #include "metrics.h"
  #include "connection.h"
+ #include "room.h"
+ #include "trace.h"
  #include "utils.h"
 
+ // Size of one send carrying the join frames for a new peer
+ #define ANNOUNCE_BATCH_LENGTH 4096
+
+ // Smallest message worth compressing
+ static int compress_min_size = DEFAULT_COMPRESS_MIN_SIZE;
+
+ // Local function prototypes
+ static uint64_t thread_cpu_ns(void);
+ static int send_encoded(int slot, const char *data, size_t len);
+ static int build_room_frame(char *frame, size_t size, char type, const char *room, const char *message);
+ static bool process_room_frame(char *frame, int slot, const char *sender_ip, int sender_port);
+ static int process_compressed_frame(const unsigned char *data, size_t wire_len, size_t raw_len,
+                                     int slot, const char *sender_ip, int sender_port);
+ static size_t process_frames(char *pending, size_t len, int slot, const char *sender_ip,
+                              int sender_port, bool nested, int *shown);
+ static bool admit_frame(int slot, bool *paid);
+
  int send_message(int conn_id, const char *message) {
     // Check message length
     if (strlen(message) > MAX_MESSAGE_LENGTH -1) {
@@ -19,15 +42,23 @@
     }
 
     // Find the connetion
-    connection_t* conn = find_connection_by_id(conn_id);
-    if (!conn) {
+    int slot = get_connection_slot(conn_id);
+    if (slot < 0) {
         print_error("Connection is not active");
         return -1;
     }
 
-    // Send the message
-    ssize_t bytes_sent = send(conn->socket, message, strlen(message), 0);
-    if (bytes_sent < 0) {
+    // Plain messages end with a newline, so several can share one receive
+    char frame[MAX_MESSAGE_LENGTH + 1];
+    int len = snprintf(frame, sizeof(frame), "%s\n", message);
+
+    // Send the message, compressed if negotiated with this peer
+    int result = send_encoded(slot, frame, (size_t)len);
+    if (result == -2) {
+        print_error("Outbound rate limit exceeded, message not sent");
+        return -1;
+    }
+    if (result < 0) {
         print_error("Failed to send message");
         return -1;
     }
@@ -35,6 +66,106 @@
     return 0;
  }
 
+ int send_room_message(const char *room, const char *message) {
+    if (!is_valid_room_name(room)) {
+        print_error("Invalid room name");
+        return -1;
+    }
+
+    if (!message || strlen(message) > MAX_MESSAGE_LENGTH - 1) {
+        print_error("Message too long. Maxium length is 100 characters");
+        return -1;
+    }
+
+    char frame[MAX_FRAME_LENGTH];
+    int len = build_room_frame(frame, sizeof(frame), ROOM_FRAME_MESSAGE, room, message);
+    if (len < 0) {
+        return -1;
+    }
+
+    // Walk the room's member array, not the whole connection list
+    int slots[MAX_CONNECTIONS];
+    int count = room_get_members(room, slots, MAX_CONNECTIONS);
+
+    int sent = 0;
+    for (int i = 0; i < count; i++) {
+        if (send_encoded(slots[i], frame, (size_t)len) == 0) {
+            sent++;
+        }
+    }
+
+    return sent;
+ }
+
+ int announce_room(const char *room, bool joined) {
+    char frame[MAX_FRAME_LENGTH];
+    int len = build_room_frame(frame, sizeof(frame),
+                               joined ? ROOM_FRAME_JOIN : ROOM_FRAME_LEAVE, room, NULL);
+    if (len < 0) {
+        return 0;
+    }
+
+    return broadcast_data(frame, (size_t)len);
+ }
+
+ void announce_capabilities(int conn_id) {
+    int slot = get_connection_slot(conn_id);
+    if (slot < 0) {
+        return;
+    }
+
+    char frame[16];
+    int len = snprintf(frame, sizeof(frame), "%c%c%s\n%c%c%s\n",
+                       ROOM_FRAME_MARKER, CAPS_FRAME, CAPS_PLAIN_NEWLINE,
+                       ROOM_FRAME_MARKER, CAPS_FRAME, CAPS_CODEC_LZ);
+    send_control_to_slot(slot, frame, (size_t)len);
+ }
+
+ void set_compress_min_size(int min_size) {
+    compress_min_size = min_size;
+ }
+
+ int get_compress_min_size(void) {
+    return compress_min_size;
+ }
+
+ void announce_joined_rooms(int conn_id) {
+    int slot = get_connection_slot(conn_id);
+    if (slot < 0) {
+        return;
+    }
+
+    char (*names)[ROOM_NAME_LENGTH] = malloc(MAX_JOINED_ROOMS * sizeof(*names));
+    if (!names) {
+        print_error("Memory allocation failed");
+        return;
+    }
+
+    int count = room_get_joined(names, MAX_JOINED_ROOMS);
+
+    // Pack the join frames into as few sends as possible
+    char batch[ANNOUNCE_BATCH_LENGTH];
+    size_t used = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (sizeof(batch) - used < MAX_FRAME_LENGTH) {
+            send_control_to_slot(slot, batch, used);
+            used = 0;
+        }
+
+        int len = build_room_frame(batch + used, sizeof(batch) - used, ROOM_FRAME_JOIN, names[i], NULL);
+        if (len > 0) {
+            used += (size_t)len;
+        }
+    }
+
+    if (used > 0) {
+        send_control_to_slot(slot, batch, used);
+    }
+
+    free(names);
+ }
+
  void process_received_message(const char *message, const char *sender_ip, int sender_port) {
     if (!message || !sender_ip) {
         return;
@@ -69,10 +200,21 @@
 
     // Free the malloc'd connection copy
     free(conn);
+
+    int slot = get_connection_slot(id);
+
+    // Name this thread in trace dumps
+    char thread_name[48];
+    snprintf(thread_name, sizeof(thread_name), "conn %d %s:%d", id, ip, port);
+    trace_thread_name(thread_name, id);
     
     // Buffer for receiving messages
     char buffer[MAX_MESSAGE_LENGTH];
 
+    // Frames may be split across receives, keep the incomplete tail here
+    char pending[2 * MAX_WIRE_FRAME_LENGTH];
+    size_t pending_len = 0;
+
     // Receive message in a loop
     while (1) {
         memset(buffer, 0, sizeof(buffer));
@@ -87,13 +229,13 @@
                 continue;
             }
 
-            // Mark connection as inactive
-            connection_t *inactive_conn = find_connection_by_id(id);
-            if (inactive_conn) {
-                inactive_conn->is_active = false;
-                inactive_conn->socket = -1;
+            if (byte_recv < 0) {
+                metrics_recv_error(slot);
             }
 
+            // Mark connection as inactive
+            mark_connection_closed(id);
+
             printf("\nConnection with %s:%d closed\n", ip, port);
             printf("Enter command: ");
             fflush(stdout);
@@ -103,12 +245,292 @@
             break;
         }
 
-        // Ensure null-termination
-        buffer[byte_recv] = '\0';
+        uint64_t received_ns = metrics_now_ns();
+        trace_instant(TRACE_RECV, id, (uint32_t)byte_recv);
+
+        // Record the frame as received, before any limit is applied
+        capture_frame(id, buffer, (size_t)byte_recv);
+
+        if (pending_len + (size_t)byte_recv >= sizeof(pending)) {
+            // Peer sent a frame longer than allowed, resynchronize
+            metrics_recv_error(slot);
+            pending_len = 0;
+            continue;
+        }
 
-        // Process the received message;
-        process_received_message(buffer, ip, port);
+        // Process the received messages and frames
+        memcpy(pending + pending_len, buffer, (size_t)byte_recv);
+        int shown = 0;
+        uint64_t trace_start = trace_begin();
+        pending_len = process_frames(pending, pending_len + (size_t)byte_recv, slot, ip, port, false, &shown);
+        trace_end(TRACE_PARSE, id, (uint32_t)byte_recv, trace_start);
+
+        // A receive holding only part of a frame, or only control frames, displays nothing
+        if (shown > 0) {
+            metrics_latency(slot, metrics_now_ns() - received_ns);
+        }
     }
     
     return NULL;
  }
+
+ static uint64_t thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+ }
+
+ // Send data on a slot, compressed when negotiated and large enough to benefit
+ static int send_encoded(int slot, const char *data, size_t len) {
+    unsigned char frame[MAX_WIRE_FRAME_LENGTH];
+    const char *wire = data;
+    size_t wire_len = len;
+    uint64_t cpu = 0;
+    bool compressed = false;
+
+    if (len >= (size_t)compress_min_size && len <= MAX_FRAME_LENGTH && use_compression(slot)) {
+        uint64_t start = thread_cpu_ns();
+        int packed = lz_compress((const unsigned char *)data, len,
+                                 frame + COMPRESSED_HEADER_LENGTH,
+                                 sizeof(frame) - COMPRESSED_HEADER_LENGTH);
+        cpu = thread_cpu_ns() - start;
+
+        // Only use the compressed form if it is actually smaller
+        if (packed > 0 && (size_t)packed + COMPRESSED_HEADER_LENGTH < len) {
+            frame[0] = COMPRESSED_FRAME_MARKER;
+            frame[1] = (unsigned char)(packed >> 8);
+            frame[2] = (unsigned char)(packed & 0xFF);
+            frame[3] = (unsigned char)(len >> 8);
+            frame[4] = (unsigned char)(len & 0xFF);
+
+            wire = (const char *)frame;
+            wire_len = (size_t)packed + COMPRESSED_HEADER_LENGTH;
+            compressed = true;
+        }
+    }
+
+    int result = send_to_slot(slot, wire, wire_len);
+    if (result == 0) {
+        // An incompressible attempt still counts its CPU time
+        record_compression(slot, true, len, wire_len, cpu, compressed);
+    }
+
+    return result;
+ }
+
+ static int build_room_frame(char *frame, size_t size, char type, const char *room, const char *message) {
+    int len;
+
+    if (message) {
+        len = snprintf(frame, size, "%c%c%s %s\n", ROOM_FRAME_MARKER, type, room, message);
+    }
+    else {
+        len = snprintf(frame, size, "%c%c%s\n", ROOM_FRAME_MARKER, type, room);
+    }
+
+    if (len < 0 || (size_t)len >= size) {
+        print_error("Room frame too long");
+        return -1;
+    }
+
+    return len;
+ }
+
+ /**
+  * Handle every complete frame in the buffer and return the length of the
+  * incomplete tail, adding the number of messages displayed to shown.
+  * Each frame is charged against the inbound limits before it is decoded
+  * or acted on, and dropped if over them. Nested calls handle decompressed
+  * data, which is not counted again and may not contain further compressed
+  * frames; its first frame was paid for with the compressed one.
+  */
+ static size_t process_frames(char *pending, size_t len, int slot, const char *sender_ip,
+                              int sender_port, bool nested, int *shown) {
+    size_t pos = 0;
+    bool paid = nested;
+
+    while (pos < len) {
+        char *frame = pending + pos;
+        size_t avail = len - pos;
+
+        if (frame[0] == ROOM_FRAME_MARKER) {
+            // Room or capability frame, ends with a newline
+            char *newline = memchr(frame, '\n', avail);
+            if (!newline) {
+                break;
+            }
+            *newline = '\0';
+
+            size_t frame_len = (size_t)(newline - frame) + 1;
+            if (!nested) {
+                record_compression(slot, false, frame_len, frame_len, 0, false);
+                metrics_message_in(slot, frame_len);
+            }
+
+            if (admit_frame(slot, &paid) && process_room_frame(frame, slot, sender_ip, sender_port)) {
+                (*shown)++;
+            }
+            pos += frame_len;
+        }
+        else if (frame[0] == COMPRESSED_FRAME_MARKER && !nested) {
+            if (avail < COMPRESSED_HEADER_LENGTH) {
+                break;
+            }
+
+            const unsigned char *header = (const unsigned char *)frame;
+            size_t wire_len = ((size_t)header[1] << 8) | header[2];
+            size_t raw_len = ((size_t)header[3] << 8) | header[4];
+
+            // Lengths no valid peer can produce: drop everything and resynchronize
+            if (raw_len > MAX_FRAME_LENGTH ||
+                COMPRESSED_HEADER_LENGTH + wire_len > MAX_WIRE_FRAME_LENGTH) {
+                metrics_recv_error(slot);
+                pos = len;
+                break;
+            }
+
+            if (avail < COMPRESSED_HEADER_LENGTH + wire_len) {
+                break;
+            }
+
+            // Shed before spending CPU time on decompression
+            if (admit_frame(slot, &paid)) {
+                *shown += process_compressed_frame(header + COMPRESSED_HEADER_LENGTH, wire_len, raw_len,
+                                                   slot, sender_ip, sender_port);
+            }
+            pos += COMPRESSED_HEADER_LENGTH + wire_len;
+        }
+        else {
+            // Plain message, ends with a newline. Peers that did not announce
+            // newlines send one message per send without it, and decompressed
+            // data holds a single message
+            char *newline = memchr(frame, '\n', avail);
+            size_t frame_len;
+            if (newline) {
+                *newline = '\0';
+                frame_len = (size_t)(newline - frame) + 1;
+            }
+            else if (nested || !peer_uses_newline(slot)) {
+                frame[avail] = '\0';
+                frame_len = avail;
+            }
+            else {
+                break;
+            }
+
+            if (!nested) {
+                record_compression(slot, false, frame_len, frame_len, 0, false);
+                metrics_message_in(slot, frame_len);
+            }
+
+            if (admit_frame(slot, &paid)) {
+                uint64_t trace_start = trace_begin();
+                process_received_message(frame, sender_ip, sender_port);
+                trace_end(TRACE_DISPLAY, TRACE_THREAD_CONN, (uint32_t)frame_len, trace_start);
+                (*shown)++;
+            }
+            pos += frame_len;
+        }
+    }
+
+    // Move the incomplete frame to the front of the buffer
+    memmove(pending, pending + pos, len - pos);
+    return len - pos;
+ }
+
+ // Charge a frame against the inbound limits, unless it was already paid for
+ static bool admit_frame(int slot, bool *paid) {
+    if (*paid) {
+        *paid = false;
+        return true;
+    }
+    return admit_inbound_message(slot);
+ }
+
+ // Returns the number of messages displayed
+ static int process_compressed_frame(const unsigned char *data, size_t wire_len, size_t raw_len,
+                                     int slot, const char *sender_ip, int sender_port) {
+    char plain[MAX_FRAME_LENGTH + 1];
+
+    uint64_t start = thread_cpu_ns();
+    int len = lz_decompress(data, wire_len, (unsigned char *)plain, MAX_FRAME_LENGTH);
+    uint64_t cpu = thread_cpu_ns() - start;
+
+    if (len < 0 || (size_t)len != raw_len) {
+        print_error("Corrupt compressed frame dropped");
+        metrics_recv_error(slot);
+        return 0;
+    }
+
+    record_compression(slot, false, raw_len, COMPRESSED_HEADER_LENGTH + wire_len, cpu, true);
+    metrics_message_in(slot, COMPRESSED_HEADER_LENGTH + wire_len);
+
+    int shown = 0;
+    process_frames(plain, (size_t)len, slot, sender_ip, sender_port, true, &shown);
+    return shown;
+ }
+
+ // Returns whether a room message was displayed
+ static bool process_room_frame(char *frame, int slot, const char *sender_ip, int sender_port) {
+    if (frame[0] != ROOM_FRAME_MARKER || frame[1] == '\0') {
+        return false;
+    }
+
+    char type = frame[1];
+    char *room = frame + 2;
+    char *message = NULL;
+
+    // Capability announcement, the rest of the frame names a codec or
+    // the framing of plain messages
+    if (type == CAPS_FRAME) {
+        if (strcmp(room, CAPS_PLAIN_NEWLINE) == 0) {
+            set_peer_newline(slot);
+        }
+        else {
+            set_peer_compression(slot, strcmp(room, CAPS_CODEC_LZ) == 0);
+        }
+        return false;
+    }
+
+    if (type == ROOM_FRAME_MESSAGE) {
+        message = strchr(room, ' ');
+        if (!message) {
+            return false;
+        }
+        *message++ = '\0';
+    }
+
+    if (!is_valid_room_name(room)) {
+        return false;
+    }
+
+    switch (type) {
+        case ROOM_FRAME_JOIN:
+            if (room_add_member(room, slot) != 0) {
+                print_error("Peer joined too many rooms, join ignored");
+            }
+            break;
+
+        case ROOM_FRAME_LEAVE:
+            room_remove_member(room, slot);
+            break;
+
+        case ROOM_FRAME_MESSAGE:
+            // Only display messages for rooms we joined
+            if (room_is_joined(room)) {
+                uint64_t trace_start = trace_begin();
+                printf("\n***Room message [%s] from: %s:%d\n", room, sender_ip, sender_port);
+                printf("-->Message:              %s\n", message);
+                printf("\nEnter command: ");
+                fflush(stdout);
+                trace_end(TRACE_DISPLAY, TRACE_THREAD_CONN, (uint32_t)strlen(message), trace_start);
+                return true;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    return false;
+ }
@@ -0,0 +1,476 @@
+/**
+ * metrics.c - Runtime metrics implementation
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <time.h>
+ #include <poll.h>
+ #include <errno.h>
+ #include <pthread.h>
+ #include <stdatomic.h>
+ #include <sys/socket.h>
+ #include <sys/un.h>
+ #include "metrics.h"
+ #include "connection.h"
+ #include "utils.h"
+
+ // Time a scrape client has to send its request
+ #define SCRAPE_REQUEST_TIMEOUT_MS 100
+
+ /**
+  * Counters of one connection slot
+  *
+  * Each group starts on its own cache line. The receive group has a single
+  * writer. The send group is written by every thread that sends to the
+  * peer (main, listener and receive threads), which is why all updates
+  * are atomic additions.
+  */
+ typedef struct {
+     // Written by the receive thread
+     _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t msgs_in;
+     _Atomic uint64_t bytes_in;
+     _Atomic uint64_t recv_errors;
+     _Atomic uint64_t latency_sum_ns;
+     _Atomic uint64_t latency[LATENCY_BUCKETS];
+
+     // Written by the threads sending to the peer
+     _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t msgs_out;
+     _Atomic uint64_t bytes_out;
+     _Atomic uint64_t send_errors;
+ } peer_metrics_t;
+
+ /**
+  * Merged counters, used for totals and for retired connections
+  */
+ typedef struct {
+     uint64_t msgs_in;
+     uint64_t bytes_in;
+     uint64_t recv_errors;
+     uint64_t latency_sum_ns;
+     uint64_t latency[LATENCY_BUCKETS];
+     uint64_t msgs_out;
+     uint64_t bytes_out;
+     uint64_t send_errors;
+ } metrics_totals_t;
+
+ // Per-slot counters
+ static peer_metrics_t peers[MAX_CONNECTIONS];
+
+ // Written by the listener thread only
+ static struct {
+     _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t accepts;
+ } listener_metrics;
+
+ // Counters of connections whose slot was reused, protected by retired_mutex
+ static metrics_totals_t retired;
+ static pthread_mutex_t retired_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+ // Start of the uptime clock
+ static uint64_t start_ns = 0;
+
+ // Metrics server
+ static int metrics_socket = -1;
+ static char metrics_path[sizeof(((struct sockaddr_un*)0)->sun_path)] = {0};
+ static pthread_t metrics_thread;
+ static bool metrics_running = false;
+
+ // Local function prototypes
+ static void add_counter(_Atomic uint64_t *counter, uint64_t value);
+ static void read_peer(int slot, metrics_totals_t *out);
+ static void merge_totals(metrics_totals_t *into, const metrics_totals_t *from);
+ static void collect_totals(metrics_totals_t *out);
+ static int latency_bucket(uint64_t ns);
+ static double latency_percentile_us(const uint64_t *hist, double percentile);
+ static void write_exposition(FILE *out);
+ static void* metrics_server(void *arg);
+
+ void metrics_init(void) {
+    start_ns = metrics_now_ns();
+ }
+
+ void metrics_reset_peer(int slot) {
+    if (slot < 0 || slot >= MAX_CONNECTIONS) {
+        return;
+    }
+
+    metrics_totals_t old;
+    read_peer(slot, &old);
+
+    // Keep the totals monotonic across slot reuse
+    pthread_mutex_lock(&retired_mutex);
+    merge_totals(&retired, &old);
+
+    peer_metrics_t *p = &peers[slot];
+    atomic_store_explicit(&p->msgs_in, 0, memory_order_relaxed);
+    atomic_store_explicit(&p->bytes_in, 0, memory_order_relaxed);
+    atomic_store_explicit(&p->recv_errors, 0, memory_order_relaxed);
+    atomic_store_explicit(&p->latency_sum_ns, 0, memory_order_relaxed);
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        atomic_store_explicit(&p->latency[i], 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(&p->msgs_out, 0, memory_order_relaxed);
+    atomic_store_explicit(&p->bytes_out, 0, memory_order_relaxed);
+    atomic_store_explicit(&p->send_errors, 0, memory_order_relaxed);
+
+    pthread_mutex_unlock(&retired_mutex);
+ }
+
+ void metrics_message_in(int slot, size_t bytes) {
+    if (slot < 0 || slot >= MAX_CONNECTIONS) {
+        return;
+    }
+    add_counter(&peers[slot].msgs_in, 1);
+    add_counter(&peers[slot].bytes_in, bytes);
+ }
+
+ void metrics_message_out(int slot, size_t bytes) {
+    if (slot < 0 || slot >= MAX_CONNECTIONS) {
+        return;
+    }
+    add_counter(&peers[slot].msgs_out, 1);
+    add_counter(&peers[slot].bytes_out, bytes);
+ }
+
+ void metrics_recv_error(int slot) {
+    if (slot >= 0 && slot < MAX_CONNECTIONS) {
+        add_counter(&peers[slot].recv_errors, 1);
+    }
+ }
+
+ void metrics_send_error(int slot) {
+    if (slot >= 0 && slot < MAX_CONNECTIONS) {
+        add_counter(&peers[slot].send_errors, 1);
+    }
+ }
+
+ void metrics_latency(int slot, uint64_t ns) {
+    if (slot < 0 || slot >= MAX_CONNECTIONS) {
+        return;
+    }
+    add_counter(&peers[slot].latency[latency_bucket(ns)], 1);
+    add_counter(&peers[slot].latency_sum_ns, ns);
+ }
+
+ void metrics_accept(void) {
+    add_counter(&listener_metrics.accepts, 1);
+ }
+
+ uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+ }
+
+ void show_metrics(void) {
+    metrics_totals_t totals;
+    collect_totals(&totals);
+
+    double uptime = (double)(metrics_now_ns() - start_ns) / 1e9;
+    uint64_t accepts = atomic_load_explicit(&listener_metrics.accepts, memory_order_relaxed);
+
+    printf("\n-------- Statistics --------\n");
+    printf("Uptime:            %.1f s\n", uptime);
+    printf("Accepted:          %llu connection(s) (%.2f/s)\n",
+           (unsigned long long)accepts, uptime > 0 ? (double)accepts / uptime : 0.0);
+    printf("Received:          %llu message(s), %llu byte(s)\n",
+           (unsigned long long)totals.msgs_in, (unsigned long long)totals.bytes_in);
+    printf("Sent:              %llu message(s), %llu byte(s)\n",
+           (unsigned long long)totals.msgs_out, (unsigned long long)totals.bytes_out);
+    printf("Errors:            %llu receive, %llu send\n",
+           (unsigned long long)totals.recv_errors, (unsigned long long)totals.send_errors);
+    printf("Recv-to-display:   p50 < %.1f us, p99 < %.1f us, max < %.1f us\n",
+           latency_percentile_us(totals.latency, 0.50),
+           latency_percentile_us(totals.latency, 0.99),
+           latency_percentile_us(totals.latency, 1.00));
+
+    connection_info_t info[MAX_CONNECTIONS];
+    int count = get_connection_info(info, MAX_CONNECTIONS);
+
+    printf("\nID  |  Msgs in   |  Bytes in    |  Msgs out  |  Bytes out   |  Errors  |  RecvQ  |  SendQ\n");
+    printf("------------------------------------------------------------------------------------------\n");
+
+    for (int i = 0; i < count; i++) {
+        metrics_totals_t peer;
+        read_peer(info[i].slot, &peer);
+
+        printf("%-4d|  %-10llu|  %-12llu|  %-10llu|  %-12llu|  %-8llu|  %-7d|  %d\n",
+               info[i].id,
+               (unsigned long long)peer.msgs_in, (unsigned long long)peer.bytes_in,
+               (unsigned long long)peer.msgs_out, (unsigned long long)peer.bytes_out,
+               (unsigned long long)(peer.recv_errors + peer.send_errors),
+               info[i].recv_queue, info[i].send_queue);
+    }
+
+    if (count == 0) {
+        printf("No active connections\n");
+    }
+
+    printf("------------------------------------------------------------------------------------------\n");
+    if (metrics_running) {
+        printf("Prometheus metrics: %s\n", metrics_path);
+    }
+ }
+
+ int start_metrics_server(const char *path) {
+    if (!path || strlen(path) >= sizeof(metrics_path)) {
+        print_error("Invalid metrics socket path");
+        return -1;
+    }
+
+    metrics_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (metrics_socket < 0) {
+        print_error("Metrics socket creation failed");
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // Remove a socket left behind by a previous run
+    unlink(path);
+
+    if (bind(metrics_socket, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(metrics_socket, 5) < 0) {
+        print_error("Metrics socket bind failed");
+        close(metrics_socket);
+        metrics_socket = -1;
+        return -1;
+    }
+
+    strcpy(metrics_path, path);
+
+    if (pthread_create(&metrics_thread, NULL, metrics_server, NULL) != 0) {
+        print_error("Failed to create metrics thread");
+        close(metrics_socket);
+        metrics_socket = -1;
+        unlink(metrics_path);
+        return -1;
+    }
+
+    metrics_running = true;
+    return 0;
+ }
+
+ void stop_metrics_server(void) {
+    if (!metrics_running) {
+        return;
+    }
+
+    // shutdown() wakes the thread blocked in accept()
+    shutdown(metrics_socket, SHUT_RDWR);
+    pthread_join(metrics_thread, NULL);
+    metrics_running = false;
+
+    close(metrics_socket);
+    metrics_socket = -1;
+    unlink(metrics_path);
+ }
+
+ // Relaxed add: counters are only summed, so no ordering is needed. The send
+ // counters have several writers, whose additions the atomic keeps exact
+ static void add_counter(_Atomic uint64_t *counter, uint64_t value) {
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+ }
+
+ static void read_peer(int slot, metrics_totals_t *out) {
+    peer_metrics_t *p = &peers[slot];
+
+    out->msgs_in = atomic_load_explicit(&p->msgs_in, memory_order_relaxed);
+    out->bytes_in = atomic_load_explicit(&p->bytes_in, memory_order_relaxed);
+    out->recv_errors = atomic_load_explicit(&p->recv_errors, memory_order_relaxed);
+    out->latency_sum_ns = atomic_load_explicit(&p->latency_sum_ns, memory_order_relaxed);
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        out->latency[i] = atomic_load_explicit(&p->latency[i], memory_order_relaxed);
+    }
+    out->msgs_out = atomic_load_explicit(&p->msgs_out, memory_order_relaxed);
+    out->bytes_out = atomic_load_explicit(&p->bytes_out, memory_order_relaxed);
+    out->send_errors = atomic_load_explicit(&p->send_errors, memory_order_relaxed);
+ }
+
+ static void merge_totals(metrics_totals_t *into, const metrics_totals_t *from) {
+    into->msgs_in += from->msgs_in;
+    into->bytes_in += from->bytes_in;
+    into->recv_errors += from->recv_errors;
+    into->latency_sum_ns += from->latency_sum_ns;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        into->latency[i] += from->latency[i];
+    }
+    into->msgs_out += from->msgs_out;
+    into->bytes_out += from->bytes_out;
+    into->send_errors += from->send_errors;
+ }
+
+ // Sum retired counters and every slot
+ static void collect_totals(metrics_totals_t *out) {
+    pthread_mutex_lock(&retired_mutex);
+
+    *out = retired;
+    for (int slot = 0; slot < MAX_CONNECTIONS; slot++) {
+        metrics_totals_t peer;
+        read_peer(slot, &peer);
+        merge_totals(out, &peer);
+    }
+
+    pthread_mutex_unlock(&retired_mutex);
+ }
+
+ // Bucket i holds latencies in [2^i, 2^(i+1)) ns
+ static int latency_bucket(uint64_t ns) {
+    int bucket = ns > 0 ? 63 - __builtin_clzll(ns) : 0;
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+ }
+
+ // Upper bound of the bucket holding the given percentile, in microseconds
+ static double latency_percentile_us(const uint64_t *hist, double percentile) {
+    uint64_t total = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        total += hist[i];
+    }
+    if (total == 0) {
+        return 0.0;
+    }
+
+    uint64_t rank = (uint64_t)(percentile * (double)total);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen >= rank) {
+            return (double)(1ULL << (i + 1)) / 1000.0;
+        }
+    }
+    return (double)(1ULL << LATENCY_BUCKETS) / 1000.0;
+ }
+
+ static void write_exposition(FILE *out) {
+    metrics_totals_t totals;
+    collect_totals(&totals);
+
+    connection_info_t info[MAX_CONNECTIONS];
+    int count = get_connection_info(info, MAX_CONNECTIONS);
+
+    fprintf(out, "# HELP chat_uptime_seconds Time since the application started.\n");
+    fprintf(out, "# TYPE chat_uptime_seconds gauge\n");
+    fprintf(out, "chat_uptime_seconds %.3f\n", (double)(metrics_now_ns() - start_ns) / 1e9);
+
+    fprintf(out, "# HELP chat_accepts_total Incoming connections accepted.\n");
+    fprintf(out, "# TYPE chat_accepts_total counter\n");
+    fprintf(out, "chat_accepts_total %llu\n",
+            (unsigned long long)atomic_load_explicit(&listener_metrics.accepts, memory_order_relaxed));
+
+    fprintf(out, "# HELP chat_active_connections Connections currently open.\n");
+    fprintf(out, "# TYPE chat_active_connections gauge\n");
+    fprintf(out, "chat_active_connections %d\n", count);
+
+    fprintf(out, "# HELP chat_messages_total Messages and frames exchanged with peers.\n");
+    fprintf(out, "# TYPE chat_messages_total counter\n");
+    fprintf(out, "chat_messages_total{direction=\"in\"} %llu\n", (unsigned long long)totals.msgs_in);
+    fprintf(out, "chat_messages_total{direction=\"out\"} %llu\n", (unsigned long long)totals.msgs_out);
+
+    fprintf(out, "# HELP chat_bytes_total Bytes exchanged with peers.\n");
+    fprintf(out, "# TYPE chat_bytes_total counter\n");
+    fprintf(out, "chat_bytes_total{direction=\"in\"} %llu\n", (unsigned long long)totals.bytes_in);
+    fprintf(out, "chat_bytes_total{direction=\"out\"} %llu\n", (unsigned long long)totals.bytes_out);
+
+    fprintf(out, "# HELP chat_errors_total Receive and send errors.\n");
+    fprintf(out, "# TYPE chat_errors_total counter\n");
+    fprintf(out, "chat_errors_total{direction=\"in\"} %llu\n", (unsigned long long)totals.recv_errors);
+    fprintf(out, "chat_errors_total{direction=\"out\"} %llu\n", (unsigned long long)totals.send_errors);
+
+    // Cumulative buckets, bounds in seconds
+    fprintf(out, "# HELP chat_receive_display_latency_seconds Time from recv() to the message being displayed.\n");
+    fprintf(out, "# TYPE chat_receive_display_latency_seconds histogram\n");
+    uint64_t cumulative = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        cumulative += totals.latency[i];
+        fprintf(out, "chat_receive_display_latency_seconds_bucket{le=\"%.9g\"} %llu\n",
+                (double)(1ULL << (i + 1)) / 1e9, (unsigned long long)cumulative);
+    }
+    fprintf(out, "chat_receive_display_latency_seconds_bucket{le=\"+Inf\"} %llu\n",
+            (unsigned long long)cumulative);
+    fprintf(out, "chat_receive_display_latency_seconds_sum %.9f\n", (double)totals.latency_sum_ns / 1e9);
+    fprintf(out, "chat_receive_display_latency_seconds_count %llu\n", (unsigned long long)cumulative);
+
+    // Per-peer series
+    fprintf(out, "# HELP chat_peer_messages_total Messages and frames exchanged with a peer.\n");
+    fprintf(out, "# TYPE chat_peer_messages_total counter\n");
+    fprintf(out, "# HELP chat_peer_bytes_total Bytes exchanged with a peer.\n");
+    fprintf(out, "# TYPE chat_peer_bytes_total counter\n");
+    fprintf(out, "# HELP chat_peer_errors_total Errors on a peer connection.\n");
+    fprintf(out, "# TYPE chat_peer_errors_total counter\n");
+    fprintf(out, "# HELP chat_peer_shed_total Messages dropped or refused by rate limiting.\n");
+    fprintf(out, "# TYPE chat_peer_shed_total counter\n");
+    fprintf(out, "# HELP chat_peer_queue_bytes Bytes waiting in the kernel socket queues.\n");
+    fprintf(out, "# TYPE chat_peer_queue_bytes gauge\n");
+
+    for (int i = 0; i < count; i++) {
+        metrics_totals_t peer;
+        read_peer(info[i].slot, &peer);
+
+        char labels[64];
+        snprintf(labels, sizeof(labels), "id=\"%d\",peer=\"%s:%d\"", info[i].id, info[i].ip, info[i].port);
+
+        fprintf(out, "chat_peer_messages_total{%s,direction=\"in\"} %llu\n", labels, (unsigned long long)peer.msgs_in);
+        fprintf(out, "chat_peer_messages_total{%s,direction=\"out\"} %llu\n", labels, (unsigned long long)peer.msgs_out);
+        fprintf(out, "chat_peer_bytes_total{%s,direction=\"in\"} %llu\n", labels, (unsigned long long)peer.bytes_in);
+        fprintf(out, "chat_peer_bytes_total{%s,direction=\"out\"} %llu\n", labels, (unsigned long long)peer.bytes_out);
+        fprintf(out, "chat_peer_errors_total{%s,direction=\"in\"} %llu\n", labels, (unsigned long long)peer.recv_errors);
+        fprintf(out, "chat_peer_errors_total{%s,direction=\"out\"} %llu\n", labels, (unsigned long long)peer.send_errors);
+        fprintf(out, "chat_peer_shed_total{%s,direction=\"in\"} %lu\n", labels, info[i].shed_in);
+        fprintf(out, "chat_peer_shed_total{%s,direction=\"out\"} %lu\n", labels, info[i].shed_out);
+        fprintf(out, "chat_peer_queue_bytes{%s,queue=\"recv\"} %d\n", labels, info[i].recv_queue);
+        fprintf(out, "chat_peer_queue_bytes{%s,queue=\"send\"} %d\n", labels, info[i].send_queue);
+    }
+ }
+
+ static void* metrics_server(void *arg) {
+    while (1) {
+        int client = accept(metrics_socket, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // Socket shut down by stop_metrics_server
+            break;
+        }
+
+        // Give HTTP clients a moment to send their request line
+        char request[256];
+        ssize_t request_len = 0;
+        struct pollfd pfd = { .fd = client, .events = POLLIN };
+        if (poll(&pfd, 1, SCRAPE_REQUEST_TIMEOUT_MS) > 0) {
+            request_len = recv(client, request, sizeof(request), MSG_DONTWAIT);
+        }
+
+        char *body = NULL;
+        size_t body_len = 0;
+        FILE *out = open_memstream(&body, &body_len);
+        if (out) {
+            write_exposition(out);
+            fclose(out);
+
+            if (request_len >= 4 && memcmp(request, "GET ", 4) == 0) {
+                char header[160];
+                int header_len = snprintf(header, sizeof(header),
+                                          "HTTP/1.0 200 OK\r\n"
+                                          "Content-Type: text/plain; version=0.0.4\r\n"
+                                          "Content-Length: %zu\r\n\r\n", body_len);
+                send(client, header, (size_t)header_len, MSG_NOSIGNAL);
+            }
+            send(client, body, body_len, MSG_NOSIGNAL);
+            free(body);
+        }
+
+        close(client);
+    }
+
+    return NULL;
+ }
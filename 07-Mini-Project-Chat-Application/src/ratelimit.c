@@ -0,0 +1,73 @@
+/**
+ * ratelimit.c - Token bucket implementation
+ */
+
+ #include <time.h>
+ #include "ratelimit.h"
+
+ // Local function prototypes
+ static void refill(token_bucket_t *bucket);
+
+ void token_bucket_init(token_bucket_t *bucket, double rate, double burst) {
+    if (!bucket) {
+        return;
+    }
+
+    bucket->rate = rate;
+    bucket->burst = burst;
+    bucket->tokens = burst;
+    clock_gettime(CLOCK_MONOTONIC, &bucket->last);
+ }
+
+ void token_bucket_configure(token_bucket_t *bucket, double rate, double burst) {
+    if (!bucket) {
+        return;
+    }
+
+    refill(bucket);
+    bucket->rate = rate;
+    bucket->burst = burst;
+
+    // Shrinking the bucket drops any tokens above the new capacity
+    if (bucket->tokens > burst) {
+        bucket->tokens = burst;
+    }
+ }
+
+ bool token_bucket_consume(token_bucket_t *bucket, double cost) {
+    if (!bucket) {
+        return false;
+    }
+
+    // No limit configured
+    if (bucket->rate <= 0) {
+        return true;
+    }
+
+    refill(bucket);
+
+    if (bucket->tokens < cost) {
+        return false;
+    }
+
+    bucket->tokens -= cost;
+    return true;
+ }
+
+ static void refill(token_bucket_t *bucket) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    double elapsed = (double)(now.tv_sec - bucket->last.tv_sec)
+                   + (double)(now.tv_nsec - bucket->last.tv_nsec) / 1e9;
+    bucket->last = now;
+
+    if (elapsed <= 0) {
+        return;
+    }
+
+    bucket->tokens += elapsed * bucket->rate;
+    if (bucket->tokens > bucket->burst) {
+        bucket->tokens = bucket->burst;
+    }
+ }
@@ -0,0 +1,551 @@
+/**
+ * room.c - Chat room subscription index implementation
+ *
+ * Rooms live in a slab indexed by room id and are found by name through
+ * an open-addressing hash table. Each room keeps a compact array of its
+ * members, and each connection keeps the list of rooms it belongs to.
+ * Both sides store the position of their counterpart, so joining and
+ * leaving are O(1) swap operations and fan-out walks a dense array.
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <stdint.h>
+ #include <ctype.h>
+ #include <pthread.h>
+ #include "room.h"
+ #include "connection.h"
+ #include "utils.h"
+
+ // Initial sizes of the dynamic arrays
+ #define INITIAL_ROOMS       16
+ #define INITIAL_TABLE_SIZE  32
+ #define INITIAL_MEMBERS     4
+
+ // Hash table slot markers
+ #define SLOT_EMPTY     -1
+ #define SLOT_DELETED   -2
+
+ /**
+  * Member entry inside a room
+  */
+ typedef struct {
+     int slot;       // Connection slot
+     int link;       // Index of the matching entry in the connection's link list
+ } room_member_t;
+
+ /**
+  * Room entry inside a connection's link list
+  */
+ typedef struct {
+     int room;       // Room id
+     int pos;        // Index of the matching entry in the room's member array
+ } room_link_t;
+
+ /**
+  * Room structure
+  */
+ typedef struct {
+     char name[ROOM_NAME_LENGTH];    // Room name
+     room_member_t *members;         // Connections subscribed to the room
+     int count;                      // Number of members
+     int capacity;                   // Allocated size of members
+     bool joined;                    // Whether the local user joined the room
+     bool in_use;                    // Whether this slab entry holds a room
+     int next_free;                  // Next free slab entry when not in use
+ } room_t;
+
+ /**
+  * Rooms a connection belongs to
+  */
+ typedef struct {
+     room_link_t *items;
+     int count;
+     int capacity;
+ } link_list_t;
+
+ // Room slab and its free list
+ static room_t *rooms = NULL;
+ static int room_capacity = 0;
+ static int room_used = 0;     // Slab entries handed out so far
+ static int room_live = 0;     // Rooms currently in use
+ static int room_joined = 0;   // Rooms joined by the local user
+ static int free_room = -1;
+
+ // Hash table mapping room names to room ids
+ static int *table = NULL;
+ static int table_size = 0;
+ static int table_filled = 0;    // Live and deleted entries
+
+ // Rooms of each connection slot
+ static link_list_t links[MAX_CONNECTIONS];
+
+ // Mutex protecting the whole index
+ static pthread_mutex_t room_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+ // Local function prototypes
+ static uint32_t hash_name(const char *name);
+ static int grow_array(void **array, int *capacity, int initial, size_t elem_size);
+ static int find_room(const char *name);
+ static int create_room(const char *name);
+ static void release_room(int id);
+ static int table_resize(int new_size);
+ static int get_or_create_room(const char *name);
+ static int find_link(int slot, int id);
+ static void remove_link(int slot, int index);
+
+ bool is_valid_room_name(const char *room) {
+    if (!room || room[0] == '\0') {
+        return false;
+    }
+
+    size_t len = strlen(room);
+    if (len >= ROOM_NAME_LENGTH) {
+        return false;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        if (!isgraph((unsigned char)room[i])) {
+            return false;
+        }
+    }
+
+    return true;
+ }
+
+ int room_add_member(const char *room, int slot) {
+    if (!is_valid_room_name(room) || slot < 0 || slot >= MAX_CONNECTIONS) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&room_mutex);
+
+    int id = get_or_create_room(room);
+    if (id < 0) {
+        pthread_mutex_unlock(&room_mutex);
+        return -1;
+    }
+
+    // Already a member
+    if (find_link(slot, id) >= 0) {
+        pthread_mutex_unlock(&room_mutex);
+        return 0;
+    }
+
+    room_t *r = &rooms[id];
+    link_list_t *list = &links[slot];
+
+    // A peer cannot grow the index without bound by joining new rooms
+    if (list->count >= MAX_JOINED_ROOMS) {
+        release_room(id);
+        pthread_mutex_unlock(&room_mutex);
+        return -1;
+    }
+
+    if (r->count == r->capacity &&
+        grow_array((void **)&r->members, &r->capacity, INITIAL_MEMBERS, sizeof(room_member_t)) < 0) {
+        release_room(id);
+        pthread_mutex_unlock(&room_mutex);
+        return -1;
+    }
+
+    if (list->count == list->capacity &&
+        grow_array((void **)&list->items, &list->capacity, INITIAL_MEMBERS, sizeof(room_link_t)) < 0) {
+        release_room(id);
+        pthread_mutex_unlock(&room_mutex);
+        return -1;
+    }
+
+    // Cross-link the two entries
+    r->members[r->count].slot = slot;
+    r->members[r->count].link = list->count;
+    list->items[list->count].room = id;
+    list->items[list->count].pos = r->count;
+    r->count++;
+    list->count++;
+
+    pthread_mutex_unlock(&room_mutex);
+    return 0;
+ }
+
+ int room_remove_member(const char *room, int slot) {
+    if (!room || slot < 0 || slot >= MAX_CONNECTIONS) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&room_mutex);
+
+    int id = find_room(room);
+    int index = id >= 0 ? find_link(slot, id) : -1;
+    if (index < 0) {
+        pthread_mutex_unlock(&room_mutex);
+        return -1;
+    }
+
+    remove_link(slot, index);
+
+    pthread_mutex_unlock(&room_mutex);
+    return 0;
+ }
+
+ void room_drop_member(int slot) {
+    if (slot < 0 || slot >= MAX_CONNECTIONS) {
+        return;
+    }
+
+    pthread_mutex_lock(&room_mutex);
+
+    // Remove from the end so no entry has to be moved
+    while (links[slot].count > 0) {
+        remove_link(slot, links[slot].count - 1);
+    }
+
+    pthread_mutex_unlock(&room_mutex);
+ }
+
+ int room_get_members(const char *room, int *slots, int max_slots) {
+    if (!room || !slots) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&room_mutex);
+
+    int count = 0;
+    int id = find_room(room);
+    if (id >= 0) {
+        room_t *r = &rooms[id];
+        for (int i = 0; i < r->count && count < max_slots; i++) {
+            slots[count++] = r->members[i].slot;
+        }
+    }
+
+    pthread_mutex_unlock(&room_mutex);
+    return count;
+ }
+
+ int room_join(const char *room) {
+    if (!is_valid_room_name(room)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&room_mutex);
+
+    int id = find_room(room);
+    if (id >= 0 && rooms[id].joined) {
+        pthread_mutex_unlock(&room_mutex);
+        return 0;
+    }
+
+    // Peers would refuse joins beyond the limit
+    if (room_joined >= MAX_JOINED_ROOMS) {
+        pthread_mutex_unlock(&room_mutex);
+        return -1;
+    }
+
+    id = get_or_create_room(room);
+    if (id >= 0) {
+        rooms[id].joined = true;
+        room_joined++;
+    }
+
+    pthread_mutex_unlock(&room_mutex);
+    return id >= 0 ? 0 : -1;
+ }
+
+ int room_leave(const char *room) {
+    if (!room) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&room_mutex);
+
+    int id = find_room(room);
+    if (id < 0 || !rooms[id].joined) {
+        pthread_mutex_unlock(&room_mutex);
+        return -1;
+    }
+
+    rooms[id].joined = false;
+    room_joined--;
+    release_room(id);
+
+    pthread_mutex_unlock(&room_mutex);
+    return 0;
+ }
+
+ bool room_is_joined(const char *room) {
+    if (!room) {
+        return false;
+    }
+
+    pthread_mutex_lock(&room_mutex);
+    int id = find_room(room);
+    bool joined = id >= 0 && rooms[id].joined;
+    pthread_mutex_unlock(&room_mutex);
+
+    return joined;
+ }
+
+ int room_get_joined(char names[][ROOM_NAME_LENGTH], int max_names) {
+    if (!names) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&room_mutex);
+
+    int count = 0;
+    for (int i = 0; i < room_used && count < max_names; i++) {
+        if (rooms[i].in_use && rooms[i].joined) {
+            memcpy(names[count++], rooms[i].name, ROOM_NAME_LENGTH);
+        }
+    }
+
+    pthread_mutex_unlock(&room_mutex);
+    return count;
+ }
+
+ void list_rooms(void) {
+    pthread_mutex_lock(&room_mutex);
+
+    printf("\n-------- Room List --------\n");
+    printf("Room                            |  Members  |  Joined\n");
+    printf("------------------------------------------------------\n");
+
+    int count = 0;
+    for (int i = 0; i < room_used; i++) {
+        if (rooms[i].in_use) {
+            printf("%-32s|  %-9d|  %s\n",
+                   rooms[i].name,
+                   rooms[i].count,
+                   rooms[i].joined ? "Yes" : "No");
+            count++;
+        }
+    }
+
+    if (count == 0) {
+        printf("No rooms\n");
+    }
+
+    printf("------------------------------------------------------\n");
+    printf("Total: %d room(s)\n", count);
+
+    pthread_mutex_unlock(&room_mutex);
+ }
+
+ void room_cleanup(void) {
+    pthread_mutex_lock(&room_mutex);
+
+    for (int i = 0; i < room_used; i++) {
+        free(rooms[i].members);
+    }
+    free(rooms);
+    free(table);
+    rooms = NULL;
+    table = NULL;
+    room_capacity = room_used = room_live = room_joined = table_size = table_filled = 0;
+    free_room = -1;
+
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        free(links[i].items);
+        links[i].items = NULL;
+        links[i].count = links[i].capacity = 0;
+    }
+
+    pthread_mutex_unlock(&room_mutex);
+ }
+
+ // FNV-1a hash of a room name
+ static uint32_t hash_name(const char *name) {
+    uint32_t hash = 2166136261u;
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+ }
+
+ // Double the capacity of a dynamic array
+ static int grow_array(void **array, int *capacity, int initial, size_t elem_size) {
+    int new_capacity = *capacity > 0 ? *capacity * 2 : initial;
+    void *grown = realloc(*array, (size_t)new_capacity * elem_size);
+    if (!grown) {
+        print_error("Memory allocation failed");
+        return -1;
+    }
+
+    *array = grown;
+    *capacity = new_capacity;
+    return 0;
+ }
+
+ static int find_room(const char *name) {
+    if (table_size == 0) {
+        return -1;
+    }
+
+    uint32_t mask = (uint32_t)table_size - 1;
+    for (uint32_t i = hash_name(name) & mask; ; i = (i + 1) & mask) {
+        if (table[i] == SLOT_EMPTY) {
+            return -1;
+        }
+        if (table[i] >= 0 && strcmp(rooms[table[i]].name, name) == 0) {
+            return table[i];
+        }
+    }
+ }
+
+ static int table_resize(int new_size) {
+    int *new_table = malloc((size_t)new_size * sizeof(int));
+    if (!new_table) {
+        print_error("Memory allocation failed");
+        return -1;
+    }
+
+    for (int i = 0; i < new_size; i++) {
+        new_table[i] = SLOT_EMPTY;
+    }
+
+    // Re-insert live rooms, dropping deleted markers
+    uint32_t mask = (uint32_t)new_size - 1;
+    table_filled = 0;
+    for (int id = 0; id < room_used; id++) {
+        if (!rooms[id].in_use) {
+            continue;
+        }
+        uint32_t i = hash_name(rooms[id].name) & mask;
+        while (new_table[i] != SLOT_EMPTY) {
+            i = (i + 1) & mask;
+        }
+        new_table[i] = id;
+        table_filled++;
+    }
+
+    free(table);
+    table = new_table;
+    table_size = new_size;
+    return 0;
+ }
+
+ static int create_room(const char *name) {
+    // Keep the load factor (including deleted entries) below 0.75
+    if ((table_filled + 1) * 4 > table_size * 3) {
+        int new_size = table_size > 0 ? table_size : INITIAL_TABLE_SIZE;
+        while ((room_live + 1) * 2 > new_size) {
+            new_size *= 2;
+        }
+        if (table_resize(new_size) < 0) {
+            return -1;
+        }
+    }
+
+    // Take a room from the free list or the end of the slab
+    int id;
+    if (free_room >= 0) {
+        id = free_room;
+        free_room = rooms[id].next_free;
+    }
+    else {
+        if (room_used == room_capacity &&
+            grow_array((void **)&rooms, &room_capacity, INITIAL_ROOMS, sizeof(room_t)) < 0) {
+            return -1;
+        }
+        id = room_used++;
+        rooms[id].members = NULL;
+        rooms[id].capacity = 0;
+    }
+
+    room_t *r = &rooms[id];
+    strncpy(r->name, name, ROOM_NAME_LENGTH - 1);
+    r->name[ROOM_NAME_LENGTH - 1] = '\0';
+    r->count = 0;
+    r->joined = false;
+    r->in_use = true;
+    r->next_free = -1;
+    room_live++;
+
+    // Insert into the hash table, reusing a deleted entry if possible
+    uint32_t mask = (uint32_t)table_size - 1;
+    uint32_t i = hash_name(name) & mask;
+    while (table[i] >= 0) {
+        i = (i + 1) & mask;
+    }
+    if (table[i] == SLOT_EMPTY) {
+        table_filled++;
+    }
+    table[i] = id;
+
+    return id;
+ }
+
+ // Remove a room that has no members and is not joined locally
+ static void release_room(int id) {
+    room_t *r = &rooms[id];
+    if (r->count > 0 || r->joined) {
+        return;
+    }
+
+    uint32_t mask = (uint32_t)table_size - 1;
+    for (uint32_t i = hash_name(r->name) & mask; table[i] != SLOT_EMPTY; i = (i + 1) & mask) {
+        if (table[i] == id) {
+            table[i] = SLOT_DELETED;
+            break;
+        }
+    }
+
+    // Keep the member array allocated for the next room using this entry
+    r->in_use = false;
+    r->next_free = free_room;
+    free_room = id;
+    room_live--;
+ }
+
+ static int get_or_create_room(const char *name) {
+    int id = find_room(name);
+    return id >= 0 ? id : create_room(name);
+ }
+
+ // Find the link of a connection to a room, scanning the shorter of the two lists
+ static int find_link(int slot, int id) {
+    link_list_t *list = &links[slot];
+    room_t *r = &rooms[id];
+
+    if (r->count < list->count) {
+        for (int i = 0; i < r->count; i++) {
+            if (r->members[i].slot == slot) {
+                return r->members[i].link;
+            }
+        }
+        return -1;
+    }
+
+    for (int i = 0; i < list->count; i++) {
+        if (list->items[i].room == id) {
+            return i;
+        }
+    }
+    return -1;
+ }
+
+ // Remove entry `index` of a connection's link list and its room member entry
+ static void remove_link(int slot, int index) {
+    link_list_t *list = &links[slot];
+    room_link_t link = list->items[index];
+    room_t *r = &rooms[link.room];
+
+    // Move the last member into the freed position
+    room_member_t last_member = r->members[--r->count];
+    if (link.pos != r->count) {
+        r->members[link.pos] = last_member;
+        links[last_member.slot].items[last_member.link].pos = link.pos;
+    }
+
+    // Move the last link into the freed position
+    room_link_t last_link = list->items[--list->count];
+    if (index != list->count) {
+        list->items[index] = last_link;
+        rooms[last_link.room].members[last_link.pos].link = index;
+    }
+
+    release_room(link.room);
+ }
@@ -0,0 +1,307 @@
+/**
+ * trace.c - In-process event tracer implementation
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <pthread.h>
+ #include <unistd.h>
+ #include <sys/syscall.h>
+ #include "trace.h"
+
+ // Length of a thread name (including null terminator)
+ #define TRACE_NAME_LENGTH 32
+
+ /**
+  * Recorded event (24 bytes)
+  */
+ typedef struct {
+     uint64_t start;             // Trace clock when the event started
+     uint32_t duration;          // Clock ticks, saturated at UINT32_MAX
+     uint32_t arg;               // Event argument (bytes)
+     int32_t conn_id;            // Connection ID, or TRACE_THREAD_CONN
+     uint32_t type;              // trace_type_t
+ } trace_event_t;
+
+ /**
+  * Ring buffer of one thread
+  *
+  * Only the owning thread writes events and advances head; readers
+  * copy events and re-check head to discard the ones overwritten
+  * meanwhile.
+  */
+ typedef struct {
+     _Atomic uint64_t head;      // Number of events ever written
+     bool in_use;                // Owned by a running thread
+     pid_t tid;                  // Kernel thread ID of the owner
+     int conn_id;                // Connection handled by the owner, or -1
+     char name[TRACE_NAME_LENGTH];
+     trace_event_t events[TRACE_RING_SIZE];
+ } trace_ring_t;
+
+ // Event names in Chrome trace output, matching trace_type_t
+ static const char *EVENT_NAMES[] = {
+    "accept",
+    "recv",
+    "parse",
+    "display",
+    "send"
+ };
+
+ atomic_bool trace_active = false;
+
+ // Rings of all threads that recorded events, protected by ring_mutex
+ static trace_ring_t *rings[TRACE_MAX_THREADS];
+ static int ring_count = 0;
+ static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+ // Releases the ring of an exiting thread
+ static pthread_key_t ring_key;
+ static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+ // Clock values when tracing was first enabled, to convert ticks to time
+ static uint64_t base_clock = 0;
+ static uint64_t base_ns = 0;
+
+ // Per-thread state
+ static _Thread_local trace_ring_t *thread_ring = NULL;
+ static _Thread_local bool thread_untraced = false;
+ static _Thread_local char thread_name[TRACE_NAME_LENGTH];
+ static _Thread_local int thread_conn = -1;
+
+ // Local function prototypes
+ static uint64_t monotonic_ns(void);
+ static void create_ring_key(void);
+ static void release_ring(void *arg);
+ static trace_ring_t* attach_ring(void);
+ static int copy_ring(trace_ring_t *ring, trace_event_t *out);
+
+ void trace_record(trace_type_t type, int conn_id, uint32_t arg, uint64_t start, uint64_t end) {
+    trace_ring_t *ring = thread_ring;
+    if (!ring) {
+        ring = attach_ring();
+        if (!ring) {
+            return;
+        }
+    }
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    trace_event_t *event = &ring->events[head & (TRACE_RING_SIZE - 1)];
+    uint64_t duration = end - start;
+
+    event->start = start;
+    event->duration = duration > UINT32_MAX ? UINT32_MAX : (uint32_t)duration;
+    event->arg = arg;
+    event->conn_id = conn_id;
+    event->type = (uint32_t)type;
+
+    // Publish the event
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+ }
+
+ void trace_thread_name(const char *name, int conn_id) {
+    if (!name) {
+        return;
+    }
+
+    strncpy(thread_name, name, TRACE_NAME_LENGTH - 1);
+    thread_name[TRACE_NAME_LENGTH - 1] = '\0';
+    thread_conn = conn_id;
+
+    // The ring may already exist if tracing was on
+    if (thread_ring) {
+        pthread_mutex_lock(&ring_mutex);
+        strcpy(thread_ring->name, thread_name);
+        thread_ring->conn_id = conn_id;
+        pthread_mutex_unlock(&ring_mutex);
+    }
+ }
+
+ void trace_set_enabled(bool enable) {
+    pthread_mutex_lock(&ring_mutex);
+
+    // Calibrate against the monotonic clock from the first enable
+    if (enable && base_clock == 0) {
+        base_clock = trace_clock();
+        base_ns = monotonic_ns();
+    }
+
+    atomic_store_explicit(&trace_active, enable, memory_order_relaxed);
+    pthread_mutex_unlock(&ring_mutex);
+ }
+
+ int trace_dump(const char *path) {
+    if (!path) {
+        return -1;
+    }
+
+    trace_event_t *events = malloc(TRACE_RING_SIZE * sizeof(trace_event_t));
+    if (!events) {
+        return -1;
+    }
+
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        free(events);
+        return -1;
+    }
+
+    pthread_mutex_lock(&ring_mutex);
+
+    // Clock ticks per microsecond since tracing was enabled
+    double ticks_per_us = 1000.0;
+    uint64_t elapsed_ns = base_clock ? monotonic_ns() - base_ns : 0;
+    if (elapsed_ns > 1000000) {
+        ticks_per_us = (double)(trace_clock() - base_clock) * 1000.0 / (double)elapsed_ns;
+    }
+
+    int pid = (int)getpid();
+    int count = 0;
+    bool first = true;
+
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+    for (int i = 0; i < ring_count; i++) {
+        trace_ring_t *ring = rings[i];
+        int n = copy_ring(ring, events);
+        if (n == 0) {
+            continue;
+        }
+
+        // Name the thread track
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", pid, (int)ring->tid,
+                ring->name[0] ? ring->name : "thread");
+        first = false;
+
+        for (int j = 0; j < n; j++) {
+            trace_event_t *event = &events[j];
+            if (event->type >= TRACE_EVENT_TYPES) {
+                continue;
+            }
+
+            double ts = (double)(int64_t)(event->start - base_clock) / ticks_per_us;
+            int conn_id = event->conn_id == TRACE_THREAD_CONN ? ring->conn_id : event->conn_id;
+
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"chat\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,",
+                    EVENT_NAMES[event->type], pid, (int)ring->tid, ts);
+
+            // Events without duration are shown as instants on the thread track
+            if (event->duration == 0) {
+                fprintf(file, "\"ph\":\"i\",\"s\":\"t\",");
+            }
+            else {
+                fprintf(file, "\"ph\":\"X\",\"dur\":%.3f,", (double)event->duration / ticks_per_us);
+            }
+
+            if (conn_id >= 0) {
+                fprintf(file, "\"args\":{\"conn\":%d,\"bytes\":%u}}", conn_id, event->arg);
+            }
+            else {
+                fprintf(file, "\"args\":{\"bytes\":%u}}", event->arg);
+            }
+            count++;
+        }
+    }
+
+    pthread_mutex_unlock(&ring_mutex);
+
+    fprintf(file, "\n]}\n");
+    free(events);
+
+    if (fclose(file) != 0) {
+        return -1;
+    }
+    return count;
+ }
+
+ static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+ }
+
+ static void create_ring_key(void) {
+    pthread_key_create(&ring_key, release_ring);
+ }
+
+ static void release_ring(void *arg) {
+    trace_ring_t *ring = (trace_ring_t *)arg;
+
+    // The events stay available until another thread takes the ring
+    pthread_mutex_lock(&ring_mutex);
+    ring->in_use = false;
+    pthread_mutex_unlock(&ring_mutex);
+ }
+
+ static trace_ring_t* attach_ring(void) {
+    if (thread_untraced) {
+        return NULL;
+    }
+
+    pthread_once(&ring_key_once, create_ring_key);
+    pthread_mutex_lock(&ring_mutex);
+
+    // Reuse the ring of a thread that exited, otherwise add one
+    trace_ring_t *ring = NULL;
+    for (int i = 0; i < ring_count; i++) {
+        if (!rings[i]->in_use) {
+            ring = rings[i];
+            atomic_store_explicit(&ring->head, 0, memory_order_relaxed);
+            break;
+        }
+    }
+
+    if (!ring && ring_count < TRACE_MAX_THREADS) {
+        ring = calloc(1, sizeof(trace_ring_t));
+        if (ring) {
+            rings[ring_count++] = ring;
+        }
+    }
+
+    if (!ring) {
+        // Too many threads: this one is not traced
+        pthread_mutex_unlock(&ring_mutex);
+        thread_untraced = true;
+        return NULL;
+    }
+
+    ring->in_use = true;
+    ring->tid = (pid_t)syscall(SYS_gettid);
+    ring->conn_id = thread_conn;
+    strcpy(ring->name, thread_name);
+
+    pthread_mutex_unlock(&ring_mutex);
+
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+    return ring;
+ }
+
+ /**
+  * Copy the events of a ring, oldest first, skipping any that the owner
+  * overwrote during the copy. Called with ring_mutex held.
+  */
+ static int copy_ring(trace_ring_t *ring, trace_event_t *out) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t start = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+    for (uint64_t i = start; i < head; i++) {
+        out[i - start] = ring->events[i & (TRACE_RING_SIZE - 1)];
+    }
+
+    // Events below this index may have been overwritten while copying
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t now = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t valid = now >= TRACE_RING_SIZE ? now - TRACE_RING_SIZE + 1 : 0;
+    uint64_t skip = valid > start ? valid - start : 0;
+
+    if (skip >= head - start) {
+        return 0;
+    }
+
+    memmove(out, out + skip, (size_t)(head - start - skip) * sizeof(trace_event_t));
+    return (int)(head - start - skip);
+ }
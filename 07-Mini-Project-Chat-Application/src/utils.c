@@ -9,8 +9,36 @@
  #include <arpa/inet.h>
  #include <netinet/in.h>
  #include <signal.h>
+ #include <pthread.h>
+ #include <poll.h>
+ #include <sys/signalfd.h>
+ #include <errno.h>
+ #include <ifaddrs.h>
+ #include <net/if.h>
+ #include <linux/netlink.h>
+ #include <linux/rtnetlink.h>
  #include "utils.h"
  #include "connection.h"
+ #include "metrics.h"
+
+ // Maximum number of local IPv4 addresses kept in the cache
+ #define MAX_LOCAL_ADDRS 32
+
+ // Cached local addresses, primary (first non-loopback) address first
+ static struct in_addr local_addrs[MAX_LOCAL_ADDRS];
+ static int local_addr_count = 0;
+ static bool addr_cache_valid = false;
+ static pthread_mutex_t addr_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+ // Address monitor thread and the descriptors it waits on
+ static pthread_t monitor_thread;
+ static bool monitor_running = false;
+ static int netlink_socket = -1;
+ static int monitor_pipe[2] = {-1, -1};
+
+ // Local function prototypes
+ static int refresh_local_addresses(void);
+ static void* address_monitor(void *arg);
 
  void print_error(const char *message) {
     if (!message) {
@@ -20,12 +48,22 @@
     fprintf(stderr, "ERROR: %s\n", message);
  }
 
- void handle_signal(int sig) {
-    if (sig == SIGINT) {
-        printf("\nReceived interrupt signal. Shutting down...\n");
-        cleanup_resources();
-        exit(EXIT_SUCCESS);
+ int setup_signal_fd(void) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+
+    // Block the signals so they are only delivered through the descriptor;
+    // threads created afterwards inherit this mask
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0) {
+        return -1;
     }
+
+    // Writing to a socket closed by the peer must fail, not kill the process
+    signal(SIGPIPE, SIG_IGN);
+
+    return signalfd(-1, &mask, SFD_CLOEXEC);
  }
 
  bool get_local_ip(char *buffer, int buffer_size) {
@@ -33,31 +71,122 @@
         return false;
     }
 
-    // Use hostname command to get IP
-    FILE *cmd = popen("hostname -I | awk '{print $1}'", "r");
-    if (!cmd) {
+    pthread_mutex_lock(&addr_mutex);
+
+    // Query the interfaces only if the monitor has not filled the cache yet
+    if (!addr_cache_valid) {
+        refresh_local_addresses();
+    }
+
+    bool found = local_addr_count > 0 && ntohl(local_addrs[0].s_addr) >> 24 != IN_LOOPBACKNET;
+    if (found) {
+        inet_ntop(AF_INET, &local_addrs[0], buffer, buffer_size);
+    }
+
+    pthread_mutex_unlock(&addr_mutex);
+
+    // Fallback to loopback if no other interface has an address
+    if (!found) {
+        strncpy(buffer, "127.0.0.1", buffer_size - 1);
+        buffer[buffer_size - 1] = '\0';
+    }
+
+    return true;
+ }
+
+ bool is_local_address(const char *ip) {
+    struct in_addr addr;
+    if (!ip || inet_pton(AF_INET, ip, &addr) != 1) {
         return false;
     }
 
-    // Read result
-    if (fgets(buffer, buffer_size, cmd) != NULL) {
-        // Remove trailing newline if present
-        size_t len = strlen(buffer);
-        if (len > 0 && buffer[len - 1] == '\n') {
-            buffer[len - 1] = '\0';
-        }
-        
-        pclose(cmd);
+    // The whole 127.0.0.0/8 block and INADDR_ANY reach this host
+    uint32_t host = ntohl(addr.s_addr);
+    if (host >> 24 == IN_LOOPBACKNET || host == INADDR_ANY) {
         return true;
     }
 
-    pclose(cmd);
+    pthread_mutex_lock(&addr_mutex);
 
-    // Fallback to loopback if hostname command fails
-    strncpy(buffer, "127.0.0.1", buffer_size - 1);
-    buffer[buffer_size - 1] = '\0';
-     
-    return true;
+    if (!addr_cache_valid) {
+        refresh_local_addresses();
+    }
+
+    bool local = false;
+    for (int i = 0; i < local_addr_count; i++) {
+        if (local_addrs[i].s_addr == addr.s_addr) {
+            local = true;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&addr_mutex);
+    return local;
+ }
+
+ int start_address_monitor(void) {
+    // Subscribe to IPv4 address changes
+    netlink_socket = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (netlink_socket < 0) {
+        print_error("Netlink socket creation failed");
+        return -1;
+    }
+
+    struct sockaddr_nl nl_addr;
+    memset(&nl_addr, 0, sizeof(nl_addr));
+    nl_addr.nl_family = AF_NETLINK;
+    nl_addr.nl_groups = RTMGRP_IPV4_IFADDR;
+
+    if (bind(netlink_socket, (struct sockaddr*)&nl_addr, sizeof(nl_addr)) < 0) {
+        print_error("Netlink bind failed");
+        close(netlink_socket);
+        netlink_socket = -1;
+        return -1;
+    }
+
+    // Pipe used to wake the monitor thread on shutdown
+    if (pipe(monitor_pipe) < 0) {
+        print_error("Pipe creation failed");
+        close(netlink_socket);
+        netlink_socket = -1;
+        return -1;
+    }
+
+    // Fill the cache after subscribing so no change can be missed
+    pthread_mutex_lock(&addr_mutex);
+    refresh_local_addresses();
+    pthread_mutex_unlock(&addr_mutex);
+
+    if (pthread_create(&monitor_thread, NULL, address_monitor, NULL) != 0) {
+        print_error("Failed to create address monitor thread");
+        close(netlink_socket);
+        close(monitor_pipe[0]);
+        close(monitor_pipe[1]);
+        netlink_socket = monitor_pipe[0] = monitor_pipe[1] = -1;
+        return -1;
+    }
+
+    monitor_running = true;
+    return 0;
+ }
+
+ void stop_address_monitor(void) {
+    if (!monitor_running) {
+        return;
+    }
+
+    // Wake the thread and wait for it to exit
+    char byte = 0;
+    if (write(monitor_pipe[1], &byte, 1) < 0) {
+        print_error("Failed to stop address monitor");
+    }
+    pthread_join(monitor_thread, NULL);
+    monitor_running = false;
+
+    close(netlink_socket);
+    close(monitor_pipe[0]);
+    close(monitor_pipe[1]);
+    netlink_socket = monitor_pipe[0] = monitor_pipe[1] = -1;
  }
 
  bool is_valid_ip(const char *ip) { 
@@ -71,9 +200,110 @@
     // Close all connections
     close_all_connections();
 
+    // Stop watching address changes
+    stop_address_monitor();
+
+    // Remove the metrics socket
+    stop_metrics_server();
+
     printf("All resources cleaned up.\n");
  }
 
  bool is_same_address(const char *ip1, int port1, const char *ip2, int port2) {
-    return (ip1 && ip2 && strcmp(ip1, ip2) == 0 && port1 == port2);
+    if (!ip1 || !ip2 || port1 != port2) {
+        return false;
+    }
+
+    if (strcmp(ip1, ip2) == 0) {
+        return true;
+    }
+
+    // Any two addresses of this host reach the same listening socket
+    return is_local_address(ip1) && is_local_address(ip2);
+ }
+
+ // Rebuild the address cache from getifaddrs(), caller must hold addr_mutex
+ static int refresh_local_addresses(void) {
+    struct ifaddrs *ifaddr;
+    if (getifaddrs(&ifaddr) < 0) {
+        return -1;
+    }
+
+    int count = 0;
+    int primary = -1;
+
+    for (struct ifaddrs *ifa = ifaddr; ifa && count < MAX_LOCAL_ADDRS; ifa = ifa->ifa_next) {
+        if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != AF_INET || !(ifa->ifa_flags & IFF_UP)) {
+            continue;
+        }
+
+        local_addrs[count] = ((struct sockaddr_in*)ifa->ifa_addr)->sin_addr;
+        if (primary < 0 && !(ifa->ifa_flags & IFF_LOOPBACK)) {
+            primary = count;
+        }
+        count++;
+    }
+
+    freeifaddrs(ifaddr);
+
+    // Keep the primary address first, as reported by `hostname -I`
+    if (primary > 0) {
+        struct in_addr tmp = local_addrs[0];
+        local_addrs[0] = local_addrs[primary];
+        local_addrs[primary] = tmp;
+    }
+
+    local_addr_count = count;
+    addr_cache_valid = true;
+    return 0;
+ }
+
+ static void* address_monitor(void *arg) {
+    char buffer[8192] __attribute__((aligned(__alignof__(struct nlmsghdr))));
+    struct pollfd fds[2] = {
+        { .fd = netlink_socket, .events = POLLIN },
+        { .fd = monitor_pipe[0], .events = POLLIN }
+    };
+
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        // Shutdown requested
+        if (fds[1].revents) {
+            break;
+        }
+
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+
+        ssize_t len = recv(netlink_socket, buffer, sizeof(buffer), 0);
+        bool changed = false;
+
+        if (len < 0) {
+            // Events were dropped (ENOBUFS), the cache may be stale
+            changed = errno != EINTR && errno != EAGAIN;
+        }
+
+        for (struct nlmsghdr *nh = (struct nlmsghdr*)buffer; len > 0 && NLMSG_OK(nh, len);
+             nh = NLMSG_NEXT(nh, len)) {
+            if (nh->nlmsg_type == RTM_NEWADDR || nh->nlmsg_type == RTM_DELADDR) {
+                changed = true;
+            }
+        }
+
+        // Re-read all addresses once per batch of events
+        if (changed) {
+            pthread_mutex_lock(&addr_mutex);
+            refresh_local_addresses();
+            pthread_mutex_unlock(&addr_mutex);
+        }
+    }
+
+    return NULL;
  }
\ No newline at end of file
@@ -0,0 +1,210 @@
+/**
+ * chat_replay.c - Replay a traffic capture into a running chat application
+ *
+ * Reads a file written by `chat_app --record <file>` and sends every frame
+ * to a live instance, opening one connection per captured connection.
+ * Frames are sent either at their original pacing or as fast as possible.
+ * The target sheds what exceeds its inbound limits, so a fast replay only
+ * reproduces the capture once those are raised with `limit in` and
+ * `limit global`.
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <getopt.h>
+ #include <time.h>
+ #include <errno.h>
+ #include <sys/socket.h>
+ #include <arpa/inet.h>
+ #include <netinet/in.h>
+ #include <netinet/tcp.h>
+ #include "capture.h"
+ #include "ratelimit.h"
+
+ // Maximum number of distinct captured connections
+ #define MAX_REPLAY_CONNECTIONS 256
+
+ // Largest frame accepted from a capture file
+ #define MAX_FRAME_SIZE 65536
+
+ /**
+  * Mapping from a captured connection to a replay socket
+  */
+ typedef struct {
+     uint32_t conn_id;       // Connection ID in the capture
+     int socket;             // Socket connected to the target
+ } replay_conn_t;
+
+ static replay_conn_t replay_conns[MAX_REPLAY_CONNECTIONS];
+ static int replay_conn_count = 0;
+
+ static void print_usage(const char *prog) {
+    printf("Usage: %s [--fast] <capture-file> <ip> <port>\n", prog);
+    printf("  --fast    Send frames as fast as possible instead of at the recorded pacing\n");
+    printf("            (raise the target's limits first: limit in 0 1, limit global 0 1)\n");
+ }
+
+ static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+ }
+
+ // Get the socket replaying a captured connection, connecting on first use
+ static int get_replay_socket(uint32_t conn_id, const struct sockaddr_in *target) {
+    for (int i = 0; i < replay_conn_count; i++) {
+        if (replay_conns[i].conn_id == conn_id) {
+            return replay_conns[i].socket;
+        }
+    }
+
+    if (replay_conn_count == MAX_REPLAY_CONNECTIONS) {
+        fprintf(stderr, "ERROR: Too many connections in capture\n");
+        return -1;
+    }
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        fprintf(stderr, "ERROR: Socket creation failed\n");
+        return -1;
+    }
+
+    if (connect(sock, (const struct sockaddr*)target, sizeof(*target)) < 0) {
+        fprintf(stderr, "ERROR: Connection failed: %s\n", strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    // Send each frame as its own segment, like the original sender did
+    int opt = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    replay_conns[replay_conn_count].conn_id = conn_id;
+    replay_conns[replay_conn_count].socket = sock;
+    replay_conn_count++;
+
+    return sock;
+ }
+
+ int main(int argc, char *argv[])
+ {
+    int fast = 0;
+
+    static const struct option long_options[] = {
+        { "fast", no_argument, NULL, 'f' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "f", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'f':
+                fast = 1;
+                break;
+            default:
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 3) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *path = argv[optind];
+    const char *ip = argv[optind + 1];
+    int port = atoi(argv[optind + 2]);
+
+    // Prepare target address
+    struct sockaddr_in target;
+    memset(&target, 0, sizeof(target));
+    target.sin_family = AF_INET;
+    target.sin_port = htons(port);
+    if (port <= 0 || port > 65535 || inet_pton(AF_INET, ip, &target.sin_addr) != 1) {
+        fprintf(stderr, "ERROR: Invalid address %s:%d\n", ip, port);
+        return EXIT_FAILURE;
+    }
+
+    capture_header_t header;
+    FILE *file = capture_open(path, &header);
+    if (!file) {
+        fprintf(stderr, "ERROR: Cannot open capture file %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    if (fast) {
+        fprintf(stderr, "WARNING: The target sheds messages above its inbound limits (default %.0f msg/s per\n"
+                        "         connection, %.0f msg/s in total). Unless they were raised with `limit in 0 1`\n"
+                        "         and `limit global 0 1`, the replay measures shedding, not message handling.\n",
+                DEFAULT_INBOUND_RATE, DEFAULT_GLOBAL_RATE);
+    }
+
+    char *frame = malloc(MAX_FRAME_SIZE);
+    if (!frame) {
+        fprintf(stderr, "ERROR: Memory allocation failed\n");
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+
+    capture_record_t record;
+    uint64_t first_ts = 0;
+    uint64_t start = now_ns();
+    unsigned long frames = 0;
+    unsigned long long bytes = 0;
+    int result;
+
+    while ((result = capture_read(file, &record, frame, MAX_FRAME_SIZE)) == 1) {
+        int sock = get_replay_socket(record.conn_id, &target);
+        if (sock < 0) {
+            result = -1;
+            break;
+        }
+
+        // Sleep until the frame's offset from the first frame has elapsed
+        if (frames == 0) {
+            first_ts = record.timestamp_ns;
+        }
+        else if (!fast) {
+            uint64_t due = start + (record.timestamp_ns - first_ts);
+            struct timespec ts = {
+                .tv_sec = (time_t)(due / 1000000000ULL),
+                .tv_nsec = (long)(due % 1000000000ULL)
+            };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+            }
+        }
+
+        if (send(sock, frame, record.length, 0) < 0) {
+            fprintf(stderr, "ERROR: Send failed: %s\n", strerror(errno));
+            result = -1;
+            break;
+        }
+
+        frames++;
+        bytes += record.length;
+    }
+
+    double elapsed = (double)(now_ns() - start) / 1e9;
+
+    if (result < 0) {
+        fprintf(stderr, "ERROR: Replay stopped after %lu frame(s)\n", frames);
+    }
+
+    printf("Replayed %lu frame(s), %llu byte(s) over %d connection(s) in %.3f s",
+           frames, bytes, replay_conn_count, elapsed);
+    if (elapsed > 0) {
+        printf(" (%.0f frames/s)", frames / elapsed);
+    }
+    printf("\n");
+
+    for (int i = 0; i < replay_conn_count; i++) {
+        close(replay_conns[i].socket);
+    }
+    free(frame);
+    fclose(file);
+
+    return result < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+ }
@@ -0,0 +1,91 @@
+/**
+ * @file anomaly.h
+ * @brief Interface for streaming anomaly detection
+ *
+ * Every sensor keeps an exponentially weighted mean and variance of its
+ * readings, updated in constant time per reading, and a slower weighted
+ * mean used as its baseline. The state of a sensor is one cache line.
+ *
+ * Three conditions are detected:
+ *
+ * - spike: a reading more than the z-score threshold of standard
+ *   deviations away from the mean. The reading only pulls the mean as
+ *   far as the threshold, so a single outlier barely moves it while a
+ *   lasting step is followed within a few dozen readings.
+ * - drift: the mean more than the drift threshold away from the
+ *   baseline. Cleared once it is back within half the threshold.
+ * - stuck: the same reading, within ANOMALY_STUCK_EPSILON, for the stuck
+ *   threshold of readings in a row. Cleared by the next change.
+ *
+ * Nothing is reported during the first ANOMALY_WARMUP readings of a
+ * sensor. Thresholds are per room: rooms listed in the file given to
+ * anomaly_init() use their own, every other room the ANOMALY_* defaults.
+ *
+ * Alerts are written to the log. Drift and stuck are logged when they
+ * are raised and when they clear. Spikes of a sensor are logged at most
+ * once per ANOMALY_SUPPRESS_MS, with the number left out since the last
+ * alert, and all alerts together at most ANOMALY_ALERTS_PER_SEC per
+ * second, with a summary of those dropped.
+ *
+ * Sensors are known by the dense slot the data manager gives them. All
+ * functions must be called from the data manager thread, except
+ * anomaly_get_stats().
+ */
+
+#ifndef _ANOMALY_H_
+#define _ANOMALY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+/**
+ * @brief Anomaly detector counters
+ */
+typedef struct {
+    uint64_t spikes;                /**< Spike readings */
+    uint64_t drifts;                /**< Times a sensor started drifting */
+    uint64_t stuck;                 /**< Times a sensor got stuck */
+    uint64_t suppressed;            /**< Alerts left out of the log */
+} anomaly_stats_t;
+
+/**
+ * @brief Allocate the state of every sensor and load the room thresholds
+ *
+ * The thresholds file holds one "<room id> <z-score> <drift> <stuck
+ * readings>" line per room. A missing file leaves every room on the
+ * defaults; a malformed one is an error.
+ *
+ * @param sensors Number of sensor slots
+ * @param ids Sensor id of every slot, kept for the alerts
+ * @param rooms Room of every slot
+ * @param thresholds_file Path to the room thresholds
+ * @param log_fd Log descriptor, or -1 to log nothing
+ * @return 0 on success, -1 on failure
+ */
+int anomaly_init(size_t sensors, const sensor_id_t *ids, const room_id_t *rooms, const char *thresholds_file,
+                 int log_fd);
+
+/**
+ * @brief Check readings against their sensors and update them, in order
+ *
+ * @param slots Slot of every reading, UINT32_MAX for readings to skip
+ * @param data Readings
+ * @param count Number of readings
+ * @param now Current time, for the global alert budget
+ */
+void anomaly_process(const uint32_t *slots, const sensor_data_t *data, size_t count, int64_t now);
+
+/**
+ * @brief Read the anomaly detector counters (any thread)
+ *
+ * @param stats Receives the counters
+ */
+void anomaly_get_stats(anomaly_stats_t *stats);
+
+/**
+ * @brief Free the state and thresholds
+ */
+void anomaly_free(void);
+
+#endif
@@ -0,0 +1,316 @@
+/**
+ * @file config.h
+ * @brief Configuration parameters for the sensor gateway
+ */
+
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+#include <stdint.h>
+
+/**
+ * @brief Size of a cache line
+ *
+ * Data written by different threads is padded to this size so the
+ * threads never contend on the same line.
+ */
+#define CACHE_LINE_SIZE 64
+
+/**
+ * @brief FIFO between the gateway and the log process, and the log file
+ */
+#define LOG_FIFO "logFifo"
+#define LOG_FILE "gateway.log"
+
+/**
+ * @brief Transport of log events used when none is given on the command line
+ *
+ * "shm" uses a shared-memory ring of LOG_SHM_SIZE bytes (power of two),
+ * "fifo" the LOG_FIFO named pipe.
+ */
+#ifndef LOG_TRANSPORT
+#define LOG_TRANSPORT "shm"
+#endif
+#ifndef LOG_SHM_SIZE
+#define LOG_SHM_SIZE (4 * 1024 * 1024)
+#endif
+
+/**
+ * @brief Log pipeline tuning
+ *
+ * The FIFO is enlarged to LOG_PIPE_SIZE bytes (capped by the system
+ * limit) so bursts of events do not block the gateway threads, and the
+ * log process syncs the log file at most every LOG_SYNC_MS.
+ */
+#ifndef LOG_PIPE_SIZE
+#define LOG_PIPE_SIZE (1024 * 1024)
+#endif
+#ifndef LOG_SYNC_MS
+#define LOG_SYNC_MS 1000
+#endif
+
+/**
+ * @brief Period of the pipeline stage latencies written to the log, 0 for never
+ */
+#ifndef LATENCY_REPORT_MS
+#define LATENCY_REPORT_MS 10000
+#endif
+
+/**
+ * @brief Record latencies in the histograms, 0 to leave them empty
+ */
+#ifndef LATENCY_RECORD
+#define LATENCY_RECORD 1
+#endif
+
+/**
+ * @brief Seconds without data after which a sensor node is disconnected
+ */
+#ifndef TIMEOUT
+#define TIMEOUT 5
+#endif
+
+/**
+ * @brief Number of readings held by the shared buffer (power of two)
+ */
+#ifndef SBUFFER_CAPACITY
+#define SBUFFER_CAPACITY 65536
+#endif
+
+/**
+ * @brief Temperature limits of the data manager, in degrees Celsius
+ *
+ * A sensor whose running average leaves this range is reported as too
+ * cold or too hot. Both can be overridden with -D at compile time.
+ */
+#ifndef SET_MIN_TEMP
+#define SET_MIN_TEMP 10
+#endif
+#ifndef SET_MAX_TEMP
+#define SET_MAX_TEMP 20
+#endif
+
+/**
+ * @brief Number of readings in the running average of a sensor
+ */
+#ifndef RUN_AVG_LENGTH
+#define RUN_AVG_LENGTH 5
+#endif
+
+/**
+ * @brief Minute, hour and day rollups of the data manager
+ *
+ * Every sensor keeps its last ROLLUP_KEEP_MINUTES minute buckets,
+ * ROLLUP_KEEP_HOURS hour buckets and ROLLUP_KEEP_DAYS day buckets in
+ * memory. A bucket without a reading for a later bucket is closed
+ * ROLLUP_GRACE_MS after its end, by a sweep every ROLLUP_SWEEP_MS.
+ */
+#ifndef ROLLUP_KEEP_MINUTES
+#define ROLLUP_KEEP_MINUTES 60
+#endif
+#ifndef ROLLUP_KEEP_HOURS
+#define ROLLUP_KEEP_HOURS 24
+#endif
+#ifndef ROLLUP_KEEP_DAYS
+#define ROLLUP_KEEP_DAYS 7
+#endif
+#ifndef ROLLUP_GRACE_MS
+#define ROLLUP_GRACE_MS 5000
+#endif
+#ifndef ROLLUP_SWEEP_MS
+#define ROLLUP_SWEEP_MS 1000
+#endif
+
+/**
+ * @brief Streaming anomaly detection of the data manager
+ *
+ * Every sensor keeps an exponentially weighted mean and variance with
+ * weight ANOMALY_ALPHA per reading, and a baseline with weight
+ * ANOMALY_BASELINE_ALPHA. Nothing is reported before ANOMALY_WARMUP
+ * readings. A reading more than ANOMALY_Z standard deviations (at least
+ * ANOMALY_MIN_STDDEV) from the mean is a spike, a mean more than
+ * ANOMALY_DRIFT degrees from the baseline a drift, and
+ * ANOMALY_STUCK_READINGS readings within ANOMALY_STUCK_EPSILON of each
+ * other a stuck sensor. The last three can be set per room in
+ * ROOM_ANOMALY_FILE.
+ *
+ * Spikes of a sensor are logged at most once per ANOMALY_SUPPRESS_MS,
+ * and alerts of all sensors at most ANOMALY_ALERTS_PER_SEC per second.
+ */
+#ifndef ANOMALY_ALPHA
+#define ANOMALY_ALPHA 0.05
+#endif
+#ifndef ANOMALY_BASELINE_ALPHA
+#define ANOMALY_BASELINE_ALPHA 0.002
+#endif
+#ifndef ANOMALY_WARMUP
+#define ANOMALY_WARMUP 50
+#endif
+#ifndef ANOMALY_Z
+#define ANOMALY_Z 5.0
+#endif
+#ifndef ANOMALY_MIN_STDDEV
+#define ANOMALY_MIN_STDDEV 0.05
+#endif
+#ifndef ANOMALY_DRIFT
+#define ANOMALY_DRIFT 5.0
+#endif
+#ifndef ANOMALY_STUCK_READINGS
+#define ANOMALY_STUCK_READINGS 60
+#endif
+#ifndef ANOMALY_STUCK_EPSILON
+#define ANOMALY_STUCK_EPSILON 1e-9
+#endif
+#ifndef ANOMALY_SUPPRESS_MS
+#define ANOMALY_SUPPRESS_MS 60000
+#endif
+#ifndef ANOMALY_ALERTS_PER_SEC
+#define ANOMALY_ALERTS_PER_SEC 100
+#endif
+
+/**
+ * @brief Unix socket of the query service, and its connection limit
+ */
+#define QUERY_SOCKET "gateway.sock"
+#ifndef QUERY_MAX_CLIENTS
+#define QUERY_MAX_CLIENTS 64
+#endif
+
+/**
+ * @brief File mapping each room to the sensor installed in it
+ *
+ * One "<room id> <sensor id>" pair per line.
+ */
+#define ROOM_MAP_FILE "room_sensor.map"
+
+/**
+ * @brief Optional file of per-room anomaly thresholds
+ *
+ * One "<room id> <z-score> <drift> <stuck readings>" line per room.
+ */
+#define ROOM_ANOMALY_FILE "room_anomaly.conf"
+
+/**
+ * @brief Storage backend used when none is given on the command line
+ *
+ * "sqlite" stores readings in a SQLite table, "tsdb" in the columnar
+ * time-series store.
+ */
+#ifndef STORAGE_BACKEND
+#define STORAGE_BACKEND "sqlite"
+#endif
+
+/**
+ * @brief Storage manager batches
+ *
+ * Pending readings are flushed to the backend (one transaction for
+ * SQLite) once STORAGE_BATCH_SIZE readings are pending, or
+ * STORAGE_FLUSH_MS after the first of them, whichever comes first. A
+ * failed insert or flush is tried again after STORAGE_RETRY_MS.
+ */
+#ifndef STORAGE_BATCH_SIZE
+#define STORAGE_BATCH_SIZE 4096
+#endif
+#ifndef STORAGE_FLUSH_MS
+#define STORAGE_FLUSH_MS 100
+#endif
+#ifndef STORAGE_RETRY_MS
+#define STORAGE_RETRY_MS 500
+#endif
+
+/**
+ * @brief Storage spillover
+ *
+ * Readings wait in memory for the storage backend. Once more than
+ * STORAGE_HIGH_WATER of them are waiting, new readings are appended to
+ * SPILL_FILE instead, until the backend has caught up and read the file
+ * back in batches of SPILL_REPLAY_BATCH readings.
+ */
+#define SPILL_FILE "storage.spill"
+#ifndef STORAGE_HIGH_WATER
+#define STORAGE_HIGH_WATER 65536
+#endif
+#ifndef SPILL_REPLAY_BATCH
+#define SPILL_REPLAY_BATCH 16384
+#endif
+
+/**
+ * @brief Journal of received readings
+ *
+ * The connection manager appends every reading to JOURNAL_DIR with one
+ * write per wake-up, of at most JOURNAL_BATCH readings, and a background
+ * thread syncs it every JOURNAL_SYNC_MS (0 never syncs, which survives a
+ * crash of the gateway but not of the machine). A new segment file is
+ * started every JOURNAL_SEGMENT_SIZE bytes.
+ */
+#define JOURNAL_DIR "journal"
+#ifndef JOURNAL_BATCH
+#define JOURNAL_BATCH 4096
+#endif
+#ifndef JOURNAL_SYNC_MS
+#define JOURNAL_SYNC_MS 100
+#endif
+#ifndef JOURNAL_SEGMENT_SIZE
+#define JOURNAL_SEGMENT_SIZE (64 << 20)
+#endif
+
+/**
+ * @brief SQLite database and tables of the storage manager
+ */
+#define DB_NAME "Sensor.db"
+#define TABLE_NAME "SensorData"
+#define ROLLUP_TABLE_NAME "SensorRollup"
+
+/**
+ * @brief Attempts to open the database before the gateway gives up
+ */
+#define DB_CONNECT_ATTEMPTS 3
+
+/**
+ * @brief Columnar time-series store
+ *
+ * Readings are kept per sensor until TSDB_BLOCK_READINGS are collected,
+ * then appended as one block to a memory-mapped segment file of
+ * TSDB_SEGMENT_SIZE bytes in TSDB_DIR. A flush of the storage manager
+ * also writes the partial blocks whose first reading is TSDB_BLOCK_AGE_MS
+ * old, so slow sensors still get blocks of a useful size.
+ */
+#define TSDB_DIR "sensor_data.tsdb"
+#ifndef TSDB_SEGMENT_SIZE
+#define TSDB_SEGMENT_SIZE (64 * 1024 * 1024)
+#endif
+#ifndef TSDB_BLOCK_READINGS
+#define TSDB_BLOCK_READINGS 1024
+#endif
+#ifndef TSDB_BLOCK_AGE_MS
+#define TSDB_BLOCK_AGE_MS 1000
+#endif
+
+typedef uint16_t sensor_id_t;       /**< Sensor node identifier */
+typedef double sensor_value_t;      /**< Temperature in degrees Celsius */
+typedef int64_t sensor_ts_t;        /**< Nanoseconds since the Unix epoch */
+typedef uint16_t room_id_t;         /**< Room identifier */
+
+/**
+ * @brief Sensor reading exchanged between the gateway threads
+ *
+ * The stage stamps are on the monotonic clock of this run; a reading
+ * without them has received set to 0.
+ */
+typedef struct {
+    sensor_id_t id;                 /**< Sensor that took the reading */
+    uint32_t insert_ns;             /**< Time from receive to publication in the shared buffer */
+    sensor_value_t value;           /**< Measured temperature */
+    sensor_ts_t ts;                 /**< Time the reading was taken */
+    uint64_t received;              /**< Time the connection manager received it */
+} sensor_data_t;
+
+/**
+ * @brief Size of a packet sent by a sensor node
+ *
+ * A packet is the sensor id (16 bits), the value (IEEE 754 double) and
+ * the timestamp (signed 64 bits), packed and little-endian.
+ */
+#define SENSOR_PACKET_SIZE 18
+
+#endif
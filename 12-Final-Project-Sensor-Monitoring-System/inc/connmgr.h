@@ -0,0 +1,57 @@
+/**
+ * @file connmgr.h
+ * @brief Interface for the connection manager
+ *
+ * The connection manager accepts TCP connections from sensor nodes and
+ * runs a single-threaded, non-blocking epoll reactor over all of them.
+ * Each connection has an incremental packet parser, and parsed readings
+ * are written straight into the shared buffer. The readings of each
+ * reactor wake-up are appended to the journal with one write before they
+ * are published. Connections that stay silent for TIMEOUT seconds are
+ * closed.
+ */
+
+#ifndef _CONNMGR_H_
+#define _CONNMGR_H_
+
+#include <stdint.h>
+#include "sbuffer.h"
+
+/**
+ * @brief Connection manager counters
+ */
+typedef struct {
+    uint64_t accepted;              /**< Connections accepted */
+    uint64_t active;                /**< Connections currently open */
+    uint64_t readings;              /**< Readings inserted in the shared buffer */
+    uint64_t bytes;                 /**< Bytes received */
+    uint64_t wakeups;               /**< Reactor wake-ups with at least one event */
+    uint64_t timeouts;              /**< Connections closed after TIMEOUT seconds of silence */
+} connmgr_stats_t;
+
+/**
+ * @brief Start listening and run the reactor in a new thread
+ *
+ * The connection manager is the only writer of the shared buffer and
+ * closes it when it stops.
+ *
+ * @param port TCP port to listen on
+ * @param buffer Shared buffer receiving the readings
+ * @param log_fd Log FIFO descriptor for connection events
+ * @return 0 on success, -1 on failure
+ */
+int connmgr_start(int port, sbuffer_t *buffer, int log_fd);
+
+/**
+ * @brief Stop the reactor, close all connections and wait for the thread
+ */
+void connmgr_stop(void);
+
+/**
+ * @brief Read the connection manager counters (any thread)
+ *
+ * @param stats Receives the counters
+ */
+void connmgr_get_stats(connmgr_stats_t *stats);
+
+#endif
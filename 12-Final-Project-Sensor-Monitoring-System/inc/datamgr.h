@@ -0,0 +1,141 @@
+/**
+ * @file datamgr.h
+ * @brief Interface for the data manager
+ *
+ * The data manager keeps a running average of the last RUN_AVG_LENGTH
+ * readings of every sensor listed in the room map, and logs when the
+ * average of a sensor leaves or re-enters the range SET_MIN_TEMP to
+ * SET_MAX_TEMP. Readings from sensors that are not in the map are
+ * logged once per sensor id and otherwise ignored.
+ *
+ * It also keeps minute, hour and day rollups of every sensor (see
+ * rollup.h), and queues every bucket that closes for the storage
+ * manager. Buckets of quiet sensors are closed by a sweep every
+ * ROLLUP_SWEEP_MS, and the open buckets when the thread stops.
+ *
+ * Every reading also goes through a streaming anomaly detector (see
+ * anomaly.h), which logs spikes, drifting and stuck sensors against the
+ * thresholds of their room.
+ *
+ * Other threads can read the state of a sensor at any time. Each
+ * sensor has a sequence counter (see seqlock.h), so a reader gets a
+ * consistent snapshot and never blocks the data manager.
+ */
+
+#ifndef _DATAMGR_H_
+#define _DATAMGR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+#include "rollup.h"
+#include "sbuffer.h"
+
+/**
+ * @brief Data manager counters
+ */
+typedef struct {
+    uint64_t sensors;               /**< Sensors in the room map */
+    uint64_t readings;              /**< Readings processed */
+    uint64_t invalid;               /**< Readings from unknown sensors */
+    uint64_t too_cold;              /**< Times a sensor became too cold */
+    uint64_t too_hot;               /**< Times a sensor became too hot */
+    uint64_t rollups;               /**< Rollup buckets closed */
+    uint64_t late;                  /**< Readings after their minute bucket closed */
+} datamgr_stats_t;
+
+/**
+ * @brief Snapshot of one sensor
+ */
+typedef struct {
+    sensor_id_t id;                 /**< Sensor */
+    room_id_t room;                 /**< Room of the sensor */
+    sensor_ts_t ts;                 /**< Time of the latest reading, 0 if none */
+    sensor_value_t value;           /**< Latest reading */
+    uint32_t readings;              /**< Readings in the running average window */
+    double sum;                     /**< Sum of the window */
+    double average;                 /**< Average of the window, 0 if empty */
+} datamgr_sensor_t;
+
+/**
+ * @brief Load the room map and allocate the per-sensor state
+ *
+ * The per-room anomaly thresholds are read from ROOM_ANOMALY_FILE when
+ * it exists. A gateway built with a static room map (see phash.h) uses
+ * the compiled-in perfect hash when the map file has the same sensors,
+ * and the compiled-in map when there is no map file.
+ *
+ * @param map_file Path to the room map
+ * @param log_fd Log FIFO descriptor, or -1 to log nothing
+ * @return 0 on success, -1 on failure
+ */
+int datamgr_init(const char *map_file, int log_fd);
+
+/**
+ * @brief Process readings in the order they were taken
+ *
+ * Called by the data manager thread for every batch read from the
+ * shared buffer; can also be called directly when no thread is running.
+ *
+ * @param data Readings
+ * @param count Number of readings
+ */
+void datamgr_process(const sensor_data_t *data, size_t count);
+
+/**
+ * @brief Run the data manager as a reader of the shared buffer
+ *
+ * The thread stops once the buffer is closed and fully read.
+ *
+ * @param buffer Shared buffer
+ * @return 0 on success, -1 on failure
+ */
+int datamgr_start(sbuffer_t *buffer);
+
+/**
+ * @brief Wait for the data manager thread to stop
+ */
+void datamgr_wait(void);
+
+/**
+ * @brief Read the data manager counters (any thread)
+ *
+ * @param stats Receives the counters
+ */
+void datamgr_get_stats(datamgr_stats_t *stats);
+
+/**
+ * @brief Read the latest reading and running average of a sensor (any thread)
+ *
+ * The average is over the readings in the window, even before it holds
+ * RUN_AVG_LENGTH of them.
+ *
+ * @param id Sensor id
+ * @param sensor Receives the snapshot
+ * @return 0 on success, -1 for a sensor that is not in the map
+ */
+int datamgr_get_sensor(sensor_id_t id, datamgr_sensor_t *sensor);
+
+/**
+ * @brief Copy the rollups of a sensor whose bucket starts within a time range (any thread)
+ *
+ * Returns the closed buckets still in memory, oldest first, followed by
+ * the open bucket.
+ *
+ * @param id Sensor id
+ * @param resolution Resolution
+ * @param from Earliest bucket start, inclusive
+ * @param to Latest bucket start, inclusive
+ * @param out Receives the rollups
+ * @param max Capacity of out
+ * @return Number of rollups copied, 0 for a sensor that is not in the map
+ */
+size_t datamgr_get_rollups(sensor_id_t id, rollup_resolution_t resolution, sensor_ts_t from, sensor_ts_t to,
+                           rollup_t *out, size_t max);
+
+/**
+ * @brief Free the per-sensor state
+ */
+void datamgr_free(void);
+
+#endif
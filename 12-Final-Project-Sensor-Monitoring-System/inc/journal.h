@@ -0,0 +1,111 @@
+/**
+ * @file journal.h
+ * @brief Interface for the write-ahead journal of received readings
+ *
+ * The connection manager appends every reading it publishes to the
+ * journal, and the storage manager checkpoints the readings it has
+ * committed, in the same order. Every reading has a position, its index
+ * in that order, and the checkpoint is the position of the first reading
+ * not committed yet.
+ *
+ * The journal is a directory of segment files, each holding a 16-byte
+ * header and the readings from the position in its name on, one
+ * sensor_data_t each, and a checkpoint file holding the checkpoint. A
+ * segment whose readings are all below the checkpoint is deleted.
+ *
+ * After a crash, journal_open() finds the readings from the checkpoint
+ * to the end of the last segment, without reading any other, and
+ * journal_recover() hands them out once. Appending starts a new segment.
+ * After a clean shutdown, every reading is committed and journal_close()
+ * deletes the files.
+ *
+ * journal_add() and journal_commit() must be called from one thread,
+ * journal_recover() and journal_checkpoint() from one other thread.
+ * Without journal_open(), every function does nothing.
+ */
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+/**
+ * @brief Journal counters
+ */
+typedef struct {
+    uint64_t readings;              /**< Readings appended */
+    uint64_t writes;                /**< Write calls */
+    uint64_t syncs;                 /**< Syncs to disk */
+    uint64_t recovered;             /**< Readings recovered after a crash */
+    uint64_t recovery_ns;           /**< Time from opening to the last recovered reading */
+} journal_stats_t;
+
+/**
+ * @brief Open the journal and find the readings left uncommitted
+ *
+ * Also starts the thread that syncs the journal every JOURNAL_SYNC_MS.
+ *
+ * @param dir Journal directory, created if missing
+ * @param log_fd Log FIFO write end
+ * @return 0 on success, -1 on failure
+ */
+int journal_open(const char *dir, int log_fd);
+
+/**
+ * @brief Number of readings left uncommitted by the last run
+ */
+uint64_t journal_backlog(void);
+
+/**
+ * @brief Stage one reading (appending thread)
+ *
+ * @param reading Reading, in the order it is published
+ */
+void journal_add(const sensor_data_t *reading);
+
+/**
+ * @brief Write the staged readings with one call (appending thread)
+ *
+ * A reading is safe from a crash of the gateway once written, and from
+ * a crash of the machine once synced. If a write fails, the journal is
+ * turned off and the failure logged.
+ */
+void journal_commit(void);
+
+/**
+ * @brief Take the next readings left uncommitted (checkpointing thread)
+ *
+ * @param out Receives the readings, in position order
+ * @param max Capacity of out
+ * @return Number of readings, 0 once all were taken
+ */
+size_t journal_recover(sensor_data_t *out, size_t max);
+
+/**
+ * @brief Move the checkpoint past the next readings (checkpointing thread)
+ *
+ * Called once readings are committed, or lost for good, in position order,
+ * recovered readings first.
+ *
+ * @param count Number of readings
+ */
+void journal_checkpoint(size_t count);
+
+/**
+ * @brief Read the journal counters (any thread)
+ *
+ * @param stats Receives the counters
+ */
+void journal_get_stats(journal_stats_t *stats);
+
+/**
+ * @brief Write the staged readings and close the journal
+ *
+ * Deletes the journal files if every reading was committed, and keeps
+ * them for the next run otherwise. The other threads must be stopped.
+ */
+void journal_close(void);
+
+#endif
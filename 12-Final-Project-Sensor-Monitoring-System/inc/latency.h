@@ -0,0 +1,112 @@
+/**
+ * @file latency.h
+ * @brief Interface for latency histograms
+ *
+ * A histogram counts latencies in nanoseconds in log-linear buckets:
+ * every power of two is split into LATENCY_SUB_BUCKETS buckets, so a
+ * percentile is accurate to about 6% from one nanosecond to hours,
+ * in a fixed array and without allocation. Recording is a few
+ * instructions. Each histogram has a single writer and can be read
+ * from any thread while it is being written.
+ *
+ * The stage histograms follow every reading through the gateway. The
+ * receive and total stages compare the timestamp in the packet with the
+ * wall clock, so they need the clocks of the sensor nodes in sync with
+ * the gateway's.
+ * The others use the monotonic clock: the connection manager stamps a
+ * reading when it is received, the shared buffer when it is published,
+ * and the data and storage managers record the time to their own step.
+ * Readings received in one reactor wake-up share their stamps, so runs of
+ * them are recorded at once.
+ */
+
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+/**
+ * @brief Latency histogram
+ */
+typedef struct {
+    _Atomic uint64_t counts[LATENCY_BUCKETS];
+    _Atomic uint64_t total;         /**< Latencies recorded */
+    _Atomic uint64_t max;           /**< Largest latency recorded */
+} latency_hist_t;
+
+/**
+ * @brief Pipeline stages timed for every reading
+ */
+typedef enum {
+    LATENCY_STAGE_RECEIVE,          /**< Sensor timestamp to receive (connection manager) */
+    LATENCY_STAGE_INSERT,           /**< Receive to publication in the shared buffer (data manager) */
+    LATENCY_STAGE_PROCESS,          /**< Publication to processing by the data manager (data manager) */
+    LATENCY_STAGE_COMMIT,           /**< Publication to commit by the storage manager (storage manager) */
+    LATENCY_STAGE_GATEWAY,          /**< Receive to commit (storage manager) */
+    LATENCY_STAGE_TOTAL,            /**< Sensor timestamp to commit (storage manager) */
+    LATENCY_STAGES
+} latency_stage_t;
+
+/**
+ * @brief Record a latency (single writer)
+ *
+ * @param hist Histogram
+ * @param ns Latency in nanoseconds; negative values count as 0
+ */
+void latency_record(latency_hist_t *hist, int64_t ns);
+
+/**
+ * @brief Record the same latency several times (single writer)
+ *
+ * @param hist Histogram
+ * @param ns Latency in nanoseconds; negative values count as 0
+ * @param count Number of times
+ */
+void latency_record_n(latency_hist_t *hist, int64_t ns, uint64_t count);
+
+/**
+ * @brief Get a percentile of the recorded latencies (any thread)
+ *
+ * @param hist Histogram
+ * @param percentile Between 0 and 100
+ * @return Upper bound of the bucket holding the percentile, in
+ *         nanoseconds, capped at the maximum; 0 if nothing was recorded
+ */
+uint64_t latency_percentile(const latency_hist_t *hist, double percentile);
+
+/**
+ * @brief Get the latencies recorded since the last call (one reader)
+ *
+ * @param hist Histogram
+ * @param last Copy of hist at the last call, all zero the first time; updated
+ * @param out Receives the latencies recorded in between; its maximum is
+ *            the upper bound of the highest bucket used
+ */
+void latency_interval(const latency_hist_t *hist, latency_hist_t *last, latency_hist_t *out);
+
+/**
+ * @brief Histogram of a pipeline stage
+ *
+ * @param stage Stage
+ * @return Histogram, written by the thread named in latency_stage_t
+ */
+latency_hist_t *latency_stage(latency_stage_t stage);
+
+/**
+ * @brief Short name of a pipeline stage
+ */
+const char *latency_stage_name(latency_stage_t stage);
+
+/**
+ * @brief Current time as sensor timestamps count it
+ *
+ * @return Nanoseconds since the Unix epoch
+ */
+int64_t latency_now(void);
+
+#endif
@@ -1,6 +1,17 @@
 /**
  * @file log.h
  * @brief Interface for the logging system
+ *
+ * Log events travel to the log process as binary records: the address
+ * of the format string, a timestamp and the raw arguments. Only the log
+ * process turns them into text. This works because the log process is
+ * forked from the gateway, so a string literal has the same address on
+ * both sides.
+ *
+ * Two transports are available: a FIFO (log_start() and
+ * log_open_fifo()) and a shared-memory ring (log_start_shm() and
+ * log_open_shm()). Both hand out a descriptor for log_event() and
+ * log_close().
  */
 
 #ifndef _LOG_H_
@@ -10,11 +21,12 @@
 
 /**
  * @brief Start the log process
- * 
+ *
  * This is function creates a child process using fork that handles
- * logging for the system. The child process reads log messages from 
- * a FIFO and write them to a log file
- * 
+ * logging for the system. The child process reads log records from
+ * a FIFO, formats them and writes them to a log file in large writes,
+ * syncing it every LOG_SYNC_MS while events arrive.
+ *
  * @param fifo_path Path to the FIFO for log messages
  * @param log_file Path to the log file
  * @return Process ID of the child process, or -1 on failure
@@ -23,13 +35,82 @@
 
 /**
  * @brief Open the log FIFO for writing
- * 
+ *
  * This is fucntion opens the log FIFO for writing and create it
- * if it doesn't exist already.
- * 
+ * if it doesn't exist already. The FIFO is enlarged to LOG_PIPE_SIZE.
+ *
  * @param fifo_path Path to the FIFO for log messages
  * @return File descriptor for the FIFO, or -1 on failure
  */
 int log_open_fifo(const char *fifo_path);
 
+/**
+ * @brief Start the log process on a shared-memory ring
+ *
+ * The ring of LOG_SHM_SIZE bytes is shared with the child created by
+ * fork. Threads reserve space in it without locks and write their
+ * records in place, with no system call. The log process is woken
+ * through an eventfd only when it has gone to sleep on an empty ring.
+ * Only one ring can be started per process.
+ *
+ * @param log_file Path to the log file
+ * @return Process ID of the child process, or -1 on failure
+ */
+pid_t log_start_shm(const char *log_file);
+
+/**
+ * @brief Get the descriptor of the ring started by log_start_shm()
+ *
+ * @return Descriptor for log_event(), or -1 if no ring was started
+ */
+int log_open_shm(void);
+
+/**
+ * @brief Close a descriptor from log_open_fifo() or log_open_shm()
+ *
+ * The log process stops once every FIFO writer is closed, or once the
+ * ring is closed, after writing the events it has received. No thread
+ * may log to the descriptor anymore.
+ *
+ * @param fd Descriptor to close
+ * @return 0 on success, -1 on failure
+ */
+int log_close(int fd);
+
+/**
+ * @brief Send a log event to the log process
+ *
+ * The format must be a string literal of the program that started the
+ * log process. The arguments are copied into a binary record, strings
+ * included. The record is written to the FIFO in a single write of at
+ * most PIPE_BUF bytes, or copied into the ring in one piece, so events
+ * sent by different threads never interleave. Inside log_batch_begin()
+ * and log_batch_end() the record is held back instead and sent with the
+ * others of the batch. The log process adds a sequence number and the
+ * time of the event.
+ *
+ * Formats using '*' widths, %n or long double arguments are formatted
+ * by the caller instead.
+ *
+ * @param fd Descriptor returned by log_open_fifo() or log_open_shm()
+ * @param format printf-style format of the message
+ * @return 0 on success, -1 on failure
+ */
+int log_event(int fd, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * @brief Hold back the log events of the calling thread
+ *
+ * Events are collected in a per-thread batch and sent together, as
+ * many records at a time as fit in PIPE_BUF bytes.
+ */
+void log_batch_begin(void);
+
+/**
+ * @brief Write the held log events of the calling thread and stop holding
+ *
+ * @return 0 on success, -1 if some events were lost
+ */
+int log_batch_end(void);
+
 #endif
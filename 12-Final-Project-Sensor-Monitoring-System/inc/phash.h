@@ -0,0 +1,99 @@
+/**
+ * @file phash.h
+ * @brief Minimal perfect hash of sensor ids
+ *
+ * A minimal perfect hash maps each of n known sensor ids to its own
+ * index in 0 to n-1, with no collisions. It uses hash and displace: a
+ * first hash puts every id in one of a few buckets, and each bucket
+ * stores a displacement that was searched at build time so the second
+ * hash of its ids lands on free indexes. A lookup reads one
+ * displacement and one key, and never probes.
+ *
+ * The table is either built at start-up with phash_build(), or generated
+ * as C source from a fixed room map by the phash_gen tool and compiled
+ * in (make STATIC_MAP=<map file>), which defines phash_static_map.
+ */
+
+#ifndef _PHASH_H_
+#define _PHASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+#define PHASH_NONE UINT32_MAX       /**< Lookup result for an unknown id */
+
+/**
+ * @brief Minimal perfect hash of a set of sensor ids
+ */
+typedef struct {
+    uint32_t seed;                  /**< Seed of the first hash */
+    uint32_t mask;                  /**< Buckets - 1, a power of two minus one */
+    uint32_t size;                  /**< Number of ids, and of indexes */
+    const uint32_t *displace;       /**< Displacement of each bucket */
+    const sensor_id_t *keys;        /**< Id at each index */
+} phash_t;
+
+/**
+ * @brief Perfect hash and room of every sensor of a fixed room map
+ */
+typedef struct {
+    phash_t hash;                   /**< Index of every sensor */
+    const room_id_t *rooms;         /**< Room of the sensor at each index */
+} phash_map_t;
+
+/**
+ * @brief Room map compiled into the program, if any
+ *
+ * Weak, so its address is NULL unless a generated table is linked in.
+ */
+extern const phash_map_t phash_static_map __attribute__((weak));
+
+/**
+ * @brief Finalizer of MurmurHash3, mixes every input bit into every output bit
+ */
+static inline uint32_t phash_mix(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x85ebca6bu;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35u;
+    x ^= x >> 16;
+    return x;
+}
+
+/**
+ * @brief Index of a sensor id
+ *
+ * @param ph Perfect hash
+ * @param key Sensor id
+ * @return Index in 0 to size-1, or PHASH_NONE if the id is not in the set
+ */
+static inline uint32_t phash_lookup(const phash_t *ph, sensor_id_t key) {
+    uint32_t h = phash_mix((uint32_t)key ^ ph->seed);
+    uint32_t d = ph->displace[h & ph->mask];
+
+    // Map the second hash to 0..size-1 with a multiply instead of a modulo
+    uint32_t index = (uint32_t)(((uint64_t)phash_mix(h ^ d) * ph->size) >> 32);
+    return ph->size > 0 && ph->keys[index] == key ? index : PHASH_NONE;
+}
+
+/**
+ * @brief Build the perfect hash of a set of distinct sensor ids
+ *
+ * The index of every id is given by phash_lookup() afterwards.
+ *
+ * @param ph Receives the perfect hash, which owns its arrays
+ * @param keys Sensor ids, without duplicates
+ * @param count Number of ids
+ * @return 0 on success, -1 on failure (duplicate ids or no memory)
+ */
+int phash_build(phash_t *ph, const sensor_id_t *keys, size_t count);
+
+/**
+ * @brief Free the arrays of a perfect hash made by phash_build()
+ *
+ * @param ph Perfect hash
+ */
+void phash_free(phash_t *ph);
+
+#endif
@@ -0,0 +1,73 @@
+/**
+ * @file querysrv.h
+ * @brief Interface for the query service
+ *
+ * The query service answers questions about the current state of the
+ * gateway on a Unix stream socket, from the in-memory state of the data
+ * manager. It runs its own thread with a small epoll loop and reads the
+ * per-sensor state through sequence counters, so a query never blocks
+ * ingestion and never touches the database.
+ *
+ * A request is one line of text. The answer is zero or more lines,
+ * followed by an empty line:
+ *
+ * - "latest <sensor>": "<sensor> <room> <timestamp> <value>"
+ * - "average <sensor>": "<sensor> <room> <average> <readings>", the
+ *   running average over the readings in the window
+ * - "rollup <sensor> minute|hour|day [from [to]]": one
+ *   "<start> <count> <min> <max> <average>" line per bucket still in
+ *   memory whose start is within the range, oldest first
+ * - "latency": one "<stage> <readings> <p50> <p99> <p99.9> <max>" line
+ *   per pipeline stage, in nanoseconds, since the gateway started
+ *
+ * Timestamps are in nanoseconds since the Unix epoch. A request that
+ * cannot be answered gets "error <reason>".
+ */
+
+#ifndef _QUERYSRV_H_
+#define _QUERYSRV_H_
+
+#include <stdint.h>
+#include "latency.h"
+
+/**
+ * @brief Query service counters
+ */
+typedef struct {
+    uint64_t connections;           /**< Clients accepted */
+    uint64_t queries;               /**< Requests answered */
+    uint64_t errors;                /**< Requests answered with an error */
+} querysrv_stats_t;
+
+/**
+ * @brief Listen on a Unix socket and serve queries in a new thread
+ *
+ * A stale socket file at the path is replaced. The data manager must be
+ * initialized.
+ *
+ * @param path Socket path
+ * @param log_fd Log descriptor
+ * @return 0 on success, -1 on failure
+ */
+int querysrv_start(const char *path, int log_fd);
+
+/**
+ * @brief Stop the service, close every client and remove the socket
+ */
+void querysrv_stop(void);
+
+/**
+ * @brief Read the query service counters (any thread)
+ *
+ * @param stats Receives the counters
+ */
+void querysrv_get_stats(querysrv_stats_t *stats);
+
+/**
+ * @brief Time from reading a request to sending its answer
+ *
+ * @return Histogram written by the service, readable from any thread
+ */
+const latency_hist_t *querysrv_get_latency(void);
+
+#endif
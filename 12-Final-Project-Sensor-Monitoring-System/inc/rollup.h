@@ -0,0 +1,139 @@
+/**
+ * @file rollup.h
+ * @brief Interface for per-sensor rollups
+ *
+ * A rollup holds the count, minimum, maximum and sum of the readings of
+ * one sensor in a bucket of one minute, one hour or one day, aligned on
+ * the Unix epoch. Every sensor has one open bucket per resolution, and a
+ * ring of its last closed buckets. A reading updates the three open
+ * buckets in constant time.
+ *
+ * A bucket closes when a reading for a later bucket arrives, or when
+ * rollup_expire() finds it ROLLUP_GRACE_MS past its end. Once a bucket
+ * is closed, readings for it or for an earlier bucket are late and left
+ * out. Closed buckets are passed to a callback, which hands them to
+ * storage.
+ *
+ * Sensors are known by the dense slot the data manager gives them. All
+ * functions must be called from one thread, except rollup_history(),
+ * which takes a consistent snapshot of a sensor from any thread. The
+ * buckets of a slot are guarded by a sequence counter that the data
+ * manager shares with the rest of its per-sensor state, so a reading
+ * costs one counter update.
+ */
+
+#ifndef _ROLLUP_H_
+#define _ROLLUP_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+#include "seqlock.h"
+
+/**
+ * @brief Width of a bucket
+ */
+typedef enum {
+    ROLLUP_MINUTE,
+    ROLLUP_HOUR,
+    ROLLUP_DAY,
+    ROLLUP_RESOLUTIONS              /**< Number of resolutions */
+} rollup_resolution_t;
+
+/**
+ * @brief Rollup of one sensor over one bucket
+ *
+ * Also the record format of rollups on disk, in host byte order.
+ */
+typedef struct {
+    sensor_ts_t start;              /**< Start of the bucket */
+    sensor_value_t min;             /**< Lowest reading */
+    sensor_value_t max;             /**< Highest reading */
+    double sum;                     /**< Sum of the readings */
+    uint32_t count;                 /**< Readings in the bucket */
+    sensor_id_t sensor_id;          /**< Sensor */
+    uint8_t resolution;             /**< rollup_resolution_t */
+    uint8_t reserved;
+} rollup_t;
+
+/**
+ * @brief Called for every bucket that closes
+ */
+typedef void (*rollup_emit_t)(const rollup_t *rollup);
+
+/**
+ * @brief Width of the buckets of a resolution
+ *
+ * @param resolution Resolution
+ * @return Width in nanoseconds
+ */
+static inline sensor_ts_t rollup_width(int resolution) {
+    static const sensor_ts_t widths[ROLLUP_RESOLUTIONS] = {
+        60LL * 1000000000LL, 3600LL * 1000000000LL, 86400LL * 1000000000LL
+    };
+    return widths[resolution];
+}
+
+/**
+ * @brief Allocate the buckets and rings of every sensor
+ *
+ * @param sensors Number of sensor slots
+ * @param emit Called for every bucket that closes
+ * @param seqs Sequence counter of every slot
+ * @return 0 on success, -1 on failure
+ */
+int rollup_init(size_t sensors, rollup_emit_t emit, seqlock_t *seqs);
+
+/**
+ * @brief Add a reading to the open buckets of a sensor
+ *
+ * Must be called between seqlock_write_begin() and seqlock_write_end()
+ * on the sequence counter of the slot.
+ *
+ * @param slot Slot of the sensor
+ * @param id Sensor id, stored in its rollups
+ * @param ts Time the reading was taken
+ * @param value Reading
+ * @return true if the reading was late for its minute bucket
+ */
+bool rollup_add(uint32_t slot, sensor_id_t id, sensor_ts_t ts, sensor_value_t value);
+
+/**
+ * @brief Close the buckets that ended ROLLUP_GRACE_MS or more before now
+ *
+ * @param now Current time, as sensor timestamps count it
+ * @return Number of buckets closed
+ */
+size_t rollup_expire(sensor_ts_t now);
+
+/**
+ * @brief Close every open bucket, when no more readings will come
+ *
+ * @return Number of buckets closed
+ */
+size_t rollup_close_all(void);
+
+/**
+ * @brief Copy the buckets of a sensor that start within a time range (any thread)
+ *
+ * Closed buckets still in the ring come first, oldest first, followed
+ * by the open bucket if it matches. Never blocks the writer.
+ *
+ * @param slot Slot of the sensor
+ * @param resolution Resolution
+ * @param from Earliest bucket start, inclusive
+ * @param to Latest bucket start, inclusive
+ * @param out Receives the buckets
+ * @param max Capacity of out
+ * @return Number of buckets copied
+ */
+size_t rollup_history(uint32_t slot, rollup_resolution_t resolution, sensor_ts_t from, sensor_ts_t to,
+                      rollup_t *out, size_t max);
+
+/**
+ * @brief Free the buckets and rings
+ */
+void rollup_free(void);
+
+#endif
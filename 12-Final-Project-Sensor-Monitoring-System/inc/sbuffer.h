@@ -0,0 +1,209 @@
+/**
+ * @file sbuffer.h
+ * @brief Interface for the shared buffer between the gateway threads
+ *
+ * The buffer is a ring of readings with one writer (the connection
+ * manager) and one read cursor per consumer (data manager and storage
+ * manager). Every consumer sees every reading, in order. A slot is only
+ * reused once all consumers have released it. Readings are written and
+ * read in place, and no mutex is taken on either side.
+ *
+ * A thread that has to wait spins briefly, then sleeps on a futex. The
+ * other side only makes a wake-up system call when a thread is asleep,
+ * and at most once per published or released batch.
+ */
+
+#ifndef _SBUFFER_H_
+#define _SBUFFER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+#define SBUFFER_SUCCESS 0           /**< Operation succeeded */
+#define SBUFFER_FAILURE -1          /**< Operation failed */
+#define SBUFFER_NO_DATA 1           /**< Buffer closed and fully read */
+#define SBUFFER_TIMEOUT 2           /**< Nothing published before the timeout */
+
+/**
+ * @brief Consumers of the shared buffer, each with its own read cursor
+ */
+typedef enum {
+    SBUFFER_READER_DATAMGR,         /**< Data manager thread */
+    SBUFFER_READER_STORAGE,         /**< Storage manager thread */
+    SBUFFER_READERS                 /**< Number of readers */
+} sbuffer_reader_t;
+
+typedef struct sbuffer sbuffer_t;
+
+/**
+ * @brief Snapshot of the shared buffer counters
+ */
+typedef struct {
+    uint64_t capacity;                      /**< Number of slots */
+    uint64_t published;                     /**< Readings published so far */
+    uint64_t occupancy;                     /**< Slots not yet released by every reader */
+    uint64_t lag[SBUFFER_READERS];          /**< Readings published but not read, per reader */
+    uint64_t reader_sleeps[SBUFFER_READERS];/**< Times a reader slept waiting for data */
+    uint64_t writer_sleeps;                 /**< Times the writer slept waiting for space */
+    uint64_t data_wakeups;                  /**< Wake-up calls made by the writer */
+    uint64_t space_wakeups;                 /**< Wake-up calls made by the readers */
+} sbuffer_stats_t;
+
+/**
+ * @brief Allocate and initialize a shared buffer
+ *
+ * @param buffer Receives the new buffer
+ * @param capacity Number of slots, must be a power of two
+ * @return SBUFFER_SUCCESS, or SBUFFER_FAILURE on failure
+ */
+int sbuffer_init(sbuffer_t **buffer, size_t capacity);
+
+/**
+ * @brief Free a shared buffer and set the pointer to NULL
+ *
+ * No thread may use the buffer anymore.
+ *
+ * @param buffer Buffer to free
+ * @return SBUFFER_SUCCESS, or SBUFFER_FAILURE on failure
+ */
+int sbuffer_free(sbuffer_t **buffer);
+
+/**
+ * @brief Claim the next free slot (writer only)
+ *
+ * Waits until every reader has released the slot. The reading is
+ * written directly into the slot and becomes visible to the readers
+ * with sbuffer_publish(). Several slots may be claimed before
+ * publishing them together, but a slot must be filled in before the
+ * next one is claimed.
+ *
+ * @param buffer Shared buffer
+ * @return Slot to fill in
+ */
+sensor_data_t *sbuffer_claim(sbuffer_t *buffer);
+
+/**
+ * @brief Make all claimed slots visible to the readers (writer only)
+ *
+ * Sleeping readers are woken once, however many slots are published.
+ * The insert_ns of every slot is set from its received stamp.
+ *
+ * @param buffer Shared buffer
+ */
+void sbuffer_publish(sbuffer_t *buffer);
+
+/**
+ * @brief Copy a reading into the buffer and publish it (writer only)
+ *
+ * @param buffer Shared buffer
+ * @param data Reading to insert
+ * @return SBUFFER_SUCCESS, or SBUFFER_FAILURE on failure
+ */
+int sbuffer_insert(sbuffer_t *buffer, const sensor_data_t *data);
+
+/**
+ * @brief Mark the end of the stream (writer only)
+ *
+ * Readers get SBUFFER_NO_DATA once they have read every published
+ * reading.
+ *
+ * @param buffer Shared buffer
+ */
+void sbuffer_close(sbuffer_t *buffer);
+
+/**
+ * @brief Get the next reading of a reader without consuming it
+ *
+ * Waits until a reading is published or the buffer is closed. The
+ * reading stays valid until sbuffer_release() is called.
+ *
+ * @param buffer Shared buffer
+ * @param reader Reader
+ * @param data Receives a pointer to the reading in the buffer
+ * @return SBUFFER_SUCCESS, SBUFFER_NO_DATA if closed and fully read,
+ *         or SBUFFER_FAILURE on failure
+ */
+int sbuffer_peek(sbuffer_t *buffer, sbuffer_reader_t reader, const sensor_data_t **data);
+
+/**
+ * @brief Release the reading returned by sbuffer_peek()
+ *
+ * @param buffer Shared buffer
+ * @param reader Reader
+ */
+void sbuffer_release(sbuffer_t *buffer, sbuffer_reader_t reader);
+
+/**
+ * @brief Get up to max contiguous readings of a reader without consuming them
+ *
+ * Waits until at least one reading is published or the buffer is
+ * closed. Fewer than max readings are returned when fewer are published
+ * or when the batch reaches the end of the ring. The readings stay valid
+ * until they are released with sbuffer_release_batch().
+ *
+ * @param buffer Shared buffer
+ * @param reader Reader
+ * @param data Receives a pointer to the first reading in the buffer
+ * @param max Maximum number of readings
+ * @param count Receives the number of readings
+ * @return SBUFFER_SUCCESS, SBUFFER_NO_DATA if closed and fully read,
+ *         or SBUFFER_FAILURE on failure
+ */
+int sbuffer_peek_batch(sbuffer_t *buffer, sbuffer_reader_t reader,
+                       const sensor_data_t **data, size_t max, size_t *count);
+
+/**
+ * @brief Like sbuffer_peek_batch(), but wait at most timeout_ms
+ *
+ * Lets a reader with time-based work, such as committing a transaction,
+ * wait for readings and for its own deadline at once.
+ *
+ * @param buffer Shared buffer
+ * @param reader Reader
+ * @param data Receives a pointer to the first reading in the buffer
+ * @param max Maximum number of readings
+ * @param count Receives the number of readings
+ * @param timeout_ms Longest wait in milliseconds, -1 to wait forever
+ * @return SBUFFER_SUCCESS, SBUFFER_TIMEOUT if nothing was published in
+ *         time, SBUFFER_NO_DATA if closed and fully read, or
+ *         SBUFFER_FAILURE on failure
+ */
+int sbuffer_peek_batch_timed(sbuffer_t *buffer, sbuffer_reader_t reader,
+                             const sensor_data_t **data, size_t max, size_t *count,
+                             int timeout_ms);
+
+/**
+ * @brief Release readings returned by sbuffer_peek_batch()
+ *
+ * A writer waiting for space is woken once for the whole batch.
+ *
+ * @param buffer Shared buffer
+ * @param reader Reader
+ * @param count Number of readings to release
+ */
+void sbuffer_release_batch(sbuffer_t *buffer, sbuffer_reader_t reader, size_t count);
+
+/**
+ * @brief Copy the next reading of a reader and release it
+ *
+ * @param buffer Shared buffer
+ * @param reader Reader
+ * @param data Receives the reading
+ * @return SBUFFER_SUCCESS, SBUFFER_NO_DATA if closed and fully read,
+ *         or SBUFFER_FAILURE on failure
+ */
+int sbuffer_remove(sbuffer_t *buffer, sbuffer_reader_t reader, sensor_data_t *data);
+
+/**
+ * @brief Read the buffer counters
+ *
+ * Can be called from any thread; the values are read without
+ * stopping the writer or the readers.
+ *
+ * @param buffer Shared buffer
+ * @param stats Receives the counters
+ */
+void sbuffer_get_stats(sbuffer_t *buffer, sbuffer_stats_t *stats);
+
+#endif
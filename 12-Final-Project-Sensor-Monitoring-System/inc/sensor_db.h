@@ -0,0 +1,25 @@
+/**
+ * @file sensor_db.h
+ * @brief Interface for the SQLite storage backend
+ *
+ * Readings are inserted into the TABLE_NAME table with a prepared
+ * statement, and each batch of the storage manager is one transaction.
+ * Rollups go into the ROLLUP_TABLE_NAME table in the same transaction.
+ * The database runs in WAL mode with synchronous=FULL, so a commit is
+ * durable once it returns.
+ */
+
+#ifndef _SENSOR_DB_H_
+#define _SENSOR_DB_H_
+
+#include "storagemgr.h"
+
+/**
+ * @brief SQLite backend, selected with the name "sqlite"
+ *
+ * Opening tries DB_CONNECT_ATTEMPTS times, one second apart, and logs
+ * the outcome. The tables are created if they do not exist.
+ */
+extern const storage_backend_t sensor_db_backend;
+
+#endif
@@ -0,0 +1,76 @@
+/**
+ * @file seqlock.h
+ * @brief Sequence counters for lock-free snapshot reads
+ *
+ * A sequence counter guards data that has a single writer. The writer
+ * makes the counter odd while it updates the data, and even again when
+ * it is done, so it never waits. A reader copies the data and retries
+ * if the counter was odd or changed meanwhile. Readers never write
+ * shared memory, so they cannot slow the writer down beyond sharing
+ * its cache lines.
+ */
+
+#ifndef _SEQLOCK_H_
+#define _SEQLOCK_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sched.h>
+
+#define SEQLOCK_SPINS 64    /**< Spins on an odd counter before a reader yields */
+
+typedef _Atomic uint32_t seqlock_t;
+
+/**
+ * @brief Start an update (single writer)
+ *
+ * @param seq Sequence counter
+ */
+static inline void seqlock_write_begin(seqlock_t *seq) {
+    atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+/**
+ * @brief End an update (single writer)
+ *
+ * @param seq Sequence counter
+ */
+static inline void seqlock_write_end(seqlock_t *seq) {
+    atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1, memory_order_release);
+}
+
+/**
+ * @brief Start a read, waiting while an update is in progress
+ *
+ * A reader that keeps finding the counter odd yields, in case the
+ * writer was preempted in the middle of an update.
+ *
+ * @param seq Sequence counter
+ * @return Value to pass to seqlock_read_retry()
+ */
+static inline uint32_t seqlock_read_begin(const seqlock_t *seq) {
+    uint32_t start;
+
+    for (int spins = 0; (start = atomic_load_explicit(seq, memory_order_acquire)) & 1; spins++) {
+        if (spins >= SEQLOCK_SPINS) {
+            sched_yield();
+        }
+    }
+    return start;
+}
+
+/**
+ * @brief Check whether the data read since seqlock_read_begin() is torn
+ *
+ * @param seq Sequence counter
+ * @param start Value returned by seqlock_read_begin()
+ * @return true if the read must be retried
+ */
+static inline bool seqlock_read_retry(const seqlock_t *seq, uint32_t start) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(seq, memory_order_relaxed) != start;
+}
+
+#endif
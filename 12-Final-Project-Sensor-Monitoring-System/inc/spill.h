@@ -0,0 +1,75 @@
+/**
+ * @file spill.h
+ * @brief Interface for the storage spill file
+ *
+ * The spill file holds readings the storage backend could not take in
+ * time. It is append-only: readings are written at its end, one
+ * sensor_data_t record each in host byte order, and read back from its
+ * start in the same order. Once every reading has been read back, the
+ * file is truncated and starts over.
+ *
+ * One thread appends while another reads; appended readings become
+ * visible to the reader once spill_append() returns. spill_reset() must
+ * not run concurrently with spill_append().
+ */
+
+#ifndef _SPILL_H_
+#define _SPILL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+/**
+ * @brief Create the spill file, or empty it if it exists
+ *
+ * @param path Spill file path
+ * @return 0 on success, -1 on failure
+ */
+int spill_open(const char *path);
+
+/**
+ * @brief Append readings (writer)
+ *
+ * Either all readings are appended or none is.
+ *
+ * @param data Readings
+ * @param count Number of readings
+ * @return 0 on success, -1 on failure (the file is left as it was)
+ */
+int spill_append(const sensor_data_t *data, size_t count);
+
+/**
+ * @brief Read the next appended readings, in order (reader)
+ *
+ * @param out Receives the readings
+ * @param max Capacity of out
+ * @return Number of readings read, 0 when every appended reading was read
+ */
+size_t spill_read(sensor_data_t *out, size_t max);
+
+/**
+ * @brief Whether every appended reading has been read (reader)
+ */
+bool spill_drained(void);
+
+/**
+ * @brief Size of the file, in bytes (any thread)
+ */
+uint64_t spill_size(void);
+
+/**
+ * @brief Truncate the file so it starts over (reader)
+ *
+ * Readings not read yet are dropped, so this is normally called once
+ * spill_drained() holds.
+ */
+void spill_reset(void);
+
+/**
+ * @brief Close and delete the spill file
+ */
+void spill_close(void);
+
+#endif
@@ -0,0 +1,39 @@
+/**
+ * @file stats.h
+ * @brief Counter and clock helpers shared by the gateway modules
+ *
+ * Modules keep their counters as _Atomic uint64_t that any thread may
+ * read with a relaxed load. Each counter has one writing thread, named
+ * next to its declaration, so an update needs no read-modify-write.
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * @brief Add to a counter (its writing thread only)
+ *
+ * @param counter Counter
+ * @param value Amount to add
+ */
+static inline void stats_count(_Atomic uint64_t *counter, uint64_t value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+                          memory_order_relaxed);
+}
+
+/**
+ * @brief Current time on the monotonic clock, for durations and stamps
+ *
+ * @return Nanoseconds, never 0
+ */
+static inline uint64_t stats_clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+#endif
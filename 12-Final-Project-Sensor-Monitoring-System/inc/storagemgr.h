@@ -0,0 +1,189 @@
+/**
+ * @file storagemgr.h
+ * @brief Interface for the storage manager and its backends
+ *
+ * The storage manager reads every reading from its own cursor in the
+ * shared buffer and hands it to a storage backend. Readings are passed
+ * on in batches and flushed once STORAGE_BATCH_SIZE are pending, or at
+ * the latest STORAGE_FLUSH_MS after the first of them. Rollups closed by
+ * the data manager are queued and written with the next flush.
+ *
+ * An intake thread copies readings out of the shared buffer into a queue
+ * as soon as they arrive, and a writer thread passes the queue on to the
+ * backend, so a slow backend never holds up the connection manager. Once
+ * the queue is STORAGE_HIGH_WATER readings behind, new readings are
+ * appended to the spill file SPILL_FILE instead, and the writer replays
+ * the file before taking from the queue again, keeping readings in order.
+ *
+ * Only a flush that succeeds moves the journal checkpoint past its
+ * readings. When the backend cannot take readings or fails a flush, it
+ * keeps the batch, and the writer tries again every STORAGE_RETRY_MS
+ * without taking new readings, which queue or spill meanwhile. If the
+ * backend still fails at shutdown, the writer stops passing readings on
+ * and the journal keeps them for the next run. Readings the journal
+ * recovered from a crash are passed on first.
+ */
+
+#ifndef _STORAGEMGR_H_
+#define _STORAGEMGR_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+#include "rollup.h"
+#include "sbuffer.h"
+
+/**
+ * @brief Storage backend
+ *
+ * Backends are only called from one thread at a time.
+ */
+typedef struct {
+    const char *name;               /**< Name used to select the backend */
+    const char *default_path;       /**< Database file or directory */
+
+    /**
+     * @brief Open the store, deleting its contents if clear is true
+     * @return 0 on success, -1 on failure
+     */
+    int (*open)(const char *path, bool clear, int log_fd);
+
+    /**
+     * @brief Add readings to the pending batch, in order, stopping at the
+     *        first one that cannot be added now
+     *
+     * position is the journal position of data[0], counted from the
+     * start of the run; the readings after it follow one by one. The
+     * storage manager passes the readings not added again later.
+     *
+     * @return Number of readings added from the start of data, -1 if none
+     *         could be
+     */
+    int (*insert)(const sensor_data_t *data, size_t count, uint64_t position);
+
+    /**
+     * @brief Add closed rollups to the pending batch; NULL if not stored
+     * @return 0 on success, -1 on failure
+     */
+    int (*insert_rollups)(const rollup_t *rollups, size_t count);
+
+    /**
+     * @brief Make the pending batch durable and visible to readers
+     * @return 0 on success, -1 on failure; the backend then keeps the
+     *         batch and writes it with a later flush
+     */
+    int (*flush)(void);
+
+    /**
+     * @brief Position of the oldest added reading a flush held back,
+     *        UINT64_MAX if none; NULL if every flush writes all readings
+     *
+     * The journal is not checkpointed past it.
+     */
+    uint64_t (*held)(void);
+
+    /**
+     * @brief Flush and close the store
+     * @return 0 if every reading added was written, -1 otherwise
+     */
+    int (*close)(void);
+} storage_backend_t;
+
+/**
+ * @brief Storage manager counters
+ */
+typedef struct {
+    uint64_t rows;                  /**< Readings flushed */
+    uint64_t flushes;               /**< Batches flushed (SQLite transactions) */
+    uint64_t failures;              /**< Inserts and flushes the backend failed, then retried */
+    uint64_t busy_ns;               /**< Time spent in the backend */
+    uint64_t flush_ns;              /**< Total time spent flushing */
+    uint64_t flush_max_ns;          /**< Longest flush */
+    uint64_t rollups;               /**< Rollups flushed */
+    uint64_t spills;                /**< Times the backend fell behind */
+    uint64_t spilled;               /**< Readings written to the spill file */
+    uint64_t replayed;              /**< Readings read back from the spill file */
+    uint64_t spill_peak;            /**< Largest size of the spill file, in bytes */
+} storagemgr_stats_t;
+
+/**
+ * @brief Find a backend by name
+ *
+ * @param name "sqlite" or "tsdb"
+ * @return The backend, or NULL if there is none with that name
+ */
+const storage_backend_t *storagemgr_find_backend(const char *name);
+
+/**
+ * @brief Open a backend
+ *
+ * @param backend Backend from storagemgr_find_backend()
+ * @param path Database file or directory, NULL for the backend default
+ * @param clear true to delete the stored readings
+ * @param log_fd Log FIFO descriptor, or -1 to log nothing
+ * @return 0 on success, -1 on failure
+ */
+int storagemgr_open(const storage_backend_t *backend, const char *path, bool clear, int log_fd);
+
+/**
+ * @brief Pass readings to the backend, flushing when the batch is full
+ *
+ * Called by the storage manager thread, which retries a failing backend
+ * until it succeeds or the gateway shuts down; can also be called
+ * directly when no thread is running, and then does not retry. After a
+ * failure that was not retried, no more readings are passed on.
+ *
+ * @param data Readings
+ * @param count Number of readings
+ * @return 0 on success, -1 if some readings were not passed on
+ */
+int storagemgr_insert(const sensor_data_t *data, size_t count);
+
+/**
+ * @brief Queue a closed rollup for the next flush (any thread)
+ *
+ * @param rollup Rollup, copied
+ * @return 0 on success, -1 if no backend is open or memory ran out
+ */
+int storagemgr_queue_rollup(const rollup_t *rollup);
+
+/**
+ * @brief Flush the pending readings and queued rollups, if any
+ *
+ * @return 0 on success, -1 on failure; the backend keeps the readings
+ *         for the next flush
+ */
+int storagemgr_flush(void);
+
+/**
+ * @brief Run the storage manager as a reader of the shared buffer
+ *
+ * Starts the intake and writer threads. The writer flushes the pending
+ * readings and stops once the buffer is closed and fully read, and the
+ * spill file, if any, replayed. While idle, it still flushes queued rollups
+ * every ROLLUP_SWEEP_MS.
+ *
+ * @param buffer Shared buffer
+ * @return 0 on success, -1 on failure
+ */
+int storagemgr_start(sbuffer_t *buffer);
+
+/**
+ * @brief Wait for the storage manager threads to stop
+ */
+void storagemgr_wait(void);
+
+/**
+ * @brief Read the storage manager counters (any thread)
+ *
+ * @param stats Receives the counters
+ */
+void storagemgr_get_stats(storagemgr_stats_t *stats);
+
+/**
+ * @brief Flush the pending readings and queued rollups, and close the backend
+ */
+void storagemgr_close(void);
+
+#endif
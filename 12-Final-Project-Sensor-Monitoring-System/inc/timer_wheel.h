@@ -0,0 +1,119 @@
+/**
+ * @file timer_wheel.h
+ * @brief Interface for the hierarchical timer wheel
+ *
+ * The wheel keeps deadlines measured in ticks. Level 0 has one slot per
+ * tick, and each higher level has slots TIMER_WHEEL_SLOTS times wider.
+ * When level 0 wraps around, a slot of the next level is moved down
+ * ("cascaded"). Adding and removing a timer is O(1), and each tick only
+ * looks at one slot.
+ *
+ * Timers are intrusive: the owner embeds a timer_node_t in its own
+ * structure, so the wheel never allocates memory.
+ */
+
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_WHEEL_BITS 6                              /**< log2 of the slots per level */
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)       /**< Slots per level */
+#define TIMER_WHEEL_LEVELS 4                            /**< Levels, 2^24 ticks in total */
+
+/**
+ * @brief Timer embedded in the structure that owns it
+ */
+typedef struct timer_node {
+    struct timer_node *next;        /**< Next timer in the slot, NULL when not scheduled */
+    struct timer_node *prev;        /**< Previous timer in the slot */
+    uint64_t expires;               /**< Tick at which the timer expires */
+} timer_node_t;
+
+/**
+ * @brief Timer wheel
+ */
+typedef struct {
+    uint64_t now;                   /**< Last tick processed */
+    size_t count;                   /**< Timers scheduled or expired but not removed */
+    timer_node_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; /**< List heads */
+} timer_wheel_t;
+
+/**
+ * @brief Initialize an empty wheel
+ *
+ * @param wheel Wheel to initialize
+ * @param now Current tick
+ */
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t now);
+
+/**
+ * @brief Initialize a list of timers, such as the list of expired timers
+ *
+ * @param list List head
+ */
+void timer_list_init(timer_node_t *list);
+
+/**
+ * @brief Check if a list of timers is empty
+ *
+ * @param list List head
+ * @return true if the list has no timers
+ */
+static inline bool timer_list_empty(const timer_node_t *list) {
+    return list->next == list;
+}
+
+/**
+ * @brief Schedule a timer
+ *
+ * A deadline that has already passed expires on the next tick. The timer
+ * must not be scheduled already.
+ *
+ * @param wheel Wheel
+ * @param timer Timer to schedule
+ * @param expires Tick at which the timer expires
+ */
+void timer_wheel_add(timer_wheel_t *wheel, timer_node_t *timer, uint64_t expires);
+
+/**
+ * @brief Remove a timer from the wheel or from a list of expired timers
+ *
+ * Does nothing if the timer is not scheduled.
+ *
+ * @param wheel Wheel
+ * @param timer Timer to remove
+ */
+void timer_wheel_del(timer_wheel_t *wheel, timer_node_t *timer);
+
+/**
+ * @brief Push back the deadline of a scheduled timer
+ *
+ * The timer stays in its slot. When that slot is reached, the wheel sees
+ * the new deadline and schedules the timer again instead of expiring it,
+ * so a deadline that is refreshed often costs one store per refresh.
+ * The new deadline must not be earlier than the old one.
+ *
+ * @param timer Scheduled timer
+ * @param expires New tick at which the timer expires
+ */
+static inline void timer_wheel_touch(timer_node_t *timer, uint64_t expires) {
+    timer->expires = expires;
+}
+
+/**
+ * @brief Process every tick up to now
+ *
+ * Expired timers are moved to the expired list in one batch. They stay
+ * on the list, and in the wheel's count, until the caller removes them
+ * with timer_wheel_del().
+ *
+ * @param wheel Wheel
+ * @param now Current tick
+ * @param expired Initialized list receiving the expired timers
+ */
+void timer_wheel_advance(timer_wheel_t *wheel, uint64_t now, timer_node_t *expired);
+
+#endif
@@ -0,0 +1,131 @@
+/**
+ * @file tsdb.h
+ * @brief Interface for the columnar time-series storage backend
+ *
+ * Readings are collected per sensor and appended as blocks to segment
+ * files of TSDB_SEGMENT_SIZE bytes, written through a shared memory
+ * mapping. A block holds the readings of one sensor, with all the
+ * timestamps first and all the values after them. Next to every
+ * segment, an index file lists each block with its sensor and time
+ * range, so a query reads the small index and only touches the pages
+ * of the blocks it needs. A flush syncs the segment, then the index.
+ *
+ * Closed rollups are appended as rollup_t records to one file per
+ * resolution and period of TSDB_ROLLUP_FILE_BUCKETS buckets, so a
+ * query reads only the files of its time range.
+ *
+ * A directory holds segments <n>.seg and indexes <n>.idx, numbered
+ * from 0, and rollup files <width>s-<period>.rlp, where width is the
+ * bucket width in seconds and period is the bucket start divided by
+ * the period length. All numbers are in host byte order.
+ */
+
+#ifndef _TSDB_H_
+#define _TSDB_H_
+
+#include <stdint.h>
+#include "storagemgr.h"
+
+#define TSDB_SEGMENT_MAGIC "TSDBSEG1"  /**< First bytes of a segment */
+#define TSDB_BLOCK_MAGIC 0x4B4C4254u   /**< First word of a block */
+#define TSDB_ALL_SENSORS -1            /**< tsdb_scan() sensor matching all sensors */
+#define TSDB_ROLLUP_FILE_BUCKETS 1440  /**< Buckets per rollup file: a day of minutes */
+
+/**
+ * @brief Header at the start of a segment
+ */
+typedef struct {
+    char magic[8];                  /**< TSDB_SEGMENT_MAGIC */
+    uint64_t size;                  /**< Size of the segment file */
+    uint64_t used;                  /**< Bytes in use, header included */
+    uint64_t blocks;                /**< Blocks written */
+    uint8_t reserved[32];
+} tsdb_segment_header_t;
+
+/**
+ * @brief Header of a block
+ *
+ * Followed by count timestamps (sensor_ts_t), then count values
+ * (sensor_value_t).
+ */
+typedef struct {
+    uint32_t magic;                 /**< TSDB_BLOCK_MAGIC */
+    uint16_t sensor_id;             /**< Sensor of every reading in the block */
+    uint16_t reserved;
+    uint32_t count;                 /**< Readings in the block */
+    uint32_t reserved2;
+    sensor_ts_t min_ts;             /**< Earliest timestamp */
+    sensor_ts_t max_ts;             /**< Latest timestamp */
+} tsdb_block_header_t;
+
+/**
+ * @brief Entry of the sparse index, one per block
+ */
+typedef struct {
+    uint16_t sensor_id;             /**< Sensor of the block */
+    uint16_t reserved;
+    uint32_t count;                 /**< Readings in the block */
+    uint64_t offset;                /**< Offset of the block in the segment */
+    sensor_ts_t min_ts;             /**< Earliest timestamp */
+    sensor_ts_t max_ts;             /**< Latest timestamp */
+} tsdb_index_entry_t;
+
+/**
+ * @brief Columnar store backend, selected with the name "tsdb"
+ *
+ * A flush writes out the partial blocks that are TSDB_BLOCK_AGE_MS old
+ * and appends the index entries of every block written since the last
+ * flush, after which those readings are visible to tsdb_scan(), also
+ * from other processes. Younger readings wait for a later flush, and
+ * closing writes them all; until then, the journal keeps them. Opening
+ * always starts a new segment.
+ */
+extern const storage_backend_t tsdb_backend;
+
+/**
+ * @brief Called by tsdb_scan() for every matching reading
+ */
+typedef void (*tsdb_visit_t)(sensor_id_t id, sensor_ts_t ts, sensor_value_t value, void *arg);
+
+/**
+ * @brief Visit the readings of a sensor within a time range
+ *
+ * Reads the index of every segment and maps only the segments that
+ * have matching blocks. Readings are visited segment by segment, block
+ * by block, in the order they were stored.
+ *
+ * @param dir Store directory
+ * @param sensor Sensor id, or TSDB_ALL_SENSORS
+ * @param from Earliest timestamp, inclusive
+ * @param to Latest timestamp, inclusive
+ * @param visit Called for every matching reading
+ * @param arg Passed to visit
+ * @return Number of blocks read, or -1 on failure
+ */
+long tsdb_scan(const char *dir, int sensor, sensor_ts_t from, sensor_ts_t to,
+               tsdb_visit_t visit, void *arg);
+
+/**
+ * @brief Called by tsdb_scan_rollups() for every matching rollup
+ */
+typedef void (*tsdb_rollup_visit_t)(const rollup_t *rollup, void *arg);
+
+/**
+ * @brief Visit the rollups of a sensor whose bucket starts within a time range
+ *
+ * Rollups are visited file by file, in the order they were stored. A
+ * bucket stored by two runs of the gateway is visited twice.
+ *
+ * @param dir Store directory
+ * @param sensor Sensor id, or TSDB_ALL_SENSORS
+ * @param resolution Resolution
+ * @param from Earliest bucket start, inclusive
+ * @param to Latest bucket start, inclusive
+ * @param visit Called for every matching rollup
+ * @param arg Passed to visit
+ * @return Number of files read, or -1 on failure
+ */
+long tsdb_scan_rollups(const char *dir, int sensor, rollup_resolution_t resolution,
+                       sensor_ts_t from, sensor_ts_t to, tsdb_rollup_visit_t visit, void *arg);
+
+#endif
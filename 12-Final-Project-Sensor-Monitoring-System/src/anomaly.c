@@ -0,0 +1,317 @@
+/**
+ * @file anomaly.c
+ * @brief Streaming anomaly detection implementation (EWMA and z-score)
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <stdbool.h>
+ #include <stdatomic.h>
+ #include <string.h>
+ #include <math.h>
+ #include "anomaly.h"
+ #include "log.h"
+ #include "stats.h"
+
+ // Marks a reading to skip
+ #define NO_SLOT UINT32_MAX
+
+ // Conditions a sensor can be in
+ #define RAISED_DRIFT 0x1
+ #define RAISED_STUCK 0x2
+
+ #define NS_PER_MS 1000000LL
+ #define NS_PER_SEC 1000000000LL
+
+ /**
+  * Thresholds of a room. Profile 0 holds the defaults.
+  */
+ typedef struct {
+     room_id_t room;
+     double z2;                              // Squared z-score of a spike
+     double drift;                           // Mean to baseline distance of a drift
+     uint32_t stuck;                         // Identical readings of a stuck sensor
+ } profile_t;
+
+ /**
+  * State of one sensor, one cache line
+  */
+ typedef struct {
+     double mean;                            // Fast EWMA of the readings
+     double var;                             // EWMA of the squared deviation from mean
+     double baseline;                        // Slow EWMA of the readings
+     sensor_value_t last;                    // Previous reading
+     sensor_ts_t spike_ts;                   // Time of the last spike alert
+     uint32_t readings;                      // Readings seen, saturates at ANOMALY_WARMUP
+     uint32_t same;                          // Readings in a row equal to last, saturates
+     uint32_t suppressed;                    // Spikes left out since spike_ts
+     uint16_t profile;                       // Thresholds of the room
+     uint8_t raised;                         // RAISED_* conditions
+ } __attribute__((aligned(CACHE_LINE_SIZE))) detector_t;
+
+ static detector_t *detectors = NULL;
+ static const sensor_id_t *slot_ids = NULL;
+ static const room_id_t *slot_rooms = NULL;
+ static profile_t *profiles = NULL;
+ static size_t profile_count = 0;
+ static int log_fd = -1;
+
+ // Global alert budget: alerts logged and dropped in the current second
+ static int64_t window_start = 0;
+ static uint32_t window_alerts = 0;
+ static uint32_t window_dropped = 0;
+
+ // Counters written by the data manager, readable from any thread
+ static _Atomic uint64_t stat_spikes;
+ static _Atomic uint64_t stat_drifts;
+ static _Atomic uint64_t stat_stuck;
+ static _Atomic uint64_t stat_suppressed;
+
+ // Local function prototypes
+ static int load_profiles(const char *thresholds_file);
+ static uint16_t find_profile(room_id_t room);
+ static void update(uint32_t slot, const sensor_data_t *reading, int64_t now);
+ static void report_spike(uint32_t slot, detector_t *d, const sensor_data_t *reading, int64_t now);
+ static bool take_budget(int64_t now);
+
+ int anomaly_init(size_t count_total, const sensor_id_t *ids, const room_id_t *rooms, const char *thresholds_file,
+                  int fd) {
+    anomaly_free();
+    if (!ids || !rooms) {
+        return -1;
+    }
+
+    log_fd = fd;
+    slot_ids = ids;
+    slot_rooms = rooms;
+    detectors = aligned_alloc(CACHE_LINE_SIZE, (count_total ? count_total : 1) * sizeof(detector_t));
+    if (!detectors || load_profiles(thresholds_file) != 0) {
+        anomaly_free();
+        return -1;
+    }
+
+    memset(detectors, 0, (count_total ? count_total : 1) * sizeof(detector_t));
+    for (size_t i = 0; i < count_total; i++) {
+        detectors[i].profile = find_profile(rooms[i]);
+    }
+    return 0;
+ }
+
+ void anomaly_process(const uint32_t *slots, const sensor_data_t *data, size_t count_total, int64_t now) {
+    // Start loading every detector of the batch before the first update,
+    // so the cache misses overlap instead of stalling one after another
+    for (size_t i = 0; i < count_total; i++) {
+        if (slots[i] != NO_SLOT) {
+            __builtin_prefetch(&detectors[slots[i]], 1);
+        }
+    }
+
+    for (size_t i = 0; i < count_total; i++) {
+        if (slots[i] != NO_SLOT) {
+            update(slots[i], &data[i], now);
+        }
+    }
+ }
+
+ void anomaly_get_stats(anomaly_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+
+    stats->spikes = atomic_load_explicit(&stat_spikes, memory_order_relaxed);
+    stats->drifts = atomic_load_explicit(&stat_drifts, memory_order_relaxed);
+    stats->stuck = atomic_load_explicit(&stat_stuck, memory_order_relaxed);
+    stats->suppressed = atomic_load_explicit(&stat_suppressed, memory_order_relaxed);
+ }
+
+ void anomaly_free(void) {
+    free(detectors);
+    free(profiles);
+    detectors = NULL;
+    profiles = NULL;
+    profile_count = 0;
+    slot_ids = NULL;
+    slot_rooms = NULL;
+    window_start = 0;
+    window_alerts = 0;
+    window_dropped = 0;
+ }
+
+ static int load_profiles(const char *thresholds_file) {
+    size_t capacity = 16;
+    profiles = malloc(capacity * sizeof(profile_t));
+    if (!profiles) {
+        return -1;
+    }
+
+    profiles[0] = (profile_t){ 0, (double)ANOMALY_Z * ANOMALY_Z, ANOMALY_DRIFT, ANOMALY_STUCK_READINGS };
+    profile_count = 1;
+
+    FILE *fp = thresholds_file ? fopen(thresholds_file, "r") : NULL;
+    if (!fp) {
+        return 0;
+    }
+
+    unsigned int room;
+    double z;
+    double drift;
+    unsigned int stuck;
+    int fields;
+
+    while ((fields = fscanf(fp, "%u %lf %lf %u", &room, &z, &drift, &stuck)) == 4) {
+        if (room > UINT16_MAX || z <= 0 || drift <= 0 || stuck == 0) {
+            break;
+        }
+        if (profile_count == capacity) {
+            capacity *= 2;
+            profile_t *p = realloc(profiles, capacity * sizeof(profile_t));
+            if (!p) {
+                fclose(fp);
+                return -1;
+            }
+            profiles = p;
+        }
+        profiles[profile_count++] = (profile_t){ (room_id_t)room, z * z, drift, stuck };
+    }
+
+    fclose(fp);
+
+    // Anything but a clean end of file is a malformed thresholds file
+    return fields == EOF ? 0 : -1;
+ }
+
+ static uint16_t find_profile(room_id_t room) {
+    // Rooms are few and this runs once per sensor; a later line wins
+    for (size_t p = profile_count; p-- > 1;) {
+        if (profiles[p].room == room) {
+            return (uint16_t)p;
+        }
+    }
+    return 0;
+ }
+
+ static void update(uint32_t slot, const sensor_data_t *reading, int64_t now) {
+    detector_t *d = &detectors[slot];
+    const profile_t *p = &profiles[d->profile];
+    double x = reading->value;
+
+    if (d->readings == 0) {
+        d->mean = x;
+        d->baseline = x;
+        d->last = x;
+        d->same = 1;
+        d->readings = 1;
+        return;
+    }
+
+    // Stuck: the same value over and over, counted before the warm-up so
+    // a sensor that starts stuck is still caught
+    if (fabs(x - d->last) <= ANOMALY_STUCK_EPSILON) {
+        d->same += d->same < p->stuck;
+        if (d->same >= p->stuck && !(d->raised & RAISED_STUCK)) {
+            d->raised |= RAISED_STUCK;
+            stats_count(&stat_stuck, 1);
+            if (take_budget(now)) {
+                log_event(log_fd, "Sensor node %u in room %u is stuck at %.2f for %u readings",
+                          slot_ids[slot], slot_rooms[slot], x, d->same);
+            }
+        }
+    }
+    else {
+        if (d->raised & RAISED_STUCK) {
+            d->raised &= (uint8_t)~RAISED_STUCK;
+            if (take_budget(now)) {
+                log_event(log_fd, "Sensor node %u in room %u is no longer stuck (%.2f)",
+                          slot_ids[slot], slot_rooms[slot], x);
+            }
+        }
+        d->same = 1;
+    }
+    d->last = x;
+
+    // Spike: compared on squares so no square root is taken per reading;
+    // the floor keeps a quiet sensor from flagging every bit of noise
+    double diff = x - d->mean;
+    double var = d->var > ANOMALY_MIN_STDDEV * ANOMALY_MIN_STDDEV ? d->var : ANOMALY_MIN_STDDEV * ANOMALY_MIN_STDDEV;
+    bool warm = d->readings >= ANOMALY_WARMUP;
+    if (warm && diff * diff > p->z2 * var) {
+        report_spike(slot, d, reading, now);
+
+        // Winsorize: the outlier pulls the mean only as far as the threshold
+        diff = copysign(sqrt(p->z2 * var), diff);
+    }
+
+    double incr = ANOMALY_ALPHA * diff;
+    d->mean += incr;
+    d->var = (1 - ANOMALY_ALPHA) * (d->var + diff * incr);
+    d->baseline += ANOMALY_BASELINE_ALPHA * (x - d->baseline);
+    if (!warm) {
+        d->readings++;
+        return;
+    }
+
+    // Drift, with hysteresis so a mean hovering at the threshold is
+    // reported once
+    double offset = fabs(d->mean - d->baseline);
+    if (!(d->raised & RAISED_DRIFT) && offset > p->drift) {
+        d->raised |= RAISED_DRIFT;
+        stats_count(&stat_drifts, 1);
+        if (take_budget(now)) {
+            log_event(log_fd, "Sensor node %u in room %u is drifting: recent average %.2f, baseline %.2f",
+                      slot_ids[slot], slot_rooms[slot], d->mean, d->baseline);
+        }
+    }
+    else if ((d->raised & RAISED_DRIFT) && offset < p->drift / 2) {
+        d->raised &= (uint8_t)~RAISED_DRIFT;
+        if (take_budget(now)) {
+            log_event(log_fd, "Sensor node %u in room %u stopped drifting: recent average %.2f, baseline %.2f",
+                      slot_ids[slot], slot_rooms[slot], d->mean, d->baseline);
+        }
+    }
+ }
+
+ static void report_spike(uint32_t slot, detector_t *d, const sensor_data_t *reading, int64_t now) {
+    stats_count(&stat_spikes, 1);
+
+    // One alert per sensor per ANOMALY_SUPPRESS_MS, event time
+    if (d->spike_ts != 0 && reading->ts - d->spike_ts < ANOMALY_SUPPRESS_MS * NS_PER_MS) {
+        d->suppressed++;
+        stats_count(&stat_suppressed, 1);
+        return;
+    }
+    if (!take_budget(now)) {
+        return;
+    }
+
+    if (d->suppressed > 0) {
+        log_event(log_fd, "Sensor node %u in room %u reports a spike: %.2f, expected %.2f +/- %.2f "
+                  "(%u more since the last alert)", slot_ids[slot], slot_rooms[slot], reading->value,
+                  d->mean, sqrt(d->var), d->suppressed);
+    }
+    else {
+        log_event(log_fd, "Sensor node %u in room %u reports a spike: %.2f, expected %.2f +/- %.2f",
+                  slot_ids[slot], slot_rooms[slot], reading->value, d->mean, sqrt(d->var));
+    }
+    d->spike_ts = reading->ts;
+    d->suppressed = 0;
+ }
+
+ static bool take_budget(int64_t now) {
+    if (now - window_start >= NS_PER_SEC) {
+        if (window_dropped > 0) {
+            log_event(log_fd, "%u anomaly alerts dropped, more than %d per second", window_dropped,
+                      ANOMALY_ALERTS_PER_SEC);
+        }
+        window_start = now;
+        window_alerts = 0;
+        window_dropped = 0;
+    }
+
+    if (window_alerts < ANOMALY_ALERTS_PER_SEC) {
+        window_alerts++;
+        return true;
+    }
+    window_dropped++;
+    stats_count(&stat_suppressed, 1);
+    return false;
+ }
@@ -0,0 +1,548 @@
+/**
+ * @file connmgr.c
+ * @brief Connection manager implementation (epoll reactor)
+ */
+
+ #define _GNU_SOURCE
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <stdbool.h>
+ #include <stdatomic.h>
+ #include <string.h>
+ #include <errno.h>
+ #include <endian.h>
+ #include <pthread.h>
+ #include <unistd.h>
+ #include <netinet/in.h>
+ #include <sys/epoll.h>
+ #include <sys/eventfd.h>
+ #include <sys/resource.h>
+ #include <sys/socket.h>
+ #include <sys/timerfd.h>
+ #include <time.h>
+ #include "connmgr.h"
+ #include "journal.h"
+ #include "latency.h"
+ #include "log.h"
+ #include "stats.h"
+ #include "timer_wheel.h"
+
+ // Events handled per reactor wake-up
+ #define MAX_EVENTS 1024
+
+ // Connections accepted per wake-up, so a connection storm cannot starve reads
+ #define ACCEPT_BATCH 256
+
+ // Bytes read from a connection per event
+ #define READ_BUFFER_SIZE 65536
+
+ // Connection slots are allocated in chunks that never move, so the
+ // timer wheel can link them
+ #define CONN_CHUNK_BITS 10
+ #define CONN_CHUNK (1u << CONN_CHUNK_BITS)
+ #define MAX_CONN_CHUNKS 1024
+
+ // Resolution of the inactivity timeout
+ #define TIMER_TICK_MS 100
+ #define TIMEOUT_TICKS ((uint64_t)TIMEOUT * 1000 / TIMER_TICK_MS)
+
+ // epoll tags of the descriptors that are not connections
+ #define TAG_LISTEN UINT64_MAX
+ #define TAG_STOP (UINT64_MAX - 1)
+ #define TAG_TIMER (UINT64_MAX - 2)
+
+ // Marks the end of the free slot list
+ #define NO_SLOT UINT32_MAX
+
+ /**
+  * Connection state, kept in a slot array indexed by the epoll tag
+  */
+ typedef struct {
+     timer_node_t timer;                     // Inactivity deadline, first member
+     int fd;                                 // Socket, -1 when the slot is free
+     uint32_t slot;                          // Index of this slot
+     uint32_t next_free;                     // Next free slot while free
+     bool identified;                        // First packet received
+     sensor_id_t sensor_id;                  // Sensor id of the first packet
+     uint8_t partial_len;                    // Bytes of an incomplete packet
+     unsigned char partial[SENSOR_PACKET_SIZE];
+ } conn_t;
+
+ // Descriptors and reactor thread
+ static int listen_fd = -1;
+ static int epoll_fd = -1;
+ static int stop_fd = -1;
+ static int timer_fd = -1;
+ static pthread_t reactor_thread;
+ static bool accept_paused = false;
+
+ // Shared buffer and log FIFO
+ static sbuffer_t *sbuffer = NULL;
+ static int log_fd = -1;
+
+ // Connection slots and deadlines, only used by the reactor thread
+ static conn_t *conn_chunks[MAX_CONN_CHUNKS];
+ static uint32_t conn_capacity = 0;
+ static uint32_t free_head = NO_SLOT;
+ static timer_wheel_t wheel;
+ static uint64_t now_tick;
+ static uint64_t now_received;
+ static int64_t now_ts;
+
+ // Counters written by the reactor, readable from any thread
+ static _Atomic uint64_t stat_accepted;
+ static _Atomic uint64_t stat_active;
+ static _Atomic uint64_t stat_readings;
+ static _Atomic uint64_t stat_bytes;
+ static _Atomic uint64_t stat_wakeups;
+ static _Atomic uint64_t stat_timeouts;
+
+ // Local function prototypes
+ static void* reactor(void *arg);
+ static int create_listen_socket(int port);
+ static void raise_fd_limit(void);
+ static int grow_connections(void);
+ static uint32_t alloc_connection(void);
+ static conn_t *conn_at(uint32_t slot);
+ static void accept_batch(void);
+ static void handle_readable(uint32_t slot);
+ static void parse_packets(conn_t *conn, const unsigned char *data, size_t len);
+ static void emit_reading(conn_t *conn, const unsigned char *packet);
+ static void close_connection(conn_t *conn, bool timed_out);
+ static uint64_t current_tick(void);
+ static void set_timer(bool armed);
+ static void reap_timeouts(void);
+
+ int connmgr_start(int port, sbuffer_t *buffer, int fd) {
+    if (!buffer) {
+        return -1;
+    }
+
+    sbuffer = buffer;
+    log_fd = fd;
+    raise_fd_limit();
+
+    listen_fd = create_listen_socket(port);
+    if (listen_fd < 0) {
+        return -1;
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (epoll_fd < 0 || stop_fd < 0 || timer_fd < 0 || grow_connections() != 0) {
+        connmgr_stop();
+        return -1;
+    }
+
+    now_tick = current_tick();
+    timer_wheel_init(&wheel, now_tick);
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = TAG_LISTEN };
+    struct epoll_event stop_ev = { .events = EPOLLIN, .data.u64 = TAG_STOP };
+    struct epoll_event timer_ev = { .events = EPOLLIN, .data.u64 = TAG_TIMER };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &stop_ev) < 0 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &timer_ev) < 0) {
+        connmgr_stop();
+        return -1;
+    }
+
+    if (pthread_create(&reactor_thread, NULL, reactor, NULL) != 0) {
+        connmgr_stop();
+        return -1;
+    }
+
+    return 0;
+ }
+
+ void connmgr_stop(void) {
+    static const uint64_t one = 1;
+
+    // Wake the reactor and wait until it has closed everything
+    if (stop_fd >= 0 && conn_capacity > 0 && write(stop_fd, &one, sizeof(one)) == sizeof(one)) {
+        pthread_join(reactor_thread, NULL);
+    }
+
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        listen_fd = -1;
+    }
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+    if (stop_fd >= 0) {
+        close(stop_fd);
+        stop_fd = -1;
+    }
+    if (timer_fd >= 0) {
+        close(timer_fd);
+        timer_fd = -1;
+    }
+
+    for (uint32_t i = 0; i < conn_capacity / CONN_CHUNK; i++) {
+        free(conn_chunks[i]);
+        conn_chunks[i] = NULL;
+    }
+    conn_capacity = 0;
+    free_head = NO_SLOT;
+ }
+
+ void connmgr_get_stats(connmgr_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+
+    stats->accepted = atomic_load_explicit(&stat_accepted, memory_order_relaxed);
+    stats->active = atomic_load_explicit(&stat_active, memory_order_relaxed);
+    stats->readings = atomic_load_explicit(&stat_readings, memory_order_relaxed);
+    stats->bytes = atomic_load_explicit(&stat_bytes, memory_order_relaxed);
+    stats->wakeups = atomic_load_explicit(&stat_wakeups, memory_order_relaxed);
+    stats->timeouts = atomic_load_explicit(&stat_timeouts, memory_order_relaxed);
+ }
+
+ static void* reactor(void *arg) {
+    (void)arg;
+    struct epoll_event events[MAX_EVENTS];
+    bool running = true;
+
+    while (running) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_event(log_fd, "Connection manager stopped: epoll_wait failed (%s)", strerror(errno));
+            break;
+        }
+        stats_count(&stat_wakeups, 1);
+        log_batch_begin();
+
+        // One monotonic clock read per wake-up serves every deadline
+        // refreshed in it and stamps every reading received in it, and one
+        // more on the wall clock times the readings from their senders
+        now_received = stats_clock_ns();
+        now_tick = now_received / 1000000 / TIMER_TICK_MS;
+        now_ts = latency_now();
+
+        for (int i = 0; i < n; i++) {
+            uint64_t tag = events[i].data.u64;
+
+            if (tag == TAG_STOP) {
+                running = false;
+            }
+            else if (tag == TAG_TIMER) {
+                reap_timeouts();
+            }
+            else if (tag == TAG_LISTEN) {
+                accept_batch();
+            }
+            else {
+                handle_readable((uint32_t)tag);
+            }
+        }
+
+        // Readings parsed in this wake-up are journaled with one write,
+        // then readers are woken once for all of them, and the log events
+        // of the wake-up go out together
+        journal_commit();
+        sbuffer_publish(sbuffer);
+        log_batch_end();
+    }
+
+    log_batch_begin();
+    for (uint32_t i = 0; i < conn_capacity; i++) {
+        if (conn_at(i)->fd >= 0) {
+            close_connection(conn_at(i), false);
+        }
+    }
+    log_batch_end();
+
+    // No more readings: let the readers drain the buffer and stop
+    sbuffer_close(sbuffer);
+    return NULL;
+ }
+
+ static int create_listen_socket(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons((uint16_t)port);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+ }
+
+ static void raise_fd_limit(void) {
+    struct rlimit limit;
+
+    // Thousands of sensor nodes need more than the default 1024 descriptors
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+ }
+
+ static int grow_connections(void) {
+    uint32_t chunk = conn_capacity / CONN_CHUNK;
+    if (chunk == MAX_CONN_CHUNKS) {
+        return -1;
+    }
+
+    conn_t *conns = malloc(CONN_CHUNK * sizeof(conn_t));
+    if (!conns) {
+        return -1;
+    }
+
+    // Chain the new slots in front of the free list, lowest index first
+    for (uint32_t i = CONN_CHUNK; i-- > 0; ) {
+        conns[i].timer.next = NULL;
+        conns[i].fd = -1;
+        conns[i].slot = conn_capacity + i;
+        conns[i].next_free = free_head;
+        free_head = conn_capacity + i;
+    }
+
+    conn_chunks[chunk] = conns;
+    conn_capacity += CONN_CHUNK;
+    return 0;
+ }
+
+ static uint32_t alloc_connection(void) {
+    if (free_head == NO_SLOT && grow_connections() != 0) {
+        return NO_SLOT;
+    }
+
+    uint32_t slot = free_head;
+    free_head = conn_at(slot)->next_free;
+    return slot;
+ }
+
+ static conn_t *conn_at(uint32_t slot) {
+    return &conn_chunks[slot >> CONN_CHUNK_BITS][slot & (CONN_CHUNK - 1)];
+ }
+
+ static void accept_batch(void) {
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE) {
+                // Stop polling the listener until a connection is closed
+                struct epoll_event ev = { .events = 0, .data.u64 = TAG_LISTEN };
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, listen_fd, &ev);
+                accept_paused = true;
+                log_event(log_fd, "Connection limit reached, new sensor nodes wait in the backlog");
+            }
+            return;
+        }
+
+        uint32_t slot = alloc_connection();
+        if (slot == NO_SLOT) {
+            close(fd);
+            continue;
+        }
+
+        conn_t *conn = conn_at(slot);
+        conn->fd = fd;
+        conn->identified = false;
+        conn->partial_len = 0;
+
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.u64 = slot };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            conn->fd = -1;
+            conn->next_free = free_head;
+            free_head = slot;
+            continue;
+        }
+
+        // The timerfd only runs while some connection has a deadline
+        if (wheel.count == 0) {
+            timer_wheel_advance(&wheel, now_tick, NULL);
+            set_timer(true);
+        }
+        timer_wheel_add(&wheel, &conn->timer, now_tick + TIMEOUT_TICKS);
+
+        stats_count(&stat_accepted, 1);
+        stats_count(&stat_active, 1);
+    }
+ }
+
+ static void handle_readable(uint32_t slot) {
+    static unsigned char data[READ_BUFFER_SIZE];
+    conn_t *conn = conn_at(slot);
+
+    // Closed by a timeout earlier in this wake-up
+    if (conn->fd < 0) {
+        return;
+    }
+
+    // One read per event keeps the reactor fair; level triggering
+    // reports the connection again if more data is waiting
+    ssize_t n = recv(conn->fd, data, sizeof(data), 0);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return;
+        }
+        close_connection(conn, false);
+        return;
+    }
+    if (n == 0) {
+        close_connection(conn, false);
+        return;
+    }
+
+    // Pushing the deadline back is a single store, see timer_wheel_touch()
+    timer_wheel_touch(&conn->timer, now_tick + TIMEOUT_TICKS);
+    stats_count(&stat_bytes, (uint64_t)n);
+    parse_packets(conn, data, (size_t)n);
+ }
+
+ static void parse_packets(conn_t *conn, const unsigned char *data, size_t len) {
+    size_t pos = 0;
+
+    // Complete a packet split across reads
+    if (conn->partial_len > 0) {
+        size_t take = SENSOR_PACKET_SIZE - conn->partial_len;
+        if (take > len) {
+            take = len;
+        }
+        memcpy(conn->partial + conn->partial_len, data, take);
+        conn->partial_len += (uint8_t)take;
+        pos = take;
+
+        if (conn->partial_len < SENSOR_PACKET_SIZE) {
+            return;
+        }
+        emit_reading(conn, conn->partial);
+        conn->partial_len = 0;
+    }
+
+    // Whole packets straight from the read buffer
+    while (len - pos >= SENSOR_PACKET_SIZE) {
+        emit_reading(conn, data + pos);
+        pos += SENSOR_PACKET_SIZE;
+    }
+
+    // Keep the start of the next packet
+    conn->partial_len = (uint8_t)(len - pos);
+    memcpy(conn->partial, data + pos, conn->partial_len);
+ }
+
+ static void emit_reading(conn_t *conn, const unsigned char *packet) {
+    uint16_t id;
+    uint64_t value;
+    uint64_t ts;
+
+    memcpy(&id, packet, sizeof(id));
+    memcpy(&value, packet + 2, sizeof(value));
+    memcpy(&ts, packet + 10, sizeof(ts));
+    id = le16toh(id);
+    value = le64toh(value);
+    ts = le64toh(ts);
+
+    // Decode directly into the shared buffer slot
+    sensor_data_t *reading = sbuffer_claim(sbuffer);
+    reading->id = id;
+    memcpy(&reading->value, &value, sizeof(reading->value));
+    reading->ts = (sensor_ts_t)ts;
+    reading->received = now_received;
+    journal_add(reading);
+    stats_count(&stat_readings, 1);
+    latency_record(latency_stage(LATENCY_STAGE_RECEIVE), now_ts - reading->ts);
+
+    if (!conn->identified) {
+        conn->identified = true;
+        conn->sensor_id = id;
+        log_event(log_fd, "A sensor node with %u has opened a new connection", id);
+    }
+ }
+
+ static void close_connection(conn_t *conn, bool timed_out) {
+    // Closing the socket also removes it from the epoll set
+    close(conn->fd);
+    conn->fd = -1;
+    conn->next_free = free_head;
+    free_head = conn->slot;
+    timer_wheel_del(&wheel, &conn->timer);
+    atomic_fetch_sub_explicit(&stat_active, 1, memory_order_relaxed);
+
+    if (timed_out) {
+        stats_count(&stat_timeouts, 1);
+        if (conn->identified) {
+            log_event(log_fd, "The sensor node with %u has been disconnected after %d seconds of inactivity",
+                      conn->sensor_id, TIMEOUT);
+        }
+        else {
+            log_event(log_fd, "A sensor node that sent no reading has been disconnected after %d seconds",
+                      TIMEOUT);
+        }
+    }
+    else if (conn->identified) {
+        log_event(log_fd, "The sensor node with %u has closed the connection", conn->sensor_id);
+    }
+
+    // A descriptor is free again, resume accepting
+    if (accept_paused) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = TAG_LISTEN };
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, listen_fd, &ev);
+        accept_paused = false;
+    }
+ }
+
+ static uint64_t current_tick(void) {
+    return stats_clock_ns() / 1000000 / TIMER_TICK_MS;
+ }
+
+ static void set_timer(bool armed) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+
+    // Periodic, one expiry per tick; all zero disarms it
+    if (armed) {
+        spec.it_interval.tv_sec = TIMER_TICK_MS / 1000;
+        spec.it_interval.tv_nsec = (TIMER_TICK_MS % 1000) * 1000000L;
+        spec.it_value = spec.it_interval;
+    }
+    timerfd_settime(timer_fd, 0, &spec, NULL);
+ }
+
+ static void reap_timeouts(void) {
+    uint64_t expirations;
+
+    // Ticks are taken from the clock, so missed expirations are caught up
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        return;
+    }
+
+    timer_node_t expired;
+    timer_list_init(&expired);
+    timer_wheel_advance(&wheel, now_tick, &expired);
+
+    // Close the whole batch; closing removes each timer from the list
+    while (!timer_list_empty(&expired)) {
+        conn_t *conn = (conn_t *)expired.next;  // The timer is the first member
+        close_connection(conn, true);
+    }
+
+    if (wheel.count == 0) {
+        set_timer(false);
+    }
+ }
@@ -0,0 +1,526 @@
+/**
+ * @file datamgr.c
+ * @brief Data manager implementation (structure-of-arrays sensor state)
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <stdbool.h>
+ #include <stdatomic.h>
+ #include <string.h>
+ #include <errno.h>
+ #include <pthread.h>
+ #include "anomaly.h"
+ #include "datamgr.h"
+ #include "latency.h"
+ #include "log.h"
+ #include "phash.h"
+ #include "seqlock.h"
+ #include "stats.h"
+ #include "storagemgr.h"
+
+ // Readings taken from the shared buffer per batch
+ #define READ_BATCH 1024
+
+ // Readings processed per pass over the per-reading scratch arrays
+ #define CHUNK 256
+
+ // Marks a reading from a sensor that is not in the map
+ #define NO_SLOT UINT32_MAX
+
+ // Average of a sensor whose window is not full yet; inside the range,
+ // so no verdict is reached before RUN_AVG_LENGTH readings
+ #define NEUTRAL_TEMP (((double)SET_MIN_TEMP + (double)SET_MAX_TEMP) / 2)
+
+ // Verdict of a running average
+ #define TOO_COLD -1
+ #define IN_RANGE 0
+ #define TOO_HOT 1
+
+ /**
+  * Per-sensor state in structure-of-arrays form. A sensor has a dense
+  * slot, given by a minimal perfect hash of the ids in the map, and every
+  * array is indexed by that slot, so each pass over a batch touches only
+  * the fields it needs. The window and rollups of a
+  * slot are guarded by its sequence counter for readers in other threads.
+  */
+ typedef struct {
+     size_t sensors;                         // Sensors in the map
+     const phash_t *index;                   // Slot of every sensor id
+     phash_t built;                          // Index built at start-up, unless compiled in
+     sensor_id_t *ids;                       // Sensor id of each slot
+     room_id_t *rooms;                       // Room of each slot
+     double *sums;                           // Sum of the window
+     double *windows;                        // RUN_AVG_LENGTH readings per slot
+     uint32_t *heads;                        // Next position in the window
+     uint8_t *full;                          // Window holds RUN_AVG_LENGTH readings
+     int8_t *verdicts;                       // Last verdict reported
+     sensor_ts_t *last_ts;                   // Time of the last reading
+     seqlock_t *seqs;                        // Sequence counter of the window and rollups
+ } sensors_t;
+
+ static sensors_t dm;
+ static int log_fd = -1;
+ static sbuffer_t *sbuffer = NULL;
+ static pthread_t datamgr_thread;
+
+ // Unknown sensor ids already logged, one bit per id
+ static uint64_t unknown_logged[(1 << (8 * sizeof(sensor_id_t))) / 64];
+
+ // Counters written by the data manager, readable from any thread
+ static _Atomic uint64_t stat_readings;
+ static _Atomic uint64_t stat_invalid;
+ static _Atomic uint64_t stat_too_cold;
+ static _Atomic uint64_t stat_too_hot;
+ static _Atomic uint64_t stat_rollups;
+ static _Atomic uint64_t stat_late;
+
+ // Local function prototypes
+ static void* datamgr_run(void *arg);
+ static int load_map(const char *map_file, room_id_t **rooms, sensor_id_t **ids, size_t *count_out);
+ static int copy_static_map(room_id_t **rooms, sensor_id_t **ids, size_t *count_out);
+ static size_t drop_duplicates(room_id_t *rooms, sensor_id_t *ids, size_t entries);
+ static int alloc_sensors(size_t sensors);
+ static int build_index(const sensor_id_t *ids, size_t entries);
+ static uint32_t lookup(sensor_id_t id);
+ static void record_stages(const sensor_data_t *data, size_t n);
+ static void report_unknown(sensor_id_t id);
+ static void report_verdict(uint32_t slot, int8_t verdict, double avg);
+ static void store_rollup(const rollup_t *rollup);
+
+ int datamgr_init(const char *map_file, int fd) {
+    room_id_t *rooms = NULL;
+    sensor_id_t *ids = NULL;
+    size_t entries = 0;
+
+    if (!map_file) {
+        return -1;
+    }
+    if (load_map(map_file, &rooms, &ids, &entries) != 0) {
+        // A gateway built for a fixed deployment can run without the map file
+        if (errno != ENOENT || copy_static_map(&rooms, &ids, &entries) != 0) {
+            return -1;
+        }
+    }
+
+    log_fd = fd;
+    entries = drop_duplicates(rooms, ids, entries);
+    if (alloc_sensors(entries) != 0 || build_index(ids, entries) != 0 ||
+        rollup_init(entries, store_rollup, dm.seqs) != 0) {
+        free(rooms);
+        free(ids);
+        datamgr_free();
+        return -1;
+    }
+
+    for (size_t i = 0; i < entries; i++) {
+        uint32_t slot = lookup(ids[i]);
+        dm.ids[slot] = ids[i];
+        dm.rooms[slot] = rooms[i];
+    }
+    dm.sensors = entries;
+
+    free(rooms);
+    free(ids);
+    if (anomaly_init(dm.sensors, dm.ids, dm.rooms, ROOM_ANOMALY_FILE, log_fd) != 0) {
+        datamgr_free();
+        return -1;
+    }
+    return 0;
+ }
+
+ void datamgr_process(const sensor_data_t *data, size_t count_total) {
+    uint32_t slots[CHUNK];
+    double avgs[CHUNK];
+    int8_t verdicts[CHUNK];
+    int64_t now = latency_now();
+
+    for (size_t base = 0; base < count_total; base += CHUNK) {
+        const sensor_data_t *batch = data + base;
+        size_t n = count_total - base < CHUNK ? count_total - base : CHUNK;
+        size_t invalid = 0;
+        size_t late = 0;
+
+        // Pass 1: map sensor ids to dense slots
+        for (size_t i = 0; i < n; i++) {
+            slots[i] = lookup(batch[i].id);
+        }
+
+        // Pass 2: update the windows in order; the same sensor can
+        // appear several times in a batch
+        for (size_t i = 0; i < n; i++) {
+            uint32_t s = slots[i];
+            if (s == NO_SLOT) {
+                avgs[i] = NEUTRAL_TEMP;
+                invalid++;
+                continue;
+            }
+
+            double *window = dm.windows + (size_t)s * RUN_AVG_LENGTH;
+            uint32_t head = dm.heads[s];
+
+            seqlock_write_begin(&dm.seqs[s]);
+            dm.sums[s] += batch[i].value - window[head];
+            window[head] = batch[i].value;
+            dm.last_ts[s] = batch[i].ts;
+
+            if (++head == RUN_AVG_LENGTH) {
+                // Recompute the sum once per lap so rounding errors of the
+                // incremental updates never accumulate
+                double sum = 0;
+                for (int k = 0; k < RUN_AVG_LENGTH; k++) {
+                    sum += window[k];
+                }
+                dm.sums[s] = sum;
+                dm.full[s] = 1;
+                head = 0;
+            }
+            dm.heads[s] = head;
+            late += rollup_add(s, batch[i].id, batch[i].ts, batch[i].value);
+            seqlock_write_end(&dm.seqs[s]);
+
+            avgs[i] = dm.full[s] ? dm.sums[s] / RUN_AVG_LENGTH : NEUTRAL_TEMP;
+        }
+
+        // Pass 3: check every reading for spikes, drift and stuck sensors
+        anomaly_process(slots, batch, n, now);
+
+        // Pass 4: classify every average, branch-free so it vectorizes
+        for (size_t i = 0; i < n; i++) {
+            verdicts[i] = (int8_t)((avgs[i] > SET_MAX_TEMP) - (avgs[i] < SET_MIN_TEMP));
+        }
+
+        // Pass 5: report unknown sensors and changed verdicts, in order
+        for (size_t i = 0; i < n; i++) {
+            uint32_t s = slots[i];
+            if (s == NO_SLOT) {
+                report_unknown(batch[i].id);
+            }
+            else if (verdicts[i] != dm.verdicts[s]) {
+                report_verdict(s, verdicts[i], avgs[i]);
+            }
+        }
+
+        stats_count(&stat_readings, n);
+        if (invalid > 0) {
+            stats_count(&stat_invalid, invalid);
+        }
+        if (late > 0) {
+            stats_count(&stat_late, late);
+        }
+    }
+
+    record_stages(data, count_total);
+ }
+
+ int datamgr_start(sbuffer_t *buffer) {
+    if (!buffer || !dm.index) {
+        return -1;
+    }
+
+    sbuffer = buffer;
+    return pthread_create(&datamgr_thread, NULL, datamgr_run, NULL) == 0 ? 0 : -1;
+ }
+
+ void datamgr_wait(void) {
+    if (sbuffer) {
+        pthread_join(datamgr_thread, NULL);
+        sbuffer = NULL;
+    }
+ }
+
+ void datamgr_get_stats(datamgr_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+
+    stats->sensors = dm.sensors;
+    stats->readings = atomic_load_explicit(&stat_readings, memory_order_relaxed);
+    stats->invalid = atomic_load_explicit(&stat_invalid, memory_order_relaxed);
+    stats->too_cold = atomic_load_explicit(&stat_too_cold, memory_order_relaxed);
+    stats->too_hot = atomic_load_explicit(&stat_too_hot, memory_order_relaxed);
+    stats->rollups = atomic_load_explicit(&stat_rollups, memory_order_relaxed);
+    stats->late = atomic_load_explicit(&stat_late, memory_order_relaxed);
+ }
+
+ int datamgr_get_sensor(sensor_id_t id, datamgr_sensor_t *sensor) {
+    if (!dm.index || !sensor) {
+        return -1;
+    }
+
+    uint32_t slot = lookup(id);
+    if (slot == NO_SLOT) {
+        return -1;
+    }
+
+    const double *window = dm.windows + (size_t)slot * RUN_AVG_LENGTH;
+    uint32_t seq;
+
+    // Copy, then start over if the data manager changed the slot meanwhile
+    do {
+        seq = seqlock_read_begin(&dm.seqs[slot]);
+        uint32_t head = dm.heads[slot];
+        sensor->ts = dm.last_ts[slot];
+        sensor->value = window[head == 0 ? RUN_AVG_LENGTH - 1 : head - 1];
+        sensor->readings = dm.full[slot] ? RUN_AVG_LENGTH : head;
+        sensor->sum = dm.sums[slot];
+    } while (seqlock_read_retry(&dm.seqs[slot], seq));
+
+    sensor->id = id;
+    sensor->room = dm.rooms[slot];
+    sensor->average = sensor->readings > 0 ? sensor->sum / sensor->readings : 0;
+    return 0;
+ }
+
+ size_t datamgr_get_rollups(sensor_id_t id, rollup_resolution_t resolution, sensor_ts_t from, sensor_ts_t to,
+                            rollup_t *out, size_t max) {
+    if (!dm.index || !out) {
+        return 0;
+    }
+
+    uint32_t slot = lookup(id);
+    return slot == NO_SLOT ? 0 : rollup_history(slot, resolution, from, to, out, max);
+ }
+
+ void datamgr_free(void) {
+    anomaly_free();
+    rollup_free();
+    phash_free(&dm.built);
+    free(dm.ids);
+    free(dm.rooms);
+    free(dm.sums);
+    free(dm.windows);
+    free(dm.heads);
+    free(dm.full);
+    free(dm.verdicts);
+    free(dm.last_ts);
+    free(dm.seqs);
+    memset(&dm, 0, sizeof(dm));
+ }
+
+ static void* datamgr_run(void *arg) {
+    (void)arg;
+    const sensor_data_t *data;
+    size_t n;
+    int64_t next_sweep = latency_now() + (int64_t)ROLLUP_SWEEP_MS * 1000000;
+
+    // Readings are processed in place and released as one batch, and the
+    // log events of a batch are written together
+    for (;;) {
+        int result = sbuffer_peek_batch_timed(sbuffer, SBUFFER_READER_DATAMGR, &data, READ_BATCH, &n,
+                                              ROLLUP_SWEEP_MS);
+        if (result == SBUFFER_SUCCESS) {
+            log_batch_begin();
+            datamgr_process(data, n);
+            log_batch_end();
+            sbuffer_release_batch(sbuffer, SBUFFER_READER_DATAMGR, n);
+        }
+        else if (result != SBUFFER_TIMEOUT) {
+            break;
+        }
+
+        // Close the buckets of sensors that went quiet
+        int64_t now = latency_now();
+        if (now >= next_sweep) {
+            rollup_expire(now);
+            next_sweep = now + (int64_t)ROLLUP_SWEEP_MS * 1000000;
+        }
+    }
+
+    // No reading will come for the open buckets any more
+    rollup_close_all();
+    return NULL;
+ }
+
+ static int load_map(const char *map_file, room_id_t **rooms, sensor_id_t **ids, size_t *count_out) {
+    FILE *fp = fopen(map_file, "r");
+    if (!fp) {
+        return -1;
+    }
+
+    size_t entries = 0;
+    size_t capacity = 0;
+    unsigned int room;
+    unsigned int sensor;
+    int fields;
+
+    while ((fields = fscanf(fp, "%u %u", &room, &sensor)) == 2) {
+        if (entries == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            room_id_t *r = realloc(*rooms, capacity * sizeof(room_id_t));
+            if (r) {
+                *rooms = r;
+            }
+            sensor_id_t *s = realloc(*ids, capacity * sizeof(sensor_id_t));
+            if (s) {
+                *ids = s;
+            }
+            if (!r || !s) {
+                fclose(fp);
+                return -1;
+            }
+        }
+
+        (*rooms)[entries] = (room_id_t)room;
+        (*ids)[entries] = (sensor_id_t)sensor;
+        entries++;
+    }
+
+    fclose(fp);
+
+    // Anything but a clean end of file is a malformed map
+    if (fields != EOF) {
+        free(*rooms);
+        free(*ids);
+        *rooms = NULL;
+        *ids = NULL;
+        return -1;
+    }
+
+    *count_out = entries;
+    return 0;
+ }
+
+ static int copy_static_map(room_id_t **rooms, sensor_id_t **ids, size_t *count_out) {
+    if (!&phash_static_map) {
+        return -1;
+    }
+
+    size_t entries = phash_static_map.hash.size;
+    *rooms = malloc((entries ? entries : 1) * sizeof(room_id_t));
+    *ids = malloc((entries ? entries : 1) * sizeof(sensor_id_t));
+    if (!*rooms || !*ids) {
+        free(*rooms);
+        free(*ids);
+        return -1;
+    }
+
+    memcpy(*rooms, phash_static_map.rooms, entries * sizeof(room_id_t));
+    memcpy(*ids, phash_static_map.hash.keys, entries * sizeof(sensor_id_t));
+    *count_out = entries;
+    return 0;
+ }
+
+ static size_t drop_duplicates(room_id_t *rooms, sensor_id_t *ids, size_t entries) {
+    static uint64_t seen[(1 << (8 * sizeof(sensor_id_t))) / 64];
+    size_t kept = 0;
+
+    // Keep the first room of every sensor, in place
+    memset(seen, 0, sizeof(seen));
+    for (size_t i = 0; i < entries; i++) {
+        uint64_t bit = 1ULL << (ids[i] % 64);
+        if (seen[ids[i] / 64] & bit) {
+            log_event(log_fd, "Sensor node %u is mapped to more than one room, room %u ignored",
+                      ids[i], rooms[i]);
+            continue;
+        }
+        seen[ids[i] / 64] |= bit;
+        rooms[kept] = rooms[i];
+        ids[kept] = ids[i];
+        kept++;
+    }
+    return kept;
+ }
+
+ static int alloc_sensors(size_t sensors) {
+    memset(&dm, 0, sizeof(dm));
+
+    // Every array gets at least one element so a valid map never fails
+    if (sensors == 0) {
+        sensors = 1;
+    }
+    dm.ids = calloc(sensors, sizeof(sensor_id_t));
+    dm.rooms = calloc(sensors, sizeof(room_id_t));
+    dm.sums = calloc(sensors, sizeof(double));
+    dm.windows = calloc(sensors * RUN_AVG_LENGTH, sizeof(double));
+    dm.heads = calloc(sensors, sizeof(uint32_t));
+    dm.full = calloc(sensors, sizeof(uint8_t));
+    dm.verdicts = calloc(sensors, sizeof(int8_t));
+    dm.last_ts = calloc(sensors, sizeof(sensor_ts_t));
+    dm.seqs = calloc(sensors, sizeof(seqlock_t));
+
+    if (!dm.ids || !dm.rooms || !dm.sums || !dm.windows ||
+        !dm.heads || !dm.full || !dm.verdicts || !dm.last_ts || !dm.seqs) {
+        return -1;
+    }
+
+    return 0;
+ }
+
+ static int build_index(const sensor_id_t *ids, size_t entries) {
+    const phash_t *compiled = &phash_static_map ? &phash_static_map.hash : NULL;
+
+    // The compiled-in hash only fits a map with exactly the same sensors
+    if (compiled) {
+        size_t found = 0;
+        while (found < entries && phash_lookup(compiled, ids[found]) != PHASH_NONE) {
+            found++;
+        }
+        if (found == entries && compiled->size == entries) {
+            dm.index = compiled;
+            return 0;
+        }
+        log_event(log_fd, "Room map differs from the compiled-in one, hashing it at start-up");
+    }
+
+    if (phash_build(&dm.built, ids, entries) != 0) {
+        return -1;
+    }
+    dm.index = &dm.built;
+    return 0;
+ }
+
+ static uint32_t lookup(sensor_id_t id) {
+    return phash_lookup(dm.index, id);
+ }
+
+ static void record_stages(const sensor_data_t *data, size_t n) {
+    latency_hist_t *insert = latency_stage(LATENCY_STAGE_INSERT);
+    latency_hist_t *process = latency_stage(LATENCY_STAGE_PROCESS);
+    uint64_t now = stats_clock_ns();
+
+    // Readings of one wake-up share their stamps: one record per run
+    for (size_t i = 0, run; i < n; i += run) {
+        for (run = 1; i + run < n && data[i + run].received == data[i].received &&
+                      data[i + run].insert_ns == data[i].insert_ns; run++) {
+        }
+        if (data[i].received != 0) {
+            uint64_t published = data[i].received + data[i].insert_ns;
+            latency_record_n(insert, data[i].insert_ns, run);
+            latency_record_n(process, (int64_t)(now - published), run);
+        }
+    }
+ }
+
+ static void report_unknown(sensor_id_t id) {
+    uint64_t bit = 1ULL << (id % 64);
+
+    if (!(unknown_logged[id / 64] & bit)) {
+        unknown_logged[id / 64] |= bit;
+        log_event(log_fd, "Received sensor data with invalid sensor node ID %u", id);
+    }
+ }
+
+ static void report_verdict(uint32_t slot, int8_t verdict, double avg) {
+    dm.verdicts[slot] = verdict;
+
+    if (verdict == TOO_COLD) {
+        stats_count(&stat_too_cold, 1);
+        log_event(log_fd, "The sensor node with %u reports it's too cold (avg temp = %.2f)",
+                  dm.ids[slot], avg);
+    }
+    else if (verdict == TOO_HOT) {
+        stats_count(&stat_too_hot, 1);
+        log_event(log_fd, "The sensor node with %u reports it's too hot (avg temp = %.2f)",
+                  dm.ids[slot], avg);
+    }
+    else {
+        log_event(log_fd, "The sensor node with %u is back in range (avg temp = %.2f)",
+                  dm.ids[slot], avg);
+    }
+ }
+
+ static void store_rollup(const rollup_t *rollup) {
+    stats_count(&stat_rollups, 1);
+    storagemgr_queue_rollup(rollup);
+ }
@@ -0,0 +1,632 @@
+/**
+ * @file journal.c
+ * @brief Write-ahead journal implementation
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <stdbool.h>
+ #include <stdatomic.h>
+ #include <errno.h>
+ #include <dirent.h>
+ #include <fcntl.h>
+ #include <pthread.h>
+ #include <time.h>
+ #include <unistd.h>
+ #include <sys/stat.h>
+ #include "journal.h"
+ #include "log.h"
+ #include "stats.h"
+
+ // "SJNL", first in every segment header
+ #define JOURNAL_MAGIC 0x4c4e4a53u
+
+ #define SEGMENT_SUFFIX ".jnl"
+ #define SEGMENT_READINGS ((uint64_t)JOURNAL_SEGMENT_SIZE / sizeof(sensor_data_t))
+ #define CHECKPOINT_NAME "checkpoint"
+
+ // Holes in the recovered readings tracked before recovery stops early
+ #define MAX_GAPS 64
+
+ /**
+  * Segment file header, followed by the readings
+  */
+ typedef struct {
+     uint32_t magic;
+     uint32_t record_size;                   // sizeof(sensor_data_t)
+     uint64_t first;                         // Position of the first reading
+ } segment_header_t;
+
+ /**
+  * Segment left by the last run
+  */
+ typedef struct {
+     uint64_t first;
+     uint64_t count;                         // Whole readings in the file
+ } old_segment_t;
+
+ /**
+  * Positions missing from the recovered readings, skipped by the
+  * checkpoint once the readings recovered before them are committed
+  */
+ typedef struct {
+     uint64_t after;                         // Readings recovered before the hole
+     uint64_t size;
+ } gap_t;
+
+ static char journal_dir[256];
+ static int log_fd = -1;
+ static bool opened = false;
+ static uint64_t open_ns;
+
+ // Appending thread
+ static int append_fd = -1;
+ static uint64_t segment_first;
+ static _Atomic uint64_t position;           // Position after the last reading written
+ static sensor_data_t staged[JOURNAL_BATCH];
+ static size_t staged_count = 0;
+
+ // Segments on disk, oldest first, and the one the sync thread still owes
+ static pthread_mutex_t segment_lock = PTHREAD_MUTEX_INITIALIZER;
+ static uint64_t *segments = NULL;
+ static size_t segment_count = 0;
+ static size_t segment_capacity = 0;
+ static int retired_fd = -1;
+
+ // Sync thread
+ static pthread_t sync_thread;
+ static pthread_cond_t sync_cond;
+ static bool sync_running = false;
+ static bool sync_stop = false;
+
+ // Checkpointing thread
+ static int checkpoint_fd = -1;
+ static uint64_t checkpoint;
+ static bool checkpoint_failed = false;
+ static uint64_t checkpoint_base;            // Checkpoint found at opening
+ static uint64_t committed;                  // Readings checkpointed since opening
+ static old_segment_t *tail = NULL;          // Segments with readings past the checkpoint
+ static size_t tail_count = 0;
+ static size_t tail_next = 0;
+ static int recover_fd = -1;
+ static uint64_t recover_pos;
+ static uint64_t recover_end;
+ static uint64_t handed_out;                 // Readings returned by journal_recover()
+ static bool recovering = false;
+ static gap_t gaps[MAX_GAPS];
+ static size_t gap_count = 0;
+ static size_t gap_next = 0;
+
+ // Counters, each written by one thread and readable from any
+ static _Atomic uint64_t stat_readings;
+ static _Atomic uint64_t stat_writes;
+ static _Atomic uint64_t stat_syncs;
+ static _Atomic uint64_t stat_recovered;
+ static _Atomic uint64_t stat_recovery_ns;
+
+ // Local function prototypes
+ static int find_tail(void);
+ static int compare_segments(const void *a, const void *b);
+ static int start_segment(uint64_t first);
+ static int push_segment(uint64_t first);
+ static void stop_appending(const char *what);
+ static void* sync_run(void *arg);
+ static void add_gap(uint64_t size);
+ static void segment_path(char *path, size_t size, uint64_t first);
+ static void journal_path(char *path, size_t size, const char *name);
+ static int write_all(int fd, const void *data, size_t len);
+ static size_t read_all(int fd, void *data, size_t len, off_t offset);
+
+ int journal_open(const char *dir, int fd) {
+    if (!dir || opened || snprintf(journal_dir, sizeof(journal_dir), "%s", dir) >= (int)sizeof(journal_dir)) {
+        return -1;
+    }
+    log_fd = fd;
+    open_ns = stats_clock_ns();
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        return -1;
+    }
+
+    char path[320];
+    journal_path(path, sizeof(path), CHECKPOINT_NAME);
+    checkpoint_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (checkpoint_fd < 0) {
+        return -1;
+    }
+    if (read_all(checkpoint_fd, &checkpoint, sizeof(checkpoint), 0) != sizeof(checkpoint)) {
+        checkpoint = 0;
+    }
+    checkpoint_base = checkpoint;
+    committed = 0;
+
+    // New readings go after the old ones, in a segment of their own, so
+    // a reading torn by the crash is never followed by good ones
+    uint64_t end = checkpoint;
+    if (find_tail() != 0) {
+        journal_close();
+        return -1;
+    }
+    if (recover_end > end) {
+        end = recover_end;
+    }
+    recovering = recover_end > checkpoint;
+
+    atomic_store(&position, end);
+    opened = true;
+    if (start_segment(end) != 0) {
+        journal_close();
+        return -1;
+    }
+
+    if (JOURNAL_SYNC_MS > 0) {
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&sync_cond, &attr);
+        pthread_condattr_destroy(&attr);
+
+        sync_stop = false;
+        sync_running = pthread_create(&sync_thread, NULL, sync_run, NULL) == 0;
+        if (!sync_running) {
+            journal_close();
+            return -1;
+        }
+    }
+
+    if (recovering) {
+        log_event(log_fd, "Journal holds %llu readings not committed by the last run, recovering them",
+                  (unsigned long long)(recover_end - checkpoint));
+    }
+    return 0;
+ }
+
+ uint64_t journal_backlog(void) {
+    return recover_end > checkpoint_base ? recover_end - checkpoint_base : 0;
+ }
+
+ void journal_add(const sensor_data_t *reading) {
+    if (append_fd < 0) {
+        return;
+    }
+
+    staged[staged_count++] = *reading;
+    if (staged_count == JOURNAL_BATCH) {
+        journal_commit();
+    }
+ }
+
+ void journal_commit(void) {
+    if (append_fd < 0 || staged_count == 0) {
+        return;
+    }
+
+    size_t n = staged_count;
+    staged_count = 0;
+    if (write_all(append_fd, staged, n * sizeof(sensor_data_t)) != 0) {
+        stop_appending("write");
+        return;
+    }
+    stats_count(&stat_writes, 1);
+    stats_count(&stat_readings, n);
+
+    uint64_t end = atomic_load_explicit(&position, memory_order_relaxed) + n;
+    atomic_store_explicit(&position, end, memory_order_release);
+    if (end - segment_first >= SEGMENT_READINGS && start_segment(end) != 0) {
+        stop_appending("segment creation");
+    }
+ }
+
+ size_t journal_recover(sensor_data_t *out, size_t max) {
+    while (tail_next < tail_count && max > 0) {
+        old_segment_t *seg = &tail[tail_next];
+        char path[320];
+
+        if (recover_fd < 0) {
+            if (seg->first > recover_pos) {
+                log_event(log_fd, "Journal is missing readings %llu to %llu, skipping them",
+                          (unsigned long long)recover_pos, (unsigned long long)seg->first - 1);
+                add_gap(seg->first - recover_pos);
+                continue;
+            }
+            if (recover_pos >= seg->first + seg->count) {
+                tail_next++;
+                continue;
+            }
+
+            segment_path(path, sizeof(path), seg->first);
+            recover_fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (recover_fd < 0) {
+                // Skipped as a hole when the next segment is opened
+                tail_next++;
+                continue;
+            }
+        }
+
+        uint64_t left = seg->first + seg->count - recover_pos;
+        size_t n = left < max ? (size_t)left : max;
+        off_t offset = (off_t)(sizeof(segment_header_t) + (recover_pos - seg->first) * sizeof(sensor_data_t));
+        size_t readings = read_all(recover_fd, out, n * sizeof(sensor_data_t), offset) / sizeof(sensor_data_t);
+
+        // A short read ends the segment there; the rest becomes a hole
+        if (readings < n) {
+            seg->count = recover_pos + readings - seg->first;
+        }
+        recover_pos += readings;
+        if (recover_pos == seg->first + seg->count) {
+            close(recover_fd);
+            recover_fd = -1;
+            tail_next++;
+        }
+
+        // Stage stamps of the last run mean nothing in this one
+        for (size_t i = 0; i < readings; i++) {
+            out[i].received = 0;
+            out[i].insert_ns = 0;
+        }
+
+        if (readings > 0) {
+            handed_out += readings;
+            stats_count(&stat_recovered, readings);
+            return readings;
+        }
+    }
+
+    if (recover_pos < recover_end) {
+        add_gap(recover_end - recover_pos);
+    }
+    return 0;
+ }
+
+ void journal_checkpoint(size_t n) {
+    if (!opened || n == 0) {
+        return;
+    }
+
+    committed += n;
+    while (gap_next < gap_count && gaps[gap_next].after <= committed) {
+        checkpoint_base += gaps[gap_next].size;
+        gap_next++;
+    }
+    checkpoint = checkpoint_base + committed;
+    if (pwrite(checkpoint_fd, &checkpoint, sizeof(checkpoint), 0) != sizeof(checkpoint) && !checkpoint_failed) {
+        checkpoint_failed = true;
+        log_event(log_fd, "Journal checkpoint write failed (%s)", strerror(errno));
+    }
+
+    if (recovering && checkpoint >= recover_end) {
+        recovering = false;
+        uint64_t elapsed = stats_clock_ns() - open_ns;
+        atomic_store_explicit(&stat_recovery_ns, elapsed, memory_order_relaxed);
+        log_event(log_fd, "Recovered %llu readings from the journal in %.1f ms",
+                  (unsigned long long)handed_out, (double)elapsed / 1e6);
+    }
+
+    // Segments are deleted once the next one starts at or below the checkpoint
+    pthread_mutex_lock(&segment_lock);
+    size_t done = 0;
+    while (segment_count - done >= 2 && segments[done + 1] <= checkpoint) {
+        char path[320];
+        segment_path(path, sizeof(path), segments[done]);
+        unlink(path);
+        done++;
+    }
+    if (done > 0) {
+        segment_count -= done;
+        memmove(segments, segments + done, segment_count * sizeof(uint64_t));
+    }
+    pthread_mutex_unlock(&segment_lock);
+ }
+
+ void journal_get_stats(journal_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+
+    stats->readings = atomic_load_explicit(&stat_readings, memory_order_relaxed);
+    stats->writes = atomic_load_explicit(&stat_writes, memory_order_relaxed);
+    stats->syncs = atomic_load_explicit(&stat_syncs, memory_order_relaxed);
+    stats->recovered = atomic_load_explicit(&stat_recovered, memory_order_relaxed);
+    stats->recovery_ns = atomic_load_explicit(&stat_recovery_ns, memory_order_relaxed);
+ }
+
+ void journal_close(void) {
+    journal_commit();
+
+    if (sync_running) {
+        pthread_mutex_lock(&segment_lock);
+        sync_stop = true;
+        pthread_cond_signal(&sync_cond);
+        pthread_mutex_unlock(&segment_lock);
+        pthread_join(sync_thread, NULL);
+        pthread_cond_destroy(&sync_cond);
+        sync_running = false;
+    }
+    if (retired_fd >= 0) {
+        fdatasync(retired_fd);
+        close(retired_fd);
+        retired_fd = -1;
+    }
+    if (append_fd >= 0) {
+        fdatasync(append_fd);
+        close(append_fd);
+        append_fd = -1;
+    }
+    if (recover_fd >= 0) {
+        close(recover_fd);
+        recover_fd = -1;
+    }
+
+    // Everything committed: the next run starts from scratch
+    uint64_t end = atomic_load(&position);
+    if (opened && checkpoint >= end) {
+        char path[320];
+        for (size_t i = 0; i < segment_count; i++) {
+            segment_path(path, sizeof(path), segments[i]);
+            unlink(path);
+        }
+        journal_path(path, sizeof(path), CHECKPOINT_NAME);
+        unlink(path);
+        rmdir(journal_dir);
+    }
+    else if (opened) {
+        log_event(log_fd, "Journal keeps %llu readings not committed for the next run",
+                  (unsigned long long)(end - checkpoint));
+    }
+
+    if (checkpoint_fd >= 0) {
+        close(checkpoint_fd);
+        checkpoint_fd = -1;
+    }
+    free(segments);
+    free(tail);
+    segments = NULL;
+    tail = NULL;
+    segment_count = segment_capacity = 0;
+    tail_count = tail_next = 0;
+    gap_count = gap_next = 0;
+    staged_count = 0;
+    handed_out = 0;
+    recover_pos = recover_end = 0;
+    recovering = false;
+    checkpoint_failed = false;
+    opened = false;
+ }
+
+ static int find_tail(void) {
+    DIR *dir = opendir(journal_dir);
+    if (!dir) {
+        return -1;
+    }
+
+    size_t capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        // Segment names are the position of their first reading in hex
+        size_t len = strlen(entry->d_name);
+        char *end;
+        if (len != 16 + strlen(SEGMENT_SUFFIX) || strcmp(entry->d_name + 16, SEGMENT_SUFFIX) != 0) {
+            continue;
+        }
+        uint64_t first = strtoull(entry->d_name, &end, 16);
+        if (end != entry->d_name + 16) {
+            continue;
+        }
+
+        char path[320];
+        segment_header_t header;
+        struct stat st;
+        segment_path(path, sizeof(path), first);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        bool valid = fd >= 0 && read_all(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                     fstat(fd, &st) == 0 && header.magic == JOURNAL_MAGIC &&
+                     header.record_size == sizeof(sensor_data_t) && header.first == first;
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (!valid) {
+            log_event(log_fd, "Journal segment %s is not valid, ignoring it", path);
+            continue;
+        }
+
+        if (tail_count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            old_segment_t *grown = realloc(tail, capacity * sizeof(old_segment_t));
+            if (!grown) {
+                closedir(dir);
+                return -1;
+            }
+            tail = grown;
+        }
+        tail[tail_count].first = first;
+        tail[tail_count].count = ((uint64_t)st.st_size - sizeof(header)) / sizeof(sensor_data_t);
+        tail_count++;
+    }
+    closedir(dir);
+
+    qsort(tail, tail_count, sizeof(old_segment_t), compare_segments);
+    for (size_t i = 0; i < tail_count; i++) {
+        if (push_segment(tail[i].first) != 0) {
+            return -1;
+        }
+    }
+
+    // Only the segments with readings past the checkpoint are read back
+    size_t skip = 0;
+    while (skip < tail_count && tail[skip].first + tail[skip].count <= checkpoint) {
+        skip++;
+    }
+    recover_end = tail_count > 0 ? tail[tail_count - 1].first + tail[tail_count - 1].count : 0;
+    tail_count -= skip;
+    memmove(tail, tail + skip, tail_count * sizeof(old_segment_t));
+    recover_pos = checkpoint;
+    handed_out = 0;
+    return 0;
+ }
+
+ static int compare_segments(const void *a, const void *b) {
+    uint64_t x = ((const old_segment_t *)a)->first;
+    uint64_t y = ((const old_segment_t *)b)->first;
+    return (x > y) - (x < y);
+ }
+
+ static int start_segment(uint64_t first) {
+    char path[320];
+    segment_path(path, sizeof(path), first);
+
+    // An empty segment left at the same position is reused
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    segment_header_t header = { JOURNAL_MAGIC, sizeof(sensor_data_t), first };
+    if (fd < 0 || write_all(fd, &header, sizeof(header)) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    pthread_mutex_lock(&segment_lock);
+    if (push_segment(first) != 0) {
+        pthread_mutex_unlock(&segment_lock);
+        close(fd);
+        return -1;
+    }
+
+    // The sync thread syncs and closes the segment being replaced; one it
+    // has not got to yet is synced here
+    if (append_fd >= 0) {
+        if (retired_fd >= 0) {
+            fdatasync(retired_fd);
+            close(retired_fd);
+        }
+        retired_fd = append_fd;
+        if (!sync_running) {
+            close(retired_fd);
+            retired_fd = -1;
+        }
+    }
+    append_fd = fd;
+    segment_first = first;
+    pthread_mutex_unlock(&segment_lock);
+    return 0;
+ }
+
+ static int push_segment(uint64_t first) {
+    if (segment_count > 0 && segments[segment_count - 1] == first) {
+        return 0;
+    }
+
+    if (segment_count == segment_capacity) {
+        size_t capacity = segment_capacity ? segment_capacity * 2 : 16;
+        uint64_t *grown = realloc(segments, capacity * sizeof(uint64_t));
+        if (!grown) {
+            return -1;
+        }
+        segments = grown;
+        segment_capacity = capacity;
+    }
+    segments[segment_count++] = first;
+    return 0;
+ }
+
+ static void stop_appending(const char *what) {
+    log_event(log_fd, "Journal %s failed (%s), new readings are no longer journaled", what, strerror(errno));
+
+    pthread_mutex_lock(&segment_lock);
+    close(append_fd);
+    append_fd = -1;
+    pthread_mutex_unlock(&segment_lock);
+ }
+
+ static void* sync_run(void *arg) {
+    (void)arg;
+    uint64_t synced = atomic_load(&position);
+
+    pthread_mutex_lock(&segment_lock);
+    while (!sync_stop) {
+        uint64_t deadline = stats_clock_ns() + (uint64_t)JOURNAL_SYNC_MS * 1000000;
+        struct timespec ts = { .tv_sec = (time_t)(deadline / 1000000000ULL),
+                               .tv_nsec = (long)(deadline % 1000000000ULL) };
+        pthread_cond_timedwait(&sync_cond, &segment_lock, &ts);
+
+        uint64_t end = atomic_load_explicit(&position, memory_order_acquire);
+        if (sync_stop || (end == synced && retired_fd < 0)) {
+            continue;
+        }
+
+        // Sync outside the lock, so the appending thread never waits for the disk
+        int current = append_fd >= 0 ? dup(append_fd) : -1;
+        int retired = retired_fd;
+        retired_fd = -1;
+        pthread_mutex_unlock(&segment_lock);
+
+        if (retired >= 0) {
+            fdatasync(retired);
+            close(retired);
+        }
+        if (current >= 0) {
+            fdatasync(current);
+            close(current);
+        }
+        stats_count(&stat_syncs, 1);
+        synced = end;
+
+        pthread_mutex_lock(&segment_lock);
+    }
+    pthread_mutex_unlock(&segment_lock);
+    return NULL;
+ }
+
+ static void add_gap(uint64_t size) {
+    // The last hole tracked takes in the rest of the old readings
+    if (gap_count == MAX_GAPS - 1) {
+        size = recover_end - recover_pos;
+        tail_next = tail_count;
+        if (recover_fd >= 0) {
+            close(recover_fd);
+            recover_fd = -1;
+        }
+    }
+    gaps[gap_count++] = (gap_t){ handed_out, size };
+    recover_pos += size;
+ }
+
+ static void segment_path(char *path, size_t size, uint64_t first) {
+    snprintf(path, size, "%s/%016llx" SEGMENT_SUFFIX, journal_dir, (unsigned long long)first);
+ }
+
+ static void journal_path(char *path, size_t size, const char *name) {
+    snprintf(path, size, "%s/%s", journal_dir, name);
+ }
+
+ static int write_all(int fd, const void *data, size_t len) {
+    const char *buf = data;
+
+    for (size_t done = 0; done < len;) {
+        ssize_t n = write(fd, buf + done, len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+ }
+
+ static size_t read_all(int fd, void *data, size_t len, off_t offset) {
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = pread(fd, (char *)data + done, len - done, offset + (off_t)done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += (size_t)n;
+    }
+    return done;
+ }
@@ -0,0 +1,119 @@
+/**
+ * @file latency.c
+ * @brief Latency histogram implementation
+ */
+
+ #include <stdatomic.h>
+ #include <time.h>
+ #include "config.h"
+ #include "latency.h"
+ #include "stats.h"
+
+ static latency_hist_t stages[LATENCY_STAGES];
+ static const char *stage_names[LATENCY_STAGES] = { "receive", "insert", "process", "commit", "gateway", "total" };
+
+ // Local function prototypes
+ static unsigned int bucket_of(uint64_t ns);
+ static uint64_t bucket_limit(unsigned int bucket);
+
+ void latency_record(latency_hist_t *hist, int64_t ns) {
+    latency_record_n(hist, ns, 1);
+ }
+
+ void latency_record_n(latency_hist_t *hist, int64_t ns, uint64_t n) {
+    if (!LATENCY_RECORD) {
+        return;
+    }
+
+    uint64_t value = ns > 0 ? (uint64_t)ns : 0;
+
+    stats_count(&hist->counts[bucket_of(value)], n);
+    stats_count(&hist->total, n);
+    if (value > atomic_load_explicit(&hist->max, memory_order_relaxed)) {
+        atomic_store_explicit(&hist->max, value, memory_order_relaxed);
+    }
+ }
+
+ uint64_t latency_percentile(const latency_hist_t *hist, double percentile) {
+    uint64_t total = atomic_load_explicit(&hist->total, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+
+    if (total == 0) {
+        return 0;
+    }
+
+    // Rank of the percentile, at least the first latency
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)total + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for (unsigned int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += atomic_load_explicit(&hist->counts[b], memory_order_relaxed);
+        if (seen >= rank) {
+            uint64_t limit = bucket_limit(b);
+            return limit < max ? limit : max;
+        }
+    }
+    return max;
+ }
+
+ void latency_interval(const latency_hist_t *hist, latency_hist_t *last, latency_hist_t *out) {
+    uint64_t total = 0;
+    uint64_t max = 0;
+
+    // Buckets are read one by one while the writer goes on, so the total
+    // is summed from them rather than read on its own
+    for (unsigned int b = 0; b < LATENCY_BUCKETS; b++) {
+        uint64_t now = atomic_load_explicit(&hist->counts[b], memory_order_relaxed);
+        uint64_t before = atomic_load_explicit(&last->counts[b], memory_order_relaxed);
+        atomic_store_explicit(&out->counts[b], now - before, memory_order_relaxed);
+        atomic_store_explicit(&last->counts[b], now, memory_order_relaxed);
+        if (now != before) {
+            max = bucket_limit(b);
+        }
+        total += now - before;
+    }
+
+    uint64_t hist_max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+    atomic_store_explicit(&out->total, total, memory_order_relaxed);
+    atomic_store_explicit(&out->max, max < hist_max ? max : hist_max, memory_order_relaxed);
+ }
+
+ latency_hist_t *latency_stage(latency_stage_t stage) {
+    return &stages[stage];
+ }
+
+ const char *latency_stage_name(latency_stage_t stage) {
+    return stage_names[stage];
+ }
+
+ int64_t latency_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+ }
+
+ static unsigned int bucket_of(uint64_t ns) {
+    // Values below LATENCY_SUB_BUCKETS have a bucket each; above, the top
+    // LATENCY_SUB_BITS bits after the leading one pick the sub-bucket
+    if (ns < LATENCY_SUB_BUCKETS) {
+        return (unsigned int)ns;
+    }
+
+    unsigned int msb = 63 - (unsigned int)__builtin_clzll(ns);
+    unsigned int sub = (unsigned int)(ns >> (msb - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1);
+    return (msb - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS + sub;
+ }
+
+ static uint64_t bucket_limit(unsigned int bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    unsigned int msb = bucket / LATENCY_SUB_BUCKETS + LATENCY_SUB_BITS - 1;
+    uint64_t sub = bucket % LATENCY_SUB_BUCKETS;
+    uint64_t low = (LATENCY_SUB_BUCKETS + sub) << (msb - LATENCY_SUB_BITS);
+    return low + (1ULL << (msb - LATENCY_SUB_BITS)) - 1;
+ }
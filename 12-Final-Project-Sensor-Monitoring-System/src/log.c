@@ -0,0 +1,868 @@
+/**
+ * @file log.c
+ * @brief Log process and log event implementation
+ */
+
+ #define _GNU_SOURCE
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <stdarg.h>
+ #include <stdbool.h>
+ #include <stddef.h>
+ #include <stdint.h>
+ #include <string.h>
+ #include <errno.h>
+ #include <fcntl.h>
+ #include <limits.h>
+ #include <poll.h>
+ #include <signal.h>
+ #include <stdatomic.h>
+ #include <time.h>
+ #include <linux/futex.h>
+ #include <sys/eventfd.h>
+ #include <sys/mman.h>
+ #include <sys/stat.h>
+ #include <sys/syscall.h>
+ #include "config.h"
+ #include "log.h"
+ #include "stats.h"
+
+ // Input and output buffers of the log process
+ #define READ_BUFFER_SIZE (1024 * 1024)
+ #define WRITE_BUFFER_SIZE (1024 * 1024)
+
+ // Longest message; longer ones are truncated
+ #define MESSAGE_MAX (PIPE_BUF - 2)
+
+ // Room for one line: sequence number, timestamp, message and newline
+ #define LINE_MAX_SIZE (64 + MESSAGE_MAX + 2)
+
+ // Longest conversion specification
+ #define SPEC_MAX 32
+
+ /**
+  * Header of a log record, followed by the arguments in 8-byte words.
+  * A string argument is its length, then its bytes padded to a word.
+  */
+ typedef struct {
+     uint32_t size;                  // Record size in bytes, a multiple of 8
+     uint32_t kind;                  // RECORD_EVENT, or RECORD_PADDING in the ring
+     const char *format;             // Valid in the log process, see log.h
+     int64_t ts;                     // Time of the event, ns since the epoch
+ } record_t;
+
+ enum {
+     RECORD_EVENT,
+     RECORD_PADDING                  // Skips the end of the ring; size and kind only
+ };
+
+ /**
+  * Shared-memory ring between the gateway and the log process.
+  * Producers reserve space by advancing head with a CAS, copy their
+  * records in and commit the first one by storing its size last. The
+  * log process reads committed records at tail, zeroes them so sizes
+  * read as uncommitted on the next lap, and advances tail.
+  */
+ typedef struct {
+     _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t head;     // Bytes reserved
+     _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t tail;     // Bytes read and zeroed
+     _Atomic uint32_t released;                           // Futex word, bumped as tail moves
+     _Atomic uint32_t space_waiters;                      // Producers waiting for space
+     _Alignas(CACHE_LINE_SIZE) _Atomic uint32_t sleeping; // Set by the log process about to sleep
+     _Atomic uint32_t closed;                             // Set by log_close()
+     _Alignas(CACHE_LINE_SIZE) uint8_t data[];
+ } ring_t;
+
+ /**
+  * Output side of the log process
+  */
+ typedef struct {
+     int fd;
+     char *buffer;
+     size_t used;
+     bool unsynced;                  // Written since the last fdatasync()
+     uint64_t last_sync;
+     unsigned long sequence;
+     int result;
+ } writer_t;
+
+ typedef enum {
+     ARG_NONE,                       // %%
+     ARG_SIGNED,
+     ARG_UNSIGNED,
+     ARG_DOUBLE,
+     ARG_STRING,
+     ARG_POINTER,
+     ARG_INVALID                     // Not supported in records
+ } arg_type_t;
+
+ typedef enum {
+     LEN_INT,                        // None, h or hh: passed as an int
+     LEN_LONG,
+     LEN_LONG_LONG,
+     LEN_SIZE,
+     LEN_INTMAX,
+     LEN_PTRDIFF,
+     LEN_LONG_DOUBLE
+ } arg_length_t;
+
+ /**
+  * A conversion specification of a format
+  */
+ typedef struct {
+     const char *start;              // The '%'
+     const char *length;             // The length modifier, if any
+     const char *end;                // The conversion character
+     arg_type_t type;
+     arg_length_t length_kind;
+ } spec_t;
+
+ // Format of the records carrying text formatted by the caller
+ static const char text_format[] = "%s";
+
+ // The ring and the eventfd that wakes its reader, after log_start_shm()
+ static ring_t *ring = NULL;
+ static int ring_fd = -1;
+
+ // Events held back by the calling thread
+ static _Thread_local struct {
+     uint64_t data[PIPE_BUF / sizeof(uint64_t)];
+     size_t used;
+     int fd;
+     bool held;
+ } batch;
+
+ // Local function prototypes
+ static int create_fifo(const char *fifo_path);
+ static const char *parse_spec(const char *p, spec_t *spec);
+ static size_t encode(uint64_t *record, const char *format, va_list *args);
+ static size_t encode_args(uint64_t *record, const char *format, ...);
+ static uint64_t scalar_arg(va_list *args, const spec_t *spec);
+ static int flush_batch(void);
+ static int send_records(int fd, const void *data, size_t size);
+ static int ring_send(const void *data, size_t size);
+ static void ring_wait_space(void);
+ static int write_all(int fd, const void *data, size_t size);
+ static int log_process(const char *fifo_path, const char *log_file);
+ static int log_process_shm(const char *log_file, pid_t parent);
+ static int writer_open(writer_t *w, const char *log_file);
+ static void writer_add(writer_t *w, const record_t *record);
+ static void writer_flush(writer_t *w);
+ static int writer_wait(writer_t *w, int fd, int max_ms);
+ static int writer_close(writer_t *w);
+ static size_t format_line(const record_t *record, unsigned long sequence, char *out);
+ static size_t format_message(const record_t *record, char *out, size_t room);
+
+ pid_t log_start(const char *fifo_path, const char *log_file) {
+    if (!fifo_path || !log_file || create_fifo(fifo_path) != 0) {
+        return -1;
+    }
+
+    // The child must not write out the parent's buffered output again
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid != 0) {
+        // Parent (or fork failure)
+        return pid;
+    }
+
+    // Child: log until every writer has closed the FIFO
+    exit(log_process(fifo_path, log_file) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+ }
+
+ pid_t log_start_shm(const char *log_file) {
+    if (!log_file || ring) {
+        return -1;
+    }
+
+    // Shared with the child by fork(), so no name is needed
+    ring = mmap(NULL, sizeof(ring_t) + LOG_SHM_SIZE, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        ring = NULL;
+        return -1;
+    }
+
+    ring_fd = eventfd(0, EFD_CLOEXEC);
+    fflush(NULL);
+    pid_t pid = ring_fd < 0 ? -1 : fork();
+    if (pid < 0) {
+        if (ring_fd >= 0) {
+            close(ring_fd);
+        }
+        munmap(ring, sizeof(ring_t) + LOG_SHM_SIZE);
+        ring = NULL;
+        ring_fd = -1;
+        return -1;
+    }
+    if (pid != 0) {
+        return pid;
+    }
+
+    // Child: log until the gateway closes the ring, or exits
+    exit(log_process_shm(log_file, getppid()) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+ }
+
+ int log_open_shm(void) {
+    return ring ? ring_fd : -1;
+ }
+
+ int log_close(int fd) {
+    if (fd < 0) {
+        return -1;
+    }
+    if (fd != ring_fd) {
+        return close(fd);
+    }
+
+    atomic_store_explicit(&ring->closed, 1, memory_order_release);
+    uint64_t one = 1;
+    ssize_t written = write(ring_fd, &one, sizeof(one));
+    (void)written;
+
+    close(ring_fd);
+    munmap(ring, sizeof(ring_t) + LOG_SHM_SIZE);
+    ring = NULL;
+    ring_fd = -1;
+    return 0;
+ }
+
+ int log_open_fifo(const char *fifo_path) {
+    if (!fifo_path || create_fifo(fifo_path) != 0) {
+        return -1;
+    }
+
+    // Blocks until the log process opens the FIFO for reading
+    int fd = open(fifo_path, O_WRONLY | O_CLOEXEC);
+
+    // A larger pipe absorbs bursts; the system may cap it, which is fine
+    if (fd >= 0) {
+        fcntl(fd, F_SETPIPE_SZ, LOG_PIPE_SIZE);
+    }
+    return fd;
+ }
+
+ int log_event(int fd, const char *format, ...) {
+    uint64_t record[PIPE_BUF / sizeof(uint64_t)];
+    va_list args, copy;
+
+    if (fd < 0 || !format) {
+        return -1;
+    }
+
+    va_start(args, format);
+    va_copy(copy, args);
+    size_t size = encode(record, format, &args);
+    if (size == 0) {
+        // A conversion records cannot carry: send the text instead
+        char text[MESSAGE_MAX + 1];
+        vsnprintf(text, sizeof(text), format, copy);
+        size = encode_args(record, text_format, text);
+    }
+    va_end(copy);
+    va_end(args);
+
+    if (!batch.held) {
+        return send_records(fd, record, size);
+    }
+
+    int result = 0;
+    if (batch.used > 0 && (batch.fd != fd || batch.used + size > sizeof(batch.data))) {
+        result = flush_batch();
+    }
+    memcpy((uint8_t *)batch.data + batch.used, record, size);
+    batch.used += size;
+    batch.fd = fd;
+    return result;
+ }
+
+ void log_batch_begin(void) {
+    batch.held = true;
+ }
+
+ int log_batch_end(void) {
+    batch.held = false;
+    return flush_batch();
+ }
+
+ static int create_fifo(const char *fifo_path) {
+    if (mkfifo(fifo_path, 0666) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+ }
+
+ static const char *parse_spec(const char *p, spec_t *spec) {
+    spec->start = p++;
+    spec->type = ARG_INVALID;
+    spec->length_kind = LEN_INT;
+
+    if (*p == '%') {
+        spec->type = ARG_NONE;
+        spec->length = spec->end = p;
+        return p + 1;
+    }
+
+    // Flags, width and precision are kept as they are, except '*'
+    p += strspn(p, "-+ #0'");
+    if (*p == '*') {
+        spec->length = spec->end = p;
+        return p;
+    }
+    p += strspn(p, "0123456789");
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec->length = spec->end = p;
+            return p;
+        }
+        p += strspn(p, "0123456789");
+    }
+
+    spec->length = p;
+    switch (*p) {
+        case 'h': p += p[1] == 'h' ? 2 : 1; break;
+        case 'l':
+            spec->length_kind = p[1] == 'l' ? LEN_LONG_LONG : LEN_LONG;
+            p += p[1] == 'l' ? 2 : 1;
+            break;
+        case 'q': spec->length_kind = LEN_LONG_LONG; p++; break;
+        case 'z': spec->length_kind = LEN_SIZE; p++; break;
+        case 'j': spec->length_kind = LEN_INTMAX; p++; break;
+        case 't': spec->length_kind = LEN_PTRDIFF; p++; break;
+        case 'L': spec->length_kind = LEN_LONG_DOUBLE; p++; break;
+        default: break;
+    }
+    spec->end = p;
+
+    switch (*p) {
+        case 'd': case 'i':
+            spec->type = spec->length_kind == LEN_LONG_DOUBLE ? ARG_INVALID : ARG_SIGNED;
+            break;
+        case 'u': case 'o': case 'x': case 'X':
+            spec->type = spec->length_kind == LEN_LONG_DOUBLE ? ARG_INVALID : ARG_UNSIGNED;
+            break;
+        case 'c':
+            spec->type = spec->length == p ? ARG_UNSIGNED : ARG_INVALID;
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            spec->type = spec->length_kind == LEN_LONG_DOUBLE ? ARG_INVALID : ARG_DOUBLE;
+            break;
+        case 's':
+            spec->type = spec->length == p ? ARG_STRING : ARG_INVALID;
+            break;
+        case 'p':
+            spec->type = spec->length == p ? ARG_POINTER : ARG_INVALID;
+            break;
+        default:
+            // %n, wide characters and the end of the string
+            return p;
+    }
+
+    if (spec->end - spec->start > SPEC_MAX - 4) {
+        spec->type = ARG_INVALID;
+    }
+    return p + 1;
+ }
+
+ static size_t encode(uint64_t *record, const char *format, va_list *args) {
+    const size_t max_words = PIPE_BUF / sizeof(uint64_t);
+    size_t words = sizeof(record_t) / sizeof(uint64_t);
+    const char *p = format;
+    spec_t spec;
+
+    while ((p = strchr(p, '%'))) {
+        p = parse_spec(p, &spec);
+        if (spec.type == ARG_NONE) {
+            continue;
+        }
+        if (spec.type == ARG_INVALID || words >= max_words) {
+            return 0;
+        }
+
+        if (spec.type == ARG_STRING) {
+            const char *s = va_arg(*args, const char *);
+            if (!s) {
+                s = "(null)";
+            }
+
+            // Strings are cut to what is left of the record
+            size_t len = strlen(s);
+            size_t room = (max_words - words - 1) * sizeof(uint64_t);
+            if (len > room) {
+                len = room;
+            }
+
+            record[words++] = len;
+            if (len > 0) {
+                record[words + (len - 1) / sizeof(uint64_t)] = 0;
+                memcpy(&record[words], s, len);
+            }
+            words += (len + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+        }
+        else {
+            record[words++] = scalar_arg(args, &spec);
+        }
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    record_t *header = (record_t *)record;
+    header->size = (uint32_t)(words * sizeof(uint64_t));
+    header->kind = RECORD_EVENT;
+    header->format = format;
+    header->ts = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+    return header->size;
+ }
+
+ static size_t encode_args(uint64_t *record, const char *format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    size_t size = encode(record, format, &args);
+    va_end(args);
+    return size;
+ }
+
+ static uint64_t scalar_arg(va_list *args, const spec_t *spec) {
+    if (spec->type == ARG_DOUBLE) {
+        double value = va_arg(*args, double);
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        return bits;
+    }
+
+    if (spec->type == ARG_POINTER) {
+        return (uint64_t)(uintptr_t)va_arg(*args, void *);
+    }
+
+    // Integers are widened to 64 bits, sign-extended if signed
+    bool is_signed = spec->type == ARG_SIGNED;
+    switch (spec->length_kind) {
+        case LEN_LONG:
+            return is_signed ? (uint64_t)va_arg(*args, long) : (uint64_t)va_arg(*args, unsigned long);
+        case LEN_LONG_LONG:
+            return is_signed ? (uint64_t)va_arg(*args, long long) : (uint64_t)va_arg(*args, unsigned long long);
+        case LEN_SIZE:
+            return is_signed ? (uint64_t)va_arg(*args, ssize_t) : (uint64_t)va_arg(*args, size_t);
+        case LEN_INTMAX:
+            return is_signed ? (uint64_t)va_arg(*args, intmax_t) : (uint64_t)va_arg(*args, uintmax_t);
+        case LEN_PTRDIFF:
+            return (uint64_t)va_arg(*args, ptrdiff_t);
+        default:
+            return is_signed ? (uint64_t)(int64_t)va_arg(*args, int) : (uint64_t)va_arg(*args, unsigned int);
+    }
+ }
+
+ static int flush_batch(void) {
+    if (batch.used == 0) {
+        return 0;
+    }
+
+    int result = send_records(batch.fd, batch.data, batch.used);
+    batch.used = 0;
+    return result;
+ }
+
+ static int send_records(int fd, const void *data, size_t size) {
+    if (ring && fd == ring_fd) {
+        return ring_send(data, size);
+    }
+    return write_all(fd, data, size);
+ }
+
+ static int ring_send(const void *data, size_t size) {
+    const uint64_t capacity = LOG_SHM_SIZE;
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t start;
+    size_t pad;
+
+    // Reserve contiguous space, padding out the end of the ring if needed
+    for (;;) {
+        uint64_t offset = head & (capacity - 1);
+        pad = offset + size > capacity ? (size_t)(capacity - offset) : 0;
+
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head + pad + size - tail > capacity) {
+            ring_wait_space();
+            head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&ring->head, &head, head + pad + size,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+            break;
+        }
+    }
+
+    if (pad > 0) {
+        record_t *padding = (record_t *)(ring->data + (head & (capacity - 1)));
+        padding->kind = RECORD_PADDING;
+        atomic_store_explicit((_Atomic uint32_t *)&padding->size, (uint32_t)pad, memory_order_release);
+    }
+    start = head + pad;
+
+    // Everything but the first size word, then that word to commit it all
+    uint8_t *dst = ring->data + (start & (capacity - 1));
+    memcpy(dst + sizeof(uint32_t), (const uint8_t *)data + sizeof(uint32_t), size - sizeof(uint32_t));
+    atomic_store_explicit((_Atomic uint32_t *)dst, ((const record_t *)data)->size, memory_order_release);
+
+    // Only wake the log process if it is about to sleep or asleep
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->sleeping, memory_order_relaxed) &&
+        atomic_exchange_explicit(&ring->sleeping, 0, memory_order_relaxed)) {
+        uint64_t one = 1;
+        if (write(ring_fd, &one, sizeof(one)) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+ }
+
+ static void ring_wait_space(void) {
+    // The ring is full: sleep until the log process frees space
+    struct timespec timeout = { .tv_sec = 0, .tv_nsec = 1000000 };
+    uint32_t released = atomic_load_explicit(&ring->released, memory_order_acquire);
+
+    atomic_fetch_add_explicit(&ring->space_waiters, 1, memory_order_seq_cst);
+    syscall(SYS_futex, &ring->released, FUTEX_WAIT, released, &timeout, NULL, 0);
+    atomic_fetch_sub_explicit(&ring->space_waiters, 1, memory_order_relaxed);
+ }
+
+ static int write_all(int fd, const void *data, size_t size) {
+    // A write of at most PIPE_BUF bytes to a FIFO is atomic and complete
+    const uint8_t *p = data;
+
+    while (size > 0) {
+        ssize_t written = write(fd, p, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += written;
+        size -= (size_t)written;
+    }
+    return 0;
+ }
+
+ static int log_process(const char *fifo_path, const char *log_file) {
+    // The gateway decides when to stop; the log ends when it closes the FIFO
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+
+    int in = open(fifo_path, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return -1;
+    }
+
+    writer_t w;
+    uint8_t *input = malloc(READ_BUFFER_SIZE);
+    if (!input || writer_open(&w, log_file) != 0) {
+        free(input);
+        close(in);
+        return -1;
+    }
+
+    size_t have = 0;
+
+    for (;;) {
+        writer_wait(&w, in, -1);
+
+        size_t want = READ_BUFFER_SIZE - have;
+        ssize_t n = read(in, input + have, want);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            w.result = -1;
+            break;
+        }
+        if (n == 0) {
+            // Every writer has closed the FIFO
+            break;
+        }
+        have += (size_t)n;
+
+        // Records are whole multiples of 8 bytes, so they stay aligned
+        size_t pos = 0;
+        while (have - pos >= sizeof(record_t)) {
+            const record_t *record = (const record_t *)(input + pos);
+            if (record->size < sizeof(record_t) || record->size > PIPE_BUF ||
+                record->size % sizeof(uint64_t) != 0) {
+                // Only a foreign writer can cause this; drop what was read
+                pos = have;
+                break;
+            }
+            if (record->size > have - pos) {
+                break;
+            }
+            writer_add(&w, record);
+            pos += record->size;
+        }
+        memmove(input, input + pos, have - pos);
+        have -= pos;
+
+        // Group commit: once the FIFO is drained, write everything formatted
+        if ((size_t)n < want) {
+            writer_flush(&w);
+        }
+    }
+
+    free(input);
+    close(in);
+    return writer_close(&w);
+ }
+
+ static int log_process_shm(const char *log_file, pid_t parent) {
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+
+    writer_t w;
+    if (writer_open(&w, log_file) != 0) {
+        return -1;
+    }
+
+    const uint64_t capacity = LOG_SHM_SIZE;
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    for (;;) {
+        uint64_t start = tail;
+
+        // Read every committed record, zeroing it behind us
+        for (;;) {
+            uint8_t *p = ring->data + (tail & (capacity - 1));
+            uint32_t size = atomic_load_explicit((_Atomic uint32_t *)p, memory_order_acquire);
+            if (size == 0) {
+                break;
+            }
+
+            const record_t *record = (const record_t *)p;
+            if (record->kind == RECORD_EVENT) {
+                writer_add(&w, record);
+            }
+            memset(p, 0, size);
+            tail += size;
+        }
+
+        if (tail != start) {
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+            atomic_fetch_add_explicit(&ring->released, 1, memory_order_seq_cst);
+            if (atomic_load_explicit(&ring->space_waiters, memory_order_seq_cst) > 0) {
+                syscall(SYS_futex, &ring->released, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+            }
+            continue;
+        }
+
+        // Drained: write what was formatted, then stop or sleep
+        writer_flush(&w);
+        if (atomic_load_explicit(&ring->closed, memory_order_acquire) &&
+            atomic_load_explicit(&ring->head, memory_order_acquire) == tail) {
+            break;
+        }
+
+        atomic_store_explicit(&ring->sleeping, 1, memory_order_seq_cst);
+        uint32_t size = atomic_load_explicit((_Atomic uint32_t *)(ring->data + (tail & (capacity - 1))),
+                                             memory_order_seq_cst);
+        if (size != 0 || atomic_load_explicit(&ring->closed, memory_order_seq_cst)) {
+            atomic_store_explicit(&ring->sleeping, 0, memory_order_relaxed);
+            continue;
+        }
+
+        // Wake up now and then to notice a gateway that died without closing
+        int ready = writer_wait(&w, ring_fd, LOG_SYNC_MS);
+        atomic_store_explicit(&ring->sleeping, 0, memory_order_relaxed);
+        if (ready > 0) {
+            uint64_t count;
+            ssize_t got = read(ring_fd, &count, sizeof(count));
+            (void)got;
+        }
+        else if (getppid() != parent) {
+            break;
+        }
+    }
+
+    return writer_close(&w);
+ }
+
+ static int writer_open(writer_t *w, const char *log_file) {
+    memset(w, 0, sizeof(*w));
+    w->fd = open(log_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    w->buffer = malloc(WRITE_BUFFER_SIZE);
+    w->last_sync = stats_clock_ns() / 1000000;
+
+    if (w->fd < 0 || !w->buffer) {
+        if (w->fd >= 0) {
+            close(w->fd);
+        }
+        free(w->buffer);
+        return -1;
+    }
+    return 0;
+ }
+
+ static void writer_add(writer_t *w, const record_t *record) {
+    if (WRITE_BUFFER_SIZE - w->used < LINE_MAX_SIZE) {
+        writer_flush(w);
+    }
+    w->used += format_line(record, w->sequence++, w->buffer + w->used);
+ }
+
+ static void writer_flush(writer_t *w) {
+    if (w->used > 0) {
+        if (write_all(w->fd, w->buffer, w->used) != 0) {
+            w->result = -1;
+        }
+        w->used = 0;
+        w->unsynced = true;
+    }
+
+    if (w->unsynced && stats_clock_ns() / 1000000 - w->last_sync >= LOG_SYNC_MS) {
+        fdatasync(w->fd);
+        w->unsynced = false;
+        w->last_sync = stats_clock_ns() / 1000000;
+    }
+ }
+
+ static int writer_wait(writer_t *w, int fd, int max_ms) {
+    // Sync what was written once no event arrives for the rest of the period
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int timeout = max_ms;
+
+    if (w->unsynced) {
+        uint64_t elapsed = stats_clock_ns() / 1000000 - w->last_sync;
+        timeout = elapsed >= LOG_SYNC_MS ? 0 : (int)(LOG_SYNC_MS - elapsed);
+    }
+
+    int ready = poll(&pfd, 1, timeout);
+    if (ready == 0 && w->unsynced) {
+        fdatasync(w->fd);
+        w->unsynced = false;
+        w->last_sync = stats_clock_ns() / 1000000;
+        if (max_ms < 0) {
+            ready = poll(&pfd, 1, -1);
+        }
+    }
+    return ready;
+ }
+
+ static int writer_close(writer_t *w) {
+    writer_flush(w);
+    fdatasync(w->fd);
+    close(w->fd);
+    free(w->buffer);
+    return w->result;
+ }
+
+ static size_t format_line(const record_t *record, unsigned long sequence, char *out) {
+    // Timestamps change once a second, so the text is reused until then
+    static time_t cached_second = -1;
+    static char cached_text[32];
+    static size_t cached_len = 0;
+
+    time_t second = (time_t)(record->ts / 1000000000LL);
+    if (second != cached_second) {
+        struct tm tm;
+        localtime_r(&second, &tm);
+        cached_len = strftime(cached_text, sizeof(cached_text), "%Y-%m-%d %H:%M:%S", &tm);
+        cached_second = second;
+    }
+
+    size_t len = (size_t)snprintf(out, LINE_MAX_SIZE, "%lu ", sequence);
+    memcpy(out + len, cached_text, cached_len);
+    len += cached_len;
+    out[len++] = ' ';
+
+    len += format_message(record, out + len, MESSAGE_MAX);
+    out[len++] = '\n';
+    return len;
+ }
+
+ static size_t format_message(const record_t *record, char *out, size_t room) {
+    const uint64_t *arg = (const uint64_t *)(record + 1);
+    const uint64_t *last = (const uint64_t *)((const uint8_t *)record + record->size);
+    const char *p = record->format;
+    size_t len = 0;
+
+    // out has room + 1 bytes, for the terminator snprintf() writes
+    while (*p && len < room) {
+        const char *percent = strchrnul(p, '%');
+        size_t n = (size_t)(percent - p);
+        if (n > room - len) {
+            n = room - len;
+        }
+        memcpy(out + len, p, n);
+        len += n;
+        if (!*percent || len == room) {
+            break;
+        }
+
+        spec_t spec;
+        p = parse_spec(percent, &spec);
+        if (spec.type == ARG_NONE) {
+            out[len++] = '%';
+            continue;
+        }
+        if (spec.type == ARG_INVALID || arg >= last) {
+            break;
+        }
+
+        // Rebuild the specification, with "ll" for every wide integer
+        char format[SPEC_MAX];
+        size_t prefix = (size_t)(spec.length - spec.start);
+        memcpy(format, spec.start, prefix);
+        bool wide = (spec.type == ARG_SIGNED || spec.type == ARG_UNSIGNED) && spec.length_kind != LEN_INT;
+        if (wide) {
+            memcpy(format + prefix, "ll", 2);
+            prefix += 2;
+        }
+        else {
+            memcpy(format + prefix, spec.length, (size_t)(spec.end - spec.length));
+            prefix += (size_t)(spec.end - spec.length);
+        }
+        format[prefix++] = *spec.end;
+        format[prefix] = '\0';
+
+        int written;
+        uint64_t value = *arg++;
+        switch (spec.type) {
+            case ARG_STRING: {
+                char text[PIPE_BUF];
+                size_t words = (value + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+                if (value >= sizeof(text) || words > (size_t)(last - arg)) {
+                    return len;
+                }
+                memcpy(text, arg, value);
+                text[value] = '\0';
+                arg += words;
+                written = snprintf(out + len, room - len + 1, format, text);
+                break;
+            }
+            case ARG_DOUBLE: {
+                double d;
+                memcpy(&d, &value, sizeof(d));
+                written = snprintf(out + len, room - len + 1, format, d);
+                break;
+            }
+            case ARG_POINTER:
+                written = snprintf(out + len, room - len + 1, format, (void *)(uintptr_t)value);
+                break;
+            case ARG_SIGNED:
+                written = wide ? snprintf(out + len, room - len + 1, format, (long long)value)
+                               : snprintf(out + len, room - len + 1, format, (int)value);
+                break;
+            default:
+                written = wide ? snprintf(out + len, room - len + 1, format, (unsigned long long)value)
+                               : snprintf(out + len, room - len + 1, format, (unsigned int)value);
+                break;
+        }
+
+        if (written < 0) {
+            break;
+        }
+        len += (size_t)written > room - len ? room - len : (size_t)written;
+    }
+
+    return len;
+ }
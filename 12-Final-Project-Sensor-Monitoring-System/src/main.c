@@ -0,0 +1,255 @@
+/**
+ * @file main.c
+ * @brief Sensor gateway entry point
+ */
+
+ #include <stdbool.h>
+ #include <errno.h>
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <signal.h>
+ #include <pthread.h>
+ #include <unistd.h>
+ #include <sys/wait.h>
+ #include "anomaly.h"
+ #include "config.h"
+ #include "connmgr.h"
+ #include "datamgr.h"
+ #include "journal.h"
+ #include "latency.h"
+ #include "log.h"
+ #include "querysrv.h"
+ #include "sbuffer.h"
+ #include "storagemgr.h"
+
+ // Local function prototypes
+ static void print_stats(sbuffer_t *buffer);
+ static void print_latency(const char *stage, const latency_hist_t *hist);
+ static void wait_for_signal(const sigset_t *signals, int log_fd);
+
+ int main(int argc, char *argv[]) {
+    const char *storage = STORAGE_BACKEND;
+    const char *transport = LOG_TRANSPORT;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:l:")) != -1) {
+        if (opt == 's') {
+            storage = optarg;
+        }
+        else if (opt == 'l') {
+            transport = optarg;
+        }
+        else {
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-s sqlite|tsdb] [-l shm|fifo] <port>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int port = atoi(argv[optind]);
+    if (port <= 0 || port > 65535) {
+        fprintf(stderr, "Invalid port: %s\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    const storage_backend_t *backend = storagemgr_find_backend(storage);
+    if (!backend) {
+        fprintf(stderr, "Unknown storage backend: %s\n", storage);
+        return EXIT_FAILURE;
+    }
+
+    bool use_shm = strcmp(transport, "shm") == 0;
+    if (!use_shm && strcmp(transport, "fifo") != 0) {
+        fprintf(stderr, "Unknown log transport: %s\n", transport);
+        return EXIT_FAILURE;
+    }
+
+    pid_t log_pid = use_shm ? log_start_shm(LOG_FILE) : log_start(LOG_FIFO, LOG_FILE);
+    if (log_pid < 0) {
+        perror("log_start");
+        return EXIT_FAILURE;
+    }
+
+    int log_fd = use_shm ? log_open_shm() : log_open_fifo(LOG_FIFO);
+    if (log_fd < 0) {
+        perror("log_open");
+        return EXIT_FAILURE;
+    }
+
+    if (datamgr_init(ROOM_MAP_FILE, log_fd) != 0) {
+        fprintf(stderr, "Failed to load the room map %s or the thresholds %s\n", ROOM_MAP_FILE,
+                ROOM_ANOMALY_FILE);
+        return EXIT_FAILURE;
+    }
+
+    // The gateway can run without a journal, but not crash-safely
+    if (journal_open(JOURNAL_DIR, log_fd) != 0) {
+        perror("Failed to open the journal in " JOURNAL_DIR);
+    }
+
+    // After a crash, the store is kept and the journal completes it
+    if (storagemgr_open(backend, NULL, journal_backlog() == 0, log_fd) != 0) {
+        fprintf(stderr, "Failed to open the %s store %s\n", backend->name, backend->default_path);
+        return EXIT_FAILURE;
+    }
+
+    sbuffer_t *buffer = NULL;
+    if (sbuffer_init(&buffer, SBUFFER_CAPACITY) != SBUFFER_SUCCESS) {
+        fprintf(stderr, "Failed to create the shared buffer\n");
+        return EXIT_FAILURE;
+    }
+
+    // Signals are handled by sigwait() below, never by the worker threads
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (datamgr_start(buffer) != 0 || storagemgr_start(buffer) != 0) {
+        perror("Failed to start the gateway threads");
+        return EXIT_FAILURE;
+    }
+
+    // The gateway can run without answering queries
+    if (querysrv_start(QUERY_SOCKET, log_fd) != 0) {
+        perror("Failed to start the query service on " QUERY_SOCKET);
+    }
+
+    if (connmgr_start(port, buffer, log_fd) != 0) {
+        perror("connmgr_start");
+        sbuffer_close(buffer);
+    }
+    else {
+        printf("Sensor gateway listening on port %d\n", port);
+        fflush(stdout);
+
+        wait_for_signal(&signals, log_fd);
+        connmgr_stop();
+    }
+
+    // The connection manager closed the buffer; readers drain it and stop
+    querysrv_stop();
+    datamgr_wait();
+    storagemgr_wait();
+
+    // Closing the store writes what it held back, then the journal can go
+    storagemgr_close();
+    journal_close();
+
+    print_stats(buffer);
+    sbuffer_free(&buffer);
+    datamgr_free();
+
+    // Closing the last writer ends the log process
+    log_close(log_fd);
+    waitpid(log_pid, NULL, 0);
+
+    return EXIT_SUCCESS;
+ }
+
+ static void print_stats(sbuffer_t *buffer) {
+    connmgr_stats_t conn;
+    datamgr_stats_t data;
+    storagemgr_stats_t db;
+    sbuffer_stats_t sb;
+    querysrv_stats_t query;
+    anomaly_stats_t anomaly;
+    journal_stats_t journal;
+
+    connmgr_get_stats(&conn);
+    datamgr_get_stats(&data);
+    storagemgr_get_stats(&db);
+    sbuffer_get_stats(buffer, &sb);
+    querysrv_get_stats(&query);
+    anomaly_get_stats(&anomaly);
+    journal_get_stats(&journal);
+
+    printf("Connections: %llu accepted, %llu active, %llu timed out\n",
+           (unsigned long long)conn.accepted, (unsigned long long)conn.active,
+           (unsigned long long)conn.timeouts);
+    printf("Received: %llu readings, %llu bytes in %llu wake-ups\n",
+           (unsigned long long)conn.readings, (unsigned long long)conn.bytes,
+           (unsigned long long)conn.wakeups);
+    printf("Shared buffer: %llu published, %llu writer sleeps\n",
+           (unsigned long long)sb.published, (unsigned long long)sb.writer_sleeps);
+    printf("Data manager: %llu readings from %llu sensors, %llu invalid, %llu too cold, %llu too hot\n",
+           (unsigned long long)data.readings, (unsigned long long)data.sensors,
+           (unsigned long long)data.invalid, (unsigned long long)data.too_cold,
+           (unsigned long long)data.too_hot);
+    printf("Rollups: %llu buckets closed, %llu stored, %llu late readings\n",
+           (unsigned long long)data.rollups, (unsigned long long)db.rollups,
+           (unsigned long long)data.late);
+    printf("Anomalies: %llu spikes, %llu drifts, %llu stuck sensors, %llu alerts suppressed\n",
+           (unsigned long long)anomaly.spikes, (unsigned long long)anomaly.drifts,
+           (unsigned long long)anomaly.stuck, (unsigned long long)anomaly.suppressed);
+    printf("Storage: %llu rows in %llu flushes, %llu failed, %.0f rows/s while busy\n",
+           (unsigned long long)db.rows, (unsigned long long)db.flushes,
+           (unsigned long long)db.failures,
+           db.busy_ns ? (double)db.rows * 1e9 / (double)db.busy_ns : 0.0);
+    printf("Flush latency: %.3f ms average, %.3f ms max\n",
+           db.flushes ? (double)db.flush_ns / (double)db.flushes / 1e6 : 0.0,
+           (double)db.flush_max_ns / 1e6);
+    printf("Spill: %llu readings spilled in %llu backlogs, %llu replayed, %.1f MiB at most\n",
+           (unsigned long long)db.spilled, (unsigned long long)db.spills,
+           (unsigned long long)db.replayed, (double)db.spill_peak / (1 << 20));
+    printf("Journal: %llu readings in %llu writes, %llu syncs, %llu recovered in %.1f ms\n",
+           (unsigned long long)journal.readings, (unsigned long long)journal.writes,
+           (unsigned long long)journal.syncs, (unsigned long long)journal.recovered,
+           (double)journal.recovery_ns / 1e6);
+    printf("Queries: %llu answered, %llu errors, %llu clients\n",
+           (unsigned long long)query.queries, (unsigned long long)query.errors,
+           (unsigned long long)query.connections);
+
+    // Service time of a query, from its request to its answer
+    print_latency("query", querysrv_get_latency());
+
+    // Time spent in each stage of the gateway, from the sensor timestamp on
+    for (int s = 0; s < LATENCY_STAGES; s++) {
+        print_latency(latency_stage_name((latency_stage_t)s), latency_stage((latency_stage_t)s));
+    }
+ }
+
+ static void print_latency(const char *stage, const latency_hist_t *hist) {
+    printf("Latency, %s: p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms\n", stage,
+           (double)latency_percentile(hist, 50) / 1e6, (double)latency_percentile(hist, 99) / 1e6,
+           (double)latency_percentile(hist, 99.9) / 1e6, (double)latency_percentile(hist, 100) / 1e6);
+ }
+
+ static void wait_for_signal(const sigset_t *signals, int log_fd) {
+    static latency_hist_t last[LATENCY_STAGES];
+    static latency_hist_t interval;
+    struct timespec period = { LATENCY_REPORT_MS / 1000, (LATENCY_REPORT_MS % 1000) * 1000000L };
+    int sig;
+
+    if (LATENCY_REPORT_MS == 0) {
+        sigwait(signals, &sig);
+        return;
+    }
+
+    // Until a signal comes, write the stage latencies of every period to the log
+    while (sigtimedwait(signals, NULL, &period) < 0) {
+        if (errno != EAGAIN) {
+            continue;
+        }
+
+        for (int s = 0; s < LATENCY_STAGES; s++) {
+            latency_interval(latency_stage((latency_stage_t)s), &last[s], &interval);
+            if (interval.total == 0) {
+                continue;
+            }
+            log_event(log_fd, "Latency of the %s stage over the last %d ms: %llu readings, p50 %.3f ms, "
+                      "p99 %.3f ms, p99.9 %.3f ms, max %.3f ms", latency_stage_name((latency_stage_t)s),
+                      LATENCY_REPORT_MS, (unsigned long long)interval.total,
+                      (double)latency_percentile(&interval, 50) / 1e6,
+                      (double)latency_percentile(&interval, 99) / 1e6,
+                      (double)latency_percentile(&interval, 99.9) / 1e6,
+                      (double)latency_percentile(&interval, 100) / 1e6);
+        }
+    }
+ }
@@ -0,0 +1,192 @@
+/**
+ * @file phash.c
+ * @brief Minimal perfect hash construction (hash and displace)
+ */
+
+ #include <stdlib.h>
+ #include <string.h>
+ #include <stdbool.h>
+ #include "phash.h"
+
+ // Average ids per bucket; more makes the table smaller and the build slower
+ #define BUCKET_LOAD 4
+
+ // Displacements tried for one bucket before the build starts over with a new seed
+ #define MAX_DISPLACE (1u << 22)
+
+ // Seeds tried before giving up
+ #define MAX_SEEDS 16
+
+ /**
+  * Scratch space of a build
+  */
+ typedef struct {
+     const sensor_id_t *keys;
+     size_t count;
+     size_t buckets;
+     uint32_t *hashes;                       // First hash of every id
+     uint32_t *order;                        // Ids grouped by bucket
+     uint32_t *start;                        // First position of each bucket in order, and the end
+     uint64_t *by_size;                      // Size << 32 | bucket, largest bucket first
+     uint8_t *taken;                         // Index already given to an id
+     uint32_t *displace;
+     sensor_id_t *slots;
+ } build_t;
+
+ // Local function prototypes
+ static bool has_duplicates(const sensor_id_t *keys, size_t count);
+ static int place(build_t *b, uint32_t seed);
+ static bool try_displace(build_t *b, uint32_t bucket, uint32_t d, uint32_t *indexes);
+ static int compare_desc(const void *a, const void *b);
+
+ int phash_build(phash_t *ph, const sensor_id_t *keys, size_t count) {
+    if (!ph || (!keys && count > 0)) {
+        return -1;
+    }
+    memset(ph, 0, sizeof(*ph));
+    if (count >= PHASH_NONE || has_duplicates(keys, count)) {
+        return -1;
+    }
+
+    build_t b = { .keys = keys, .count = count, .buckets = 1 };
+    while (b.buckets * BUCKET_LOAD < count) {
+        b.buckets *= 2;
+    }
+
+    // Every array gets at least one element so an empty set still looks up
+    size_t n = count ? count : 1;
+    b.hashes = malloc(n * sizeof(uint32_t));
+    b.order = malloc(n * sizeof(uint32_t));
+    b.start = malloc((b.buckets + 1) * sizeof(uint32_t));
+    b.by_size = malloc(b.buckets * sizeof(uint64_t));
+    b.taken = malloc(n);
+    b.displace = calloc(b.buckets, sizeof(uint32_t));
+    b.slots = calloc(n, sizeof(sensor_id_t));
+
+    uint32_t seed = 0;
+    int ret = -1;
+    if (b.hashes && b.order && b.start && b.by_size && b.taken && b.displace && b.slots) {
+        for (uint32_t attempt = 0; attempt < MAX_SEEDS && ret != 0; attempt++) {
+            seed = phash_mix(attempt + 1);
+            ret = place(&b, seed);
+        }
+    }
+
+    free(b.hashes);
+    free(b.order);
+    free(b.start);
+    free(b.by_size);
+    free(b.taken);
+    if (ret != 0) {
+        free(b.displace);
+        free(b.slots);
+        return -1;
+    }
+
+    ph->seed = seed;
+    ph->mask = (uint32_t)(b.buckets - 1);
+    ph->size = (uint32_t)count;
+    ph->displace = b.displace;
+    ph->keys = b.slots;
+    return 0;
+ }
+
+ void phash_free(phash_t *ph) {
+    if (ph) {
+        free((void *)ph->displace);
+        free((void *)ph->keys);
+        memset(ph, 0, sizeof(*ph));
+    }
+ }
+
+ static bool has_duplicates(const sensor_id_t *keys, size_t count) {
+    // Ids are 16 bits, so one bit per possible id is 8 KiB
+    static uint64_t seen[(1 << (8 * sizeof(sensor_id_t))) / 64];
+    bool duplicate = false;
+
+    memset(seen, 0, sizeof(seen));
+    for (size_t i = 0; i < count && !duplicate; i++) {
+        uint64_t bit = 1ULL << (keys[i] % 64);
+        duplicate = (seen[keys[i] / 64] & bit) != 0;
+        seen[keys[i] / 64] |= bit;
+    }
+    return duplicate;
+ }
+
+ static int place(build_t *b, uint32_t seed) {
+    uint32_t mask = (uint32_t)(b->buckets - 1);
+    uint32_t indexes[256];
+
+    // Group the ids by bucket with a counting sort
+    memset(b->start, 0, (b->buckets + 1) * sizeof(uint32_t));
+    for (size_t i = 0; i < b->count; i++) {
+        b->hashes[i] = phash_mix((uint32_t)b->keys[i] ^ seed);
+        b->start[b->hashes[i] & mask]++;
+    }
+    for (size_t k = 1; k < b->buckets; k++) {
+        b->start[k] += b->start[k - 1];
+    }
+    for (size_t i = 0; i < b->count; i++) {
+        b->order[--b->start[b->hashes[i] & mask]] = (uint32_t)i;
+    }
+    b->start[b->buckets] = (uint32_t)b->count;
+
+    for (size_t k = 0; k < b->buckets; k++) {
+        uint32_t size = b->start[k + 1] - b->start[k];
+        if (size > sizeof(indexes) / sizeof(indexes[0])) {
+            return -1;
+        }
+        b->by_size[k] = (uint64_t)size << 32 | k;
+    }
+
+    // Place the largest buckets first, while most indexes are still free
+    qsort(b->by_size, b->buckets, sizeof(uint64_t), compare_desc);
+    memset(b->taken, 0, b->count ? b->count : 1);
+
+    for (size_t k = 0; k < b->buckets; k++) {
+        uint32_t bucket = (uint32_t)b->by_size[k];
+        if ((b->by_size[k] >> 32) == 0) {
+            break;
+        }
+
+        uint32_t d = 0;
+        while (d < MAX_DISPLACE && !try_displace(b, bucket, d, indexes)) {
+            d++;
+        }
+        if (d == MAX_DISPLACE) {
+            return -1;
+        }
+
+        b->displace[bucket] = d;
+        for (uint32_t pos = b->start[bucket]; pos < b->start[bucket + 1]; pos++) {
+            b->slots[indexes[pos - b->start[bucket]]] = b->keys[b->order[pos]];
+        }
+    }
+    return 0;
+ }
+
+ static bool try_displace(build_t *b, uint32_t bucket, uint32_t d, uint32_t *indexes) {
+    uint32_t first = b->start[bucket];
+    uint32_t n = b->start[bucket + 1] - first;
+
+    // Take the indexes one by one, and give them back if one is in use
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t h = b->hashes[b->order[first + i]];
+        uint32_t index = (uint32_t)(((uint64_t)phash_mix(h ^ d) * b->count) >> 32);
+        if (b->taken[index]) {
+            while (i-- > 0) {
+                b->taken[indexes[i]] = 0;
+            }
+            return false;
+        }
+        b->taken[index] = 1;
+        indexes[i] = index;
+    }
+    return true;
+ }
+
+ static int compare_desc(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x < y) - (x > y);
+ }
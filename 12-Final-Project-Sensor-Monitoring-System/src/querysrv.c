@@ -0,0 +1,359 @@
+/**
+ * @file querysrv.c
+ * @brief Query service implementation (Unix socket, epoll loop)
+ */
+
+ #define _GNU_SOURCE
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <stdbool.h>
+ #include <stdatomic.h>
+ #include <string.h>
+ #include <errno.h>
+ #include <pthread.h>
+ #include <time.h>
+ #include <unistd.h>
+ #include <sys/epoll.h>
+ #include <sys/eventfd.h>
+ #include <sys/socket.h>
+ #include <sys/un.h>
+ #include "querysrv.h"
+ #include "datamgr.h"
+ #include "log.h"
+ #include "stats.h"
+
+ // Events handled per wake-up
+ #define MAX_EVENTS 64
+
+ // Longest request line, newline included
+ #define REQUEST_SIZE 256
+
+ // Most buckets an answer can hold: all those of one resolution in memory
+ #define MAX_ROLLUPS (ROLLUP_KEEP_MINUTES + ROLLUP_KEEP_HOURS + ROLLUP_KEEP_DAYS + 1)
+
+ // Room for the longest answer
+ #define REPLY_SIZE (MAX_ROLLUPS * 128 + 128)
+
+ // epoll tags of the descriptors that are not clients
+ #define TAG_LISTEN UINT64_MAX
+ #define TAG_STOP (UINT64_MAX - 1)
+
+ /**
+  * Client connection with its partial request
+  */
+ typedef struct {
+     int fd;                         // Socket, -1 when the slot is free
+     size_t len;                     // Bytes in request
+     char request[REQUEST_SIZE];
+ } client_t;
+
+ static int listen_fd = -1;
+ static int epoll_fd = -1;
+ static int stop_fd = -1;
+ static pthread_t server_thread;
+ static bool running = false;
+ static char socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+ static int log_fd = -1;
+ static client_t clients[QUERY_MAX_CLIENTS];
+
+ // Counters written by the service, readable from any thread
+ static _Atomic uint64_t stat_connections;
+ static _Atomic uint64_t stat_queries;
+ static _Atomic uint64_t stat_errors;
+ static latency_hist_t query_latency;
+
+ // Local function prototypes
+ static void* serve(void *arg);
+ static int create_socket(const char *path);
+ static void accept_client(void);
+ static void handle_readable(client_t *client);
+ static bool answer(client_t *client, char *line);
+ static size_t format_answer(char *line, char *reply, size_t size);
+ static int parse_resolution(const char *name);
+ static void close_client(client_t *client);
+
+ int querysrv_start(const char *path, int fd) {
+    if (!path || strlen(path) >= sizeof(socket_path) || running) {
+        return -1;
+    }
+
+    log_fd = fd;
+    snprintf(socket_path, sizeof(socket_path), "%s", path);
+    for (int i = 0; i < QUERY_MAX_CLIENTS; i++) {
+        clients[i].fd = -1;
+    }
+
+    listen_fd = create_socket(path);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (listen_fd < 0 || epoll_fd < 0 || stop_fd < 0) {
+        querysrv_stop();
+        return -1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = TAG_LISTEN };
+    struct epoll_event stop_ev = { .events = EPOLLIN, .data.u64 = TAG_STOP };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &stop_ev) < 0 ||
+        pthread_create(&server_thread, NULL, serve, NULL) != 0) {
+        querysrv_stop();
+        return -1;
+    }
+
+    running = true;
+    return 0;
+ }
+
+ void querysrv_stop(void) {
+    static const uint64_t one = 1;
+
+    if (running && write(stop_fd, &one, sizeof(one)) == sizeof(one)) {
+        pthread_join(server_thread, NULL);
+    }
+    running = false;
+
+    for (int i = 0; i < QUERY_MAX_CLIENTS; i++) {
+        close_client(&clients[i]);
+    }
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        listen_fd = -1;
+        unlink(socket_path);
+    }
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+    if (stop_fd >= 0) {
+        close(stop_fd);
+        stop_fd = -1;
+    }
+ }
+
+ void querysrv_get_stats(querysrv_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+
+    stats->connections = atomic_load_explicit(&stat_connections, memory_order_relaxed);
+    stats->queries = atomic_load_explicit(&stat_queries, memory_order_relaxed);
+    stats->errors = atomic_load_explicit(&stat_errors, memory_order_relaxed);
+ }
+
+ const latency_hist_t *querysrv_get_latency(void) {
+    return &query_latency;
+ }
+
+ static void* serve(void *arg) {
+    (void)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (;;) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_event(log_fd, "Query service stopped: epoll_wait failed (%s)", strerror(errno));
+            return NULL;
+        }
+
+        for (int i = 0; i < n; i++) {
+            uint64_t tag = events[i].data.u64;
+
+            if (tag == TAG_STOP) {
+                return NULL;
+            }
+            if (tag == TAG_LISTEN) {
+                accept_client();
+            }
+            else {
+                handle_readable(&clients[tag]);
+            }
+        }
+    }
+ }
+
+ static int create_socket(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // A socket file left by a gateway that did not stop cleanly
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, QUERY_MAX_CLIENTS) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+ }
+
+ static void accept_client(void) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+
+    for (int i = 0; i < QUERY_MAX_CLIENTS; i++) {
+        if (clients[i].fd >= 0) {
+            continue;
+        }
+
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.u64 = (uint64_t)i };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            break;
+        }
+        clients[i].fd = fd;
+        clients[i].len = 0;
+        stats_count(&stat_connections, 1);
+        return;
+    }
+
+    // No free slot
+    close(fd);
+ }
+
+ static void handle_readable(client_t *client) {
+    if (client->fd < 0) {
+        return;
+    }
+
+    ssize_t n = recv(client->fd, client->request + client->len, sizeof(client->request) - client->len, 0);
+    if (n <= 0) {
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return;
+        }
+        close_client(client);
+        return;
+    }
+    client->len += (size_t)n;
+
+    // Answer every complete line; a client may pipeline requests
+    size_t start = 0;
+    for (size_t i = 0; i < client->len; i++) {
+        if (client->request[i] != '\n') {
+            continue;
+        }
+        client->request[i] = '\0';
+        if (!answer(client, client->request + start)) {
+            close_client(client);
+            return;
+        }
+        start = i + 1;
+    }
+
+    client->len -= start;
+    memmove(client->request, client->request + start, client->len);
+    if (client->len == sizeof(client->request)) {
+        close_client(client);
+    }
+ }
+
+ static bool answer(client_t *client, char *line) {
+    static char reply[REPLY_SIZE];
+    uint64_t start = stats_clock_ns();
+
+    size_t len = format_answer(line, reply, sizeof(reply) - 1);
+    reply[len++] = '\n';
+
+    // Answers are small; a client that cannot take one at once is dropped
+    // rather than allowed to stall the other clients
+    ssize_t sent = send(client->fd, reply, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    latency_record(&query_latency, (int64_t)(stats_clock_ns() - start));
+    stats_count(&stat_queries, 1);
+    return sent == (ssize_t)len;
+ }
+
+ static size_t format_answer(char *line, char *reply, size_t size) {
+    static rollup_t rollups[MAX_ROLLUPS];
+    char command[16];
+    char name[16];
+    unsigned int id;
+    long long from = INT64_MIN;
+    long long to = INT64_MAX;
+    datamgr_sensor_t sensor;
+    const char *error = "unknown command";
+    int fields = sscanf(line, "%15s %u %15s %lld %lld", command, &id, name, &from, &to);
+
+    if (fields >= 2 && id <= UINT16_MAX && strcmp(command, "latest") == 0) {
+        if (datamgr_get_sensor((sensor_id_t)id, &sensor) != 0) {
+            error = "unknown sensor";
+        }
+        else if (sensor.readings == 0) {
+            error = "no reading";
+        }
+        else {
+            return (size_t)snprintf(reply, size, "%u %u %lld %.3f\n", sensor.id, sensor.room,
+                                    (long long)sensor.ts, sensor.value);
+        }
+    }
+    else if (fields >= 2 && id <= UINT16_MAX && strcmp(command, "average") == 0) {
+        if (datamgr_get_sensor((sensor_id_t)id, &sensor) != 0) {
+            error = "unknown sensor";
+        }
+        else {
+            return (size_t)snprintf(reply, size, "%u %u %.3f %u\n", sensor.id, sensor.room,
+                                    sensor.average, sensor.readings);
+        }
+    }
+    else if (fields >= 3 && id <= UINT16_MAX && strcmp(command, "rollup") == 0) {
+        int resolution = parse_resolution(name);
+        if (resolution < 0) {
+            error = "unknown resolution";
+        }
+        else if (datamgr_get_sensor((sensor_id_t)id, &sensor) != 0) {
+            error = "unknown sensor";
+        }
+        else {
+            size_t n = datamgr_get_rollups((sensor_id_t)id, (rollup_resolution_t)resolution,
+                                           (sensor_ts_t)from, (sensor_ts_t)to, rollups, MAX_ROLLUPS);
+            size_t len = 0;
+            for (size_t i = 0; i < n && len < size; i++) {
+                const rollup_t *r = &rollups[i];
+                len += (size_t)snprintf(reply + len, size - len, "%lld %u %.3f %.3f %.3f\n",
+                                        (long long)r->start, r->count, r->min, r->max,
+                                        r->sum / (double)r->count);
+            }
+            return len < size ? len : size;
+        }
+    }
+    else if (fields >= 1 && strcmp(command, "latency") == 0) {
+        size_t len = 0;
+        for (int s = 0; s < LATENCY_STAGES && len < size; s++) {
+            const latency_hist_t *hist = latency_stage((latency_stage_t)s);
+            len += (size_t)snprintf(reply + len, size - len, "%s %llu %llu %llu %llu %llu\n",
+                                    latency_stage_name((latency_stage_t)s),
+                                    (unsigned long long)atomic_load_explicit(&hist->total, memory_order_relaxed),
+                                    (unsigned long long)latency_percentile(hist, 50),
+                                    (unsigned long long)latency_percentile(hist, 99),
+                                    (unsigned long long)latency_percentile(hist, 99.9),
+                                    (unsigned long long)latency_percentile(hist, 100));
+        }
+        return len < size ? len : size;
+    }
+
+    stats_count(&stat_errors, 1);
+    return (size_t)snprintf(reply, size, "error %s\n", error);
+ }
+
+ static int parse_resolution(const char *name) {
+    static const char *names[ROLLUP_RESOLUTIONS] = { "minute", "hour", "day" };
+
+    for (int r = 0; r < ROLLUP_RESOLUTIONS; r++) {
+        if (strcmp(name, names[r]) == 0) {
+            return r;
+        }
+    }
+    return -1;
+ }
+
+ static void close_client(client_t *client) {
+    if (client->fd >= 0) {
+        close(client->fd);
+        client->fd = -1;
+    }
+ }
@@ -0,0 +1,203 @@
+/**
+ * @file rollup.c
+ * @brief Per-sensor rollup implementation
+ */
+
+ #include <stdlib.h>
+ #include <string.h>
+ #include "rollup.h"
+
+ // Closed buckets kept in memory per sensor and resolution
+ static const uint32_t ring_length[ROLLUP_RESOLUTIONS] = {
+    ROLLUP_KEEP_MINUTES, ROLLUP_KEEP_HOURS, ROLLUP_KEEP_DAYS
+ };
+
+ /**
+  * Buckets of every sensor. The open bucket of a slot and resolution is
+  * open[slot * ROLLUP_RESOLUTIONS + resolution]. While it has no
+  * readings, its start is the end of the last closed bucket, so any
+  * earlier reading is late.
+  */
+ typedef struct {
+     size_t sensors;
+     rollup_t *open;
+     rollup_t *rings[ROLLUP_RESOLUTIONS];        // ring_length[r] buckets per slot
+     uint32_t *ring_next[ROLLUP_RESOLUTIONS];    // Next position in the ring of a slot
+     uint32_t *ring_count[ROLLUP_RESOLUTIONS];   // Buckets in the ring of a slot
+     seqlock_t *seqs;                            // Sequence counter of a slot, owned by the caller
+     rollup_emit_t emit;
+ } rollups_t;
+
+ static rollups_t state;
+
+ // Local function prototypes
+ static void close_bucket(uint32_t slot, int resolution, rollup_t *bucket);
+ static sensor_ts_t bucket_start(sensor_ts_t ts, sensor_ts_t width);
+
+ int rollup_init(size_t sensors, rollup_emit_t emit, seqlock_t *seqs) {
+    memset(&state, 0, sizeof(state));
+    if (sensors == 0) {
+        sensors = 1;
+    }
+
+    state.sensors = sensors;
+    state.emit = emit;
+    state.seqs = seqs;
+    state.open = calloc(sensors * ROLLUP_RESOLUTIONS, sizeof(rollup_t));
+    if (!state.open || !seqs) {
+        rollup_free();
+        return -1;
+    }
+
+    for (int r = 0; r < ROLLUP_RESOLUTIONS; r++) {
+        state.rings[r] = calloc(sensors * ring_length[r], sizeof(rollup_t));
+        state.ring_next[r] = calloc(sensors, sizeof(uint32_t));
+        state.ring_count[r] = calloc(sensors, sizeof(uint32_t));
+        if (!state.rings[r] || !state.ring_next[r] || !state.ring_count[r]) {
+            rollup_free();
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; i < sensors * ROLLUP_RESOLUTIONS; i++) {
+        state.open[i].start = INT64_MIN;
+        state.open[i].resolution = (uint8_t)(i % ROLLUP_RESOLUTIONS);
+    }
+    return 0;
+ }
+
+ bool rollup_add(uint32_t slot, sensor_id_t id, sensor_ts_t ts, sensor_value_t value) {
+    rollup_t *buckets = state.open + (size_t)slot * ROLLUP_RESOLUTIONS;
+    bool late = false;
+
+    for (int r = 0; r < ROLLUP_RESOLUTIONS; r++) {
+        rollup_t *b = &buckets[r];
+
+        if (ts < b->start) {
+            late |= r == ROLLUP_MINUTE;
+            continue;
+        }
+
+        if (b->count > 0 && ts - b->start >= rollup_width(r)) {
+            close_bucket(slot, r, b);
+        }
+
+        if (b->count == 0) {
+            b->start = bucket_start(ts, rollup_width(r));
+            b->sensor_id = id;
+            b->min = value;
+            b->max = value;
+            b->sum = value;
+            b->count = 1;
+            continue;
+        }
+
+        b->min = value < b->min ? value : b->min;
+        b->max = value > b->max ? value : b->max;
+        b->sum += value;
+        b->count++;
+    }
+
+    return late;
+ }
+
+ size_t rollup_expire(sensor_ts_t now) {
+    size_t closed = 0;
+
+    for (size_t i = 0; i < state.sensors * ROLLUP_RESOLUTIONS; i++) {
+        rollup_t *b = &state.open[i];
+        int r = (int)(i % ROLLUP_RESOLUTIONS);
+
+        if (b->count > 0 && now - b->start >= rollup_width(r) + (sensor_ts_t)ROLLUP_GRACE_MS * 1000000) {
+            uint32_t slot = (uint32_t)(i / ROLLUP_RESOLUTIONS);
+            seqlock_write_begin(&state.seqs[slot]);
+            close_bucket(slot, r, b);
+            seqlock_write_end(&state.seqs[slot]);
+            closed++;
+        }
+    }
+    return closed;
+ }
+
+ size_t rollup_close_all(void) {
+    size_t closed = 0;
+
+    for (size_t i = 0; i < state.sensors * ROLLUP_RESOLUTIONS; i++) {
+        if (state.open[i].count > 0) {
+            uint32_t slot = (uint32_t)(i / ROLLUP_RESOLUTIONS);
+            seqlock_write_begin(&state.seqs[slot]);
+            close_bucket(slot, (int)(i % ROLLUP_RESOLUTIONS), &state.open[i]);
+            seqlock_write_end(&state.seqs[slot]);
+            closed++;
+        }
+    }
+    return closed;
+ }
+
+ size_t rollup_history(uint32_t slot, rollup_resolution_t resolution, sensor_ts_t from, sensor_ts_t to,
+                       rollup_t *out, size_t max) {
+    if (slot >= state.sensors || resolution >= ROLLUP_RESOLUTIONS || !state.open) {
+        return 0;
+    }
+
+    const uint32_t length = ring_length[resolution];
+    const rollup_t *ring = state.rings[resolution] + (size_t)slot * length;
+    const rollup_t *open = &state.open[(size_t)slot * ROLLUP_RESOLUTIONS + resolution];
+    uint32_t seq;
+    size_t n;
+
+    // Copy, then start over if the data manager changed the slot meanwhile
+    do {
+        seq = seqlock_read_begin(&state.seqs[slot]);
+        uint32_t count = state.ring_count[resolution][slot];
+        uint32_t pos = (state.ring_next[resolution][slot] + length - count) % length;
+        n = 0;
+
+        for (uint32_t k = 0; k < count && n < max; k++) {
+            const rollup_t *b = &ring[(pos + k) % length];
+            if (b->start >= from && b->start <= to) {
+                out[n++] = *b;
+            }
+        }
+        if (open->count > 0 && open->start >= from && open->start <= to && n < max) {
+            out[n++] = *open;
+        }
+    } while (seqlock_read_retry(&state.seqs[slot], seq));
+
+    return n;
+ }
+
+ void rollup_free(void) {
+    free(state.open);
+    for (int r = 0; r < ROLLUP_RESOLUTIONS; r++) {
+        free(state.rings[r]);
+        free(state.ring_next[r]);
+        free(state.ring_count[r]);
+    }
+    memset(&state, 0, sizeof(state));
+ }
+
+ static void close_bucket(uint32_t slot, int resolution, rollup_t *bucket) {
+    const uint32_t length = ring_length[resolution];
+    uint32_t next = state.ring_next[resolution][slot];
+
+    state.rings[resolution][(size_t)slot * length + next] = *bucket;
+    state.ring_next[resolution][slot] = next + 1 == length ? 0 : next + 1;
+    if (state.ring_count[resolution][slot] < length) {
+        state.ring_count[resolution][slot]++;
+    }
+
+    if (state.emit) {
+        state.emit(bucket);
+    }
+
+    // Readings before the end of this bucket are late from now on
+    bucket->start += rollup_width(resolution);
+    bucket->count = 0;
+ }
+
+ static sensor_ts_t bucket_start(sensor_ts_t ts, sensor_ts_t width) {
+    // Round down, also for timestamps before the epoch
+    sensor_ts_t rem = ts % width;
+    return rem < 0 ? ts - rem - width : ts - rem;
+ }
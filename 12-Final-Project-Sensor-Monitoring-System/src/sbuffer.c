@@ -0,0 +1,410 @@
+/**
+ * @file sbuffer.c
+ * @brief Shared buffer implementation (single writer, multiple readers)
+ */
+
+ #include <stdatomic.h>
+ #include <stdbool.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <limits.h>
+ #include <time.h>
+ #include <unistd.h>
+ #include <linux/futex.h>
+ #include <sys/syscall.h>
+ #include "sbuffer.h"
+ #include "stats.h"
+
+ // Busy-wait iterations before a waiting thread goes to sleep
+ #define SPIN_LIMIT 2000
+
+ /**
+  * Cursors are sequence numbers that only grow; a sequence maps to the
+  * slot (sequence & mask). Each cursor sits on its own cache line, next
+  * to the private copy its owner keeps of the cursors it waits on, so a
+  * thread only touches another thread's line when its copy runs out.
+  */
+ typedef struct {
+     _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t cursor;   // Next sequence to read
+     uint64_t cached_published;                           // Last published value seen
+     _Atomic uint64_t sleeps;                             // Times this reader slept
+ } sbuffer_cursor_t;
+
+ /**
+  * A thread about to sleep reads seq, sets sleeping, checks its condition
+  * one last time, then sleeps as long as seq has not changed. The other
+  * side changes the condition, then wakes the sleepers only if it is the
+  * one to clear sleeping, so nothing is paid while nobody sleeps and a
+  * burst of updates costs a single wake-up.
+  */
+ typedef struct {
+     _Alignas(CACHE_LINE_SIZE) _Atomic uint32_t seq;      // Futex word
+     _Atomic uint32_t sleeping;                           // Set by threads about to sleep
+     _Atomic uint64_t wakeups;                            // Wake-up calls made
+ } sbuffer_waitq_t;
+
+ struct sbuffer {
+     // Written by the writer
+     _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t published; // Sequences below are readable
+     uint64_t claimed;                                     // Sequences below are claimed
+     uint64_t cached_min_reader;                           // Slowest reader seen by the writer
+     _Atomic uint64_t writer_sleeps;                       // Times the writer slept
+
+     // One line per reader
+     sbuffer_cursor_t readers[SBUFFER_READERS];
+
+     // Readers waiting for data, writer waiting for space
+     sbuffer_waitq_t data;
+     sbuffer_waitq_t space;
+
+     // Read-only after initialization, and the end of stream flag
+     _Alignas(CACHE_LINE_SIZE) _Atomic bool closed;
+     uint64_t capacity;
+     uint64_t mask;
+     sensor_data_t *slots;
+ };
+
+ // Local function prototypes
+ static inline void cpu_relax(void);
+ static uint32_t waitq_prepare(sbuffer_waitq_t *q);
+ static void waitq_sleep(sbuffer_waitq_t *q, uint32_t seq, const struct timespec *timeout);
+ static void waitq_wake(sbuffer_waitq_t *q);
+ static uint64_t wait_published(sbuffer_t *buffer, sbuffer_cursor_t *r, uint64_t seq,
+                                const struct timespec *deadline);
+ static bool time_left(const struct timespec *deadline, struct timespec *left);
+ static uint64_t min_reader_cursor(sbuffer_t *buffer);
+
+ int sbuffer_init(sbuffer_t **buffer, size_t capacity) {
+    if (!buffer || capacity == 0 || (capacity & (capacity - 1)) != 0) {
+        return SBUFFER_FAILURE;
+    }
+
+    sbuffer_t *b = aligned_alloc(CACHE_LINE_SIZE, sizeof(sbuffer_t));
+    if (!b) {
+        return SBUFFER_FAILURE;
+    }
+    memset(b, 0, sizeof(sbuffer_t));
+
+    // Slots are allocated once and reused for the lifetime of the buffer
+    size_t size = capacity * sizeof(sensor_data_t);
+    size = (size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+    b->slots = aligned_alloc(CACHE_LINE_SIZE, size);
+    if (!b->slots) {
+        free(b);
+        return SBUFFER_FAILURE;
+    }
+
+    b->capacity = capacity;
+    b->mask = capacity - 1;
+    atomic_init(&b->published, 0);
+    atomic_init(&b->writer_sleeps, 0);
+    atomic_init(&b->closed, false);
+    for (int i = 0; i < SBUFFER_READERS; i++) {
+        atomic_init(&b->readers[i].cursor, 0);
+        atomic_init(&b->readers[i].sleeps, 0);
+    }
+    atomic_init(&b->data.seq, 0);
+    atomic_init(&b->data.sleeping, 0);
+    atomic_init(&b->data.wakeups, 0);
+    atomic_init(&b->space.seq, 0);
+    atomic_init(&b->space.sleeping, 0);
+    atomic_init(&b->space.wakeups, 0);
+
+    *buffer = b;
+    return SBUFFER_SUCCESS;
+ }
+
+ int sbuffer_free(sbuffer_t **buffer) {
+    if (!buffer || !*buffer) {
+        return SBUFFER_FAILURE;
+    }
+
+    free((*buffer)->slots);
+    free(*buffer);
+    *buffer = NULL;
+    return SBUFFER_SUCCESS;
+ }
+
+ sensor_data_t *sbuffer_claim(sbuffer_t *buffer) {
+    uint64_t seq = buffer->claimed;
+
+    // The slot is free once the slowest reader is less than a lap behind
+    if (seq - buffer->cached_min_reader >= buffer->capacity) {
+        // Readers waiting for data would never release a slot
+        sbuffer_publish(buffer);
+
+        for (unsigned int spins = 0; ; spins++) {
+            buffer->cached_min_reader = min_reader_cursor(buffer);
+            if (seq - buffer->cached_min_reader < buffer->capacity) {
+                break;
+            }
+
+            if (spins < SPIN_LIMIT) {
+                cpu_relax();
+                continue;
+            }
+
+            // Register before the last check, so a release after it wakes us
+            uint32_t gen = waitq_prepare(&buffer->space);
+            if (seq - min_reader_cursor(buffer) >= buffer->capacity) {
+                atomic_fetch_add_explicit(&buffer->writer_sleeps, 1, memory_order_relaxed);
+                waitq_sleep(&buffer->space, gen, NULL);
+            }
+        }
+    }
+
+    buffer->claimed = seq + 1;
+    return &buffer->slots[seq & buffer->mask];
+ }
+
+ void sbuffer_publish(sbuffer_t *buffer) {
+    uint64_t published = atomic_load_explicit(&buffer->published, memory_order_relaxed);
+    if (buffer->claimed == published) {
+        return;
+    }
+
+    // Stamp the time from receive to publication; the slots are still in
+    // the writer's cache
+    uint64_t now = stats_clock_ns();
+    for (uint64_t seq = published; seq != buffer->claimed; seq++) {
+        sensor_data_t *slot = &buffer->slots[seq & buffer->mask];
+        uint64_t elapsed = slot->received ? now - slot->received : 0;
+        slot->insert_ns = elapsed < UINT32_MAX ? (uint32_t)elapsed : UINT32_MAX;
+    }
+
+    // The slot contents are visible before the new cursor, which is
+    // ordered before the check for sleeping readers
+    atomic_store(&buffer->published, buffer->claimed);
+    waitq_wake(&buffer->data);
+ }
+
+ int sbuffer_insert(sbuffer_t *buffer, const sensor_data_t *data) {
+    if (!buffer || !data) {
+        return SBUFFER_FAILURE;
+    }
+
+    *sbuffer_claim(buffer) = *data;
+    sbuffer_publish(buffer);
+    return SBUFFER_SUCCESS;
+ }
+
+ void sbuffer_close(sbuffer_t *buffer) {
+    if (!buffer) {
+        return;
+    }
+
+    sbuffer_publish(buffer);
+    atomic_store(&buffer->closed, true);
+    waitq_wake(&buffer->data);
+ }
+
+ int sbuffer_peek(sbuffer_t *buffer, sbuffer_reader_t reader, const sensor_data_t **data) {
+    size_t count;
+    return sbuffer_peek_batch(buffer, reader, data, 1, &count);
+ }
+
+ void sbuffer_release(sbuffer_t *buffer, sbuffer_reader_t reader) {
+    sbuffer_release_batch(buffer, reader, 1);
+ }
+
+ int sbuffer_peek_batch(sbuffer_t *buffer, sbuffer_reader_t reader,
+                        const sensor_data_t **data, size_t max, size_t *count) {
+    return sbuffer_peek_batch_timed(buffer, reader, data, max, count, -1);
+ }
+
+ int sbuffer_peek_batch_timed(sbuffer_t *buffer, sbuffer_reader_t reader,
+                              const sensor_data_t **data, size_t max, size_t *count,
+                              int timeout_ms) {
+    if (!buffer || !data || !count || max == 0 || reader < 0 || reader >= SBUFFER_READERS) {
+        return SBUFFER_FAILURE;
+    }
+
+    sbuffer_cursor_t *r = &buffer->readers[reader];
+    uint64_t seq = atomic_load_explicit(&r->cursor, memory_order_relaxed);
+
+    // Look for more readings only when the cached cursor cannot fill the batch
+    if (seq + max > r->cached_published) {
+        r->cached_published = atomic_load_explicit(&buffer->published, memory_order_acquire);
+        if (r->cached_published <= seq) {
+            struct timespec deadline;
+            if (timeout_ms >= 0) {
+                clock_gettime(CLOCK_MONOTONIC, &deadline);
+                deadline.tv_sec += timeout_ms / 1000;
+                deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+                if (deadline.tv_nsec >= 1000000000L) {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000L;
+                }
+            }
+
+            r->cached_published = wait_published(buffer, r, seq, timeout_ms >= 0 ? &deadline : NULL);
+            if (r->cached_published <= seq) {
+                return atomic_load(&buffer->closed) ? SBUFFER_NO_DATA : SBUFFER_TIMEOUT;
+            }
+        }
+    }
+
+    // A batch is contiguous in memory, so it stops at the end of the ring
+    uint64_t available = r->cached_published - seq;
+    uint64_t to_end = buffer->capacity - (seq & buffer->mask);
+    size_t n = max;
+    if (n > available) {
+        n = (size_t)available;
+    }
+    if (n > to_end) {
+        n = (size_t)to_end;
+    }
+
+    *data = &buffer->slots[seq & buffer->mask];
+    *count = n;
+    return SBUFFER_SUCCESS;
+ }
+
+ void sbuffer_release_batch(sbuffer_t *buffer, sbuffer_reader_t reader, size_t count) {
+    sbuffer_cursor_t *r = &buffer->readers[reader];
+    uint64_t seq = atomic_load_explicit(&r->cursor, memory_order_relaxed);
+
+    // The reader is done with the slots before the writer may reuse them,
+    // and the new cursor is ordered before the check for a sleeping writer
+    atomic_store(&r->cursor, seq + count);
+    waitq_wake(&buffer->space);
+ }
+
+ int sbuffer_remove(sbuffer_t *buffer, sbuffer_reader_t reader, sensor_data_t *data) {
+    const sensor_data_t *slot;
+
+    if (!data) {
+        return SBUFFER_FAILURE;
+    }
+
+    int result = sbuffer_peek(buffer, reader, &slot);
+    if (result != SBUFFER_SUCCESS) {
+        return result;
+    }
+
+    *data = *slot;
+    sbuffer_release(buffer, reader);
+    return SBUFFER_SUCCESS;
+ }
+
+ void sbuffer_get_stats(sbuffer_t *buffer, sbuffer_stats_t *stats) {
+    if (!buffer || !stats) {
+        return;
+    }
+
+    // Cursors are read before published, so lags are never negative
+    uint64_t cursors[SBUFFER_READERS];
+    for (int i = 0; i < SBUFFER_READERS; i++) {
+        cursors[i] = atomic_load_explicit(&buffer->readers[i].cursor, memory_order_acquire);
+    }
+    uint64_t published = atomic_load_explicit(&buffer->published, memory_order_acquire);
+
+    stats->capacity = buffer->capacity;
+    stats->published = published;
+    stats->occupancy = 0;
+
+    for (int i = 0; i < SBUFFER_READERS; i++) {
+        stats->lag[i] = published - cursors[i];
+        if (stats->lag[i] > stats->occupancy) {
+            stats->occupancy = stats->lag[i];
+        }
+        stats->reader_sleeps[i] = atomic_load_explicit(&buffer->readers[i].sleeps, memory_order_relaxed);
+    }
+
+    stats->writer_sleeps = atomic_load_explicit(&buffer->writer_sleeps, memory_order_relaxed);
+    stats->data_wakeups = atomic_load_explicit(&buffer->data.wakeups, memory_order_relaxed);
+    stats->space_wakeups = atomic_load_explicit(&buffer->space.wakeups, memory_order_relaxed);
+ }
+
+ static inline void cpu_relax(void) {
+ #if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+ #endif
+ }
+
+ static uint32_t waitq_prepare(sbuffer_waitq_t *q) {
+    uint32_t seq = atomic_load(&q->seq);
+    atomic_store(&q->sleeping, 1);
+    return seq;
+ }
+
+ static void waitq_sleep(sbuffer_waitq_t *q, uint32_t seq, const struct timespec *timeout) {
+    // Returns at once if seq changed since it was read
+    syscall(SYS_futex, &q->seq, FUTEX_WAIT_PRIVATE, seq, timeout, NULL, 0);
+ }
+
+ static void waitq_wake(sbuffer_waitq_t *q) {
+    // Plain load first: the common case is that nobody sleeps
+    if (!atomic_load(&q->sleeping) || !atomic_exchange(&q->sleeping, 0)) {
+        return;
+    }
+
+    atomic_fetch_add(&q->seq, 1);
+    atomic_fetch_add_explicit(&q->wakeups, 1, memory_order_relaxed);
+    syscall(SYS_futex, &q->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+ }
+
+ /**
+  * Spin, then sleep until the writer publishes past seq, closes the
+  * buffer or the deadline (if any) passes. Returns the published cursor,
+  * which is not past seq only if the buffer is closed and fully read or
+  * the deadline passed.
+  */
+ static uint64_t wait_published(sbuffer_t *buffer, sbuffer_cursor_t *r, uint64_t seq,
+                                const struct timespec *deadline) {
+    for (unsigned int spins = 0; ; spins++) {
+        uint64_t published = atomic_load_explicit(&buffer->published, memory_order_acquire);
+        if (published > seq) {
+            return published;
+        }
+
+        // Closed is set after the last publish, so read the cursor again
+        if (atomic_load_explicit(&buffer->closed, memory_order_acquire)) {
+            return atomic_load_explicit(&buffer->published, memory_order_acquire);
+        }
+
+        if (spins < SPIN_LIMIT) {
+            cpu_relax();
+            continue;
+        }
+
+        struct timespec left;
+        if (deadline && !time_left(deadline, &left)) {
+            return atomic_load_explicit(&buffer->published, memory_order_acquire);
+        }
+
+        // Register before the last check, so a publish after it wakes us
+        uint32_t gen = waitq_prepare(&buffer->data);
+        if (atomic_load(&buffer->published) <= seq && !atomic_load(&buffer->closed)) {
+            atomic_fetch_add_explicit(&r->sleeps, 1, memory_order_relaxed);
+            waitq_sleep(&buffer->data, gen, deadline ? &left : NULL);
+        }
+    }
+ }
+
+ static bool time_left(const struct timespec *deadline, struct timespec *left) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    left->tv_sec = deadline->tv_sec - now.tv_sec;
+    left->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if (left->tv_nsec < 0) {
+        left->tv_sec--;
+        left->tv_nsec += 1000000000L;
+    }
+    return left->tv_sec >= 0 && (left->tv_sec > 0 || left->tv_nsec > 0);
+ }
+
+ static uint64_t min_reader_cursor(sbuffer_t *buffer) {
+    // Acquire: reads of a released slot happen before the writer reuses it
+    uint64_t min = atomic_load_explicit(&buffer->readers[0].cursor, memory_order_acquire);
+
+    for (int i = 1; i < SBUFFER_READERS; i++) {
+        uint64_t cursor = atomic_load_explicit(&buffer->readers[i].cursor, memory_order_acquire);
+        if (cursor < min) {
+            min = cursor;
+        }
+    }
+
+    return min;
+ }
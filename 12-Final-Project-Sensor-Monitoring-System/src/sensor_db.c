@@ -0,0 +1,330 @@
+/**
+ * @file sensor_db.c
+ * @brief SQLite storage backend implementation
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <unistd.h>
+ #include <sqlite3.h>
+ #include "sensor_db.h"
+ #include "log.h"
+
+ static sqlite3 *db = NULL;
+ static sqlite3_stmt *insert_stmt = NULL;
+ static sqlite3_stmt *rollup_stmt = NULL;
+ static sqlite3_stmt *begin_stmt = NULL;
+ static sqlite3_stmt *commit_stmt = NULL;
+ static sqlite3_stmt *rollback_stmt = NULL;
+ static bool in_transaction = false;
+ static int log_fd = -1;
+
+ // Readings and rollups added since the last commit, added again to the
+ // next transaction if SQLite rolled this one back
+ static sensor_data_t kept[STORAGE_BATCH_SIZE];
+ static size_t kept_count = 0;
+ static rollup_t *kept_rollups = NULL;
+ static size_t kept_rollup_count = 0;
+ static size_t kept_rollup_capacity = 0;
+
+ // Local function prototypes
+ static int sensor_db_open(const char *path, bool clear, int log_fd);
+ static int sensor_db_insert(const sensor_data_t *data, size_t count, uint64_t position);
+ static int sensor_db_insert_rollups(const rollup_t *rollups, size_t count);
+ static int sensor_db_flush(void);
+ static int sensor_db_close(void);
+ static int begin(void);
+ static int add_reading(const sensor_data_t *reading);
+ static int add_rollup(const rollup_t *r);
+ static void check_rollback(void);
+ static int open_database(const char *path, bool clear);
+ static bool table_exists(const char *name);
+ static int prepare(const char *sql, sqlite3_stmt **stmt);
+ static int run(sqlite3_stmt *stmt);
+
+ const storage_backend_t sensor_db_backend = {
+    .name = "sqlite",
+    .default_path = DB_NAME,
+    .open = sensor_db_open,
+    .insert = sensor_db_insert,
+    .insert_rollups = sensor_db_insert_rollups,
+    .flush = sensor_db_flush,
+    .close = sensor_db_close,
+ };
+
+ static int sensor_db_open(const char *path, bool clear, int fd) {
+    log_fd = fd;
+
+    for (int attempt = 1; attempt <= DB_CONNECT_ATTEMPTS; attempt++) {
+        if (open_database(path, clear) == 0) {
+            log_event(log_fd, "Connection to SQL server established");
+            return 0;
+        }
+
+        log_event(log_fd, "Unable to connect to SQL server (attempt %d of %d): %s",
+                  attempt, DB_CONNECT_ATTEMPTS, db ? sqlite3_errmsg(db) : "out of memory");
+        sensor_db_close();
+        if (attempt < DB_CONNECT_ATTEMPTS) {
+            sleep(1);
+        }
+    }
+
+    return -1;
+ }
+
+ static int sensor_db_insert(const sensor_data_t *data, size_t count, uint64_t position) {
+    (void)position;
+    int inserted = 0;
+
+    if (begin() != 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < count && kept_count < STORAGE_BATCH_SIZE; i++) {
+        if (add_reading(&data[i]) != 0) {
+            log_event(log_fd, "Failed to insert a reading of sensor node %u: %s",
+                      data[i].id, sqlite3_errmsg(db));
+            check_rollback();
+            break;
+        }
+        kept[kept_count++] = data[i];
+        inserted++;
+    }
+
+    return inserted;
+ }
+
+ static int sensor_db_insert_rollups(const rollup_t *rollups, size_t count) {
+    int result = 0;
+
+    if (begin() != 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (kept_rollup_count == kept_rollup_capacity) {
+            size_t capacity = kept_rollup_capacity ? kept_rollup_capacity * 2 : 256;
+            rollup_t *grown = realloc(kept_rollups, capacity * sizeof(rollup_t));
+            if (!grown) {
+                return -1;
+            }
+            kept_rollups = grown;
+            kept_rollup_capacity = capacity;
+        }
+
+        if (add_rollup(&rollups[i]) != 0) {
+            log_event(log_fd, "Failed to insert a rollup of sensor node %u: %s",
+                      rollups[i].sensor_id, sqlite3_errmsg(db));
+            result = -1;
+            check_rollback();
+            if (!in_transaction) {
+                break;
+            }
+            continue;
+        }
+        kept_rollups[kept_rollup_count++] = rollups[i];
+    }
+
+    return result;
+ }
+
+ static int sensor_db_flush(void) {
+    // A transaction SQLite rolled back is redone first
+    if (!in_transaction && kept_count == 0 && kept_rollup_count == 0) {
+        return 0;
+    }
+    if (begin() != 0) {
+        return -1;
+    }
+
+    if (run(commit_stmt) != 0) {
+        log_event(log_fd, "Failed to commit a transaction: %s", sqlite3_errmsg(db));
+        if (!sqlite3_get_autocommit(db)) {
+            run(rollback_stmt);
+        }
+        in_transaction = false;
+        return -1;
+    }
+
+    in_transaction = false;
+    kept_count = 0;
+    kept_rollup_count = 0;
+    return 0;
+ }
+
+ static int sensor_db_close(void) {
+    int result = 0;
+
+    if (db) {
+        result = sensor_db_flush();
+    }
+
+    sqlite3_finalize(insert_stmt);
+    sqlite3_finalize(rollup_stmt);
+    sqlite3_finalize(begin_stmt);
+    sqlite3_finalize(commit_stmt);
+    sqlite3_finalize(rollback_stmt);
+    insert_stmt = rollup_stmt = begin_stmt = commit_stmt = rollback_stmt = NULL;
+
+    if (db) {
+        sqlite3_close(db);
+        db = NULL;
+    }
+
+    free(kept_rollups);
+    kept_rollups = NULL;
+    kept_count = kept_rollup_count = kept_rollup_capacity = 0;
+    return result;
+ }
+
+ static int begin(void) {
+    // A batch of the storage manager is one transaction
+    if (in_transaction) {
+        return 0;
+    }
+    if (run(begin_stmt) != 0) {
+        log_event(log_fd, "Failed to begin a transaction: %s", sqlite3_errmsg(db));
+        return -1;
+    }
+    in_transaction = true;
+
+    // Whatever the last transaction held when it was rolled back goes
+    // into this one, ahead of anything new
+    for (size_t i = 0; i < kept_count; i++) {
+        if (add_reading(&kept[i]) != 0) {
+            log_event(log_fd, "Failed to insert a reading of sensor node %u again: %s",
+                      kept[i].id, sqlite3_errmsg(db));
+            run(rollback_stmt);
+            in_transaction = false;
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < kept_rollup_count; i++) {
+        if (add_rollup(&kept_rollups[i]) != 0) {
+            log_event(log_fd, "Failed to insert a rollup of sensor node %u again: %s",
+                      kept_rollups[i].sensor_id, sqlite3_errmsg(db));
+            run(rollback_stmt);
+            in_transaction = false;
+            return -1;
+        }
+    }
+    return 0;
+ }
+
+ static int add_reading(const sensor_data_t *reading) {
+    // Bound parameters, no SQL text parsed per row
+    sqlite3_bind_int(insert_stmt, 1, reading->id);
+    sqlite3_bind_double(insert_stmt, 2, reading->value);
+    sqlite3_bind_int64(insert_stmt, 3, reading->ts);
+    return run(insert_stmt);
+ }
+
+ static int add_rollup(const rollup_t *r) {
+    // A bucket stored before, by an earlier run, is merged
+    sqlite3_bind_int(rollup_stmt, 1, r->sensor_id);
+    sqlite3_bind_int64(rollup_stmt, 2, rollup_width(r->resolution) / 1000000000LL);
+    sqlite3_bind_int64(rollup_stmt, 3, r->start);
+    sqlite3_bind_int64(rollup_stmt, 4, r->count);
+    sqlite3_bind_double(rollup_stmt, 5, r->min);
+    sqlite3_bind_double(rollup_stmt, 6, r->max);
+    sqlite3_bind_double(rollup_stmt, 7, r->sum);
+    return run(rollup_stmt);
+ }
+
+ static void check_rollback(void) {
+    // Some errors make SQLite roll the whole transaction back
+    if (in_transaction && sqlite3_get_autocommit(db)) {
+        in_transaction = false;
+    }
+ }
+
+ static int open_database(const char *path, bool clear) {
+    if (sqlite3_open(path, &db) != SQLITE_OK) {
+        return -1;
+    }
+
+    // WAL lets a commit append to the log instead of rewriting pages, and
+    // with synchronous=FULL every commit syncs the log, so the journal is
+    // only checkpointed past readings that survive a power loss
+    const char *setup =
+        "PRAGMA journal_mode=WAL;"
+        "PRAGMA synchronous=FULL;"
+        "PRAGMA temp_store=MEMORY;"
+        "PRAGMA cache_size=-16384;";
+    if (sqlite3_exec(db, setup, NULL, NULL, NULL) != SQLITE_OK) {
+        return -1;
+    }
+
+    if (!table_exists(TABLE_NAME)) {
+        const char *create =
+            "CREATE TABLE " TABLE_NAME " ("
+            "id INTEGER PRIMARY KEY AUTOINCREMENT, "
+            "sensor_id INTEGER, "
+            "sensor_value REAL, "
+            "timestamp INTEGER);";
+        if (sqlite3_exec(db, create, NULL, NULL, NULL) != SQLITE_OK) {
+            return -1;
+        }
+        log_event(log_fd, "New table " TABLE_NAME " created");
+    }
+
+    // Resolution is the bucket width in seconds; the key serves range
+    // queries on one sensor and resolution
+    if (!table_exists(ROLLUP_TABLE_NAME)) {
+        const char *create =
+            "CREATE TABLE " ROLLUP_TABLE_NAME " ("
+            "sensor_id INTEGER, "
+            "resolution INTEGER, "
+            "start INTEGER, "
+            "count INTEGER, "
+            "min REAL, "
+            "max REAL, "
+            "sum REAL, "
+            "PRIMARY KEY (sensor_id, resolution, start)) WITHOUT ROWID;";
+        if (sqlite3_exec(db, create, NULL, NULL, NULL) != SQLITE_OK) {
+            return -1;
+        }
+        log_event(log_fd, "New table " ROLLUP_TABLE_NAME " created");
+    }
+
+    if (clear && sqlite3_exec(db, "DELETE FROM " TABLE_NAME "; DELETE FROM " ROLLUP_TABLE_NAME ";",
+                              NULL, NULL, NULL) != SQLITE_OK) {
+        return -1;
+    }
+
+    if (prepare("INSERT INTO " TABLE_NAME " (sensor_id, sensor_value, timestamp) VALUES (?, ?, ?);",
+                &insert_stmt) != 0 ||
+        prepare("INSERT INTO " ROLLUP_TABLE_NAME " (sensor_id, resolution, start, count, min, max, sum) "
+                "VALUES (?, ?, ?, ?, ?, ?, ?) ON CONFLICT DO UPDATE SET "
+                "count = count + excluded.count, min = MIN(min, excluded.min), "
+                "max = MAX(max, excluded.max), sum = sum + excluded.sum;", &rollup_stmt) != 0 ||
+        prepare("BEGIN;", &begin_stmt) != 0 ||
+        prepare("COMMIT;", &commit_stmt) != 0 ||
+        prepare("ROLLBACK;", &rollback_stmt) != 0) {
+        return -1;
+    }
+
+    return 0;
+ }
+
+ static bool table_exists(const char *name) {
+    sqlite3_stmt *stmt;
+    bool exists = false;
+
+    if (prepare("SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?;", &stmt) == 0) {
+        sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+        exists = sqlite3_step(stmt) == SQLITE_ROW;
+        sqlite3_finalize(stmt);
+    }
+    return exists;
+ }
+
+ static int prepare(const char *sql, sqlite3_stmt **stmt) {
+    return sqlite3_prepare_v2(db, sql, -1, stmt, NULL) == SQLITE_OK ? 0 : -1;
+ }
+
+ static int run(sqlite3_stmt *stmt) {
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    return rc == SQLITE_DONE ? 0 : -1;
+ }
@@ -0,0 +1,110 @@
+/**
+ * @file spill.c
+ * @brief Storage spill file implementation
+ */
+
+ #include <stdio.h>
+ #include <stdatomic.h>
+ #include <errno.h>
+ #include <fcntl.h>
+ #include <unistd.h>
+ #include "spill.h"
+
+ static int spill_fd = -1;
+ static char spill_path[256];
+
+ // End of the appended records, published by the writer after each append
+ static _Atomic uint64_t written = 0;
+
+ // Next record to read, private to the reader
+ static uint64_t read_offset = 0;
+
+ int spill_open(const char *path) {
+    if (!path || spill_fd >= 0 || snprintf(spill_path, sizeof(spill_path), "%s", path) >= (int)sizeof(spill_path)) {
+        return -1;
+    }
+
+    spill_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    atomic_store(&written, 0);
+    read_offset = 0;
+    return spill_fd >= 0 ? 0 : -1;
+ }
+
+ int spill_append(const sensor_data_t *data, size_t count) {
+    if (spill_fd < 0) {
+        return -1;
+    }
+
+    const char *buf = (const char *)data;
+    size_t len = count * sizeof(sensor_data_t);
+    uint64_t end = atomic_load_explicit(&written, memory_order_relaxed);
+
+    // Written at the end of the last whole append, so a failed one leaves
+    // nothing the reader could see and is overwritten by the next
+    for (size_t done = 0; done < len;) {
+        ssize_t n = pwrite(spill_fd, buf + done, len - done, (off_t)(end + done));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += (size_t)n;
+    }
+
+    atomic_store_explicit(&written, end + len, memory_order_release);
+    return 0;
+ }
+
+ size_t spill_read(sensor_data_t *out, size_t max) {
+    uint64_t end = atomic_load_explicit(&written, memory_order_acquire);
+    if (spill_fd < 0 || end == read_offset) {
+        return 0;
+    }
+
+    size_t len = max * sizeof(sensor_data_t);
+    if (len > end - read_offset) {
+        len = (size_t)(end - read_offset);
+    }
+
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(spill_fd, (char *)out + done, len - done, (off_t)(read_offset + done));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += (size_t)n;
+    }
+
+    size_t readings = done / sizeof(sensor_data_t);
+    read_offset += readings * sizeof(sensor_data_t);
+    return readings;
+ }
+
+ bool spill_drained(void) {
+    return atomic_load_explicit(&written, memory_order_acquire) == read_offset;
+ }
+
+ uint64_t spill_size(void) {
+    return atomic_load_explicit(&written, memory_order_relaxed);
+ }
+
+ void spill_reset(void) {
+    if (spill_fd >= 0 && ftruncate(spill_fd, 0) == 0) {
+        atomic_store(&written, 0);
+        read_offset = 0;
+    }
+ }
+
+ void spill_close(void) {
+    if (spill_fd >= 0) {
+        close(spill_fd);
+        unlink(spill_path);
+        spill_fd = -1;
+    }
+    atomic_store(&written, 0);
+    read_offset = 0;
+ }
@@ -0,0 +1,603 @@
+/**
+ * @file storagemgr.c
+ * @brief Storage manager implementation (batching and backend selection)
+ */
+
+ #include <stdlib.h>
+ #include <string.h>
+ #include <stdatomic.h>
+ #include <errno.h>
+ #include <pthread.h>
+ #include <time.h>
+ #include "storagemgr.h"
+ #include "journal.h"
+ #include "latency.h"
+ #include "log.h"
+ #include "sensor_db.h"
+ #include "spill.h"
+ #include "stats.h"
+ #include "tsdb.h"
+
+ // Readings taken from the shared buffer per batch
+ #define READ_BATCH 1024
+
+ static const storage_backend_t *backends[] = { &sensor_db_backend, &tsdb_backend };
+
+ static const storage_backend_t *backend = NULL;
+ static sbuffer_t *sbuffer = NULL;
+ static pthread_t intake_thread;
+ static pthread_t writer_thread;
+ static int log_fd = -1;
+
+ // Current batch, with the timestamps and stage stamps of its readings
+ static size_t pending = 0;
+ static uint64_t batch_start_ns = 0;
+ static sensor_ts_t pending_ts[STORAGE_BATCH_SIZE];
+ static uint64_t pending_received[STORAGE_BATCH_SIZE];
+ static uint32_t pending_insert[STORAGE_BATCH_SIZE];
+
+ // Journal position of the next reading passed on, accepted by the backend
+ // or not, and of the first reading not checkpointed yet
+ static uint64_t position = 0;
+ static uint64_t checkpointed = 0;
+
+ // Set once the backend failed and was not retried; from then on, no
+ // reading is passed on and the journal keeps them all
+ static bool stalled = false;
+
+ // Rollups queued by the data manager, swapped with the batch taken
+ // from them at each flush; rollups are rare, so a mutex is cheap enough
+ static pthread_mutex_t rollup_lock = PTHREAD_MUTEX_INITIALIZER;
+ static rollup_t *rollup_queue = NULL;
+ static size_t rollup_queued = 0;
+ static size_t rollup_queue_capacity = 0;
+ static rollup_t *rollup_batch = NULL;
+ static size_t rollup_batch_capacity = 0;
+
+ // Readings copied out of the shared buffer by the intake thread, waiting
+ // for the writer thread, which swaps queue with work to take them all
+ static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+ static pthread_cond_t queue_ready;
+ static pthread_cond_t queue_space;
+ static sensor_data_t *queue = NULL;
+ static sensor_data_t *work = NULL;
+ static size_t queued = 0;
+ static bool intake_done = false;
+
+ // While spilling, new readings go to the spill file instead of the queue
+ static bool spill_enabled = false;
+ static bool spilling = false;
+ static sensor_data_t *replay = NULL;
+
+ // Counters readable from any thread. Each has one writing thread: the
+ // intake thread writes stat_spills, stat_spilled and stat_spill_peak,
+ // the writer thread all the others
+ static _Atomic uint64_t stat_rows;
+ static _Atomic uint64_t stat_flushes;
+ static _Atomic uint64_t stat_failures;
+ static _Atomic uint64_t stat_busy_ns;
+ static _Atomic uint64_t stat_flush_ns;
+ static _Atomic uint64_t stat_flush_max_ns;
+ static _Atomic uint64_t stat_rollups;
+ static _Atomic uint64_t stat_spills;
+ static _Atomic uint64_t stat_spilled;
+ static _Atomic uint64_t stat_replayed;
+ static _Atomic uint64_t stat_spill_peak;
+
+ // Local function prototypes
+ static void* intake_run(void *arg);
+ static void* writer_run(void *arg);
+ static void enqueue(const sensor_data_t *data, size_t n);
+ static bool wait_ready(void);
+ static void drop_spill(void);
+ static void free_queues(void);
+ static void record_stages(void);
+ static int flush_retrying(void);
+ static bool back_off(void);
+ static void checkpoint(void);
+ static size_t take_rollups(void);
+
+ const storage_backend_t *storagemgr_find_backend(const char *name) {
+    for (size_t i = 0; name && i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (strcmp(backends[i]->name, name) == 0) {
+            return backends[i];
+        }
+    }
+    return NULL;
+ }
+
+ int storagemgr_open(const storage_backend_t *selected, const char *path, bool clear, int fd) {
+    if (!selected || backend) {
+        return -1;
+    }
+
+    if (selected->open(path ? path : selected->default_path, clear, fd) != 0) {
+        return -1;
+    }
+
+    backend = selected;
+    log_fd = fd;
+    return 0;
+ }
+
+ int storagemgr_insert(const sensor_data_t *data, size_t count_total) {
+    if (!backend) {
+        return -1;
+    }
+
+    int result = 0;
+    uint64_t start = stats_clock_ns();
+
+    // Cut the readings at batch boundaries so no batch exceeds the limit
+    while (count_total > 0 && !stalled) {
+        size_t n = STORAGE_BATCH_SIZE - pending;
+        if (n > count_total) {
+            n = count_total;
+        }
+
+        if (pending == 0) {
+            batch_start_ns = start;
+        }
+
+        int accepted = backend->insert(data, n, position);
+        if (accepted < 0) {
+            accepted = 0;
+        }
+        for (int i = 0; i < accepted; i++) {
+            pending_ts[pending + (size_t)i] = data[i].ts;
+            pending_received[pending + (size_t)i] = data[i].received;
+            pending_insert[pending + (size_t)i] = data[i].insert_ns;
+        }
+        pending += (size_t)accepted;
+        position += (size_t)accepted;
+        data += accepted;
+        count_total -= (size_t)accepted;
+
+        // The backend stopped at a reading it could not take: hand it the
+        // rest again once it has had time to recover
+        if ((size_t)accepted < n) {
+            stats_count(&stat_failures, 1);
+            if (!back_off()) {
+                break;
+            }
+            continue;
+        }
+
+        if (pending >= STORAGE_BATCH_SIZE && flush_retrying() != 0) {
+            break;
+        }
+    }
+    if (count_total > 0) {
+        result = -1;
+    }
+
+    stats_count(&stat_busy_ns, stats_clock_ns() - start);
+    return result;
+ }
+
+ int storagemgr_queue_rollup(const rollup_t *rollup) {
+    if (!rollup) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&rollup_lock);
+    if (!backend) {
+        pthread_mutex_unlock(&rollup_lock);
+        return -1;
+    }
+    if (rollup_queued == rollup_queue_capacity) {
+        size_t capacity = rollup_queue_capacity ? rollup_queue_capacity * 2 : 1024;
+        rollup_t *grown = realloc(rollup_queue, capacity * sizeof(rollup_t));
+        if (!grown) {
+            pthread_mutex_unlock(&rollup_lock);
+            return -1;
+        }
+        rollup_queue = grown;
+        rollup_queue_capacity = capacity;
+    }
+    rollup_queue[rollup_queued++] = *rollup;
+    pthread_mutex_unlock(&rollup_lock);
+    return 0;
+ }
+
+ int storagemgr_flush(void) {
+    if (!backend) {
+        return 0;
+    }
+
+    size_t rollups = take_rollups();
+    if (pending == 0 && rollups == 0) {
+        checkpoint();
+        return 0;
+    }
+
+    // Rollups go into the same batch as the readings
+    uint64_t start = stats_clock_ns();
+    // A rollup the backend fails to take is logged there and not stored
+    int rollup_result = 0;
+    if (rollups > 0 && backend->insert_rollups) {
+        rollup_result = backend->insert_rollups(rollup_batch, rollups);
+    }
+    int result = backend->flush();
+    uint64_t elapsed = stats_clock_ns() - start;
+
+    // The backend keeps a batch it failed to write, and so does the
+    // journal until a later flush has written it
+    if (result != 0) {
+        stats_count(&stat_failures, 1);
+        return result;
+    }
+
+    stats_count(&stat_rows, pending);
+    stats_count(&stat_flushes, 1);
+    stats_count(&stat_flush_ns, elapsed);
+    if (elapsed > atomic_load_explicit(&stat_flush_max_ns, memory_order_relaxed)) {
+        atomic_store_explicit(&stat_flush_max_ns, elapsed, memory_order_relaxed);
+    }
+    if (rollup_result == 0 && backend->insert_rollups) {
+        stats_count(&stat_rollups, rollups);
+    }
+
+    record_stages();
+    checkpoint();
+    pending = 0;
+    return 0;
+ }
+
+ int storagemgr_start(sbuffer_t *buffer) {
+    if (!buffer || !backend || sbuffer) {
+        return -1;
+    }
+
+    queue = malloc(STORAGE_HIGH_WATER * sizeof(sensor_data_t));
+    work = malloc(STORAGE_HIGH_WATER * sizeof(sensor_data_t));
+    replay = malloc(SPILL_REPLAY_BATCH * sizeof(sensor_data_t));
+    if (!queue || !work || !replay) {
+        free_queues();
+        return -1;
+    }
+
+    // The writer's deadlines are on the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&queue_ready, &attr);
+    pthread_cond_init(&queue_space, NULL);
+    pthread_condattr_destroy(&attr);
+
+    queued = 0;
+    intake_done = false;
+    spilling = false;
+    spill_enabled = spill_open(SPILL_FILE) == 0;
+    if (!spill_enabled) {
+        log_event(log_fd, "Cannot create the spill file %s, a slow store will slow down ingestion",
+                  SPILL_FILE);
+    }
+
+    sbuffer = buffer;
+    if (pthread_create(&writer_thread, NULL, writer_run, NULL) != 0) {
+        sbuffer = NULL;
+        spill_close();
+        free_queues();
+        return -1;
+    }
+    if (pthread_create(&intake_thread, NULL, intake_run, NULL) != 0) {
+        pthread_mutex_lock(&queue_lock);
+        intake_done = true;
+        pthread_cond_signal(&queue_ready);
+        pthread_mutex_unlock(&queue_lock);
+        pthread_join(writer_thread, NULL);
+        sbuffer = NULL;
+        spill_close();
+        free_queues();
+        return -1;
+    }
+    return 0;
+ }
+
+ void storagemgr_wait(void) {
+    if (sbuffer) {
+        pthread_join(intake_thread, NULL);
+        pthread_join(writer_thread, NULL);
+        sbuffer = NULL;
+        spill_close();
+        free_queues();
+    }
+ }
+
+ void storagemgr_get_stats(storagemgr_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+
+    stats->rows = atomic_load_explicit(&stat_rows, memory_order_relaxed);
+    stats->flushes = atomic_load_explicit(&stat_flushes, memory_order_relaxed);
+    stats->failures = atomic_load_explicit(&stat_failures, memory_order_relaxed);
+    stats->busy_ns = atomic_load_explicit(&stat_busy_ns, memory_order_relaxed);
+    stats->flush_ns = atomic_load_explicit(&stat_flush_ns, memory_order_relaxed);
+    stats->flush_max_ns = atomic_load_explicit(&stat_flush_max_ns, memory_order_relaxed);
+    stats->rollups = atomic_load_explicit(&stat_rollups, memory_order_relaxed);
+    stats->spills = atomic_load_explicit(&stat_spills, memory_order_relaxed);
+    stats->spilled = atomic_load_explicit(&stat_spilled, memory_order_relaxed);
+    stats->replayed = atomic_load_explicit(&stat_replayed, memory_order_relaxed);
+    stats->spill_peak = atomic_load_explicit(&stat_spill_peak, memory_order_relaxed);
+ }
+
+ void storagemgr_close(void) {
+    if (!backend) {
+        return;
+    }
+
+    // Closing writes whatever the backend still holds; if that fails,
+    // the journal keeps it for the next run
+    int result = storagemgr_flush();
+    if (backend->close() != 0) {
+        result = -1;
+    }
+    if (result == 0) {
+        journal_checkpoint((size_t)(position - checkpointed));
+        checkpointed = position;
+    }
+    if (result != 0 || stalled) {
+        log_event(log_fd, "Storage closed with readings not written, the journal keeps them for the next run");
+    }
+
+    pthread_mutex_lock(&rollup_lock);
+    backend = NULL;
+    free(rollup_queue);
+    free(rollup_batch);
+    rollup_queue = rollup_batch = NULL;
+    rollup_queued = rollup_queue_capacity = rollup_batch_capacity = 0;
+    pthread_mutex_unlock(&rollup_lock);
+ }
+
+ static void* intake_run(void *arg) {
+    (void)arg;
+    const sensor_data_t *data;
+    size_t n;
+
+    // Copy every reading out of the shared buffer at once, so a stalled
+    // backend never holds up the connection manager
+    while (sbuffer_peek_batch(sbuffer, SBUFFER_READER_STORAGE, &data, READ_BATCH, &n) == SBUFFER_SUCCESS) {
+        enqueue(data, n);
+        sbuffer_release_batch(sbuffer, SBUFFER_READER_STORAGE, n);
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    intake_done = true;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+    return NULL;
+ }
+
+ static void* writer_run(void *arg) {
+    (void)arg;
+
+    // Readings a crash left uncommitted go first, ahead of any new ones
+    size_t recovered;
+    while ((recovered = journal_recover(replay, SPILL_REPLAY_BATCH)) > 0) {
+        storagemgr_insert(replay, recovered);
+    }
+    flush_retrying();
+
+    for (;;) {
+        bool timed_out = false;
+
+        pthread_mutex_lock(&queue_lock);
+        while (queued == 0 && !spilling && !intake_done && !timed_out) {
+            timed_out = wait_ready();
+        }
+
+        // Take the whole queue; while spilling, it only holds readings
+        // older than those in the file
+        size_t n = queued;
+        sensor_data_t *taken = queue;
+        queue = work;
+        work = taken;
+        queued = 0;
+
+        bool replaying = n == 0 && spilling;
+        if (replaying && spill_drained()) {
+            // Caught up: new readings go through memory again
+            spill_reset();
+            spilling = false;
+            replaying = false;
+            log_event(log_fd, "Storage caught up, spill file %s replayed", SPILL_FILE);
+        }
+        bool done = n == 0 && !spilling && intake_done;
+        pthread_cond_signal(&queue_space);
+        pthread_mutex_unlock(&queue_lock);
+
+        if (n > 0) {
+            storagemgr_insert(work, n);
+        }
+        else if (replaying) {
+            size_t r = spill_read(replay, SPILL_REPLAY_BATCH);
+            if (r == 0) {
+                drop_spill();
+            }
+            stats_count(&stat_replayed, r);
+            storagemgr_insert(replay, r);
+        }
+        else if (done) {
+            break;
+        }
+        else if (timed_out) {
+            flush_retrying();
+        }
+
+        // A steady trickle of readings never times out the wait above
+        if (pending > 0 && stats_clock_ns() - batch_start_ns >= (uint64_t)STORAGE_FLUSH_MS * 1000000) {
+            flush_retrying();
+        }
+    }
+
+    storagemgr_flush();
+    return NULL;
+ }
+
+ static void enqueue(const sensor_data_t *data, size_t n) {
+    pthread_mutex_lock(&queue_lock);
+
+    // Spill once the backend is STORAGE_HIGH_WATER readings behind, and
+    // keep spilling until it has read the file back, so readings reach
+    // the backend in order
+    if (!spilling && spill_enabled && queued + n > STORAGE_HIGH_WATER) {
+        spilling = true;
+        stats_count(&stat_spills, 1);
+        log_event(log_fd, "Storage is %zu readings behind, spilling to %s", queued, SPILL_FILE);
+    }
+
+    if (spilling && spill_enabled) {
+        if (spill_append(data, n) == 0) {
+            uint64_t size = spill_size();
+            if (size > atomic_load_explicit(&stat_spill_peak, memory_order_relaxed)) {
+                atomic_store_explicit(&stat_spill_peak, size, memory_order_relaxed);
+            }
+            stats_count(&stat_spilled, n);
+            pthread_cond_signal(&queue_ready);
+            pthread_mutex_unlock(&queue_lock);
+            return;
+        }
+        spill_enabled = false;
+        log_event(log_fd, "Cannot write to the spill file %s, a slow store will slow down ingestion",
+                  SPILL_FILE);
+    }
+
+    // Without a spill file, wait for the backend as the shared buffer would
+    while (spilling || queued + n > STORAGE_HIGH_WATER) {
+        pthread_cond_wait(&queue_space, &queue_lock);
+    }
+    memcpy(queue + queued, data, n * sizeof(sensor_data_t));
+    queued += n;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+ }
+
+ static bool wait_ready(void) {
+    // Wait no longer than the open batch may last, and look for queued
+    // rollups now and then
+    uint64_t timeout_ms = ROLLUP_SWEEP_MS;
+    if (pending > 0) {
+        uint64_t age_ms = (stats_clock_ns() - batch_start_ns) / 1000000;
+        timeout_ms = age_ms >= STORAGE_FLUSH_MS ? 0 : STORAGE_FLUSH_MS - age_ms;
+    }
+
+    uint64_t deadline = stats_clock_ns() + timeout_ms * 1000000;
+    struct timespec ts = { .tv_sec = (time_t)(deadline / 1000000000ULL),
+                           .tv_nsec = (long)(deadline % 1000000000ULL) };
+    return pthread_cond_timedwait(&queue_ready, &queue_lock, &ts) == ETIMEDOUT;
+ }
+
+ static void drop_spill(void) {
+    // The file cannot be read back; give up on it rather than spin, and
+    // let the journal move past the readings in it
+    storagemgr_flush();
+
+    pthread_mutex_lock(&queue_lock);
+    uint64_t lost = atomic_load_explicit(&stat_spilled, memory_order_relaxed) -
+                    atomic_load_explicit(&stat_replayed, memory_order_relaxed);
+    stats_count(&stat_failures, 1);
+    log_event(log_fd, "Cannot read the spill file %s back, %llu readings lost", SPILL_FILE,
+              (unsigned long long)lost);
+    position += lost;
+    spill_reset();
+    spilling = false;
+    spill_enabled = false;
+    pthread_cond_signal(&queue_space);
+    pthread_mutex_unlock(&queue_lock);
+
+    checkpoint();
+ }
+
+ static void record_stages(void) {
+    latency_hist_t *commit = latency_stage(LATENCY_STAGE_COMMIT);
+    latency_hist_t *gateway = latency_stage(LATENCY_STAGE_GATEWAY);
+    latency_hist_t *total = latency_stage(LATENCY_STAGE_TOTAL);
+    uint64_t now = stats_clock_ns();
+    int64_t now_ts = latency_now();
+
+    // Readings of one wake-up share their stamps: one record per run
+    for (size_t i = 0, run; i < pending; i += run) {
+        for (run = 1; i + run < pending && pending_received[i + run] == pending_received[i] &&
+                      pending_insert[i + run] == pending_insert[i]; run++) {
+        }
+        if (pending_received[i] != 0) {
+            uint64_t published = pending_received[i] + pending_insert[i];
+            latency_record_n(commit, (int64_t)(now - published), run);
+            latency_record_n(gateway, (int64_t)(now - pending_received[i]), run);
+        }
+    }
+
+    // Each reading has its own timestamp from its sensor
+    for (size_t i = 0; i < pending; i++) {
+        if (pending_received[i] != 0) {
+            latency_record(total, now_ts - pending_ts[i]);
+        }
+    }
+ }
+
+ static int flush_retrying(void) {
+    while (storagemgr_flush() != 0) {
+        if (!back_off()) {
+            return -1;
+        }
+    }
+    return 0;
+ }
+
+ static bool back_off(void) {
+    // Called directly, or at shutdown, a failing backend is not waited for
+    pthread_mutex_lock(&queue_lock);
+    bool stopping = !sbuffer || intake_done;
+    pthread_mutex_unlock(&queue_lock);
+    if (stopping) {
+        if (!stalled) {
+            stalled = true;
+            log_event(log_fd, "Storage backend still failing, the journal keeps the readings not written");
+        }
+        return false;
+    }
+
+    struct timespec delay = { STORAGE_RETRY_MS / 1000, (STORAGE_RETRY_MS % 1000) * 1000000L };
+    nanosleep(&delay, NULL);
+    return true;
+ }
+
+ static void checkpoint(void) {
+    // Readings the backend holds in memory stay in the journal
+    uint64_t durable = position;
+    if (backend->held) {
+        uint64_t held = backend->held();
+        if (held < durable) {
+            durable = held;
+        }
+    }
+
+    journal_checkpoint((size_t)(durable - checkpointed));
+    checkpointed = durable;
+ }
+
+ static void free_queues(void) {
+    free(queue);
+    free(work);
+    free(replay);
+    queue = work = replay = NULL;
+ }
+
+ static size_t take_rollups(void) {
+    // Swap the buffers so the data manager never waits for a flush
+    pthread_mutex_lock(&rollup_lock);
+    size_t taken = rollup_queued;
+    rollup_t *queue = rollup_queue;
+    size_t capacity = rollup_queue_capacity;
+
+    rollup_queue = rollup_batch;
+    rollup_queue_capacity = rollup_batch_capacity;
+    rollup_queued = 0;
+    rollup_batch = queue;
+    rollup_batch_capacity = capacity;
+    pthread_mutex_unlock(&rollup_lock);
+
+    return taken;
+ }
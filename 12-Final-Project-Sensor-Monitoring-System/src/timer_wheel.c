@@ -0,0 +1,154 @@
+/**
+ * @file timer_wheel.c
+ * @brief Hierarchical timer wheel implementation
+ */
+
+ #include "timer_wheel.h"
+
+ #define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+ // Ticks covered by the whole wheel
+ #define WHEEL_SPAN (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+ // Local function prototypes
+ static void link_tail(timer_node_t *list, timer_node_t *timer);
+ static void unlink_node(timer_node_t *timer);
+ static void splice(timer_node_t *from, timer_node_t *to);
+ static void insert(timer_wheel_t *wheel, timer_node_t *timer, uint64_t now, uint64_t earliest);
+ static void cascade(timer_wheel_t *wheel, int level, uint64_t tick);
+
+ void timer_wheel_init(timer_wheel_t *wheel, uint64_t now) {
+    wheel->now = now;
+    wheel->count = 0;
+
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            timer_list_init(&wheel->slots[level][slot]);
+        }
+    }
+ }
+
+ void timer_list_init(timer_node_t *list) {
+    list->next = list;
+    list->prev = list;
+ }
+
+ void timer_wheel_add(timer_wheel_t *wheel, timer_node_t *timer, uint64_t expires) {
+    timer->expires = expires;
+    insert(wheel, timer, wheel->now, wheel->now + 1);
+    wheel->count++;
+ }
+
+ void timer_wheel_del(timer_wheel_t *wheel, timer_node_t *timer) {
+    if (!timer->next) {
+        return;
+    }
+
+    unlink_node(timer);
+    wheel->count--;
+ }
+
+ void timer_wheel_advance(timer_wheel_t *wheel, uint64_t now, timer_node_t *expired) {
+    // Nothing to expire: jump straight to the current tick
+    if (wheel->count == 0) {
+        if (now > wheel->now) {
+            wheel->now = now;
+        }
+        return;
+    }
+
+    while (wheel->now < now) {
+        uint64_t tick = wheel->now + 1;
+
+        // Find the highest level whose slot starts at this tick and move
+        // its timers down, highest first, so that a timer can fall
+        // through several levels in the same tick
+        int top = 0;
+        while (top + 1 < TIMER_WHEEL_LEVELS &&
+               (tick & ((1ULL << (TIMER_WHEEL_BITS * (top + 1))) - 1)) == 0) {
+            top++;
+        }
+        for (int level = top; level > 0; level--) {
+            cascade(wheel, level, tick);
+        }
+
+        // Expire the timers of this tick; touched timers are scheduled again
+        timer_node_t due;
+        timer_list_init(&due);
+        splice(&wheel->slots[0][tick & SLOT_MASK], &due);
+        wheel->now = tick;
+
+        while (!timer_list_empty(&due)) {
+            timer_node_t *timer = due.next;
+            unlink_node(timer);
+
+            if (timer->expires <= tick) {
+                link_tail(expired, timer);
+            }
+            else {
+                insert(wheel, timer, tick, tick + 1);
+            }
+        }
+    }
+ }
+
+ static void link_tail(timer_node_t *list, timer_node_t *timer) {
+    timer->next = list;
+    timer->prev = list->prev;
+    list->prev->next = timer;
+    list->prev = timer;
+ }
+
+ static void unlink_node(timer_node_t *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+ }
+
+ static void splice(timer_node_t *from, timer_node_t *to) {
+    if (timer_list_empty(from)) {
+        return;
+    }
+
+    from->next->prev = to->prev;
+    to->prev->next = from->next;
+    from->prev->next = to;
+    to->prev = from->prev;
+    timer_list_init(from);
+ }
+
+ static void insert(timer_wheel_t *wheel, timer_node_t *timer, uint64_t now, uint64_t earliest) {
+    // Slots are chosen relative to now, the tick whose level 0 slot is
+    // processed last; overdue timers are placed at the earliest tick
+    uint64_t expires = timer->expires > earliest ? timer->expires : earliest;
+    uint64_t delta = expires - now;
+
+    // Deadlines beyond the wheel wait in the last slot reachable and are
+    // placed again when it is cascaded
+    if (delta >= WHEEL_SPAN) {
+        expires = now + WHEEL_SPAN - 1;
+        delta = WHEEL_SPAN - 1;
+    }
+
+    int level = 0;
+    while (delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+
+    link_tail(&wheel->slots[level][(expires >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK], timer);
+ }
+
+ static void cascade(timer_wheel_t *wheel, int level, uint64_t tick) {
+    timer_node_t moved;
+    timer_list_init(&moved);
+    splice(&wheel->slots[level][(tick >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK], &moved);
+
+    // Placed relative to this tick, so timers due now land in the level 0
+    // slot about to be processed and none returns to the slot just emptied
+    while (!timer_list_empty(&moved)) {
+        timer_node_t *timer = moved.next;
+        unlink_node(timer);
+        insert(wheel, timer, tick, tick);
+    }
+ }
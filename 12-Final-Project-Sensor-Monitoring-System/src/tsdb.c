@@ -0,0 +1,831 @@
+/**
+ * @file tsdb.c
+ * @brief Columnar time-series storage backend implementation
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <errno.h>
+ #include <fcntl.h>
+ #include <time.h>
+ #include <dirent.h>
+ #include <unistd.h>
+ #include <sys/mman.h>
+ #include <sys/stat.h>
+ #include "tsdb.h"
+ #include "log.h"
+ #include "stats.h"
+
+ // Sensor ids are 16 bits, so staging is a direct table
+ #define MAX_SENSORS (1 << (8 * sizeof(sensor_id_t)))
+
+ // First allocation of a sensor's staging columns, doubled up to a block
+ #define STAGING_INITIAL 16
+
+ // Rollups collected for one write
+ #define ROLLUP_WRITE_BATCH 256
+
+ /**
+  * Readings of one sensor waiting to be written as a block
+  */
+ typedef struct {
+     uint32_t count;
+     uint32_t capacity;
+     bool dirty;                     // Listed in dirty[]
+     uint64_t first_ns;              // Time the first reading was staged
+     uint64_t first_position;        // Journal position of the first reading
+     sensor_ts_t *ts;
+     sensor_value_t *values;
+ } staging_t;
+
+ // Store directory and current segment
+ static char *dir_path = NULL;
+ static unsigned int seg_no = 0;
+ static int seg_fd = -1;
+ static int idx_fd = -1;
+ static uint8_t *seg_map = NULL;
+ static tsdb_segment_header_t *seg_header = NULL;
+ static int log_fd = -1;
+
+ // Staged readings, and the sensors that have some
+ static staging_t *staging[MAX_SENSORS];
+ static sensor_id_t dirty[MAX_SENSORS];
+ static size_t dirty_count = 0;
+
+ // Rollup file being appended to, per resolution
+ static int rollup_fd[ROLLUP_RESOLUTIONS] = { -1, -1, -1 };
+ static int64_t rollup_file_period[ROLLUP_RESOLUTIONS];
+
+ /**
+  * A rollup file found in the store directory
+  */
+ typedef struct {
+     int64_t seconds;                // Bucket width
+     int64_t period;
+ } rollup_file_t;
+
+ // Index entries of the blocks written since the last flush, and the
+ // bytes of them already in the index file
+ static tsdb_index_entry_t *index_buf = NULL;
+ static size_t index_count = 0;
+ static size_t index_capacity = 0;
+ static size_t index_written = 0;
+
+ // Local function prototypes
+ static int tsdb_open(const char *path, bool clear, int fd);
+ static int tsdb_insert(const sensor_data_t *data, size_t count, uint64_t position);
+ static int tsdb_insert_rollups(const rollup_t *rollups, size_t count);
+ static int tsdb_flush(void);
+ static uint64_t tsdb_held(void);
+ static int write_staged(uint64_t max_age_ns);
+ static int tsdb_close(void);
+ static int stage(const sensor_data_t *reading, uint64_t position);
+ static int write_block(sensor_id_t id, staging_t *s);
+ static int write_index(void);
+ static int sync_segment(void);
+ static int open_segment(void);
+ static void close_segment(void);
+ static void segment_path(char *buf, size_t size, const char *dir, unsigned int n, const char *ext);
+ static long list_segments(const char *dir, unsigned int **numbers);
+ static int compare_numbers(const void *a, const void *b);
+ static int append_rollups(int resolution, int64_t period, const rollup_t *rollups, size_t count);
+ static int64_t rollup_period(sensor_ts_t start, int resolution);
+ static void rollup_path(char *buf, size_t size, const char *dir, int64_t seconds, int64_t period);
+ static long list_rollup_files(const char *dir, rollup_file_t **files);
+ static int compare_rollup_files(const void *a, const void *b);
+ static int write_all(int fd, const void *buf, size_t len);
+ static long scan_segment(const char *dir, unsigned int n, int sensor, sensor_ts_t from, sensor_ts_t to,
+                          tsdb_visit_t visit, void *arg);
+
+ const storage_backend_t tsdb_backend = {
+    .name = "tsdb",
+    .default_path = TSDB_DIR,
+    .open = tsdb_open,
+    .insert = tsdb_insert,
+    .insert_rollups = tsdb_insert_rollups,
+    .flush = tsdb_flush,
+    .held = tsdb_held,
+    .close = tsdb_close,
+ };
+
+ long tsdb_scan(const char *dir, int sensor, sensor_ts_t from, sensor_ts_t to,
+                tsdb_visit_t visit, void *arg) {
+    unsigned int *numbers = NULL;
+
+    if (!dir || !visit) {
+        return -1;
+    }
+
+    long segments = list_segments(dir, &numbers);
+    if (segments < 0) {
+        return -1;
+    }
+
+    long blocks = 0;
+    for (long i = 0; i < segments; i++) {
+        long n = scan_segment(dir, numbers[i], sensor, from, to, visit, arg);
+        if (n > 0) {
+            blocks += n;
+        }
+    }
+
+    free(numbers);
+    return blocks;
+ }
+
+ long tsdb_scan_rollups(const char *dir, int sensor, rollup_resolution_t resolution,
+                        sensor_ts_t from, sensor_ts_t to, tsdb_rollup_visit_t visit, void *arg) {
+    rollup_file_t *files = NULL;
+
+    if (!dir || !visit || resolution >= ROLLUP_RESOLUTIONS) {
+        return -1;
+    }
+
+    long count = list_rollup_files(dir, &files);
+    if (count < 0) {
+        return -1;
+    }
+
+    const int64_t seconds = rollup_width(resolution) / 1000000000LL;
+    const int64_t first = rollup_period(from, resolution);
+    const int64_t last = rollup_period(to, resolution);
+    rollup_t *buf = malloc(ROLLUP_WRITE_BATCH * sizeof(rollup_t));
+    long read_files = 0;
+
+    for (long i = 0; buf && i < count; i++) {
+        if (files[i].seconds != seconds || files[i].period < first || files[i].period > last) {
+            continue;
+        }
+
+        char file[4096];
+        rollup_path(file, sizeof(file), dir, seconds, files[i].period);
+        int fd = open(file, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+
+        ssize_t got;
+        while ((got = read(fd, buf, ROLLUP_WRITE_BATCH * sizeof(rollup_t))) > 0) {
+            for (size_t k = 0; k < (size_t)got / sizeof(rollup_t); k++) {
+                const rollup_t *r = &buf[k];
+                if ((sensor == TSDB_ALL_SENSORS || r->sensor_id == sensor) && r->start >= from && r->start <= to) {
+                    visit(r, arg);
+                }
+            }
+        }
+        close(fd);
+        read_files++;
+    }
+
+    free(buf);
+    free(files);
+    return read_files;
+ }
+
+ static int tsdb_open(const char *path, bool clear, int fd) {
+    log_fd = fd;
+
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        return -1;
+    }
+
+    dir_path = strdup(path);
+    if (!dir_path) {
+        return -1;
+    }
+
+    unsigned int *numbers = NULL;
+    long segments = list_segments(path, &numbers);
+    if (segments < 0) {
+        tsdb_close();
+        return -1;
+    }
+
+    // Continue after the last segment, or start over
+    seg_no = segments > 0 ? numbers[segments - 1] + 1 : 0;
+    if (clear) {
+        char file[4096];
+        for (long i = 0; i < segments; i++) {
+            segment_path(file, sizeof(file), path, numbers[i], "seg");
+            unlink(file);
+            segment_path(file, sizeof(file), path, numbers[i], "idx");
+            unlink(file);
+        }
+        seg_no = 0;
+
+        rollup_file_t *files = NULL;
+        long count = list_rollup_files(path, &files);
+        for (long i = 0; i < count; i++) {
+            rollup_path(file, sizeof(file), path, files[i].seconds, files[i].period);
+            unlink(file);
+        }
+        free(files);
+    }
+    free(numbers);
+
+    if (open_segment() != 0) {
+        log_event(log_fd, "Unable to create a segment in %s: %s", path, strerror(errno));
+        tsdb_close();
+        return -1;
+    }
+
+    log_event(log_fd, "Time-series store %s opened at segment %u", path, seg_no);
+    return 0;
+ }
+
+ static int tsdb_insert(const sensor_data_t *data, size_t count, uint64_t position) {
+    int accepted = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (stage(&data[i], position + i) != 0) {
+            break;
+        }
+        accepted++;
+    }
+
+    return accepted;
+ }
+
+ static int tsdb_insert_rollups(const rollup_t *rollups, size_t count) {
+    rollup_t buf[ROLLUP_WRITE_BATCH];
+    int result = 0;
+
+    // Consecutive rollups of the same file are written together
+    for (int r = 0; r < ROLLUP_RESOLUTIONS; r++) {
+        int64_t period = 0;
+        size_t n = 0;
+
+        for (size_t i = 0; i <= count; i++) {
+            if (i < count && rollups[i].resolution != r) {
+                continue;
+            }
+
+            int64_t p = i < count ? rollup_period(rollups[i].start, r) : period;
+            if (n > 0 && (i == count || p != period || n == ROLLUP_WRITE_BATCH)) {
+                if (append_rollups(r, period, buf, n) != 0) {
+                    result = -1;
+                }
+                n = 0;
+            }
+            if (i < count) {
+                period = p;
+                buf[n++] = rollups[i];
+            }
+        }
+    }
+
+    return result;
+ }
+
+ static int tsdb_flush(void) {
+    int result = write_staged((uint64_t)TSDB_BLOCK_AGE_MS * 1000000);
+
+    if (sync_segment() != 0) {
+        result = -1;
+    }
+    return result;
+ }
+
+ static uint64_t tsdb_held(void) {
+    uint64_t oldest = UINT64_MAX;
+
+    // Staged readings are only in memory until their block is written
+    for (size_t i = 0; i < dirty_count; i++) {
+        const staging_t *s = staging[dirty[i]];
+        if (s->count > 0 && s->first_position < oldest) {
+            oldest = s->first_position;
+        }
+    }
+    return oldest;
+ }
+
+ static int write_staged(uint64_t max_age_ns) {
+    int result = 0;
+    uint64_t now = stats_clock_ns();
+    size_t kept = 0;
+
+    // Write the partial blocks that are old enough, keep listing the
+    // others and those that could not be written
+    for (size_t i = 0; i < dirty_count; i++) {
+        staging_t *s = staging[dirty[i]];
+        if (s->count > 0 && now - s->first_ns < max_age_ns) {
+            dirty[kept++] = dirty[i];
+            continue;
+        }
+        if (s->count > 0 && write_block(dirty[i], s) != 0) {
+            dirty[kept++] = dirty[i];
+            result = -1;
+            continue;
+        }
+        s->dirty = false;
+    }
+    dirty_count = kept;
+    return result;
+ }
+
+ static int tsdb_close(void) {
+    int result = 0;
+
+    if (seg_map) {
+        if (write_staged(0) != 0 || sync_segment() != 0) {
+            result = -1;
+        }
+        close_segment();
+    }
+
+    for (size_t i = 0; i < MAX_SENSORS; i++) {
+        if (staging[i]) {
+            free(staging[i]->ts);
+            free(staging[i]->values);
+            free(staging[i]);
+            staging[i] = NULL;
+        }
+    }
+    dirty_count = 0;
+
+    free(index_buf);
+    index_buf = NULL;
+    index_count = index_capacity = index_written = 0;
+
+    for (int r = 0; r < ROLLUP_RESOLUTIONS; r++) {
+        if (rollup_fd[r] >= 0) {
+            close(rollup_fd[r]);
+            rollup_fd[r] = -1;
+        }
+    }
+
+    free(dir_path);
+    dir_path = NULL;
+    return result;
+ }
+
+ static int stage(const sensor_data_t *reading, uint64_t position) {
+    staging_t *s = staging[reading->id];
+
+    if (!s) {
+        s = calloc(1, sizeof(staging_t));
+        if (!s) {
+            return -1;
+        }
+        staging[reading->id] = s;
+    }
+
+    // A full block that could not be written goes out before more readings
+    if (s->count == TSDB_BLOCK_READINGS && write_block(reading->id, s) != 0) {
+        return -1;
+    }
+
+    if (s->count == s->capacity) {
+        uint32_t capacity = s->capacity ? s->capacity * 2 : STAGING_INITIAL;
+        if (capacity > TSDB_BLOCK_READINGS) {
+            capacity = TSDB_BLOCK_READINGS;
+        }
+        sensor_ts_t *ts = realloc(s->ts, capacity * sizeof(sensor_ts_t));
+        if (ts) {
+            s->ts = ts;
+        }
+        sensor_value_t *values = realloc(s->values, capacity * sizeof(sensor_value_t));
+        if (values) {
+            s->values = values;
+        }
+        if (!ts || !values) {
+            return -1;
+        }
+        s->capacity = capacity;
+    }
+
+    if (!s->dirty) {
+        s->dirty = true;
+        dirty[dirty_count++] = reading->id;
+    }
+    if (s->count == 0) {
+        s->first_ns = stats_clock_ns();
+        s->first_position = position;
+    }
+    s->ts[s->count] = reading->ts;
+    s->values[s->count] = reading->value;
+    s->count++;
+
+    // Full blocks go out at once; one that cannot be written stays staged
+    // for the next flush
+    if (s->count == TSDB_BLOCK_READINGS) {
+        write_block(reading->id, s);
+    }
+    return 0;
+ }
+
+ static int write_block(sensor_id_t id, staging_t *s) {
+    size_t ts_bytes = s->count * sizeof(sensor_ts_t);
+    size_t bytes = sizeof(tsdb_block_header_t) + ts_bytes + s->count * sizeof(sensor_value_t);
+
+    // On failure the readings stay staged and the flush fails, so the
+    // block is written by a later one
+    if (seg_map && seg_header->used + bytes > seg_header->size) {
+        if (sync_segment() != 0) {
+            return -1;
+        }
+        close_segment();
+        seg_no++;
+    }
+    if (!seg_map && open_segment() != 0) {
+        log_event(log_fd, "Unable to create segment %u: %s", seg_no, strerror(errno));
+        return -1;
+    }
+
+    if (index_count == index_capacity) {
+        size_t capacity = index_capacity ? index_capacity * 2 : 1024;
+        tsdb_index_entry_t *grown = realloc(index_buf, capacity * sizeof(tsdb_index_entry_t));
+        if (!grown) {
+            return -1;
+        }
+        index_buf = grown;
+        index_capacity = capacity;
+    }
+
+    tsdb_block_header_t header = {
+        .magic = TSDB_BLOCK_MAGIC,
+        .sensor_id = id,
+        .count = s->count,
+        .min_ts = s->ts[0],
+        .max_ts = s->ts[0],
+    };
+    for (uint32_t i = 1; i < s->count; i++) {
+        if (s->ts[i] < header.min_ts) {
+            header.min_ts = s->ts[i];
+        }
+        if (s->ts[i] > header.max_ts) {
+            header.max_ts = s->ts[i];
+        }
+    }
+
+    // Columns are copied whole into the mapping
+    uint64_t offset = seg_header->used;
+    uint8_t *dst = seg_map + offset;
+    memcpy(dst, &header, sizeof(header));
+    memcpy(dst + sizeof(header), s->ts, ts_bytes);
+    memcpy(dst + sizeof(header) + ts_bytes, s->values, s->count * sizeof(sensor_value_t));
+    seg_header->used += bytes;
+    seg_header->blocks++;
+
+    index_buf[index_count++] = (tsdb_index_entry_t) {
+        .sensor_id = id,
+        .count = s->count,
+        .offset = offset,
+        .min_ts = header.min_ts,
+        .max_ts = header.max_ts,
+    };
+
+    s->count = 0;
+    return 0;
+ }
+
+ static int write_index(void) {
+    // The blocks are already in the mapping, so an entry never points
+    // at a block a reader cannot see yet. After a failure, the entries
+    // are kept and the next call writes the rest of them
+    const uint8_t *data = (const uint8_t *)index_buf;
+    size_t left = index_count * sizeof(tsdb_index_entry_t);
+
+    while (index_written < left) {
+        ssize_t written = write(idx_fd, data + index_written, left - index_written);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_event(log_fd, "Unable to write the index of segment %u: %s", seg_no, strerror(errno));
+            return -1;
+        }
+        index_written += (size_t)written;
+    }
+
+    index_count = 0;
+    index_written = 0;
+    return 0;
+ }
+
+ static int sync_segment(void) {
+    if (!seg_map) {
+        return 0;
+    }
+
+    // The blocks reach the disk before the index entries that point at
+    // them, and both before the storage manager checkpoints the journal
+    if (msync(seg_map, seg_header->used, MS_SYNC) < 0) {
+        log_event(log_fd, "Unable to sync segment %u: %s", seg_no, strerror(errno));
+        return -1;
+    }
+    if (write_index() != 0) {
+        return -1;
+    }
+    if (fdatasync(idx_fd) < 0) {
+        log_event(log_fd, "Unable to sync the index of segment %u: %s", seg_no, strerror(errno));
+        return -1;
+    }
+    return 0;
+ }
+
+ static int open_segment(void) {
+    char file[4096];
+
+    segment_path(file, sizeof(file), dir_path, seg_no, "seg");
+    seg_fd = open(file, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (seg_fd < 0) {
+        return -1;
+    }
+
+    segment_path(file, sizeof(file), dir_path, seg_no, "idx");
+    idx_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (idx_fd < 0 || ftruncate(seg_fd, TSDB_SEGMENT_SIZE) < 0) {
+        close_segment();
+        return -1;
+    }
+
+    seg_map = mmap(NULL, TSDB_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, seg_fd, 0);
+    if (seg_map == MAP_FAILED) {
+        seg_map = NULL;
+        close_segment();
+        return -1;
+    }
+
+    // The directory entries of the new files are synced once, so a later
+    // sync of their contents is enough
+    int dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0 || fsync(dir_fd) < 0) {
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
+        munmap(seg_map, TSDB_SEGMENT_SIZE);
+        seg_map = NULL;
+        close_segment();
+        return -1;
+    }
+    close(dir_fd);
+
+    seg_header = (tsdb_segment_header_t *)seg_map;
+    memcpy(seg_header->magic, TSDB_SEGMENT_MAGIC, sizeof(seg_header->magic));
+    seg_header->size = TSDB_SEGMENT_SIZE;
+    seg_header->used = sizeof(tsdb_segment_header_t);
+    seg_header->blocks = 0;
+    return 0;
+ }
+
+ static void close_segment(void) {
+    uint64_t used = 0;
+
+    if (seg_map) {
+        write_index();
+        used = seg_header->used;
+        seg_header->size = used;
+        munmap(seg_map, TSDB_SEGMENT_SIZE);
+        seg_map = NULL;
+        seg_header = NULL;
+    }
+
+    // Give back the unused tail of the segment
+    if (seg_fd >= 0) {
+        if (used > 0 && ftruncate(seg_fd, (off_t)used) < 0) {
+            log_event(log_fd, "Unable to trim segment %u: %s", seg_no, strerror(errno));
+        }
+        close(seg_fd);
+        seg_fd = -1;
+    }
+    if (idx_fd >= 0) {
+        close(idx_fd);
+        idx_fd = -1;
+    }
+ }
+
+ static void segment_path(char *buf, size_t size, const char *dir, unsigned int n, const char *ext) {
+    snprintf(buf, size, "%s/%06u.%s", dir, n, ext);
+ }
+
+ static long list_segments(const char *dir, unsigned int **numbers) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        return -1;
+    }
+
+    long count = 0;
+    long capacity = 0;
+    struct dirent *entry;
+
+    while ((entry = readdir(d))) {
+        unsigned int n;
+        char ext[8];
+
+        if (sscanf(entry->d_name, "%u.%7s", &n, ext) != 2 || strcmp(ext, "seg") != 0) {
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            unsigned int *grown = realloc(*numbers, (size_t)capacity * sizeof(unsigned int));
+            if (!grown) {
+                free(*numbers);
+                *numbers = NULL;
+                closedir(d);
+                return -1;
+            }
+            *numbers = grown;
+        }
+        (*numbers)[count++] = n;
+    }
+
+    closedir(d);
+    if (count > 0) {
+        qsort(*numbers, (size_t)count, sizeof(unsigned int), compare_numbers);
+    }
+    return count;
+ }
+
+ static int compare_numbers(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *)a;
+    unsigned int y = *(const unsigned int *)b;
+    return (x > y) - (x < y);
+ }
+
+ static int append_rollups(int resolution, int64_t period, const rollup_t *rollups, size_t count) {
+    if (rollup_fd[resolution] < 0 || rollup_file_period[resolution] != period) {
+        char file[4096];
+
+        if (rollup_fd[resolution] >= 0) {
+            close(rollup_fd[resolution]);
+        }
+        rollup_path(file, sizeof(file), dir_path, rollup_width(resolution) / 1000000000LL, period);
+        rollup_fd[resolution] = open(file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        rollup_file_period[resolution] = period;
+        if (rollup_fd[resolution] < 0) {
+            log_event(log_fd, "Unable to open the rollup file %s: %s", file, strerror(errno));
+            return -1;
+        }
+    }
+
+    if (write_all(rollup_fd[resolution], rollups, count * sizeof(rollup_t)) != 0) {
+        log_event(log_fd, "Unable to write %zu rollups: %s", count, strerror(errno));
+        return -1;
+    }
+    return 0;
+ }
+
+ static int64_t rollup_period(sensor_ts_t start, int resolution) {
+    int64_t span = rollup_width(resolution) * TSDB_ROLLUP_FILE_BUCKETS;
+    int64_t period = start / span;
+    return start % span < 0 ? period - 1 : period;
+ }
+
+ static void rollup_path(char *buf, size_t size, const char *dir, int64_t seconds, int64_t period) {
+    snprintf(buf, size, "%s/%llds-%lld.rlp", dir, (long long)seconds, (long long)period);
+ }
+
+ static long list_rollup_files(const char *dir, rollup_file_t **files) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        return -1;
+    }
+
+    long count = 0;
+    long capacity = 0;
+    struct dirent *entry;
+
+    while ((entry = readdir(d))) {
+        long long seconds;
+        long long period;
+        char ext[8];
+
+        if (sscanf(entry->d_name, "%llds-%lld.%7s", &seconds, &period, ext) != 3 || strcmp(ext, "rlp") != 0) {
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            rollup_file_t *grown = realloc(*files, (size_t)capacity * sizeof(rollup_file_t));
+            if (!grown) {
+                free(*files);
+                *files = NULL;
+                closedir(d);
+                return -1;
+            }
+            *files = grown;
+        }
+        (*files)[count++] = (rollup_file_t) { .seconds = seconds, .period = period };
+    }
+
+    closedir(d);
+    if (count > 0) {
+        qsort(*files, (size_t)count, sizeof(rollup_file_t), compare_rollup_files);
+    }
+    return count;
+ }
+
+ static int compare_rollup_files(const void *a, const void *b) {
+    const rollup_file_t *x = a;
+    const rollup_file_t *y = b;
+    if (x->seconds != y->seconds) {
+        return (x->seconds > y->seconds) - (x->seconds < y->seconds);
+    }
+    return (x->period > y->period) - (x->period < y->period);
+ }
+
+ static int write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *data = buf;
+
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+    return 0;
+ }
+
+ static long scan_segment(const char *dir, unsigned int n, int sensor, sensor_ts_t from, sensor_ts_t to,
+                          tsdb_visit_t visit, void *arg) {
+    char file[4096];
+    struct stat st;
+
+    // The index is small; read it whole
+    segment_path(file, sizeof(file), dir, n, "idx");
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    size_t entries = (size_t)st.st_size / sizeof(tsdb_index_entry_t);
+    tsdb_index_entry_t *index = malloc(entries * sizeof(tsdb_index_entry_t) + 1);
+    ssize_t got = index ? read(fd, index, entries * sizeof(tsdb_index_entry_t)) : -1;
+    close(fd);
+    if (got < 0) {
+        free(index);
+        return -1;
+    }
+    entries = (size_t)got / sizeof(tsdb_index_entry_t);
+
+    // Map the segment only if some block matches
+    bool match = false;
+    for (size_t i = 0; i < entries && !match; i++) {
+        match = (sensor == TSDB_ALL_SENSORS || index[i].sensor_id == sensor) &&
+                index[i].max_ts >= from && index[i].min_ts <= to;
+    }
+    if (!match) {
+        free(index);
+        return 0;
+    }
+
+    segment_path(file, sizeof(file), dir, n, "seg");
+    fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(index);
+        return -1;
+    }
+
+    const uint8_t *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        free(index);
+        return -1;
+    }
+
+    long blocks = 0;
+    for (size_t i = 0; i < entries; i++) {
+        const tsdb_index_entry_t *e = &index[i];
+        if ((sensor != TSDB_ALL_SENSORS && e->sensor_id != sensor) || e->max_ts < from || e->min_ts > to) {
+            continue;
+        }
+
+        size_t bytes = sizeof(tsdb_block_header_t) + e->count * (sizeof(sensor_ts_t) + sizeof(sensor_value_t));
+        if (e->offset + bytes > (uint64_t)st.st_size) {
+            continue;
+        }
+
+        const tsdb_block_header_t *header = (const tsdb_block_header_t *)(map + e->offset);
+        if (header->magic != TSDB_BLOCK_MAGIC || header->count != e->count) {
+            continue;
+        }
+
+        // Only the timestamp column is scanned; a value is read per match
+        const sensor_ts_t *ts = (const sensor_ts_t *)(header + 1);
+        const sensor_value_t *values = (const sensor_value_t *)(ts + e->count);
+        for (uint32_t k = 0; k < e->count; k++) {
+            if (ts[k] >= from && ts[k] <= to) {
+                visit(e->sensor_id, ts[k], values[k], arg);
+            }
+        }
+        blocks++;
+    }
+
+    munmap((void *)map, (size_t)st.st_size);
+    free(index);
+    return blocks;
+ }
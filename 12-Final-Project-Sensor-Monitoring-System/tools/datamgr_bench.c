@@ -0,0 +1,106 @@
+/**
+ * @file datamgr_bench.c
+ * @brief Throughput benchmark of the data manager
+ *
+ * Loads a room map with the requested number of sensors, then feeds the
+ * data manager batches of readings from random sensors, about 1% of them
+ * unknown, and reports readings per second on one core.
+ *
+ * Usage: datamgr_bench [readings] [sensors]
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <unistd.h>
+ #include <time.h>
+ #include "datamgr.h"
+ #include "stats.h"
+
+ #define DEFAULT_READINGS 100000000ULL
+ #define DEFAULT_SENSORS 60000
+ #define MAX_SENSORS 65000
+ #define BATCH 1024
+
+ // Distinct readings cycled through, large enough to defeat the caches
+ #define POOL_SIZE (1 << 20)
+
+ int main(int argc, char *argv[]) {
+    unsigned long long readings = DEFAULT_READINGS;
+    unsigned int sensors = DEFAULT_SENSORS;
+
+    if (argc > 1) {
+        readings = strtoull(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        sensors = (unsigned int)strtoul(argv[2], NULL, 10);
+    }
+    if (sensors == 0 || sensors > MAX_SENSORS) {
+        fprintf(stderr, "sensors must be between 1 and %d\n", MAX_SENSORS);
+        return EXIT_FAILURE;
+    }
+
+    // Sensor ids are spread out so the hash table does real work
+    char map_file[] = "/tmp/datamgr_bench_XXXXXX";
+    int fd = mkstemp(map_file);
+    FILE *fp = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!fp) {
+        perror("map file");
+        return EXIT_FAILURE;
+    }
+    for (unsigned int i = 0; i < sensors; i++) {
+        fprintf(fp, "%u %u\n", i + 1, (i * 7919u) % 65521u + 1);
+    }
+    fclose(fp);
+
+    int ret = datamgr_init(map_file, -1);
+    unlink(map_file);
+    if (ret != 0) {
+        fprintf(stderr, "datamgr_init failed\n");
+        return EXIT_FAILURE;
+    }
+
+    sensor_data_t *pool = malloc(POOL_SIZE * sizeof(sensor_data_t));
+    if (!pool) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+
+    srand(42);
+    for (size_t i = 0; i < POOL_SIZE; i++) {
+        unsigned int r = (unsigned int)rand();
+        pool[i].id = r % 100 == 0 ? 0 : (sensor_id_t)(((r % sensors) * 7919u) % 65521u + 1);
+        pool[i].value = 5.0 + (double)(rand() % 2000) / 100.0;
+        pool[i].ts = (sensor_ts_t)i;
+    }
+
+    double start = (double)stats_clock_ns() / 1e9;
+    unsigned long long done = 0;
+    size_t pos = 0;
+
+    while (done < readings) {
+        size_t n = readings - done < BATCH ? (size_t)(readings - done) : BATCH;
+        if (pos + n > POOL_SIZE) {
+            pos = 0;
+        }
+        datamgr_process(pool + pos, n);
+        pos += n;
+        done += n;
+    }
+
+    double elapsed = (double)stats_clock_ns() / 1e9 - start;
+    datamgr_stats_t stats;
+    datamgr_get_stats(&stats);
+
+    printf("Readings:    %llu from %llu sensors\n",
+           (unsigned long long)stats.readings, (unsigned long long)stats.sensors);
+    printf("Invalid:     %llu\n", (unsigned long long)stats.invalid);
+    printf("Verdicts:    %llu too cold, %llu too hot\n",
+           (unsigned long long)stats.too_cold, (unsigned long long)stats.too_hot);
+    printf("Time:        %.3f s\n", elapsed);
+    printf("Throughput:  %.2f M readings/s (%.1f ns per reading)\n",
+           (double)readings / elapsed / 1e6, elapsed * 1e9 / (double)readings);
+
+    free(pool);
+    datamgr_free();
+    return stats.readings == readings ? EXIT_SUCCESS : EXIT_FAILURE;
+ }
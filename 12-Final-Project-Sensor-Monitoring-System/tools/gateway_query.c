@@ -0,0 +1,112 @@
+/**
+ * @file gateway_query.c
+ * @brief Client of the gateway query service
+ *
+ * Sends one request, made of the remaining arguments, to the query
+ * socket of a running gateway and prints the answer. With -n, it sends
+ * the request that many times over the same connection and reports the
+ * round-trip latency percentiles.
+ *
+ * Usage: gateway_query [-S socket] [-n repeat] latest|average|rollup <sensor> [...] | latency
+ */
+
+ #include <stdio.h>
+ #include <stdint.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <time.h>
+ #include <unistd.h>
+ #include <sys/socket.h>
+ #include <sys/un.h>
+ #include "config.h"
+ #include "stats.h"
+
+ #define REPLY_SIZE (1 << 16)
+
+ static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+ }
+
+ // Reads until the empty line that ends an answer
+ static ssize_t read_answer(int fd, char *reply, size_t size) {
+    size_t len = 0;
+
+    while (len < size) {
+        ssize_t n = read(fd, reply + len, size - len);
+        if (n <= 0) {
+            return -1;
+        }
+        len += (size_t)n;
+        if ((len == 1 && reply[0] == '\n') || (len >= 2 && reply[len - 2] == '\n' && reply[len - 1] == '\n')) {
+            return (ssize_t)len;
+        }
+    }
+    return -1;
+ }
+
+ int main(int argc, char *argv[]) {
+    const char *path = QUERY_SOCKET;
+    unsigned long repeat = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "S:n:")) != -1) {
+        switch (opt) {
+            case 'S': path = optarg; break;
+            case 'n': repeat = strtoul(optarg, NULL, 10); break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+    if (optind >= argc || repeat == 0) {
+        fprintf(stderr, "Usage: %s [-S socket] [-n repeat] latest|average|rollup <sensor> [...] | latency\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char request[256] = "";
+    for (int i = optind; i < argc; i++) {
+        strncat(request, argv[i], sizeof(request) - strlen(request) - 2);
+        strncat(request, i + 1 < argc ? " " : "\n", sizeof(request) - strlen(request) - 1);
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    static char reply[REPLY_SIZE];
+    uint64_t *samples = malloc(repeat * sizeof(uint64_t));
+    size_t request_len = strlen(request);
+    ssize_t len = -1;
+    if (!samples) {
+        return EXIT_FAILURE;
+    }
+
+    for (unsigned long i = 0; i < repeat; i++) {
+        uint64_t start = stats_clock_ns();
+        if (write(fd, request, request_len) != (ssize_t)request_len ||
+            (len = read_answer(fd, reply, sizeof(reply))) < 0) {
+            fprintf(stderr, "Connection closed by the gateway\n");
+            return EXIT_FAILURE;
+        }
+        samples[i] = stats_clock_ns() - start;
+    }
+    close(fd);
+
+    fwrite(reply, 1, (size_t)len - 1, stdout);
+    if (repeat > 1) {
+        qsort(samples, repeat, sizeof(uint64_t), compare_u64);
+        fprintf(stderr, "%lu requests: p50 %.1f us, p99 %.1f us, max %.1f us\n", repeat,
+                (double)samples[repeat / 2] / 1e3, (double)samples[repeat * 99 / 100] / 1e3,
+                (double)samples[repeat - 1] / 1e3);
+    }
+
+    free(samples);
+    return strncmp(reply, "error", 5) == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+ }
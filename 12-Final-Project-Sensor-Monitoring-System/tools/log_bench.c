@@ -0,0 +1,201 @@
+/**
+ * @file log_bench.c
+ * @brief Throughput benchmark of the log pipeline
+ *
+ * Starts a log process and lets several threads send it events shaped
+ * like the gateway's, in batches of the given size (0 sends every event
+ * on its own), over the FIFO, the shared-memory ring, or both in turn.
+ * The time runs until the log process has written and synced the last
+ * line, and the lines are counted afterwards. Every 16th event is timed
+ * on the producer side, batch flushes included, for latency percentiles.
+ *
+ * Usage: log_bench [events] [threads] [batch] [fifo|shm|all]
+ */
+
+ #include <stdio.h>
+ #include <stdint.h>
+ #include <stdlib.h>
+ #include <stdbool.h>
+ #include <string.h>
+ #include <pthread.h>
+ #include <unistd.h>
+ #include <time.h>
+ #include <sys/wait.h>
+ #include "log.h"
+ #include "stats.h"
+
+ #define DEFAULT_EVENTS 4000000ULL
+ #define DEFAULT_THREADS 2
+ #define DEFAULT_BATCH 64
+ #define MAX_THREADS 64
+ #define BENCH_FIFO "/tmp/log_bench.fifo"
+ #define BENCH_LOG "/tmp/log_bench.log"
+
+ // One event in SAMPLE_EVERY is timed
+ #define SAMPLE_EVERY 16
+
+ static int log_fd;
+ static unsigned long long events_per_thread;
+ static unsigned int batch_size;
+ static uint64_t *samples[MAX_THREADS];
+
+ static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+ }
+
+ static void* sender(void *arg) {
+    unsigned int id = (unsigned int)(unsigned long)arg;
+
+    for (unsigned long long i = 0; i < events_per_thread; i++) {
+        bool sampled = i % SAMPLE_EVERY == 0;
+        uint64_t start = sampled ? stats_clock_ns() : 0;
+
+        if (batch_size > 0 && i % batch_size == 0) {
+            log_batch_begin();
+        }
+
+        switch (i % 4) {
+            case 0:
+                log_event(log_fd, "A sensor node with %u has opened a new connection", (unsigned int)(i % 65536));
+                break;
+            case 1:
+                log_event(log_fd, "The sensor node with %u reports it's too hot (avg temp = %.2f)",
+                          (unsigned int)(i % 65536), 20.0 + (double)(i % 100) / 10.0);
+                break;
+            case 2:
+                log_event(log_fd, "Received sensor data with invalid sensor node ID %u", id);
+                break;
+            default:
+                log_event(log_fd, "Failed to insert a reading of sensor node %u: %s", id, "database is locked");
+                break;
+        }
+
+        if (batch_size > 0 && (i + 1) % batch_size == 0) {
+            log_batch_end();
+        }
+
+        if (sampled) {
+            samples[id][i / SAMPLE_EVERY] = stats_clock_ns() - start;
+        }
+    }
+
+    log_batch_end();
+    return NULL;
+ }
+
+ static int run(const char *transport, unsigned int threads) {
+    bool use_shm = strcmp(transport, "shm") == 0;
+    unsigned long long events = events_per_thread * threads;
+
+    unlink(BENCH_LOG);
+    pid_t pid = use_shm ? log_start_shm(BENCH_LOG) : log_start(BENCH_FIFO, BENCH_LOG);
+    if (pid < 0) {
+        perror("log_start");
+        return -1;
+    }
+    log_fd = use_shm ? log_open_shm() : log_open_fifo(BENCH_FIFO);
+    if (log_fd < 0) {
+        perror("log_open");
+        return -1;
+    }
+
+    size_t per_thread = (size_t)((events_per_thread + SAMPLE_EVERY - 1) / SAMPLE_EVERY);
+    for (unsigned int i = 0; i < threads; i++) {
+        samples[i] = calloc(per_thread, sizeof(uint64_t));
+    }
+
+    pthread_t tids[MAX_THREADS];
+    double start = (double)stats_clock_ns() / 1e9;
+
+    for (unsigned int i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, sender, (void *)(unsigned long)i);
+    }
+    for (unsigned int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double sent = (double)stats_clock_ns() / 1e9 - start;
+
+    // The log process exits once it has written and synced everything
+    log_close(log_fd);
+    waitpid(pid, NULL, 0);
+    double elapsed = (double)stats_clock_ns() / 1e9 - start;
+
+    unsigned long long lines = 0;
+    unsigned long long bytes = 0;
+    FILE *fp = fopen(BENCH_LOG, "r");
+    if (fp) {
+        char buffer[1 << 16];
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+            bytes += n;
+            for (char *p = buffer; (p = memchr(p, '\n', (size_t)(buffer + n - p))); p++) {
+                lines++;
+            }
+        }
+        fclose(fp);
+    }
+
+    size_t total = per_thread * threads;
+    uint64_t *all = malloc(total * sizeof(uint64_t));
+    for (unsigned int i = 0; i < threads; i++) {
+        memcpy(all + i * per_thread, samples[i], per_thread * sizeof(uint64_t));
+        free(samples[i]);
+    }
+    qsort(all, total, sizeof(uint64_t), compare_u64);
+
+    printf("%s\n", transport);
+    printf("  Events:     %llu from %u threads, batches of %u\n", events, threads, batch_size);
+    printf("  Sent:       %.3f s, %.0f events/s\n", sent, (double)events / sent);
+    printf("  Logged:     %.3f s, %.0f events/s, %.1f MB\n", elapsed, (double)events / elapsed,
+           (double)bytes / 1e6);
+    printf("  Producer:   p50 %llu ns, p99 %llu ns, p99.9 %llu ns, max %llu ns\n",
+           (unsigned long long)all[total / 2], (unsigned long long)all[total * 99 / 100],
+           (unsigned long long)all[total * 999 / 1000], (unsigned long long)all[total - 1]);
+    printf("  Lines:      %llu%s\n", lines, lines == events ? "" : " (MISMATCH)");
+
+    free(all);
+    unlink(BENCH_LOG);
+    unlink(BENCH_FIFO);
+    return lines == events ? 0 : -1;
+ }
+
+ int main(int argc, char *argv[]) {
+    unsigned long long events = DEFAULT_EVENTS;
+    unsigned int threads = DEFAULT_THREADS;
+    const char *which = "all";
+    batch_size = DEFAULT_BATCH;
+
+    if (argc > 1) {
+        events = strtoull(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        threads = (unsigned int)strtoul(argv[2], NULL, 10);
+    }
+    if (argc > 3) {
+        batch_size = (unsigned int)strtoul(argv[3], NULL, 10);
+    }
+    if (argc > 4) {
+        which = argv[4];
+    }
+    if (threads == 0 || threads > MAX_THREADS) {
+        fprintf(stderr, "Threads must be between 1 and %d\n", MAX_THREADS);
+        return EXIT_FAILURE;
+    }
+    events_per_thread = events / threads;
+    if (events_per_thread == 0) {
+        fprintf(stderr, "Need at least one event per thread\n");
+        return EXIT_FAILURE;
+    }
+
+    int result = 0;
+    if (strcmp(which, "fifo") == 0 || strcmp(which, "all") == 0) {
+        result |= run("fifo", threads);
+    }
+    if (strcmp(which, "shm") == 0 || strcmp(which, "all") == 0) {
+        result |= run("shm", threads);
+    }
+
+    return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+ }
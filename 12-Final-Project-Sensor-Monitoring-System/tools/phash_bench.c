@@ -0,0 +1,268 @@
+/**
+ * @file phash_bench.c
+ * @brief Lookup benchmark of the perfect hash against general hash tables
+ *
+ * Maps the same sensor ids to dense slots with three tables: the minimal
+ * perfect hash of the data manager, the open-addressing table with linear
+ * probing it used before, and a generic chained table with one node per
+ * entry and hash and compare callbacks. Reports the build time, the
+ * memory used and the time per lookup for known and unknown ids, in a
+ * random order that defeats the branch predictor.
+ *
+ * Usage: phash_bench [lookups] [sensors]
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <time.h>
+ #include "phash.h"
+ #include "stats.h"
+
+ #define DEFAULT_LOOKUPS 20000000ULL
+ #define DEFAULT_SENSORS 60000
+ #define MAX_SENSORS 65000
+ #define NO_SLOT UINT32_MAX
+
+ // Ids looked up, cycled through
+ #define POOL_SIZE (1 << 20)
+
+ /**
+  * Open addressing with linear probing: slot + 1, 0 when empty
+  */
+ typedef struct {
+     uint32_t mask;
+     uint32_t *table;
+     const sensor_id_t *ids;
+ } probe_table_t;
+
+ /**
+  * Generic chained table: keys and values are pointers
+  */
+ typedef struct node {
+     const void *key;
+     const void *value;
+     struct node *next;
+ } node_t;
+
+ typedef struct {
+     size_t buckets;
+     node_t **heads;
+     uint32_t (*hash)(const void *key);
+     int (*equal)(const void *a, const void *b);
+ } chained_table_t;
+
+ static uint32_t probe_hash(const probe_table_t *t, sensor_id_t id) {
+    return ((uint32_t)id * 2654435769u >> 16) & t->mask;
+ }
+
+ static int probe_build(probe_table_t *t, const sensor_id_t *ids, size_t n) {
+    size_t size = 16;
+    while (size < n * 2) {
+        size *= 2;
+    }
+    t->mask = (uint32_t)(size - 1);
+    t->table = calloc(size, sizeof(uint32_t));
+    t->ids = ids;
+    if (!t->table) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        uint32_t pos = probe_hash(t, ids[i]);
+        while (t->table[pos] != 0) {
+            pos = (pos + 1) & t->mask;
+        }
+        t->table[pos] = (uint32_t)i + 1;
+    }
+    return 0;
+ }
+
+ static uint32_t probe_lookup(const probe_table_t *t, sensor_id_t id) {
+    for (uint32_t pos = probe_hash(t, id);; pos = (pos + 1) & t->mask) {
+        uint32_t entry = t->table[pos];
+        if (entry == 0) {
+            return NO_SLOT;
+        }
+        if (t->ids[entry - 1] == id) {
+            return entry - 1;
+        }
+    }
+ }
+
+ static uint32_t id_hash(const void *key) {
+    return phash_mix(*(const sensor_id_t *)key);
+ }
+
+ static int id_equal(const void *a, const void *b) {
+    return *(const sensor_id_t *)a == *(const sensor_id_t *)b;
+ }
+
+ static int chained_build(chained_table_t *t, const sensor_id_t *ids, const uint32_t *slots, size_t n) {
+    t->buckets = 16;
+    while (t->buckets < n) {
+        t->buckets *= 2;
+    }
+    t->hash = id_hash;
+    t->equal = id_equal;
+    t->heads = calloc(t->buckets, sizeof(node_t *));
+    if (!t->heads) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        node_t *node = malloc(sizeof(node_t));
+        if (!node) {
+            return -1;
+        }
+        size_t b = t->hash(&ids[i]) & (t->buckets - 1);
+        *node = (node_t){ &ids[i], &slots[i], t->heads[b] };
+        t->heads[b] = node;
+    }
+    return 0;
+ }
+
+ static uint32_t chained_lookup(const chained_table_t *t, sensor_id_t id) {
+    for (const node_t *node = t->heads[t->hash(&id) & (t->buckets - 1)]; node; node = node->next) {
+        if (t->equal(node->key, &id)) {
+            return *(const uint32_t *)node->value;
+        }
+    }
+    return NO_SLOT;
+ }
+
+ static void chained_free(chained_table_t *t) {
+    for (size_t b = 0; b < t->buckets; b++) {
+        for (node_t *node = t->heads[b]; node;) {
+            node_t *next = node->next;
+            free(node);
+            node = next;
+        }
+    }
+    free(t->heads);
+ }
+
+ static void report(const char *name, double build, size_t bytes, double hit, double miss,
+                    unsigned long long lookups) {
+    printf("%-18s %9.3f %10zu %9.1f %9.1f\n", name, build * 1e3, bytes,
+           hit * 1e9 / (double)lookups, miss * 1e9 / (double)lookups);
+ }
+
+ int main(int argc, char *argv[]) {
+    unsigned long long lookups = DEFAULT_LOOKUPS;
+    unsigned int sensors = DEFAULT_SENSORS;
+
+    if (argc > 1) {
+        lookups = strtoull(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        sensors = (unsigned int)strtoul(argv[2], NULL, 10);
+    }
+    if (sensors == 0 || sensors > MAX_SENSORS || lookups == 0) {
+        fprintf(stderr, "sensors must be between 1 and %d\n", MAX_SENSORS);
+        return EXIT_FAILURE;
+    }
+
+    // Same spread-out ids as datamgr_bench; every other id is unknown
+    static uint8_t known[1 << 16];
+    sensor_id_t *ids = malloc(sensors * sizeof(sensor_id_t));
+    uint32_t *slots = malloc(sensors * sizeof(uint32_t));
+    sensor_id_t *hits = malloc(POOL_SIZE * sizeof(sensor_id_t));
+    sensor_id_t *misses = malloc(POOL_SIZE * sizeof(sensor_id_t));
+    if (!ids || !slots || !hits || !misses) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    for (unsigned int i = 0; i < sensors; i++) {
+        ids[i] = (sensor_id_t)((i * 7919u) % 65521u + 1);
+        slots[i] = i;
+        known[ids[i]] = 1;
+    }
+
+    srand(42);
+    for (size_t i = 0; i < POOL_SIZE; i++) {
+        sensor_id_t miss;
+        do {
+            miss = (sensor_id_t)rand();
+        } while (known[miss]);
+        hits[i] = ids[(unsigned int)rand() % sensors];
+        misses[i] = miss;
+    }
+
+    phash_t perfect;
+    probe_table_t probe;
+    chained_table_t chained;
+    double t0 = (double)stats_clock_ns() / 1e9;
+    int ret = phash_build(&perfect, ids, sensors);
+    double t1 = (double)stats_clock_ns() / 1e9;
+    ret |= probe_build(&probe, ids, sensors);
+    double t2 = (double)stats_clock_ns() / 1e9;
+    ret |= chained_build(&chained, ids, slots, sensors);
+    double t3 = (double)stats_clock_ns() / 1e9;
+    if (ret != 0) {
+        fprintf(stderr, "Failed to build the tables\n");
+        return EXIT_FAILURE;
+    }
+
+    // Every table must give each known id a slot holding that id, and no
+    // slot to an unknown id
+    unsigned long long errors = 0;
+    for (unsigned int i = 0; i < sensors; i++) {
+        uint32_t slot = phash_lookup(&perfect, ids[i]);
+        errors += slot == NO_SLOT || perfect.keys[slot] != ids[i];
+        errors += probe_lookup(&probe, ids[i]) != i;
+        errors += chained_lookup(&chained, ids[i]) != i;
+    }
+    for (size_t i = 0; i < 1000; i++) {
+        errors += phash_lookup(&perfect, misses[i]) != NO_SLOT;
+        errors += probe_lookup(&probe, misses[i]) != NO_SLOT;
+        errors += chained_lookup(&chained, misses[i]) != NO_SLOT;
+    }
+
+    // Sum the slots so the compiler cannot drop the lookups
+    unsigned long long sum = 0;
+    double hit[3];
+    double miss[3];
+    const sensor_id_t *pools[2] = { hits, misses };
+    double *times[2] = { hit, miss };
+
+    for (int p = 0; p < 2; p++) {
+        const sensor_id_t *pool = pools[p];
+        double start = (double)stats_clock_ns() / 1e9;
+        for (unsigned long long i = 0; i < lookups; i++) {
+            sum += phash_lookup(&perfect, pool[i & (POOL_SIZE - 1)]);
+        }
+        double mid = (double)stats_clock_ns() / 1e9;
+        for (unsigned long long i = 0; i < lookups; i++) {
+            sum += probe_lookup(&probe, pool[i & (POOL_SIZE - 1)]);
+        }
+        double end = (double)stats_clock_ns() / 1e9;
+        for (unsigned long long i = 0; i < lookups; i++) {
+            sum += chained_lookup(&chained, pool[i & (POOL_SIZE - 1)]);
+        }
+        times[p][0] = mid - start;
+        times[p][1] = end - mid;
+        times[p][2] = (double)stats_clock_ns() / 1e9 - end;
+    }
+
+    printf("%u sensors, %llu lookups per run (checksum %llu)\n", sensors, lookups, sum);
+    printf("%-18s %9s %10s %9s %9s\n", "table", "build ms", "bytes", "hit ns", "miss ns");
+    report("perfect hash", t1 - t0, (perfect.mask + 1) * sizeof(uint32_t) + sensors * sizeof(sensor_id_t),
+           hit[0], miss[0], lookups);
+    report("linear probing", t2 - t1, (probe.mask + 1) * sizeof(uint32_t) + sensors * sizeof(sensor_id_t),
+           hit[1], miss[1], lookups);
+    report("chained, generic", t3 - t2, chained.buckets * sizeof(node_t *) + sensors * sizeof(node_t),
+           hit[2], miss[2], lookups);
+    if (errors > 0) {
+        fprintf(stderr, "%llu wrong lookups\n", errors);
+    }
+
+    phash_free(&perfect);
+    free(probe.table);
+    chained_free(&chained);
+    free(ids);
+    free(slots);
+    free(hits);
+    free(misses);
+    return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+ }
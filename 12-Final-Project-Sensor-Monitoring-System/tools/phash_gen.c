@@ -0,0 +1,115 @@
+/**
+ * @file phash_gen.c
+ * @brief Generate the perfect hash of a fixed room map as C source
+ *
+ * Reads a room map, builds the minimal perfect hash of its sensor ids
+ * and writes a C file that defines phash_static_map with the hash and
+ * the room of every sensor. Linked into the gateway, it replaces the
+ * hash built at start-up as long as the room map has the same sensors,
+ * and stands in for the map file when there is none. Like the data
+ * manager, the first room of a sensor listed twice wins.
+ *
+ * Usage: phash_gen <map file> [output]
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include "phash.h"
+
+ // Values per line in the generated arrays
+ #define PER_LINE 12
+
+ static void write_array(FILE *out, const char *type, const char *name, const uint32_t *values, size_t n) {
+    // An empty array is not valid C, and the lookup reads one displacement
+    static const uint32_t zero = 0;
+    if (n == 0) {
+        values = &zero;
+        n = 1;
+    }
+
+    fprintf(out, "static const %s %s[%zu] = {", type, name, n);
+    for (size_t i = 0; i < n; i++) {
+        fprintf(out, "%s%u%s", i % PER_LINE == 0 ? "\n    " : " ", values[i], i + 1 < n ? "," : "\n");
+    }
+    fprintf(out, "};\n\n");
+ }
+
+ int main(int argc, char *argv[]) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s <map file> [output]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *fp = fopen(argv[1], "r");
+    if (!fp) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    static uint8_t seen[1 << 16];
+    static sensor_id_t ids[1 << 16];
+    static room_id_t rooms_by_id[1 << 16];
+    size_t n = 0;
+    unsigned int room;
+    unsigned int sensor;
+    int fields;
+
+    while ((fields = fscanf(fp, "%u %u", &room, &sensor)) == 2) {
+        if (room > UINT16_MAX || sensor > UINT16_MAX) {
+            break;
+        }
+        if (seen[sensor]) {
+            fprintf(stderr, "Sensor node %u is mapped to more than one room, room %u ignored\n", sensor, room);
+            continue;
+        }
+        seen[sensor] = 1;
+        rooms_by_id[sensor] = (room_id_t)room;
+        ids[n++] = (sensor_id_t)sensor;
+    }
+    fclose(fp);
+    if (fields != EOF) {
+        fprintf(stderr, "%s: malformed room map\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    phash_t ph;
+    if (phash_build(&ph, ids, n) != 0) {
+        fprintf(stderr, "Failed to build the perfect hash\n");
+        return EXIT_FAILURE;
+    }
+
+    uint32_t *values = calloc((size_t)ph.mask + 1 > n ? (size_t)ph.mask + 1 : n, sizeof(uint32_t));
+    FILE *out = argc == 3 ? fopen(argv[2], "w") : stdout;
+    if (!values || !out) {
+        perror(argc == 3 ? argv[2] : "malloc");
+        return EXIT_FAILURE;
+    }
+
+    fprintf(out, "/**\n"
+                 " * @file static_map.c\n"
+                 " * @brief Room map of %zu sensors compiled into the gateway\n"
+                 " *\n"
+                 " * Generated by phash_gen from %s, do not edit.\n"
+                 " */\n\n"
+                 "#include \"phash.h\"\n\n", n, argv[1]);
+
+    write_array(out, "uint32_t", "displace", ph.displace, (size_t)ph.mask + 1);
+    for (size_t i = 0; i < n; i++) {
+        values[i] = ph.keys[i];
+    }
+    write_array(out, "sensor_id_t", "keys", values, n);
+    for (size_t i = 0; i < n; i++) {
+        values[i] = rooms_by_id[ph.keys[i]];
+    }
+    write_array(out, "room_id_t", "rooms", values, n);
+
+    fprintf(out, "const phash_map_t phash_static_map = {\n"
+                 "    { %uu, %uu, %uu, displace, keys },\n"
+                 "    rooms\n"
+                 "};\n", ph.seed, ph.mask, ph.size);
+
+    int ret = fclose(out) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    free(values);
+    phash_free(&ph);
+    return ret;
+ }
@@ -0,0 +1,135 @@
+/**
+ * @file sbuffer_bench.c
+ * @brief Throughput benchmark of the shared buffer
+ *
+ * One writer thread publishes readings in batches while the data manager
+ * and storage manager readers consume them in batches, checking that
+ * each reader sees every reading in order.
+ *
+ * Usage: sbuffer_bench [readings] [capacity] [batch]
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <pthread.h>
+ #include <time.h>
+ #include "sbuffer.h"
+ #include "stats.h"
+
+ #define DEFAULT_READINGS 50000000ULL
+ #define DEFAULT_BATCH 64
+
+ typedef struct {
+     sbuffer_t *buffer;
+     sbuffer_reader_t reader;
+     unsigned long long count;
+     unsigned long long errors;
+ } reader_arg_t;
+
+ static unsigned long long readings = DEFAULT_READINGS;
+ static size_t batch = DEFAULT_BATCH;
+
+ static void* writer(void *arg) {
+    sbuffer_t *buffer = (sbuffer_t *)arg;
+
+    for (unsigned long long i = 0; i < readings; i++) {
+        sensor_data_t *slot = sbuffer_claim(buffer);
+        slot->id = (sensor_id_t)(i & 0xFFFF);
+        slot->value = (sensor_value_t)i;
+        slot->ts = (sensor_ts_t)i;
+
+        // Publish once per batch
+        if ((i + 1) % batch == 0) {
+            sbuffer_publish(buffer);
+        }
+    }
+
+    sbuffer_close(buffer);
+    return NULL;
+ }
+
+ static void* reader(void *arg) {
+    reader_arg_t *r = (reader_arg_t *)arg;
+    const sensor_data_t *data;
+    size_t count;
+
+    while (sbuffer_peek_batch(r->buffer, r->reader, &data, batch, &count) == SBUFFER_SUCCESS) {
+        for (size_t i = 0; i < count; i++) {
+            if (data[i].ts != (sensor_ts_t)r->count) {
+                r->errors++;
+            }
+            r->count++;
+        }
+        sbuffer_release_batch(r->buffer, r->reader, count);
+    }
+
+    return NULL;
+ }
+
+ int main(int argc, char *argv[]) {
+    size_t capacity = SBUFFER_CAPACITY;
+    sbuffer_t *buffer;
+
+    if (argc > 1) {
+        readings = strtoull(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        capacity = (size_t)strtoull(argv[2], NULL, 10);
+    }
+    if (argc > 3) {
+        batch = (size_t)strtoull(argv[3], NULL, 10);
+        if (batch == 0) {
+            batch = 1;
+        }
+    }
+
+    if (sbuffer_init(&buffer, capacity) != SBUFFER_SUCCESS) {
+        fprintf(stderr, "Error: capacity must be a power of two\n");
+        return EXIT_FAILURE;
+    }
+
+    reader_arg_t args[SBUFFER_READERS];
+    pthread_t readers[SBUFFER_READERS];
+    pthread_t writer_thread;
+
+    double start = (double)stats_clock_ns() / 1e9;
+
+    for (int i = 0; i < SBUFFER_READERS; i++) {
+        args[i] = (reader_arg_t){ buffer, (sbuffer_reader_t)i, 0, 0 };
+        pthread_create(&readers[i], NULL, reader, &args[i]);
+    }
+    pthread_create(&writer_thread, NULL, writer, buffer);
+
+    pthread_join(writer_thread, NULL);
+    for (int i = 0; i < SBUFFER_READERS; i++) {
+        pthread_join(readers[i], NULL);
+    }
+
+    double elapsed = (double)stats_clock_ns() / 1e9 - start;
+    int status = EXIT_SUCCESS;
+
+    sbuffer_stats_t stats;
+    sbuffer_get_stats(buffer, &stats);
+
+    printf("Readings:   %llu (capacity %zu, batch %zu, %d readers)\n",
+           readings, capacity, batch, SBUFFER_READERS);
+    printf("Elapsed:    %.3f s\n", elapsed);
+    printf("Throughput: %.2f M readings/s\n", (double)readings / elapsed / 1e6);
+
+    for (int i = 0; i < SBUFFER_READERS; i++) {
+        printf("Reader %d:   %llu read, %llu out of order\n", i, args[i].count, args[i].errors);
+        if (args[i].count != readings || args[i].errors != 0) {
+            status = EXIT_FAILURE;
+        }
+    }
+
+    printf("Sleeps:     writer %llu, readers %llu/%llu\n",
+           (unsigned long long)stats.writer_sleeps,
+           (unsigned long long)stats.reader_sleeps[SBUFFER_READER_DATAMGR],
+           (unsigned long long)stats.reader_sleeps[SBUFFER_READER_STORAGE]);
+    printf("Wake-ups:   %llu by writer, %llu by readers\n",
+           (unsigned long long)stats.data_wakeups, (unsigned long long)stats.space_wakeups);
+
+    sbuffer_free(&buffer);
+    return status;
+ }
@@ -0,0 +1,584 @@
+/**
+ * @file sensor_sim.c
+ * @brief Sensor node simulator and end-to-end gateway benchmark
+ *
+ * Opens one TCP connection per simulated node and sends readings at a
+ * fixed rate per node. Each node's temperature follows its own cycle of
+ * -c seconds, plus a slow random walk and noise. Every packet carries
+ * the time it was sent, so the gateway can measure its latencies.
+ *
+ * With -g, the simulator runs the gateway itself, in directory -w with
+ * a room map of all simulated nodes. For each rate of the comma-separated
+ * list -r, it starts the gateway, sends the load for -d seconds, stops
+ * the gateway and collects its latency percentiles. It then reports
+ * them per rate, with the rate at which latency starts to climb.
+ *
+ * Usage: sensor_sim [-a addr] [-p port] [-n nodes] [-r rate[,rate...]]
+ *                   [-d seconds] [-c cycle] [-g gateway [-w dir] [-b backend]]
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <stdbool.h>
+ #include <stdint.h>
+ #include <string.h>
+ #include <errno.h>
+ #include <endian.h>
+ #include <fcntl.h>
+ #include <math.h>
+ #include <poll.h>
+ #include <signal.h>
+ #include <time.h>
+ #include <unistd.h>
+ #include <arpa/inet.h>
+ #include <netinet/in.h>
+ #include <netinet/tcp.h>
+ #include <sys/resource.h>
+ #include <sys/socket.h>
+ #include <sys/stat.h>
+ #include <sys/wait.h>
+ #include "config.h"
+ #include "stats.h"
+
+ #define DEFAULT_PORT 5678
+ #define DEFAULT_NODES 1000
+ #define DEFAULT_SECONDS 5
+ #define DEFAULT_CYCLE 60.0
+ #define DEFAULT_DIR "/tmp/sensor_sim"
+ #define MAX_RATES 32
+ #define MAX_NODES 65535
+
+ // Packets a node sends in one call, and keeps when the socket is full
+ #define SEND_BATCH 256
+
+ // Latency stages reported by the gateway
+ #define STAGES 3
+ static const char *stage_names[STAGES] = { "receive", "process", "total" };
+
+ typedef struct {
+     int fd;
+     sensor_id_t id;
+     double base;                    // Mean temperature
+     double phase;                   // Offset in the temperature cycle
+     double walk;                    // Slow random drift
+     size_t pending_len;
+     unsigned char pending[SEND_BATCH * SENSOR_PACKET_SIZE];
+ } node_t;
+
+ typedef struct {
+     uint64_t sent;                  // Readings fully handed to the socket
+     uint64_t skipped;               // Readings not generated, node was behind
+     uint64_t closed;                // Nodes whose connection was closed
+     double seconds;
+ } load_stats_t;
+
+ typedef struct {
+     double p50[STAGES];
+     double p99[STAGES];
+     double p999[STAGES];
+     double max[STAGES];
+     unsigned long long received;
+     bool found[STAGES];
+ } gateway_report_t;
+
+ static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+ static double cycle_seconds = DEFAULT_CYCLE;
+
+ // Local function prototypes
+ static int64_t now_epoch_ns(void);
+ static double uniform(void);
+ static double gaussian(void);
+ static int connect_nodes(node_t *nodes, unsigned int count, const char *addr, int port);
+ static void close_nodes(node_t *nodes, unsigned int count);
+ static void run_load(node_t *nodes, unsigned int count, double rate, double seconds, load_stats_t *stats);
+ static void send_readings(node_t *node, unsigned int k, double t, load_stats_t *stats);
+ static bool flush_pending(node_t *node, load_stats_t *stats);
+ static int write_map(const char *dir, unsigned int count);
+ static pid_t start_gateway(const char *gateway, const char *dir, const char *backend, int port, int *out_fd);
+ static void stop_gateway(pid_t pid, int out_fd, gateway_report_t *report);
+ static int parse_rates(char *list, double *rates);
+ static void raise_fd_limit(void);
+
+ int main(int argc, char *argv[]) {
+    const char *addr = "127.0.0.1";
+    int port = DEFAULT_PORT;
+    unsigned int count = DEFAULT_NODES;
+    double seconds = DEFAULT_SECONDS;
+    char rate_list[256] = "1";
+    const char *gateway = NULL;
+    const char *dir = DEFAULT_DIR;
+    const char *backend = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:p:n:r:d:c:g:w:b:")) != -1) {
+        switch (opt) {
+            case 'a': addr = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'n': count = (unsigned int)strtoul(optarg, NULL, 10); break;
+            case 'r': snprintf(rate_list, sizeof(rate_list), "%s", optarg); break;
+            case 'd': seconds = atof(optarg); break;
+            case 'c': cycle_seconds = atof(optarg); break;
+            case 'g': gateway = optarg; break;
+            case 'w': dir = optarg; break;
+            case 'b': backend = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-a addr] [-p port] [-n nodes] [-r rate[,rate...]] [-d seconds] "
+                        "[-c cycle] [-g gateway [-w dir] [-b backend]]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    double rates[MAX_RATES];
+    int steps = parse_rates(rate_list, rates);
+    if (count == 0 || count > MAX_NODES || steps <= 0 || seconds <= 0 || cycle_seconds <= 0) {
+        fprintf(stderr, "Invalid arguments\n");
+        return EXIT_FAILURE;
+    }
+    if (!gateway && steps > 1) {
+        fprintf(stderr, "Several rates need -g to restart the gateway between them\n");
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+
+    node_t *nodes = calloc(count, sizeof(node_t));
+    if (!nodes) {
+        return EXIT_FAILURE;
+    }
+
+    // Each node keeps its own climate for the whole run
+    rng_state ^= (uint64_t)time(NULL);
+    for (unsigned int i = 0; i < count; i++) {
+        nodes[i].fd = -1;
+        nodes[i].id = (sensor_id_t)(i + 1);
+        nodes[i].base = 12.0 + 10.0 * uniform();
+        nodes[i].phase = 2.0 * M_PI * uniform();
+    }
+
+    if (!gateway) {
+        load_stats_t stats = {0};
+        if (connect_nodes(nodes, count, addr, port) != 0) {
+            perror("connect");
+            return EXIT_FAILURE;
+        }
+        run_load(nodes, count, rates[0], seconds, &stats);
+        close_nodes(nodes, count);
+
+        printf("Nodes:        %u at %.2f readings/s each\n", count, rates[0]);
+        printf("Sent:         %llu readings in %.3f s, %.0f readings/s\n", (unsigned long long)stats.sent,
+               stats.seconds, (double)stats.sent / stats.seconds);
+        printf("Skipped:      %llu readings while sockets were full, %llu connections closed\n",
+               (unsigned long long)stats.skipped, (unsigned long long)stats.closed);
+        free(nodes);
+        return EXIT_SUCCESS;
+    }
+
+    if ((mkdir(dir, 0755) < 0 && errno != EEXIST) || write_map(dir, count) != 0) {
+        fprintf(stderr, "Unable to prepare %s\n", dir);
+        return EXIT_FAILURE;
+    }
+    char *gateway_path = realpath(gateway, NULL);
+    if (!gateway_path) {
+        perror(gateway);
+        return EXIT_FAILURE;
+    }
+
+    printf("%u nodes, %.0f s per rate, latencies in ms per gateway stage\n\n",
+           count, seconds);
+    printf("%10s %10s %10s |", "rate/node", "offered/s", "stored/s");
+    for (int s = 0; s < STAGES; s++) {
+        char label[32];
+        snprintf(label, sizeof(label), "%s p50", stage_names[s]);
+        printf(" %12s %10s |", label, "p99");
+    }
+    printf("\n");
+
+    double baseline_p99 = 0;
+    double knee_rate = 0;
+    double sustained_rate = 0;
+
+    for (int step = 0; step < steps; step++) {
+        int out_fd;
+        pid_t pid = start_gateway(gateway_path, dir, backend, port, &out_fd);
+        if (pid < 0) {
+            fprintf(stderr, "Unable to start %s\n", gateway_path);
+            return EXIT_FAILURE;
+        }
+
+        load_stats_t stats = {0};
+        gateway_report_t report;
+        if (connect_nodes(nodes, count, addr, port) != 0) {
+            perror("connect");
+            kill(pid, SIGTERM);
+            return EXIT_FAILURE;
+        }
+        run_load(nodes, count, rates[step], seconds, &stats);
+        close_nodes(nodes, count);
+        stop_gateway(pid, out_fd, &report);
+
+        double offered = rates[step] * count;
+        double stored = (double)report.received / stats.seconds;
+        printf("%10.2f %10.0f %10.0f |", rates[step], offered, stored);
+        for (int s = 0; s < STAGES; s++) {
+            if (report.found[s]) {
+                printf(" %12.3f %10.3f |", report.p50[s], report.p99[s]);
+            }
+            else {
+                printf(" %12s %10s |", "-", "-");
+            }
+        }
+        printf("%s\n", stats.skipped > 0 ? " (sockets full)" : "");
+        fflush(stdout);
+
+        // End to end is the total stage
+        double p99 = report.p99[STAGES - 1];
+        if (step == 0) {
+            baseline_p99 = p99;
+        }
+        if (knee_rate == 0 && step > 0 && p99 > 2 * baseline_p99) {
+            knee_rate = offered;
+        }
+        if (knee_rate == 0) {
+            sustained_rate = stored;
+        }
+    }
+
+    printf("\n");
+    if (knee_rate > 0) {
+        printf("End-to-end p99 latency starts to climb at %.0f readings/s offered; "
+               "%.0f readings/s were sustained before that.\n", knee_rate, sustained_rate);
+    }
+    else {
+        printf("End-to-end p99 latency stayed within twice its lowest-rate value up to %.0f readings/s.\n",
+               sustained_rate);
+    }
+
+    free(gateway_path);
+    free(nodes);
+    return EXIT_SUCCESS;
+ }
+
+ static int64_t now_epoch_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+ }
+
+ static double uniform(void) {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (double)((rng_state * 0x2545F4914F6CDD1DULL) >> 11) / (double)(1ULL << 53);
+ }
+
+ static double gaussian(void) {
+    // Irwin-Hall approximation, good enough for noise
+    return uniform() + uniform() + uniform() + uniform() - 2.0;
+ }
+
+ static int connect_nodes(node_t *nodes, unsigned int count, const char *addr, int port) {
+    struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons((uint16_t)port) };
+    if (inet_pton(AF_INET, addr, &sa.sin_addr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            close_nodes(nodes, i);
+            return -1;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        nodes[i].fd = fd;
+        nodes[i].pending_len = 0;
+    }
+    return 0;
+ }
+
+ static void close_nodes(node_t *nodes, unsigned int count) {
+    for (unsigned int i = 0; i < count; i++) {
+        if (nodes[i].fd >= 0) {
+            close(nodes[i].fd);
+            nodes[i].fd = -1;
+        }
+    }
+ }
+
+ static void run_load(node_t *nodes, unsigned int count, double rate, double seconds, load_stats_t *stats) {
+    const double total_rate = rate * count;
+    uint64_t generated = 0;
+    unsigned int cursor = 0;
+    double start = (double)stats_clock_ns() / 1e9;
+    struct timespec tick;
+
+    clock_gettime(CLOCK_MONOTONIC, &tick);
+
+    // Every millisecond, hand out the readings due since the last tick
+    for (;;) {
+        double t = (double)stats_clock_ns() / 1e9 - start;
+        if (t >= seconds) {
+            break;
+        }
+
+        uint64_t due = (uint64_t)(total_rate * t) - generated;
+        uint64_t each = due / count;
+        uint64_t extra = due % count;
+        generated += due;
+
+        if (each == 0) {
+            for (uint64_t k = 0; k < extra; k++) {
+                send_readings(&nodes[(cursor + k) % count], 1, t, stats);
+            }
+        }
+        else {
+            for (unsigned int k = 0; k < count; k++) {
+                unsigned int i = (cursor + k) % count;
+                send_readings(&nodes[i], (unsigned int)each + (k < extra ? 1 : 0), t, stats);
+            }
+        }
+        cursor = (unsigned int)((cursor + extra) % count);
+
+        tick.tv_nsec += 1000000;
+        if (tick.tv_nsec >= 1000000000) {
+            tick.tv_sec++;
+            tick.tv_nsec -= 1000000000;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tick, NULL);
+    }
+
+    // Give the sockets a moment to take what is still pending
+    double drain_until = (double)stats_clock_ns() / 1e9 + 1.0;
+    bool pending = true;
+    while (pending && (double)stats_clock_ns() / 1e9 < drain_until) {
+        pending = false;
+        for (unsigned int i = 0; i < count; i++) {
+            if (!flush_pending(&nodes[i], stats)) {
+                pending = true;
+            }
+        }
+        if (pending) {
+            usleep(1000);
+        }
+    }
+
+    stats->seconds = (double)stats_clock_ns() / 1e9 - start;
+ }
+
+ static void send_readings(node_t *node, unsigned int k, double t, load_stats_t *stats) {
+    unsigned char packets[SEND_BATCH * SENSOR_PACKET_SIZE];
+
+    if (node->fd < 0 || !flush_pending(node, stats)) {
+        stats->skipped += k;
+        return;
+    }
+    if (k > SEND_BATCH) {
+        stats->skipped += k - SEND_BATCH;
+        k = SEND_BATCH;
+    }
+
+    int64_t ts = now_epoch_ns();
+    for (unsigned int j = 0; j < k; j++) {
+        node->walk += 0.02 * gaussian();
+        if (node->walk > 5.0 || node->walk < -5.0) {
+            node->walk *= 0.9;
+        }
+        double value = node->base + 4.0 * sin(2.0 * M_PI * t / cycle_seconds + node->phase) +
+                       node->walk + 0.1 * gaussian();
+
+        uint16_t id = htole16(node->id);
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        bits = htole64(bits);
+        uint64_t stamp = htole64((uint64_t)ts);
+
+        unsigned char *p = packets + j * SENSOR_PACKET_SIZE;
+        memcpy(p, &id, sizeof(id));
+        memcpy(p + 2, &bits, sizeof(bits));
+        memcpy(p + 10, &stamp, sizeof(stamp));
+    }
+
+    size_t len = (size_t)k * SENSOR_PACKET_SIZE;
+    ssize_t n = send(node->fd, packets, len, MSG_NOSIGNAL);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            close(node->fd);
+            node->fd = -1;
+            stats->closed++;
+            stats->skipped += k;
+            return;
+        }
+        n = 0;
+    }
+
+    // Whole packets sent count now; the rest waits in the node
+    stats->sent += (uint64_t)n / SENSOR_PACKET_SIZE;
+    node->pending_len = len - (size_t)n;
+    memcpy(node->pending, packets + n, node->pending_len);
+ }
+
+ static bool flush_pending(node_t *node, load_stats_t *stats) {
+    if (node->pending_len == 0 || node->fd < 0) {
+        return true;
+    }
+
+    // A packet split by the last send counts once its last byte is out
+    size_t before = node->pending_len;
+    ssize_t n = send(node->fd, node->pending, node->pending_len, MSG_NOSIGNAL);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return false;
+        }
+        close(node->fd);
+        node->fd = -1;
+        node->pending_len = 0;
+        stats->closed++;
+        return true;
+    }
+
+    node->pending_len -= (size_t)n;
+    memmove(node->pending, node->pending + n, node->pending_len);
+    stats->sent += before / SENSOR_PACKET_SIZE - node->pending_len / SENSOR_PACKET_SIZE +
+                   (before % SENSOR_PACKET_SIZE != 0 && node->pending_len % SENSOR_PACKET_SIZE == 0);
+    return node->pending_len == 0;
+ }
+
+ static int write_map(const char *dir, unsigned int count) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, ROOM_MAP_FILE);
+
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        return -1;
+    }
+    for (unsigned int i = 1; i <= count; i++) {
+        fprintf(fp, "%u %u\n", i, i);
+    }
+    return fclose(fp);
+ }
+
+ static pid_t start_gateway(const char *gateway, const char *dir, const char *backend, int port, int *out_fd) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) < 0) {
+        return -1;
+    }
+
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        char port_text[16];
+        snprintf(port_text, sizeof(port_text), "%d", port);
+        dup2(pipe_fds[1], STDOUT_FILENO);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        if (chdir(dir) < 0) {
+            _exit(EXIT_FAILURE);
+        }
+        if (backend) {
+            execl(gateway, gateway, "-s", backend, port_text, (char *)NULL);
+        }
+        else {
+            execl(gateway, gateway, port_text, (char *)NULL);
+        }
+        _exit(EXIT_FAILURE);
+    }
+
+    close(pipe_fds[1]);
+    *out_fd = pipe_fds[0];
+
+    // The gateway prints a line once it is listening
+    char line[256];
+    size_t len = 0;
+    double deadline = (double)stats_clock_ns() / 1e9 + 10.0;
+    while ((double)stats_clock_ns() / 1e9 < deadline) {
+        struct pollfd pfd = { .fd = *out_fd, .events = POLLIN };
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+        ssize_t n = read(*out_fd, line + len, 1);
+        if (n <= 0) {
+            break;
+        }
+        if (line[len] == '\n' || len == sizeof(line) - 2) {
+            line[len] = '\0';
+            if (strstr(line, "listening")) {
+                return pid;
+            }
+            len = 0;
+            continue;
+        }
+        len++;
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    close(*out_fd);
+    return -1;
+ }
+
+ static void stop_gateway(pid_t pid, int out_fd, gateway_report_t *report) {
+    memset(report, 0, sizeof(*report));
+    kill(pid, SIGINT);
+
+    FILE *out = fdopen(out_fd, "r");
+    char line[512];
+    while (out && fgets(line, sizeof(line), out)) {
+        char stage[32];
+        double p50, p99, p999, max;
+        unsigned long long received;
+
+        if (sscanf(line, "Latency, %31[^:]: p50 %lf ms, p99 %lf ms, p99.9 %lf ms, max %lf ms",
+                   stage, &p50, &p99, &p999, &max) == 5) {
+            for (int s = 0; s < STAGES; s++) {
+                if (strcmp(stage, stage_names[s]) == 0) {
+                    report->p50[s] = p50;
+                    report->p99[s] = p99;
+                    report->p999[s] = p999;
+                    report->max[s] = max;
+                    report->found[s] = true;
+                }
+            }
+        }
+        else if (sscanf(line, "Storage: %llu rows", &received) == 1) {
+            report->received = received;
+        }
+    }
+    if (out) {
+        fclose(out);
+    }
+    waitpid(pid, NULL, 0);
+ }
+
+ static int parse_rates(char *list, double *rates) {
+    int count = 0;
+    for (char *token = strtok(list, ","); token && count < MAX_RATES; token = strtok(NULL, ",")) {
+        rates[count] = atof(token);
+        if (rates[count] <= 0) {
+            return -1;
+        }
+        count++;
+    }
+    return count;
+ }
+
+ static void raise_fd_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+ }
@@ -0,0 +1,166 @@
+/**
+ * @file storage_bench.c
+ * @brief Insert throughput benchmark of the storage backends
+ *
+ * Inserts readings into a fresh store through the storage manager, in
+ * batches of STORAGE_BATCH_SIZE rows, and reports rows per second, flush
+ * latency and size on disk for each backend. For the columnar store it
+ * also times a range scan of one sensor.
+ *
+ * Usage: storage_bench [readings] [sqlite|tsdb|all] [sensors]
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <dirent.h>
+ #include <unistd.h>
+ #include <time.h>
+ #include <sys/stat.h>
+ #include "storagemgr.h"
+ #include "tsdb.h"
+ #include "stats.h"
+
+ #define DEFAULT_READINGS 2000000ULL
+ #define DEFAULT_SENSORS 1000
+ #define SQLITE_PATH "/tmp/storage_bench.db"
+ #define TSDB_PATH "/tmp/storage_bench.tsdb"
+ #define BATCH 1024
+
+ // Size of a file, or of the files in a directory; removes them if asked
+ static unsigned long long disk_usage(const char *path, bool remove) {
+    struct stat st;
+    unsigned long long total = 0;
+
+    if (stat(path, &st) != 0) {
+        return 0;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        DIR *d = opendir(path);
+        struct dirent *entry;
+        while (d && (entry = readdir(d))) {
+            if (entry->d_name[0] != '.') {
+                char name[4096];
+                snprintf(name, sizeof(name), "%s/%s", path, entry->d_name);
+                total += disk_usage(name, remove);
+            }
+        }
+        if (d) {
+            closedir(d);
+        }
+        if (remove) {
+            rmdir(path);
+        }
+        return total;
+    }
+
+    if (remove) {
+        unlink(path);
+    }
+    return (unsigned long long)st.st_size;
+ }
+
+ static unsigned long long store_usage(const char *path, bool remove) {
+    char name[4096];
+    unsigned long long total = disk_usage(path, remove);
+
+    snprintf(name, sizeof(name), "%s-wal", path);
+    total += disk_usage(name, remove);
+    snprintf(name, sizeof(name), "%s-shm", path);
+    total += disk_usage(name, remove);
+    return total;
+ }
+
+ static void count_reading(sensor_id_t id, sensor_ts_t ts, sensor_value_t value, void *arg) {
+    (void)id;
+    (void)ts;
+    (void)value;
+    (*(unsigned long long *)arg)++;
+ }
+
+ static int run(const char *name, const char *path, unsigned long long readings, unsigned int sensors) {
+    const storage_backend_t *backend = storagemgr_find_backend(name);
+    storagemgr_stats_t before, after;
+
+    store_usage(path, true);
+    if (!backend || storagemgr_open(backend, path, true, -1) != 0) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        return -1;
+    }
+    storagemgr_get_stats(&before);
+
+    sensor_data_t batch[BATCH];
+    double start = (double)stats_clock_ns() / 1e9;
+
+    for (unsigned long long done = 0; done < readings; ) {
+        size_t n = readings - done < BATCH ? (size_t)(readings - done) : BATCH;
+        for (size_t i = 0; i < n; i++) {
+            batch[i].id = (sensor_id_t)((done + i) % sensors + 1);
+            batch[i].value = 15.0 + (double)((done + i) % 100) / 10.0;
+            batch[i].ts = (sensor_ts_t)(done + i);
+        }
+        storagemgr_insert(batch, n);
+        done += n;
+    }
+    storagemgr_close();
+
+    double elapsed = (double)stats_clock_ns() / 1e9 - start;
+    storagemgr_get_stats(&after);
+    uint64_t rows = after.rows - before.rows;
+    uint64_t flushes = after.flushes - before.flushes;
+
+    printf("%s\n", name);
+    printf("  Rows:       %llu in %llu flushes of up to %d rows, %llu failed\n",
+           (unsigned long long)rows, (unsigned long long)flushes, STORAGE_BATCH_SIZE,
+           (unsigned long long)(after.failures - before.failures));
+    printf("  Time:       %.3f s\n", elapsed);
+    printf("  Throughput: %.0f rows/s\n", (double)rows / elapsed);
+    printf("  Flush:      %.3f ms average, %.3f ms max (all runs)\n",
+           flushes ? (double)(after.flush_ns - before.flush_ns) / (double)flushes / 1e6 : 0.0,
+           (double)after.flush_max_ns / 1e6);
+    printf("  Disk:       %.1f MB, %.1f bytes per reading\n",
+           (double)store_usage(path, false) / 1e6,
+           rows ? (double)store_usage(path, false) / (double)rows : 0.0);
+
+    if (strcmp(name, "tsdb") == 0) {
+        unsigned long long matched = 0;
+        start = (double)stats_clock_ns() / 1e9;
+        long blocks = tsdb_scan(path, 1, 0, (sensor_ts_t)(readings / 2), count_reading, &matched);
+        printf("  Scan:       %llu readings of sensor 1 in the first half, %ld blocks, %.3f ms\n",
+               matched, blocks, ((double)stats_clock_ns() / 1e9 - start) * 1e3);
+    }
+
+    store_usage(path, true);
+    return rows == readings ? 0 : -1;
+ }
+
+ int main(int argc, char *argv[]) {
+    unsigned long long readings = DEFAULT_READINGS;
+    const char *which = "all";
+    unsigned int sensors = DEFAULT_SENSORS;
+
+    if (argc > 1) {
+        readings = strtoull(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        which = argv[2];
+    }
+    if (argc > 3) {
+        sensors = (unsigned int)strtoul(argv[3], NULL, 10);
+    }
+    if (sensors == 0 || sensors > 65535) {
+        fprintf(stderr, "Sensors must be between 1 and 65535\n");
+        return EXIT_FAILURE;
+    }
+
+    int result = 0;
+    if (strcmp(which, "sqlite") == 0 || strcmp(which, "all") == 0) {
+        result |= run("sqlite", SQLITE_PATH, readings, sensors);
+    }
+    if (strcmp(which, "tsdb") == 0 || strcmp(which, "all") == 0) {
+        result |= run("tsdb", TSDB_PATH, readings, sensors);
+    }
+
+    return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+ }
@@ -0,0 +1,144 @@
+/**
+ * @file tsdb_query.c
+ * @brief Range query over a columnar time-series store
+ *
+ * Prints the readings of one or all sensors within a time range, one
+ * "sensor timestamp value" line each, or with -c a count, minimum,
+ * maximum and average per sensor. With -r, it prints the minute, hour
+ * or day rollups whose bucket starts within the range instead, one
+ * "sensor start count min max avg" line each. Timestamps are in
+ * nanoseconds since the epoch. Can run while the gateway is writing
+ * the store.
+ *
+ * Usage: tsdb_query [-d dir] [-s sensor] [-f from] [-t to] [-c | -r minute|hour|day]
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <stdint.h>
+ #include <inttypes.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include "tsdb.h"
+
+ #define MAX_SENSORS (1 << (8 * sizeof(sensor_id_t)))
+
+ typedef struct {
+    uint64_t count;
+    sensor_value_t min;
+    sensor_value_t max;
+    double sum;
+ } summary_t;
+
+ static void print_reading(sensor_id_t id, sensor_ts_t ts, sensor_value_t value, void *arg) {
+    (void)arg;
+    printf("%u %" PRId64 " %g\n", id, ts, value);
+ }
+
+ static void summarize_reading(sensor_id_t id, sensor_ts_t ts, sensor_value_t value, void *arg) {
+    (void)ts;
+    summary_t *s = &((summary_t *)arg)[id];
+
+    if (s->count == 0 || value < s->min) {
+        s->min = value;
+    }
+    if (s->count == 0 || value > s->max) {
+        s->max = value;
+    }
+    s->sum += value;
+    s->count++;
+ }
+
+ static void print_rollup(const rollup_t *r, void *arg) {
+    (void)arg;
+    printf("%u %" PRId64 " %" PRIu32 " %.2f %.2f %.2f\n", r->sensor_id, r->start, r->count,
+           r->min, r->max, r->sum / (double)r->count);
+ }
+
+ static int parse_resolution(const char *name) {
+    static const char *names[ROLLUP_RESOLUTIONS] = { "minute", "hour", "day" };
+
+    for (int r = 0; r < ROLLUP_RESOLUTIONS; r++) {
+        if (strcmp(name, names[r]) == 0) {
+            return r;
+        }
+    }
+    return -1;
+ }
+
+ static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-d dir] [-s sensor] [-f from] [-t to] [-c | -r minute|hour|day]\n", name);
+ }
+
+ int main(int argc, char *argv[]) {
+    const char *dir = TSDB_DIR;
+    int sensor = TSDB_ALL_SENSORS;
+    sensor_ts_t from = INT64_MIN;
+    sensor_ts_t to = INT64_MAX;
+    int summarize = 0;
+    int resolution = -1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:s:f:t:cr:")) != -1) {
+        switch (opt) {
+            case 'd': dir = optarg; break;
+            case 's': sensor = atoi(optarg); break;
+            case 'f': from = strtoll(optarg, NULL, 10); break;
+            case 't': to = strtoll(optarg, NULL, 10); break;
+            case 'c': summarize = 1; break;
+            case 'r':
+                resolution = parse_resolution(optarg);
+                if (resolution < 0) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc || sensor < TSDB_ALL_SENSORS || sensor >= (int)MAX_SENSORS) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (resolution >= 0) {
+        long files = tsdb_scan_rollups(dir, sensor, (rollup_resolution_t)resolution, from, to, print_rollup, NULL);
+        if (files < 0) {
+            fprintf(stderr, "Unable to read %s\n", dir);
+            return EXIT_FAILURE;
+        }
+        fprintf(stderr, "%ld rollup files read\n", files);
+        return EXIT_SUCCESS;
+    }
+
+    summary_t *summaries = NULL;
+    if (summarize) {
+        summaries = calloc(MAX_SENSORS, sizeof(summary_t));
+        if (!summaries) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    long blocks = tsdb_scan(dir, sensor, from, to, summarize ? summarize_reading : print_reading, summaries);
+    if (blocks < 0) {
+        fprintf(stderr, "Unable to read %s\n", dir);
+        free(summaries);
+        return EXIT_FAILURE;
+    }
+
+    if (summarize) {
+        for (size_t id = 0; id < MAX_SENSORS; id++) {
+            const summary_t *s = &summaries[id];
+            if (s->count > 0) {
+                printf("%zu count=%" PRIu64 " min=%.2f max=%.2f avg=%.2f\n",
+                       id, s->count, s->min, s->max, s->sum / (double)s->count);
+            }
+        }
+        free(summaries);
+    }
+
+    fprintf(stderr, "%ld blocks read\n", blocks);
+    return EXIT_SUCCESS;
+ }